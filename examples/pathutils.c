@@ -29,32 +29,33 @@
 /* Find the folder_id of a given path
  * Runs by walking through folders structure */
 static uint32_t
-lookup_folder_id (LIBMTP_folder_t * folder, char * path, char * parent)
+lookup_folder_id (LIBMTP_folder_t * folder, char * path)
 {
-  char * current;
-  uint32_t ret = (uint32_t) -1;
+  uint32_t ret = 0;
 
-  if (strcmp(path,"/")==0)
-    return 0;
+  if (*path != '/')
+    return (uint32_t) -1;
 
-  if (folder == NULL) {
-    return ret;
-  }
+  /* Walk down the tree one path component at a time */
+  while (*path != '\0') {
+    size_t len;
 
-  current = malloc (strlen(parent) + strlen(folder->name) + 2);
-  sprintf(current,"%s/%s",parent,folder->name);
-  if (strcasecmp (path, current) == 0) {
-    free (current);
-    return folder->folder_id;
-  }
-  if (strncasecmp (path, current, strlen (current)) == 0) {
-    ret = lookup_folder_id (folder->child, path, current);
-  }
-  free (current);
-  if (ret != (uint32_t) (-1)) {
-    return ret;
+    while (*path == '/')
+      path++;
+    if (*path == '\0')
+      break;
+    len = strcspn (path, "/");
+    while (folder != NULL &&
+	   (folder->name == NULL || strlen (folder->name) != len ||
+	    strncasecmp (folder->name, path, len) != 0)) {
+      folder = folder->sibling;
+    }
+    if (folder == NULL)
+      return (uint32_t) -1;
+    ret = folder->folder_id;
+    folder = folder->child;
+    path += len;
   }
-  ret = lookup_folder_id (folder->sibling, path, parent);
   return ret;
 }
 
@@ -84,13 +85,13 @@ parse_path (char * path, LIBMTP_file_t * files, LIBMTP_folder_t * folders)
     return item_id;
   }
   // Check if path is a folder
-  item_id = lookup_folder_id(folders,path,"");
+  item_id = lookup_folder_id(folders,path);
   if (item_id == (uint32_t) -1) {
     char * dirc = strdup(path);
     char * basec = strdup(path);
     char * parent = dirname(dirc);
     char * filename = basename(basec);
-    uint32_t parent_id = lookup_folder_id(folders,parent,"");
+    uint32_t parent_id = lookup_folder_id(folders,parent);
     LIBMTP_file_t * file;
 
     file = files;
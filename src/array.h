@@ -47,12 +47,20 @@
  * free_array_recursive(&objects, ptp_free_object);
  */
 
+/* cap is the number of allocated elements in val. It may be lower than len
+ * (e.g. 0) if val was allocated outside of these macros, the next extend
+ * will then simply reallocate, but it must never be larger than the
+ * actual allocation. */
 #define ARRAY_OF(TYPE) struct ArrayOf##TYPE \
 { \
 	TYPE *val; \
 	uint32_t len; \
+	uint32_t cap; \
 }
 
+/* smallest capacity allocated by array_extend_capacity */
+#define ARRAY_MIN_CAPACITY 4
+
 /* TODO: with support for C23, we can improve the for_each macro by dropping the TYPE argument
  *     #define for_each(PTR, ARRAY) for (typeof(ARRAY.val) PTR = ARRAY.val; PTR != ARRAY.val + ARRAY.len; ++PTR)
  */
@@ -62,12 +70,14 @@
 #define array_init(ARRAY) do { \
 	(ARRAY)->val = 0; \
 	(ARRAY)->len = 0; \
+	(ARRAY)->cap = 0; \
 } while (0)
 
 #define free_array(ARRAY) do { \
 	free ((ARRAY)->val); \
 	(ARRAY)->val = 0; \
 	(ARRAY)->len = 0; \
+	(ARRAY)->cap = 0; \
 } while (0)
 
 #define free_array_recusive(ARRAY, DESTRUCTOR) do { \
@@ -76,13 +86,43 @@
 	free_array (ARRAY); \
 } while (0)
 
+/* make room for at least CAP elements in total, never shrinks */
+#define array_reserve(ARRAY, CAP) do { \
+	uint32_t _newcap = (CAP); \
+	if (_newcap > (ARRAY)->cap) { \
+		void *_newval = realloc((ARRAY)->val, _newcap * sizeof((ARRAY)->val[0])); \
+		if (!_newval) { \
+			GP_LOG_E ("Out of memory: 'realloc' of %ld bytes failed.", _newcap * sizeof((ARRAY)->val[0])); \
+			return GP_ERROR_NO_MEMORY; \
+		} \
+		(ARRAY)->val = _newval; \
+		(ARRAY)->cap = _newcap; \
+	} \
+} while(0)
+
+/* make room for LEN more elements and zero them. The capacity grows
+ * geometrically, so repeated push_backs are amortized O(1). */
 #define array_extend_capacity(ARRAY, LEN) do { \
-	(ARRAY)->val = realloc((ARRAY)->val, ((ARRAY)->len + (LEN)) * sizeof((ARRAY)->val[0])); \
-	if (!(ARRAY)->val) { \
-		GP_LOG_E ("Out of memory: 'realloc' of %ld bytes failed.", ((ARRAY)->len + (LEN)) * sizeof((ARRAY)->val[0])); \
-		return GP_ERROR_NO_MEMORY; \
+	uint32_t _needed = (ARRAY)->len + (LEN); \
+	if (_needed > (ARRAY)->cap) { \
+		uint32_t _grow = (ARRAY)->cap > (ARRAY)->len ? (ARRAY)->cap : (ARRAY)->len; \
+		_grow = _grow < ARRAY_MIN_CAPACITY ? ARRAY_MIN_CAPACITY : _grow * 2; \
+		array_reserve(ARRAY, _grow > _needed ? _grow : _needed); \
+	} \
+	memset((ARRAY)->val + (ARRAY)->len, 0, (LEN) * sizeof((ARRAY)->val[0])); \
+} while(0)
+
+/* release unused capacity, e.g. after an array has been filled completely */
+#define array_shrink_to_fit(ARRAY) do { \
+	if (!(ARRAY)->len) { \
+		free_array (ARRAY); \
+	} else if ((ARRAY)->cap > (ARRAY)->len) { \
+		void *_newval = realloc((ARRAY)->val, (ARRAY)->len * sizeof((ARRAY)->val[0])); \
+		if (_newval) { \
+			(ARRAY)->val = _newval; \
+			(ARRAY)->cap = (ARRAY)->len; \
+		} \
 	} \
-	memset((ARRAY)->val + (ARRAY)->len, 0, LEN * sizeof((ARRAY)->val[0])); \
 } while(0)
 
 #define array_push_back_empty(ARRAY, PITER) do { \
@@ -41,6 +41,8 @@
 #include "libusb-glue.h"
 #include "device-flags.h"
 #include "playlist-spl.h"
+#include "snapshot.h"
+#include "loopback-glue.h"
 #include "util.h"
 
 #include "mtpz.h"
@@ -56,11 +58,23 @@ int use_mtpz;
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #ifdef _MSC_VER // For MSVC++
 #define USE_WINDOWS_IO_H
 #include <io.h>
 #endif
 
+/* Used by the array_* helpers from array.h */
+#define GP_ERROR_NO_MEMORY -1
+#define GP_LOG_E(x,y)
+
+/* Values of LIBMTP_mtpdevice_t.cached */
+#define CACHE_NONE 0 /* every request goes to the device */
+#define CACHE_FULL 1 /* the whole device is scanned when first needed */
+#define CACHE_LAZY 2 /* folders are scanned as they are first needed */
+
 
 /**
  * Global debug level
@@ -88,6 +102,11 @@ int use_mtpz;
  */
 int LIBMTP_debug = LIBMTP_DEBUG_NONE;
 
+/*
+ * Directory for metadata snapshots, NULL when snapshots are disabled.
+ */
+static char *snapshot_directory = NULL;
+
 
 /*
  * This is a mapping between libmtp internal MTP filetypes and
@@ -123,6 +142,7 @@ typedef struct propertymap_struct {
 typedef struct event_cb_data_struct {
   LIBMTP_event_cb_fn cb;
   void *user_data;
+  LIBMTP_mtpdevice_t *device;
 } event_cb_data_t;
 
 // Global variables
@@ -146,7 +166,13 @@ static void add_error_to_errorstack(LIBMTP_mtpdevice_t *device,
 static void add_ptp_error_to_errorstack(LIBMTP_mtpdevice_t *device,
 					uint16_t ptp_error,
 					char const * const error_text);
+static void free_errorstack(LIBMTP_mtpdevice_t *device);
 static void flush_handles(LIBMTP_mtpdevice_t *device);
+static void cache_objects(LIBMTP_mtpdevice_t *device, uint32_t storage,
+			  uint32_t parent, int subtree);
+static int load_folder(LIBMTP_mtpdevice_t *device, uint32_t storage,
+		       uint32_t parent, PTPObjectHandles *children);
+static void load_default_folders(LIBMTP_mtpdevice_t *device);
 static uint16_t get_handles_recursively(LIBMTP_mtpdevice_t *device,
 				    PTPParams *params,
 				    uint32_t storageid,
@@ -190,7 +216,8 @@ static int set_object_u8(LIBMTP_mtpdevice_t *device, uint32_t const object_id,
 			 uint16_t const attribute_id, uint8_t const value);
 static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat,
 			       LIBMTP_track_t *track);
-static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_t parent);
+static LIBMTP_track_t *obj2track(LIBMTP_mtpdevice_t *device, PTPObject *ob);
+static void pick_property_to_track_metadata(LIBMTP_mtpdevice_t *device, MTPObjectProp *prop, LIBMTP_track_t *track);
 static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
 				    char const * const name,
 				    char const * const artist,
@@ -213,14 +240,19 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
 				uint32_t const * const tracks,
 				uint32_t const no_tracks);
 static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata);
-static void add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
+static int add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
 static void update_metadata_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
+static void mark_cache_stale(LIBMTP_mtpdevice_t *device, uint32_t storage,
+			     uint32_t parent);
+static void queue_cache_event(LIBMTP_mtpdevice_t *device, PTPContainer *ptp_event);
+static void apply_cache_events(LIBMTP_mtpdevice_t *device);
 static int set_object_filename(LIBMTP_mtpdevice_t *device,
 		uint32_t object_id,
 		uint16_t ptp_type,
                 const char **newname);
-static char *generate_unique_filename(PTPParams* params, char const * const filename);
-static int check_filename_exists(PTPParams* params, char const * const filename);
+static char *generate_unique_filename(LIBMTP_mtpdevice_t *device,
+				      uint32_t storage_id, uint32_t parent_id,
+				      char const * const filename);
 static void LIBMTP_Handle_Event(PTPContainer *ptp_event,
                                 LIBMTP_event_t *event, uint32_t *out1);
 
@@ -763,6 +795,69 @@ void LIBMTP_Set_Debug(int level)
 }
 
 
+/**
+ * Enable on-disk snapshots of the metadata cache. When a device is
+ * released its object metadata is saved to a file in this directory,
+ * and the next time the same device (identified by serial number) is
+ * opened the cache is loaded from that file instead of being read
+ * from the device, provided the storages of the device are unchanged.
+ *
+ * A profile of the capabilities of each device is kept in the same
+ * directory, so that reopening a device running the same firmware
+ * skips most of the questions asked when it is first opened. This
+ * applies to uncached devices as well.
+ *
+ * Devices without a serial number never use snapshots.
+ *
+ * @param dirname an existing directory writable by the program, or
+ *        NULL to disable snapshots again (the default).
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Snapshot_Directory(char const * const dirname)
+{
+  char *tmp = NULL;
+
+  if (dirname != NULL) {
+    tmp = strdup(dirname);
+    if (tmp == NULL)
+      return -1;
+  }
+  free(snapshot_directory);
+  snapshot_directory = tmp;
+  return 0;
+}
+
+/**
+ * Forget what was learned about a device from the requests it
+ * refused, such as it not being able to list the properties of all
+ * objects at once, and delete its profile from the snapshot
+ * directory. The device is asked again from then on, and the next
+ * profile saved for it starts over. A profile is dropped by itself
+ * when the firmware version of the device changes, this is for when
+ * a device was wrongly judged.
+ * @param device a pointer to the device to reset the profile of.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Set_Snapshot_Directory()
+ */
+int LIBMTP_Reset_Device_Profile(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+
+  ptp_usb->rawdevice.device_entry.device_flags &= ~ptp_usb->learned_flags;
+  params->device_flags &= ~ptp_usb->learned_flags;
+  ptp_usb->learned_flags = 0;
+  if (snapshot_directory != NULL &&
+      remove_device_profile(device, snapshot_directory) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Reset_Device_Profile(): could not "
+			    "delete the device profile.");
+    return -1;
+  }
+  return 0;
+}
+
+
 /**
  * Initialize the library. You are only supposed to call this
  * one, before using the library for the first time in a program.
@@ -1910,6 +2005,143 @@ static void parse_extension_descriptor(LIBMTP_mtpdevice_t *mtpdevice,
   }
 }
 
+/**
+ * This function registers a loopback device: a simulated MTP device
+ * answering from memory, to try out and time programs and the
+ * library itself without any hardware. The raw device that is filled
+ * in can be opened like any detected device and given to the
+ * transfer scheduler; every opening starts out with the storage as
+ * configured and changes to it are lost when the device is released.
+ *
+ * The generated files are MP3 files named "file000001.mp3" and so
+ * on, the byte at offset n of a file with object ID id is
+ * (id + n) & 0xff. Device flags may be set in the device entry of
+ * the raw device before it is opened, to mimic the quirks of some
+ * real device.
+ * @param config the configuration of the device, it is copied.
+ * @param rawdevice the raw device to fill in.
+ * @return 0 on success, any other value means that no more loopback
+ *         devices can be registered.
+ * @see LIBMTP_Open_Raw_Device()
+ */
+int LIBMTP_Add_Loopback_Device(LIBMTP_loopback_config_t const *config,
+			       LIBMTP_raw_device_t *rawdevice)
+{
+  uint16_t properties[32];
+  uint32_t numproperties = 0;
+  uint32_t i;
+
+  if (config->properties == NULL)
+    return add_loopback_device(config, NULL, 0, rawdevice);
+  for (i = 0; config->properties[i] != LIBMTP_PROPERTY_UNKNOWN &&
+	 numproperties < sizeof(properties) / sizeof(properties[0]); i++) {
+    uint16_t prop = map_libmtp_property_to_ptp_property(config->properties[i]);
+
+    if (prop != 0)
+      properties[numproperties++] = prop;
+  }
+  return add_loopback_device(config, properties, numproperties, rawdevice);
+}
+
+/**
+ * Determines whether the object sizes of a device are 32 or 64 bit
+ * wide. This asks for the object size property description of every
+ * object format the device supports.
+ * @param device the device to inspect.
+ * @return 32 or 64.
+ */
+static uint8_t detect_object_bitsize(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint8_t bs = 0;
+  unsigned int i;
+
+  if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjectPropsSupported)) {
+    for (i=0;i<params->deviceinfo.ImageFormats_len;i++) {
+      PTPObjectPropDesc opd;
+
+      if (ptp_mtp_getobjectpropdesc(params,
+                                    PTP_OPC_ObjectSize,
+                                    params->deviceinfo.ImageFormats[i],
+                                    &opd) != PTP_RC_OK) {
+        LIBMTP_ERROR("LIBMTP PANIC: "
+                     "could not inspect object property description 0x%04x!\n", params->deviceinfo.ImageFormats[i]);
+      } else {
+        if (opd.DataType == PTP_DTC_UINT32) {
+          if (bs == 0) {
+            bs = 32;
+          } else if (bs != 32) {
+            LIBMTP_ERROR("LIBMTP PANIC: "
+                         "different objects support different object sizes!\n");
+            bs = 0;
+            break;
+          }
+        } else if (opd.DataType == PTP_DTC_UINT64) {
+          if (bs == 0) {
+            bs = 64;
+          } else if (bs != 64) {
+            LIBMTP_ERROR("LIBMTP PANIC: "
+                         "different objects support different object sizes!\n");
+            bs = 0;
+            break;
+          }
+        } else {
+          // Ignore if other size.
+          LIBMTP_ERROR("LIBMTP PANIC: "
+                       "awkward object size data type: %04x\n", opd.DataType);
+          bs = 0;
+          break;
+        }
+      }
+    }
+  }
+  if (bs == 0) {
+    // Could not detect object bitsize, assume 32 bits
+    bs = 32;
+  }
+  return bs;
+}
+
+/**
+ * Reads the maximum battery level of a device.
+ * @param device the device to inspect.
+ * @return the maximum battery level, 100 if the device does not say.
+ */
+static uint8_t detect_maximum_battery_level(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  /* Default Max Battery Level, we will adjust this if possible */
+  uint8_t level = 100;
+
+  /* Check if device supports reading maximum battery level */
+  if(!FLAG_BROKEN_BATTERY_LEVEL(ptp_usb) &&
+     ptp_property_issupported( params, PTP_DPC_BatteryLevel)) {
+    PTPDevicePropDesc dpd;
+
+    /* Try to read maximum battery level */
+    if(ptp_getdevicepropdesc(params,
+			     PTP_DPC_BatteryLevel,
+			     &dpd) != PTP_RC_OK) {
+      add_error_to_errorstack(device,
+			      LIBMTP_ERROR_CONNECTING,
+			      "Unable to read Maximum Battery Level for this "
+			      "device even though the device supposedly "
+			      "supports this functionality");
+      return level;
+    }
+
+    /* TODO: is this appropriate? */
+    /* If max battery level is 0 then leave the default, otherwise assign */
+    if (dpd.FORM.Range.MaxValue.u8 != 0) {
+      level = dpd.FORM.Range.MaxValue.u8;
+    }
+
+    ptp_free_devicepropdesc(&dpd);
+  }
+  return level;
+}
+
 /**
  * This function opens a device from a raw device. It is the
  * preferred way to access devices in the new interface where
@@ -1921,7 +2153,6 @@ static void parse_extension_descriptor(LIBMTP_mtpdevice_t *mtpdevice,
 LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevice)
 {
   LIBMTP_mtpdevice_t *mtp_device;
-  uint8_t bs = 0;
   PTPParams *current_params;
   PTP_USB *ptp_usb;
   LIBMTP_error_number_t err;
@@ -1943,7 +2174,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   }
   memset(mtp_device, 0, sizeof(LIBMTP_mtpdevice_t));
   // Non-cached by default
-  mtp_device->cached = 0;
+  mtp_device->cached = CACHE_NONE;
 
   /* Create PTP params */
   current_params = (PTPParams *) malloc(sizeof(PTPParams));
@@ -1952,6 +2183,10 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
     return NULL;
   }
   memset(current_params, 0, sizeof(PTPParams));
+  if (ptp_init_locks(current_params) < 0) {
+    LIBMTP_ERROR("LIBMTP PANIC: could not set up locking, "
+		 "the device must not be shared between threads\n");
+  }
   current_params->device_flags = rawdevice->device_entry.device_flags;
   current_params->objects.len = 0;
   current_params->cachetime = 2;
@@ -1964,6 +2199,8 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   current_params->error_func = LIBMTP_ptp_error;
   /* TODO: Will this always be little endian? */
   current_params->byteorder = PTP_DL_LE;
+  /* All strings in the API are UTF-8 */
+  current_params->utf8_strings = 1;
 #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
   current_params->cd_locale_to_ucs2 = iconv_open("UTF-16LE", "UTF-8");
   current_params->cd_ucs2_to_locale = iconv_open("UTF-8", "UTF-16LE");
@@ -1972,6 +2209,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
      current_params->cd_ucs2_to_locale == (iconv_t) -1) {
     LIBMTP_ERROR("LIBMTP PANIC: Cannot open iconv() converters to/from UCS-2!\n"
 	    "Too old stdlibc, glibc and libiconv?\n");
+    ptp_free_locks(current_params);
     free(current_params);
     free(mtp_device);
     return NULL;
@@ -1980,14 +2218,20 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   mtp_device->params = current_params;
 
   /* Create usbinfo, this also opens the session */
-  err = configure_usb_device(rawdevice,
-			     current_params,
-			     &mtp_device->usbinfo);
+  if (is_loopback_device(rawdevice))
+    err = configure_loopback_device(rawdevice,
+				    current_params,
+				    &mtp_device->usbinfo);
+  else
+    err = configure_usb_device(rawdevice,
+			       current_params,
+			       &mtp_device->usbinfo);
   if (err != LIBMTP_ERROR_NONE) {
 #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
     iconv_close(current_params->cd_locale_to_ucs2);
     iconv_close(current_params->cd_ucs2_to_locale);
 #endif
+    ptp_free_locks(current_params);
     free(current_params);
     free(mtp_device);
     return NULL;
@@ -2009,6 +2253,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
     iconv_close(current_params->cd_ucs2_to_locale);
 #endif
     free(mtp_device->usbinfo);
+    ptp_free_locks(current_params);
     free(mtp_device->params);
     current_params = NULL;
     free(mtp_device);
@@ -2105,81 +2350,15 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
     }
   }
 
-  /* Determine if the object size supported is 32 or 64 bit wide */
-  if (ptp_operation_issupported(current_params,PTP_OC_MTP_GetObjectPropsSupported)) {
-    for (i=0;i<current_params->deviceinfo.ImageFormats_len;i++) {
-      PTPObjectPropDesc opd;
-
-      if (ptp_mtp_getobjectpropdesc(current_params,
-                                    PTP_OPC_ObjectSize,
-                                    current_params->deviceinfo.ImageFormats[i],
-                                    &opd) != PTP_RC_OK) {
-        LIBMTP_ERROR("LIBMTP PANIC: "
-                     "could not inspect object property description 0x%04x!\n", current_params->deviceinfo.ImageFormats[i]);
-      } else {
-        if (opd.DataType == PTP_DTC_UINT32) {
-          if (bs == 0) {
-            bs = 32;
-          } else if (bs != 32) {
-            LIBMTP_ERROR("LIBMTP PANIC: "
-                         "different objects support different object sizes!\n");
-            bs = 0;
-            break;
-          }
-        } else if (opd.DataType == PTP_DTC_UINT64) {
-          if (bs == 0) {
-            bs = 64;
-          } else if (bs != 64) {
-            LIBMTP_ERROR("LIBMTP PANIC: "
-                         "different objects support different object sizes!\n");
-            bs = 0;
-            break;
-          }
-        } else {
-          // Ignore if other size.
-          LIBMTP_ERROR("LIBMTP PANIC: "
-                       "awkward object size data type: %04x\n", opd.DataType);
-          bs = 0;
-          break;
-        }
-      }
-    }
-  }
-  if (bs == 0) {
-    // Could not detect object bitsize, assume 32 bits
-    bs = 32;
-  }
-  mtp_device->object_bitsize = bs;
-
   /* No Errors yet for this device */
   mtp_device->errorstack = NULL;
 
-  /* Default Max Battery Level, we will adjust this if possible */
-  mtp_device->maximum_battery_level = 100;
-
-  /* Check if device supports reading maximum battery level */
-  if(!FLAG_BROKEN_BATTERY_LEVEL(ptp_usb) &&
-     ptp_property_issupported( current_params, PTP_DPC_BatteryLevel)) {
-    PTPDevicePropDesc dpd;
-
-    /* Try to read maximum battery level */
-    if(ptp_getdevicepropdesc(current_params,
-			     PTP_DPC_BatteryLevel,
-			     &dpd) != PTP_RC_OK) {
-      add_error_to_errorstack(mtp_device,
-			      LIBMTP_ERROR_CONNECTING,
-			      "Unable to read Maximum Battery Level for this "
-			      "device even though the device supposedly "
-			      "supports this functionality");
-    }
-
-    /* TODO: is this appropriate? */
-    /* If max battery level is 0 then leave the default, otherwise assign */
-    if (dpd.FORM.Range.MaxValue.u8 != 0) {
-      mtp_device->maximum_battery_level = dpd.FORM.Range.MaxValue.u8;
-    }
-
-    ptp_free_devicepropdesc(&dpd);
+  /* A device seen before need not be asked about its capabilities */
+  if (snapshot_directory == NULL ||
+      load_device_profile(mtp_device, snapshot_directory) != 0) {
+    mtp_device->object_bitsize = detect_object_bitsize(mtp_device);
+    mtp_device->maximum_battery_level =
+      detect_maximum_battery_level(mtp_device);
   }
 
   /* Set all default folders to 0xffffffffU (root directory) */
@@ -2205,7 +2384,15 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   return mtp_device;
 }
 
-LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
+/**
+ * Opens a device like LIBMTP_Open_Raw_Device_Uncached() and sets up its
+ * object cache.
+ * @param rawdevice the raw device to open a "real" device for.
+ * @param cached CACHE_FULL or CACHE_LAZY.
+ * @return an open device.
+ */
+static LIBMTP_mtpdevice_t *open_cached_device(LIBMTP_raw_device_t *rawdevice,
+					      int cached)
 {
   LIBMTP_mtpdevice_t *mtp_device = LIBMTP_Open_Raw_Device_Uncached(rawdevice);
 
@@ -2231,7 +2418,12 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
   }
 
   // Set up this device as cached
-  mtp_device->cached = 1;
+  mtp_device->cached = cached;
+  if (cached == CACHE_LAZY) {
+    // Only what is needed for the default folders, the rest on demand
+    load_default_folders(mtp_device);
+    return mtp_device;
+  }
   /*
    * Then get the handles and try to locate the default folders.
    * This has the desired side effect of caching all handles from
@@ -2241,9 +2433,40 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
   return mtp_device;
 }
 
+/**
+ * This function opens a device from a raw device and caches all
+ * objects on it up front, which makes opening slow on devices with
+ * many files but later operations fast.
+ * @param rawdevice the raw device to open a "real" device for.
+ * @return an open device.
+ * @see LIBMTP_Open_Raw_Device_Lazy()
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
+{
+  return open_cached_device(rawdevice, CACHE_FULL);
+}
+
+/**
+ * This function opens a device from a raw device like
+ * LIBMTP_Open_Raw_Device() but fills the object cache on demand: a
+ * folder is listed the first time something in it is asked for and
+ * served from the cache after that. Opening only lists the root
+ * folder of the primary storage. Functions that need all objects, like
+ * LIBMTP_Get_Filelisting(), still scan the whole device, once.
+ * LIBMTP_Get_Files_And_Folders() and LIBMTP_Get_Children() can be
+ * used on such a device too.
+ * @param rawdevice the raw device to open a "real" device for.
+ * @return an open device.
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Lazy(LIBMTP_raw_device_t *rawdevice)
+{
+  return open_cached_device(rawdevice, CACHE_LAZY);
+}
+
 /**
  * To read events sent by the device, repeatedly call this function from a secondary
- * thread until the return value is < 0.
+ * thread until the return value is < 0. Other threads may keep using the
+ * device meanwhile, transactions and the object cache are locked per device.
  *
  * @param device a pointer to the MTP device to poll for events.
  * @param event contains a pointer to be filled in with the event retrieved if the call
@@ -2258,18 +2481,27 @@ int LIBMTP_Read_Event(LIBMTP_mtpdevice_t *device, LIBMTP_event_t *event, uint32_
    * FIXME: Potential race-condition here, if client deallocs device
    * while we're *not* waiting for input. As we'll be waiting for
    * input most of the time, it's unlikely but still worth considering
-   * for improvement. Also we cannot affect the state of the cache etc
-   * unless we know we are the sole user on the device. A spinlock or
-   * mutex in the LIBMTP_mtpdevice_t is needed for this to work.
+   * for improvement. The wait itself takes no locks, so transfers in
+   * other threads go on meanwhile; the cache is updated under its
+   * write lock afterwards, together with any events queued by
+   * LIBMTP_Read_Event_Async().
    */
   PTPParams *params = (PTPParams *) device->params;
   PTPContainer ptp_event;
-  uint16_t ret = ptp_usb_event_wait(params, &ptp_event);
+  uint16_t ret;
+
+  // Transports other than USB bring their own event functions
+  if (params->event_wait != NULL)
+    ret = params->event_wait(params, &ptp_event);
+  else
+    ret = ptp_usb_event_wait(params, &ptp_event);
 
   if (ret != PTP_RC_OK) {
     /* Device is closing down or other fatal stuff, exit thread */
     return -1;
   }
+  queue_cache_event(device, &ptp_event);
+  apply_cache_events(device);
   LIBMTP_Handle_Event(&ptp_event, event, out1);
   return 0;
 }
@@ -2306,13 +2538,11 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       break;
     case PTP_EC_StoreAdded:
       LIBMTP_INFO("Received event PTP_EC_StoreAdded in session %u\n", session_id);
-      /* TODO: rescan storages */
       *event = LIBMTP_EVENT_STORE_ADDED;
       *out1 = param1;
       break;
     case PTP_EC_StoreRemoved:
       LIBMTP_INFO("Received event PTP_EC_StoreRemoved in session %u\n", session_id);
-      /* TODO: rescan storages */
       *event = LIBMTP_EVENT_STORE_REMOVED;
       *out1 = param1;
       break;
@@ -2324,7 +2554,6 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       break;
     case PTP_EC_ObjectInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_ObjectInfoChanged in session %u\n", session_id);
-      /* TODO: rescan object cache or just for this one object */
       break;
     case PTP_EC_DeviceInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_DeviceInfoChanged in session %u\n", session_id);
@@ -2341,7 +2570,6 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       break;
     case PTP_EC_StorageInfoChanged :
       LIBMTP_INFO( "Received event PTP_EC_StorageInfoChanged in session %u\n", session_id);
-     /* TODO: update storage info */
       break;
     case PTP_EC_CaptureComplete :
       LIBMTP_INFO( "Received event PTP_EC_CaptureComplete in session %u\n", session_id);
@@ -2365,6 +2593,9 @@ static void LIBMTP_Read_Event_Cb(PTPParams *params, uint16_t ret_code,
   switch (ret_code) {
   case PTP_RC_OK:
     handler_ret = LIBMTP_HANDLER_RETURN_OK;
+    // This runs inside libusb event handling, possibly in the middle of
+    // a transaction of another thread: no I/O and no cache lock here.
+    queue_cache_event(data->device, ptp_event);
     LIBMTP_Handle_Event(ptp_event, &event, &param1);
     break;
   case PTP_ERROR_CANCEL:
@@ -2387,6 +2618,9 @@ static void LIBMTP_Read_Event_Cb(PTPParams *params, uint16_t ret_code,
  * After an event is received, this function should be called again to listen for the next
  * event.
  *
+ * The object cache is not updated from the callback, the event is applied
+ * to it the next time the cache is used.
+ *
  * For now, this non-blocking mechanism only works with libusb-1.0, and not any of the
  * other usb library backends. Attempting to call this method with another backend will
  * always return an error.
@@ -2399,16 +2633,78 @@ static void LIBMTP_Read_Event_Cb(PTPParams *params, uint16_t ret_code,
  */
 int LIBMTP_Read_Event_Async(LIBMTP_mtpdevice_t *device, LIBMTP_event_cb_fn cb, void *user_data) {
   PTPParams *params = (PTPParams *) device->params;
-  event_cb_data_t *data =  malloc(sizeof(event_cb_data_t));
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  event_cb_data_t *data;
   uint16_t ret;
 
+  // Loopback devices have no USB interrupt endpoint to poll
+  if (ptp_usb->loopback != NULL)
+    return -1;
+  data = malloc(sizeof(event_cb_data_t));
   data->cb = cb;
   data->user_data = user_data;
+  data->device = device;
 
   ret = ptp_usb_event_async(params, LIBMTP_Read_Event_Cb, data);
   return ret == PTP_RC_OK ? 0 : -1;
 }
 
+#ifdef HAVE_PTHREAD_H
+typedef struct open_device_job_struct {
+  LIBMTP_raw_device_t *rawdevice;
+  LIBMTP_mtpdevice_t *device;
+  pthread_t thread;
+  int started;
+} open_device_job_t;
+
+static void *open_device_thread(void *data)
+{
+  open_device_job_t *job = (open_device_job_t *) data;
+
+  job->device = LIBMTP_Open_Raw_Device(job->rawdevice);
+  return NULL;
+}
+#endif
+
+/**
+ * Opens a number of devices. Opening a device reads all its metadata,
+ * so with threads available the devices are opened in parallel.
+ * @param devices the raw devices to open.
+ * @param numdevs the number of raw devices.
+ * @param opened filled in with the opened devices, NULL where opening
+ *        failed.
+ */
+static void open_raw_devices(LIBMTP_raw_device_t *devices, unsigned int numdevs,
+			     LIBMTP_mtpdevice_t **opened)
+{
+  unsigned int i;
+#ifdef HAVE_PTHREAD_H
+  open_device_job_t *jobs;
+
+  jobs = (open_device_job_t *) calloc(numdevs, sizeof(open_device_job_t));
+  if (jobs != NULL) {
+    for (i = 0; i < numdevs; i++) {
+      jobs[i].rawdevice = &devices[i];
+      jobs[i].started = (pthread_create(&jobs[i].thread, NULL,
+					open_device_thread, &jobs[i]) == 0);
+    }
+    for (i = 0; i < numdevs; i++) {
+      if (jobs[i].started) {
+	pthread_join(jobs[i].thread, NULL);
+      } else {
+	jobs[i].device = LIBMTP_Open_Raw_Device(&devices[i]);
+      }
+      opened[i] = jobs[i].device;
+    }
+    free(jobs);
+    return;
+  }
+#endif
+  for (i = 0; i < numdevs; i++) {
+    opened[i] = LIBMTP_Open_Raw_Device(&devices[i]);
+  }
+}
+
 /**
  * Recursive function that adds MTP devices to a linked list
  * @param devices a list of raw devices to have real devices created for.
@@ -2420,10 +2716,15 @@ static LIBMTP_mtpdevice_t * create_usb_mtp_devices(LIBMTP_raw_device_t *devices,
   unsigned int i;
   LIBMTP_mtpdevice_t *mtp_device_list = NULL;
   LIBMTP_mtpdevice_t *current_device = NULL;
+  LIBMTP_mtpdevice_t **opened;
+
+  opened = (LIBMTP_mtpdevice_t **) malloc(numdevs * sizeof(LIBMTP_mtpdevice_t *));
+  if (opened == NULL)
+    return NULL;
+  open_raw_devices(devices, numdevs, opened);
 
   for (i=0; i < numdevs; i++) {
-    LIBMTP_mtpdevice_t *mtp_device;
-    mtp_device = LIBMTP_Open_Raw_Device(&devices[i]);
+    LIBMTP_mtpdevice_t *mtp_device = opened[i];
 
     /* On error, try next device */
     if (mtp_device == NULL)
@@ -2438,6 +2739,7 @@ static LIBMTP_mtpdevice_t * create_usb_mtp_devices(LIBMTP_raw_device_t *devices,
       current_device = mtp_device;
     }
   }
+  free(opened);
   return mtp_device_list;
 }
 
@@ -2522,15 +2824,25 @@ void LIBMTP_Release_Device(LIBMTP_mtpdevice_t *device)
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
-  close_device(ptp_usb, params);
-  // Clear error stack
-  LIBMTP_Clear_Errorstack(device);
+  // Save the cache while the device can still be asked for storage info
+  if (snapshot_directory != NULL && device->cached &&
+      params->objects.complete && params->objects.len)
+    save_metadata_snapshot(device, snapshot_directory);
+  if (snapshot_directory != NULL)
+    save_device_profile(device, snapshot_directory);
+  if (ptp_usb->loopback != NULL)
+    close_loopback_device(ptp_usb, params);
+  else
+    close_device(ptp_usb, params);
+  // Free the error stack
+  free_errorstack(device);
 #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
   iconv_close(params->cd_locale_to_ucs2);
   iconv_close(params->cd_ucs2_to_locale);
 #endif
   free(ptp_usb);
   ptp_free_params(params);
+  ptp_free_locks(params);
   free(params);
   free_storage_list(device);
   // Free extension list...
@@ -2549,6 +2861,53 @@ void LIBMTP_Release_Device(LIBMTP_mtpdevice_t *device)
   free(device);
 }
 
+#ifdef HAVE_PTHREAD_H
+/*
+ * The error stack of a device is shared by all threads using it, also
+ * those libmtp starts itself to open devices or run scheduled jobs, so
+ * that no error is lost with the thread that ran into it. Errors are
+ * rare, one lock for the stacks of all devices is enough.
+ */
+static pthread_mutex_t errorstack_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock_errorstack() pthread_mutex_lock(&errorstack_lock)
+#define unlock_errorstack() pthread_mutex_unlock(&errorstack_lock)
+#else
+#define lock_errorstack()
+#define unlock_errorstack()
+#endif
+
+/**
+ * Frees a list of errors.
+ */
+static void free_error_list(LIBMTP_error_t *tmp)
+{
+  while (tmp != NULL) {
+    LIBMTP_error_t *tmp2;
+
+    if (tmp->error_text != NULL) {
+      free(tmp->error_text);
+    }
+    tmp2 = tmp;
+    tmp = tmp->next;
+    free(tmp2);
+  }
+}
+
+/**
+ * Drops the error stack of a device.
+ * @param device the device that is going away.
+ */
+static void free_errorstack(LIBMTP_mtpdevice_t *device)
+{
+  LIBMTP_error_t *errors;
+
+  lock_errorstack();
+  errors = device->errorstack;
+  device->errorstack = NULL;
+  unlock_errorstack();
+  free_error_list(errors);
+}
+
 /**
  * This can be used by any libmtp-intrinsic code that
  * need to stack up an error on the stack. You are only
@@ -2561,25 +2920,27 @@ static void add_error_to_errorstack(LIBMTP_mtpdevice_t *device,
 				    char const * const error_text)
 {
   LIBMTP_error_t *newerror;
+  LIBMTP_error_t **errorstack;
 
   if (device == NULL) {
     LIBMTP_ERROR("LIBMTP PANIC: Trying to add error to a NULL device!\n");
     return;
   }
   newerror = (LIBMTP_error_t *) malloc(sizeof(LIBMTP_error_t));
+  if (newerror == NULL) {
+    LIBMTP_ERROR("LIBMTP PANIC: Could not stack error: %s\n", error_text);
+    return;
+  }
   newerror->errornumber = errornumber;
   newerror->error_text = strdup(error_text);
   newerror->next = NULL;
-  if (device->errorstack == NULL) {
-    device->errorstack = newerror;
-  } else {
-    LIBMTP_error_t *tmp = device->errorstack;
-
-    while (tmp->next != NULL) {
-      tmp = tmp->next;
-    }
-    tmp->next = newerror;
+  lock_errorstack();
+  errorstack = &device->errorstack;
+  while (*errorstack != NULL) {
+    errorstack = &(*errorstack)->next;
   }
+  *errorstack = newerror;
+  unlock_errorstack();
 }
 
 /**
@@ -2612,7 +2973,9 @@ static void add_ptp_error_to_errorstack(LIBMTP_mtpdevice_t *device,
  * representations for each error number) or when you need
  * to build a multi-line error text widget or something like
  * that. You need to call the <code>LIBMTP_Clear_Errorstack</code>
- * to clear it when you're finished with it.
+ * to clear it when you're finished with it. All threads using the
+ * device share its error stack, the list returned stays valid until
+ * one of them clears it.
  * @param device a pointer to the MTP device to get the error
  *        stack for.
  * @return the error stack or NULL if there are no errors
@@ -2622,11 +2985,16 @@ static void add_ptp_error_to_errorstack(LIBMTP_mtpdevice_t *device,
  */
 LIBMTP_error_t *LIBMTP_Get_Errorstack(LIBMTP_mtpdevice_t *device)
 {
+  LIBMTP_error_t *errors;
+
   if (device == NULL) {
     LIBMTP_ERROR("LIBMTP PANIC: Trying to get the error stack of a NULL device!\n");
     return NULL;
   }
-  return device->errorstack;
+  lock_errorstack();
+  errors = device->errorstack;
+  unlock_errorstack();
+  return errors;
 }
 
 /**
@@ -2641,19 +3009,7 @@ void LIBMTP_Clear_Errorstack(LIBMTP_mtpdevice_t *device)
   if (device == NULL) {
     LIBMTP_ERROR("LIBMTP PANIC: Trying to clear the error stack of a NULL device!\n");
   } else {
-    LIBMTP_error_t *tmp = device->errorstack;
-
-    while (tmp != NULL) {
-      LIBMTP_error_t *tmp2;
-
-      if (tmp->error_text != NULL) {
-	free(tmp->error_text);
-      }
-      tmp2 = tmp;
-      tmp = tmp->next;
-      free(tmp2);
-    }
-    device->errorstack = NULL;
+    free_errorstack(device);
   }
 }
 
@@ -2668,8 +3024,10 @@ void LIBMTP_Dump_Errorstack(LIBMTP_mtpdevice_t *device)
   if (device == NULL) {
     LIBMTP_ERROR("LIBMTP PANIC: Trying to dump the error stack of a NULL device!\n");
   } else {
-    LIBMTP_error_t *tmp = device->errorstack;
+    LIBMTP_error_t *tmp;
 
+    lock_errorstack();
+    tmp = device->errorstack;
     while (tmp != NULL) {
       if (tmp->error_text != NULL) {
 	LIBMTP_ERROR("Error %d: %s\n", tmp->errornumber, tmp->error_text);
@@ -2678,7 +3036,180 @@ void LIBMTP_Dump_Errorstack(LIBMTP_mtpdevice_t *device)
       }
       tmp = tmp->next;
     }
+    unlock_errorstack();
+  }
+}
+
+/**
+ * This function tunes the queue of bulk transfers a device uses for
+ * large reads or writes, such as file transfers. While the transfers
+ * already queued drain to or from the device, the next one is filled
+ * or emptied on the host, so disk and bus work overlap. A deeper queue
+ * or larger transfers help fast devices on busy hosts, a shallow queue
+ * keeps the memory use of many devices opened at once down. The
+ * defaults come from the LIBMTP_READ_QUEUE_DEPTH,
+ * LIBMTP_READ_TRANSFER_SIZE, LIBMTP_WRITE_QUEUE_DEPTH and
+ * LIBMTP_WRITE_TRANSFER_SIZE environment variables if set.
+ *
+ * The new settings apply from the next transfer on, do not call this
+ * while another thread is transferring to or from the device. Only the
+ * libusb 1.0 backend queues transfers, elsewhere this has no effect.
+ * @param device a pointer to the device to tune.
+ * @param write 0 to set the read queue, any other value to set the
+ *        write queue.
+ * @param depth the number of transfers queued at once, 1 turns the
+ *        queue off.
+ * @param transfer_size the size in bytes of each transfer. It is cut
+ *        down to a whole number of USB packets.
+ * @return 0 on success, any other value means the settings are
+ *         invalid and were not changed.
+ */
+int LIBMTP_Set_Transfer_Queue(LIBMTP_mtpdevice_t *device, int write,
+			      int depth, int transfer_size)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+
+  if (depth < 1 || transfer_size < 1) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Set_Transfer_Queue(): invalid queue "
+			    "depth or transfer size.");
+    return -1;
+  }
+  if (write) {
+    ptp_usb->write_queue_depth = depth;
+    ptp_usb->write_transfer_size = transfer_size;
+  } else {
+    ptp_usb->read_queue_depth = depth;
+    ptp_usb->read_transfer_size = transfer_size;
+  }
+  return 0;
+}
+
+/**
+ * This function retrieves the transaction statistics of a device,
+ * one entry per PTP operation code used since the device was opened
+ * or the statistics were reset. The time of each transaction is
+ * split into the time spent waiting for the device, which includes
+ * the USB bus, and the time spent reading and writing the data on the
+ * host, e.g. in the file or callback of a transfer.
+ * @param device a pointer to the device to get the statistics for.
+ * @param stats a pointer to a variable that will hold the newly
+ *        allocated array of statistics. Free it with free().
+ * @param numstats a pointer to a variable that will hold the number
+ *        of entries in the array.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Reset_Statistics()
+ */
+int LIBMTP_Get_Statistics(LIBMTP_mtpdevice_t *device,
+			  LIBMTP_statistics_t **stats, int *numstats)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPOpStats *ops;
+  unsigned int nops;
+  unsigned int i;
+
+  *stats = NULL;
+  *numstats = 0;
+  if (ptp_stats_get(params, &ops, &nops) < 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Get_Statistics(): out of memory.");
+    return -1;
+  }
+  if (nops == 0) {
+    free(ops);
+    return 0;
+  }
+  *stats = (LIBMTP_statistics_t *) malloc(nops * sizeof(LIBMTP_statistics_t));
+  if (*stats == NULL) {
+    free(ops);
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Get_Statistics(): out of memory.");
+    return -1;
+  }
+  for (i = 0; i < nops; i++) {
+    LIBMTP_statistics_t *st = &(*stats)[i];
+
+    st->opcode = ops[i].opcode;
+    st->count = ops[i].count;
+    st->errors = ops[i].errors;
+    st->bytes_in = ops[i].bytes_in;
+    st->bytes_out = ops[i].bytes_out;
+    st->device_usec = ops[i].device_usec;
+    st->handler_usec = ops[i].handler_usec;
+    st->max_usec = ops[i].max_usec;
+    memcpy(st->histogram, ops[i].histogram, sizeof(st->histogram));
+  }
+  free(ops);
+  *numstats = nops;
+  return 0;
+}
+
+/**
+ * This function clears the transaction statistics and the trace of
+ * a device.
+ * @param device a pointer to the device to reset the statistics for.
+ * @see LIBMTP_Get_Statistics()
+ */
+void LIBMTP_Reset_Statistics(LIBMTP_mtpdevice_t *device)
+{
+  ptp_stats_reset((PTPParams *) device->params);
+}
+
+/**
+ * This function turns the transaction trace of a device on or off.
+ * The trace keeps the last transactions in a ring buffer, with their
+ * parameters, response, data sizes and times, for
+ * LIBMTP_Dump_Trace() to print. Anything traced before is dropped.
+ * @param device a pointer to the device to trace.
+ * @param entries the number of transactions to keep, 0 turns the
+ *        trace off.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Trace_Size(LIBMTP_mtpdevice_t *device, int entries)
+{
+  if (entries < 0 ||
+      ptp_stats_set_trace((PTPParams *) device->params, entries) < 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Set_Trace_Size(): could not set up the trace.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * This function dumps the transaction trace of a device to
+ * <code>stdout</code>, oldest transaction first. Times are in
+ * microseconds, the start relative to the first transaction shown.
+ * @param device a pointer to the device to dump the trace for.
+ * @see LIBMTP_Set_Trace_Size()
+ */
+void LIBMTP_Dump_Trace(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPTraceEntry *entries;
+  unsigned int nentries;
+  unsigned int i;
+
+  if (ptp_stats_get_trace(params, &entries, &nentries) < 0) {
+    LIBMTP_ERROR("LIBMTP_Dump_Trace(): out of memory.\n");
+    return;
+  }
+  for (i = 0; i < nentries; i++) {
+    PTPTraceEntry *e = &entries[i];
+    int j;
+
+    printf("%10llu %-28s", (unsigned long long) (e->start - entries[0].start),
+	   ptp_get_opcode_name(params, e->opcode));
+    for (j = 0; j < e->nparam && j < 5; j++)
+      printf(" 0x%08x", e->param[j]);
+    printf(" -> 0x%04x in %llu out %llu device %llu handler %llu\n",
+	   e->response,
+	   (unsigned long long) e->bytes_in,
+	   (unsigned long long) e->bytes_out,
+	   (unsigned long long) e->device_usec,
+	   (unsigned long long) e->handler_usec);
   }
+  free(entries);
 }
 
 /**
@@ -2693,11 +3224,7 @@ void LIBMTP_Dump_Errorstack(LIBMTP_mtpdevice_t *device)
 static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
 {
   PTPParams      *params = (PTPParams *) device->params;
-  int		 cnt = 0;
-  int            i, j, nrofprops;
-  uint32_t	 lasthandle = 0xffffffff;
-  MTPObjectProp  *props = NULL;
-  MTPObjectProp  *prop;
+  uint32_t       i;
   uint16_t       ret;
   int            oldtimeout;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
@@ -2718,9 +3245,21 @@ static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
   get_usb_device_timeout(ptp_usb, &oldtimeout);
   set_usb_device_timeout(ptp_usb, 60000);
 
-  ret = ptp_mtp_getobjectproplist(params, 0xffffffff, &props, &nrofprops);
+  /*
+   * The property list is decoded while it is being received and
+   * stored directly into params->objects, so the complete list never
+   * has to be held in memory.
+   */
+  ret = ptp_mtp_getobjectproplist_to_cache(params, 0xffffffff,
+					   0x00000000U, 0xFFFFFFFFU, 0,
+					   0xFFFFFFFFU, NULL);
   set_usb_device_timeout(ptp_usb, oldtimeout);
 
+  if (ret != PTP_RC_OK) {
+    // Drop whatever was decoded before the failure so the caller
+    // falls back to the classic methods.
+    ptp_objects_clear(params);
+  }
   if (ret == PTP_RC_MTP_Specification_By_Group_Unsupported) {
     // What's the point in the device implementing this command if
     // you cannot use it to get all props for AT LEAST one object?
@@ -2734,92 +3273,14 @@ static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
     "could not get proplist of all objects.");
     return -1;
   }
-  if (props == NULL && nrofprops != 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "get_all_metadata_fast(): "
-			    "call to ptp_mtp_getobjectproplist() returned "
-			    "inconsistent results.");
-    return -1;
-  }
-  /*
-   * We count the number of objects by counting the ObjectHandle
-   * references, whenever it changes we get a new object, when it's
-   * the same, it is just different properties of the same object.
-   */
-  prop = props;
-  for (i=0;i<nrofprops;i++) {
-      if (lasthandle != prop->ObjectHandle) {
-	cnt++;
-	lasthandle = prop->ObjectHandle;
-      }
-      prop++;
-  }
-  lasthandle = 0xffffffff;
-  array_init(&params->objects);
-#define GP_ERROR_NO_MEMORY -1
-#define GP_LOG_E(x,y)
-  array_extend_capacity(&params->objects, cnt);
-
-  prop = props;
-  i = -1;
-  for (j=0;j<nrofprops;j++) {
-    if (lasthandle != prop->ObjectHandle) {
-      if (i >= 0) {
-        params->objects.val[i].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-	if (!params->objects.val[i].oi.Filename) {
-	  /* I have one such file on my Creative (Marcus) */
-	  params->objects.val[i].oi.Filename = strdup("<null>");
-	}
-      }
-      i++;
-      lasthandle = prop->ObjectHandle;
-      params->objects.val[i].oid = prop->ObjectHandle;
-    }
-    switch (prop->PropCode) {
-    case PTP_OPC_ParentObject:
-      params->objects.val[i].oi.ParentObject = prop->Value.u32;
-      params->objects.val[i].flags |= PTPOBJECT_PARENTOBJECT_LOADED;
-      break;
-    case PTP_OPC_ObjectFormat:
-      params->objects.val[i].oi.ObjectFormat = prop->Value.u16;
-      break;
-    case PTP_OPC_ObjectSize:
-      // We loose precision here, up to 32 bits! However the commands that
-      // retrieve metadata for files and tracks will make sure that the
-      // PTP_OPC_ObjectSize is read in and duplicated again.
-      if (device->object_bitsize == 64) {
-	params->objects.val[i].oi.ObjectSize = (uint32_t) prop->Value.u64;
-      } else {
-	params->objects.val[i].oi.ObjectSize = prop->Value.u32;
-      }
-      break;
-    case PTP_OPC_StorageID:
-      params->objects.val[i].oi.StorageID = prop->Value.u32;
-      params->objects.val[i].flags |= PTPOBJECT_STORAGEID_LOADED;
-      break;
-    case PTP_OPC_ObjectFileName:
-      if (prop->Value.str != NULL)
-        params->objects.val[i].oi.Filename = strdup(prop->Value.str);
-      break;
-    default: {
-      /* Copy all of the other MTP oprierties into the per-object proplist */
-      array_push_back(&params->objects.val[i].mtp_props,props[j]);
-      params->objects.val[i].flags |= PTPOBJECT_MTPPROPLIST_LOADED;
-      break;
+  for (i=0;i<params->objects.len;i++) {
+    if (!params->objects.val[i]->oi.Filename) {
+      /* I have one such file on my Creative (Marcus) */
+      params->objects.val[i]->oi.Filename = ptp_intern_string(params, "<null>");
     }
-    }
-    prop++;
-  }
-  /* mark last entry also */
-  if (i >= 0) {
-    params->objects.val[i].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-    params->objects.len = i+1;
-  } else {
-    params->objects.len = 0;
   }
-  free (props);
-  /* The device might not give the list in linear ascending order */
-  ptp_objects_sort (params);
+  /* the cache is complete now, give back what the growth left over */
+  array_shrink_to_fit(&params->objects);
   return 0;
 }
 
@@ -2873,6 +3334,310 @@ static uint16_t get_handles_recursively(LIBMTP_mtpdevice_t *device,
   return PTP_RC_OK;
 }
 
+/**
+ * Collects the distinct property group codes of the given object
+ * formats, for devices that refuse to return all properties at once
+ * and want them group by group instead.
+ * @param device a pointer to the device to ask.
+ * @param formats the object formats to collect the groups for.
+ * @param nformats the number of formats.
+ * @param groups returns an array of group codes, free() it after use.
+ * @return the number of group codes found.
+ */
+static uint32_t get_property_groups(LIBMTP_mtpdevice_t *device,
+				    uint16_t const *formats, uint32_t nformats,
+				    uint32_t **groups)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t ngroups = 0;
+  uint32_t i, j, k;
+
+  *groups = NULL;
+  for (i = 0; i < nformats; i++) {
+    uint16_t *props = NULL;
+    uint32_t propcnt = 0;
+
+    if (ptp_mtp_getobjectpropssupported(params, formats[i],
+					&propcnt, &props) != PTP_RC_OK) {
+      continue;
+    }
+    for (j = 0; j < propcnt; j++) {
+      PTPObjectPropDesc opd;
+      uint32_t *tmp;
+
+      if (ptp_mtp_getobjectpropdesc(params, props[j], formats[i],
+				    &opd) != PTP_RC_OK) {
+	continue;
+      }
+      for (k = 0; k < ngroups; k++) {
+	if ((*groups)[k] == opd.GroupCode) {
+	  break;
+	}
+      }
+      if (opd.GroupCode != 0 && k == ngroups) {
+	tmp = realloc(*groups, (ngroups + 1) * sizeof(uint32_t));
+	if (tmp != NULL) {
+	  *groups = tmp;
+	  (*groups)[ngroups++] = opd.GroupCode;
+	}
+      }
+      ptp_free_objectpropdesc(&opd);
+    }
+    free(props);
+  }
+  return ngroups;
+}
+
+/**
+ * Issues one filtered GetObjPropList request into the object cache,
+ * or one request per property group if <code>ngroups</code> is set.
+ */
+static uint16_t prefetch_proplist(PTPParams *params, uint32_t handle,
+				  uint32_t format, uint32_t level,
+				  uint32_t const *groups, uint32_t ngroups)
+{
+  uint16_t ret;
+  uint32_t i;
+
+  if (ngroups == 0) {
+    return ptp_mtp_getobjectproplist_to_cache(params, handle, format,
+					      0xFFFFFFFFU, 0, level, NULL);
+  }
+  for (i = 0; i < ngroups; i++) {
+    ret = ptp_mtp_getobjectproplist_to_cache(params, handle, format,
+					     0x00000000U, groups[i], level,
+					     NULL);
+    if (ret != PTP_RC_OK) {
+      return ret;
+    }
+  }
+  return PTP_RC_OK;
+}
+
+/**
+ * Loads the property lists of the objects directly in one folder,
+ * falling back to requests per property group if the device refuses
+ * to return all properties at once.
+ * @param handle the folder, or 0x00000000 for the storage roots.
+ */
+static uint16_t prefetch_folder(LIBMTP_mtpdevice_t *device, uint32_t handle,
+				uint16_t const *formats, uint32_t nformats,
+				uint32_t **groups, uint32_t *ngroups)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+
+  ret = prefetch_proplist(params, handle, 0x00000000U, 1,
+			  *groups, *ngroups);
+  if (ret == PTP_RC_MTP_Specification_By_Group_Unsupported &&
+      *ngroups == 0) {
+    *ngroups = get_property_groups(device, formats, nformats, groups);
+    if (*ngroups != 0) {
+      ret = prefetch_proplist(params, handle, 0x00000000U, 1,
+			      *groups, *ngroups);
+    }
+  }
+  return ret;
+}
+
+/**
+ * Tells whether a failed GetObjPropList was the device declining the
+ * request, as opposed to the transfer failing or being cancelled.
+ * Most devices that cannot list all objects answer with a general
+ * error rather than one of the more specific codes.
+ */
+static int proplist_refused(uint16_t ret)
+{
+  switch (ret) {
+  case PTP_RC_GeneralError:
+  case PTP_RC_OperationNotSupported:
+  case PTP_RC_ParameterNotSupported:
+  case PTP_RC_InvalidParameter:
+  case PTP_RC_SpecificationByFormatUnsupported:
+  case PTP_RC_MTP_Specification_By_Group_Unsupported:
+  case PTP_RC_MTP_Specification_By_Depth_Unsupported:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * When the metadata of all objects could not be retrieved in one
+ * go, the object infos have been fetched one by one, and without
+ * this every later track, album or file lookup would cost one
+ * transaction per object and property. This loads the property
+ * lists in a few batched requests instead, trying in order:
+ *
+ * <ol>
+ * <li>one request per object format, over all objects</li>
+ * <li>one request per folder, and one for the storage roots, for
+ *     the objects directly in them</li>
+ * </ol>
+ *
+ * Devices that refuse to return all properties at once get one
+ * request per property group in either case. A device that refuses
+ * the per-format request is flagged
+ * <code>DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL</code> so later
+ * flushes go straight to the per-folder requests; one that merely
+ * failed to complete it, on a timeout or I/O error, is not. Whatever
+ * is left over is still loaded per object on demand.
+ * @param device a pointer to the device to prefetch metadata for.
+ */
+static void prefetch_metadata(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint16_t *formats = NULL;
+  uint32_t nformats = 0;
+  uint32_t *groups = NULL;
+  uint32_t ngroups = 0;
+  uint16_t ret = PTP_RC_OK;
+  int oldtimeout;
+  uint32_t i, j;
+
+  if (!ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList) ||
+      FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)) {
+    return;
+  }
+
+  // Which formats still lack their properties?
+  for (i = 0; i < params->objects.len; i++) {
+    PTPObject *ob = params->objects.val[i];
+
+    if (ob->oi.ObjectFormat == PTP_OFC_Association ||
+	(ob->flags & PTPOBJECT_MTPPROPLIST_LOADED)) {
+      continue;
+    }
+    for (j = 0; j < nformats; j++) {
+      if (formats[j] == ob->oi.ObjectFormat) {
+	break;
+      }
+    }
+    if (j == nformats) {
+      uint16_t *tmp = realloc(formats, (nformats + 1) * sizeof(uint16_t));
+
+      if (tmp == NULL) {
+	free(formats);
+	return;
+      }
+      formats = tmp;
+      formats[nformats++] = ob->oi.ObjectFormat;
+    }
+  }
+  if (nformats == 0) {
+    return;
+  }
+
+  // Like get_all_metadata_fast(), these can take a while on large devices.
+  get_usb_device_timeout(ptp_usb, &oldtimeout);
+  set_usb_device_timeout(ptp_usb, 60000);
+
+  if (!FLAG_BROKEN_MTPGETOBJPROPLIST_ALL(ptp_usb)) {
+    for (i = 0; i < nformats; i++) {
+      ret = prefetch_proplist(params, 0xFFFFFFFFU, formats[i], 0xFFFFFFFFU,
+			      groups, ngroups);
+      if (ret == PTP_RC_MTP_Specification_By_Group_Unsupported &&
+	  ngroups == 0) {
+	ngroups = get_property_groups(device, formats, nformats, &groups);
+	if (ngroups != 0) {
+	  ret = prefetch_proplist(params, 0xFFFFFFFFU, formats[i],
+				  0xFFFFFFFFU, groups, ngroups);
+	}
+      }
+      if (ret != PTP_RC_OK) {
+	break;
+      }
+    }
+    if (ret == PTP_RC_OK) {
+      goto done;
+    }
+    LIBMTP_INFO("Per-format metadata retrieval failed (0x%04x), "
+		"falling back to per-folder retrieval\n", ret);
+    if (proplist_refused(ret)) {
+      ptp_usb->rawdevice.device_entry.device_flags |=
+	DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL;
+      params->device_flags |= DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL;
+      ptp_usb->learned_flags |= DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL;
+    }
+  }
+
+  /*
+   * Per folder, starting with the objects in the storage roots that
+   * no folder holds. The object list may grow while the property
+   * lists come in, but only with objects the folder scan did not see,
+   * so the original length is what we walk.
+   */
+  ret = prefetch_folder(device, 0x00000000U, formats, nformats,
+			&groups, &ngroups);
+  for (i = 0, j = params->objects.len; ret == PTP_RC_OK && i < j; i++) {
+    PTPObject *ob = params->objects.val[i];
+
+    if (ob->oi.ObjectFormat != PTP_OFC_Association) {
+      continue;
+    }
+    ret = prefetch_folder(device, ob->oid, formats, nformats,
+			  &groups, &ngroups);
+  }
+  if (ret != PTP_RC_OK) {
+    LIBMTP_INFO("Per-folder metadata retrieval failed (0x%04x), "
+		"metadata will be retrieved per object\n", ret);
+  }
+
+ done:
+  set_usb_device_timeout(ptp_usb, oldtimeout);
+  free(groups);
+  free(formats);
+}
+
+/**
+ * Remembers a folder in the root of the primary storage as one of the
+ * default folders if its name is one of the usual ones.
+ * @param device a pointer to the MTP device.
+ * @param ob the folder.
+ */
+static void check_default_folder(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+{
+  /* Is this the Music Folder */
+  if (!strcasecmp(ob->oi.Filename, "My Music") ||
+      !strcasecmp(ob->oi.Filename, "My_Music") ||
+      !strcasecmp(ob->oi.Filename, "Music")) {
+    device->default_music_folder = ob->oid;
+  }
+  else if (!strcasecmp(ob->oi.Filename, "My Playlists") ||
+           !strcasecmp(ob->oi.Filename, "My_Playlists") ||
+           !strcasecmp(ob->oi.Filename, "Playlists")) {
+    device->default_playlist_folder = ob->oid;
+  }
+  else if (!strcasecmp(ob->oi.Filename, "My Pictures") ||
+           !strcasecmp(ob->oi.Filename, "My_Pictures") ||
+           !strcasecmp(ob->oi.Filename, "Pictures")) {
+    device->default_picture_folder = ob->oid;
+  }
+  else if (!strcasecmp(ob->oi.Filename, "My Video") ||
+           !strcasecmp(ob->oi.Filename, "My_Video") ||
+           !strcasecmp(ob->oi.Filename, "Video")) {
+      device->default_video_folder = ob->oid;
+  }
+  else if (!strcasecmp(ob->oi.Filename, "My Organizer") ||
+           !strcasecmp(ob->oi.Filename, "My_Organizer")) {
+    device->default_organizer_folder = ob->oid;
+  }
+  else if (!strcasecmp(ob->oi.Filename, "ZENcast") ||
+           !strcasecmp(ob->oi.Filename, "Datacasts")) {
+    device->default_zencast_folder = ob->oid;
+  }
+  else if (!strcasecmp(ob->oi.Filename, "My Albums") ||
+           !strcasecmp(ob->oi.Filename, "My_Albums") ||
+           !strcasecmp(ob->oi.Filename, "Albums")) {
+    device->default_album_folder = ob->oid;
+  }
+  else if (!strcasecmp(ob->oi.Filename, "Text") ||
+           !strcasecmp(ob->oi.Filename, "Texts")) {
+    device->default_text_folder = ob->oid;
+  }
+}
+
 /**
  * This function refresh the internal handle list whenever
  * the items stored inside the device is altered. On operations
@@ -2890,14 +3655,18 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
   if (!device->cached) {
     return;
   }
-
-  if (params->objects.val != NULL) {
-    for (i=0;i<params->objects.len;i++)
-      ptp_free_object (&params->objects.val[i]);
-    free_array(&params->objects);
+  // Keep listings and event handlers out while the cache is rebuilt
+  if (ptp_cache_wrlock(params) < 0) {
+    LIBMTP_ERROR("flush_handles(): cache is in use by this thread\n");
+    return;
   }
 
-  if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
+  ptp_objects_clear(params);
+
+  if (snapshot_directory != NULL &&
+      load_metadata_snapshot(device, snapshot_directory) == 0) {
+    // Unchanged since the last session, no need to scan the device.
+  } else if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
       && !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)
       && !FLAG_BROKEN_MTPGETOBJPROPLIST_ALL(ptp_usb)) {
     // Use the fast method. Ignore return value for now.
@@ -2922,8 +3691,13 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
 	storage = storage->next;
       }
     }
+    // Then load the metadata in bulk where the device can do that.
+    prefetch_metadata(device);
   }
 
+  /* The device might not give the list in linear ascending order */
+  ptp_objects_sort(params);
+
   /*
    * Loop over the handles, fix up any NULL filenames or
    * keywords, then attempt to locate some default folders
@@ -2932,16 +3706,16 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
   for(i = 0; i < params->objects.len; i++) {
     PTPObject *ob, *xob;
 
-    ob = &params->objects.val[i];
-    ret = ptp_object_want(params,params->objects.val[i].oid,
+    ob = params->objects.val[i];
+    ret = ptp_object_want(params,ob->oid,
 			  PTPOBJECT_OBJECTINFO_LOADED, &xob);
     if (ret != PTP_RC_OK) {
-	LIBMTP_ERROR("broken! %x not found\n", params->objects.val[i].oid);
+	LIBMTP_ERROR("broken! %x not found\n", ob->oid);
     }
     if (ob->oi.Filename == NULL)
-      ob->oi.Filename = strdup("<null>");
+      ob->oi.Filename = ptp_intern_string(params, "<null>");
     if (ob->oi.Keywords == NULL)
-      ob->oi.Keywords = strdup("<null>");
+      ob->oi.Keywords = ptp_intern_string(params, "<null>");
 
     /* Ignore handles that point to non-folders */
     if(ob->oi.ObjectFormat != PTP_OFC_Association)
@@ -2956,65 +3730,258 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
     if (device->storage != NULL && ob->oi.StorageID != device->storage->id)
       continue;
 
-    /* Is this the Music Folder */
-    if (!strcasecmp(ob->oi.Filename, "My Music") ||
-	!strcasecmp(ob->oi.Filename, "My_Music") ||
-	!strcasecmp(ob->oi.Filename, "Music")) {
-      device->default_music_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "My Playlists") ||
-	     !strcasecmp(ob->oi.Filename, "My_Playlists") ||
-	     !strcasecmp(ob->oi.Filename, "Playlists")) {
-      device->default_playlist_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "My Pictures") ||
-	     !strcasecmp(ob->oi.Filename, "My_Pictures") ||
-	     !strcasecmp(ob->oi.Filename, "Pictures")) {
-      device->default_picture_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "My Video") ||
-	     !strcasecmp(ob->oi.Filename, "My_Video") ||
-	     !strcasecmp(ob->oi.Filename, "Video")) {
-	device->default_video_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "My Organizer") ||
-	     !strcasecmp(ob->oi.Filename, "My_Organizer")) {
-      device->default_organizer_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "ZENcast") ||
-	     !strcasecmp(ob->oi.Filename, "Datacasts")) {
-      device->default_zencast_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "My Albums") ||
-	     !strcasecmp(ob->oi.Filename, "My_Albums") ||
-	     !strcasecmp(ob->oi.Filename, "Albums")) {
-      device->default_album_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "Text") ||
-	     !strcasecmp(ob->oi.Filename, "Texts")) {
-      device->default_text_folder = ob->oid;
-    }
+    check_default_folder(device, ob);
   }
+
+  params->objects.complete = 1;
+  ptp_cache_unlock(params);
 }
 
 /**
- * This function traverses a devices storage list freeing up the
- * strings and the structs.
- * @param device a pointer to the MTP device to free the storage
- * list for.
+ * Loads the objects in one folder into the object cache of a lazily
+ * cached device. Whether a folder has been listed is remembered apart
+ * from what is in it, so an empty folder is listed only once. Call
+ * with the cache locked for writing.
+ * @param device a pointer to the MTP device.
+ * @param storage the storage of the folder. For the root folder 0
+ *        stands for the root folders of all storages.
+ * @param parent the folder, 0 for the root folder.
+ * @param children returns the IDs of the objects in the folder if not
+ *        NULL, free_array() it after use, also on failure.
+ * @return 0 on success, -1 on failure.
  */
-static void free_storage_list(LIBMTP_mtpdevice_t *device)
+static int load_folder(LIBMTP_mtpdevice_t *device, uint32_t storage,
+		       uint32_t parent, PTPObjectHandles *children)
 {
-  LIBMTP_devicestorage_t *storage;
-  LIBMTP_devicestorage_t *tmp;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPObjectHandles handles;
+  PTPObject *folder = NULL;
+  unsigned int loaded;
+  uint16_t ret;
+  uint32_t i;
+  int failed = 0;
 
-  storage = device->storage;
-  while(storage != NULL) {
-    if (storage->StorageDescription != NULL) {
-      free(storage->StorageDescription);
-    }
-    if (storage->VolumeIdentifier != NULL) {
-      free(storage->VolumeIdentifier);
+  if (children != NULL)
+    array_init(children);
+  if (storage == 0)
+    storage = PTP_GOH_ALL_STORAGE;
+  if (parent != 0) {
+    ret = ptp_object_want(params, parent, PTPOBJECT_OBJECTINFO_LOADED, &folder);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "load_folder(): could not get folder.");
+      return -1;
+    }
+    loaded = folder->flags & PTPOBJECT_DIRECTORY_LOADED;
+  } else {
+    loaded = ptp_storage_loaded(params, storage) & PTPOBJECT_DIRECTORY_LOADED;
+  }
+
+  if (params->objects.complete || loaded) {
+    if (children == NULL)
+      return 0;
+    // Listed before, the cache knows what is in there
+    for (i = 0; i < params->objects.len; i++) {
+      PTPObject *ob = params->objects.val[i];
+
+      if (parent == 0) {
+	// Some buggy devices put the top level folders in 0xffffffff
+	if (ob->oi.ParentObject != 0x00000000U &&
+	    ob->oi.ParentObject != 0xffffffffU)
+	  continue;
+	if (storage != PTP_GOH_ALL_STORAGE && ob->oi.StorageID != storage)
+	  continue;
+      } else if (ob->oi.ParentObject != parent) {
+	continue;
+      }
+      array_push_back(children, ob->oid);
+    }
+    return 0;
+  }
+
+  ret = ptp_getobjecthandles(params, storage, PTP_GOH_ALL_FORMATS,
+			     parent != 0 ? parent : PTP_GOH_ROOT_PARENT,
+			     &handles);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "load_folder(): could not get object handles.");
+    return -1;
+  }
+
+  // One request for the metadata of the whole folder where possible,
+  // like the per-folder case of prefetch_metadata().
+  if (parent != 0 && handles.len > 1 &&
+      ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList) &&
+      !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)) {
+    prefetch_proplist(params, parent, 0x00000000U, 1, NULL, 0);
+  }
+  for (i = 0; i < handles.len; i++) {
+    PTPObject *ob;
+
+    ret = ptp_object_want(params, handles.val[i],
+			  PTPOBJECT_OBJECTINFO_LOADED, &ob);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "load_folder(): could not get object info.");
+      failed = 1;
+      continue;
+    }
+    if (ob->oi.Filename == NULL)
+      ob->oi.Filename = ptp_intern_string(params, "<null>");
+    if (ob->oi.Keywords == NULL)
+      ob->oi.Keywords = ptp_intern_string(params, "<null>");
+  }
+
+  if (!failed) {
+    if (folder != NULL)
+      folder->flags |= PTPOBJECT_DIRECTORY_LOADED;
+    else
+      ptp_set_storage_loaded(params, storage, PTPOBJECT_DIRECTORY_LOADED);
+  }
+  if (children != NULL)
+    *children = handles;
+  else
+    free_array(&handles);
+  return failed ? -1 : 0;
+}
+
+/**
+ * Loads all objects below a folder into the object cache of a lazily
+ * cached device, one folder at a time. Call with the cache locked for
+ * writing.
+ * @param device a pointer to the MTP device.
+ * @param storage the storage of the folder, 0 for all storages.
+ * @param parent the folder, 0 for the root folder.
+ * @return 0 on success, -1 if some folder could not be loaded.
+ */
+static int load_subtree(LIBMTP_mtpdevice_t *device, uint32_t storage,
+			uint32_t parent)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObjectHandles children;
+  PTPObject *folder = NULL;
+  uint32_t i;
+  int ret = 0;
+
+  if (params->objects.complete)
+    return 0;
+  if (storage == 0)
+    storage = PTP_GOH_ALL_STORAGE;
+  if (parent != 0) {
+    if (ptp_object_want(params, parent, PTPOBJECT_OBJECTINFO_LOADED,
+			&folder) != PTP_RC_OK)
+      return -1;
+    if (folder->flags & PTPOBJECT_SUBTREE_LOADED)
+      return 0;
+  } else if (ptp_storage_loaded(params, storage) & PTPOBJECT_SUBTREE_LOADED) {
+    return 0;
+  }
+
+  if (load_folder(device, storage, parent, &children) < 0)
+    ret = -1;
+  for (i = 0; i < children.len; i++) {
+    PTPObject *ob;
+
+    // Some devices list a folder as its own child
+    if (children.val[i] == parent ||
+	ptp_find_object_in_cache(params, children.val[i], &ob) != PTP_RC_OK)
+      continue;
+    if (ob->oi.ObjectFormat == PTP_OFC_Association &&
+	load_subtree(device, ob->oi.StorageID, ob->oid) < 0)
+      ret = -1;
+  }
+  free_array(&children);
+
+  if (ret == 0) {
+    if (folder != NULL)
+      folder->flags |= PTPOBJECT_SUBTREE_LOADED;
+    else
+      ptp_set_storage_loaded(params, storage, PTPOBJECT_SUBTREE_LOADED);
+  }
+  return ret;
+}
+
+/**
+ * Makes sure the object cache of a cached device holds the objects a
+ * request is about to look at. A fully cached device is scanned
+ * completely the first time, a lazily cached one only in the folders
+ * asked for. Either way a scan is not repeated, also when it found
+ * nothing.
+ * @param device a pointer to the MTP device.
+ * @param storage the storage to cover, 0 or 0xFFFFFFFF for all of them.
+ * @param parent the folder to cover, 0 for the root folder.
+ * @param subtree also cover all folders below parent.
+ */
+static void cache_objects(LIBMTP_mtpdevice_t *device, uint32_t storage,
+			  uint32_t parent, int subtree)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  apply_cache_events(device);
+  if (device->cached == CACHE_NONE || params->objects.complete)
+    return;
+  if (storage == PTP_GOH_ALL_STORAGE)
+    storage = 0;
+  // When everything is needed one scan beats going folder by folder
+  if (device->cached == CACHE_FULL ||
+      (storage == 0 && parent == 0 && subtree)) {
+    flush_handles(device);
+    return;
+  }
+  if (ptp_cache_wrlock(params) < 0) {
+    LIBMTP_ERROR("cache_objects(): cache is in use by this thread\n");
+    return;
+  }
+  if (subtree)
+    load_subtree(device, storage, parent);
+  else
+    load_folder(device, storage, parent, NULL);
+  ptp_cache_unlock(params);
+}
+
+/**
+ * Locates the default folders of a lazily cached device, only the root
+ * folder of the primary storage is listed for that.
+ * @param device a pointer to the MTP device.
+ */
+static void load_default_folders(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObjectHandles root;
+  uint32_t i;
+
+  if (device->storage == NULL)
+    return;
+  if (ptp_cache_wrlock(params) < 0)
+    return;
+  load_folder(device, device->storage->id, 0, &root);
+  for (i = 0; i < root.len; i++) {
+    PTPObject *ob;
+
+    if (ptp_find_object_in_cache(params, root.val[i], &ob) == PTP_RC_OK &&
+	ob->oi.ObjectFormat == PTP_OFC_Association)
+      check_default_folder(device, ob);
+  }
+  free_array(&root);
+  ptp_cache_unlock(params);
+}
+
+/**
+ * This function traverses a devices storage list freeing up the
+ * strings and the structs.
+ * @param device a pointer to the MTP device to free the storage
+ * list for.
+ */
+static void free_storage_list(LIBMTP_mtpdevice_t *device)
+{
+  LIBMTP_devicestorage_t *storage;
+  LIBMTP_devicestorage_t *tmp;
+
+  storage = device->storage;
+  while(storage != NULL) {
+    if (storage->StorageDescription != NULL) {
+      free(storage->StorageDescription);
+    }
+    if (storage->VolumeIdentifier != NULL) {
+      free(storage->VolumeIdentifier);
     }
     tmp = storage;
     storage = storage->next;
@@ -3245,7 +4212,11 @@ void LIBMTP_Dump_Device_Info(LIBMTP_mtpdevice_t *device)
   LIBMTP_device_extension_t *tmpext = device->extensions;
 
   printf("USB low-level info:\n");
-  dump_usbinfo(ptp_usb);
+  if (ptp_usb->loopback != NULL)
+    printf("   Loopback device %d, no USB hardware\n",
+	   ptp_usb->rawdevice.devnum);
+  else
+    dump_usbinfo(ptp_usb);
   /* Print out some verbose information */
   printf("Device info:\n");
   printf("   Manufacturer: %s\n", params->deviceinfo.Manufacturer);
@@ -4328,6 +5299,37 @@ void LIBMTP_destroy_file_t(LIBMTP_file_t *file)
   return;
 }
 
+/**
+ * Helper function that tells the file type of a PTP object.
+ */
+static LIBMTP_filetype_t get_object_filetype(LIBMTP_mtpdevice_t *device,
+					     PTPObject *ob)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_filetype_t filetype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
+
+  /*
+   * A special quirk for devices that doesn't quite
+   * remember that some files marked as "unknown" type are
+   * actually OGG or FLAC files. We look at the filename extension
+   * and see if it happens that this was atleast named "ogg" or "flac"
+   * and fall back on this heuristic approach in that case,
+   * for these bugged devices only.
+   */
+  if (filetype == LIBMTP_FILETYPE_UNKNOWN) {
+    if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
+        FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
+        has_ogg_extension(ob->oi.Filename)) {
+      filetype = LIBMTP_FILETYPE_OGG;
+    }
+
+    if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && has_flac_extension(ob->oi.Filename)) {
+        filetype = LIBMTP_FILETYPE_FLAC;
+    }
+  }
+  return filetype;
+}
+
 /**
  * Helper function that takes one PTP object and creates a
  * LIBMTP_file_t metadata entry.
@@ -4335,7 +5337,6 @@ void LIBMTP_destroy_file_t(LIBMTP_file_t *file)
 static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
 {
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
   LIBMTP_file_t *file;
   unsigned int i;
 
@@ -4350,27 +5351,7 @@ static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
   }
 
   // Set the filetype
-  file->filetype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
-
-  /*
-   * A special quirk for devices that doesn't quite
-   * remember that some files marked as "unknown" type are
-   * actually OGG or FLAC files. We look at the filename extension
-   * and see if it happens that this was atleast named "ogg" or "flac"
-   * and fall back on this heuristic approach in that case,
-   * for these bugged devices only.
-   */
-  if (file->filetype == LIBMTP_FILETYPE_UNKNOWN) {
-    if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
-        FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
-        has_ogg_extension(file->filename)) {
-      file->filetype = LIBMTP_FILETYPE_OGG;
-    }
-
-    if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && has_flac_extension(file->filename)) {
-        file->filetype = LIBMTP_FILETYPE_FLAC;
-    }
-  }
+  file->filetype = get_object_filetype(device, ob);
 
   // Set the modification date
   file->modificationdate = ob->oi.ModificationDate;
@@ -4457,10 +5438,9 @@ LIBMTP_file_t *LIBMTP_Get_Filemetadata(LIBMTP_mtpdevice_t *device, uint32_t cons
   PTPObject *ob;
 
   // Get all the handles if we haven't already done that
-  // (Only on cached devices.)
-  if (device->cached && params->objects.len == 0) {
-    flush_handles(device);
-  }
+  // (Lazily cached devices load the one object on demand.)
+  if (device->cached == CACHE_FULL)
+    cache_objects(device, 0, 0, 1);
 
   ret = ptp_object_want(params, fileid, PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_MTPPROPLIST_LOADED, &ob);
   if (ret != PTP_RC_OK)
@@ -4532,9 +5512,10 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
   PTPParams *params = (PTPParams *) device->params;
 
   // Get all the handles if we haven't already done that
-  if (params->objects.len == 0) {
-    flush_handles(device);
-  }
+  cache_objects(device, 0, 0, 1);
+  ptp_objects_sort(params);
+  // Listings only read the cache, events may update it meanwhile
+  ptp_cache_rdlock(params);
 
   for (i = 0; i < params->objects.len; i++) {
     LIBMTP_file_t *file;
@@ -4543,7 +5524,7 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
     if (callback != NULL)
       callback(i, params->objects.len, data);
 
-    ob = &params->objects.val[i];
+    ob = params->objects.val[i];
 
     if (ob->oi.ObjectFormat == PTP_OFC_Association) {
       // MTP use this object format for folders which means
@@ -4570,17 +5551,307 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
     // double progressPercent = (double)i*(double)100.0 / (double)params->handles.n;
 
   } // Handle counting loop
+  ptp_cache_unlock(params);
   return retfiles;
 }
 
+/**
+ * A cursor over the object cache, see LIBMTP_Open_Cursor().
+ */
+struct LIBMTP_cursor_struct {
+  LIBMTP_mtpdevice_t *device; /**< The device walked */
+  LIBMTP_cursor_filter_t filter; /**< The objects walked */
+  uint32_t next; /**< Position of the next object in the cache */
+  PTPObject *current; /**< The object the cursor is on, NULL if none */
+};
+
+/**
+ * Helper function that tells whether an object passes a cursor filter.
+ */
+static int cursor_match(LIBMTP_cursor_t *cursor, PTPObject *ob)
+{
+  LIBMTP_cursor_filter_t const *filter = &cursor->filter;
+
+  if ((filter->flags & LIBMTP_CURSOR_STORAGE) &&
+      ob->oi.StorageID != filter->storage_id)
+    return 0;
+  if ((filter->flags & LIBMTP_CURSOR_PARENT) &&
+      ob->oi.ParentObject != filter->parent_id)
+    return 0;
+  if ((filter->flags & LIBMTP_CURSOR_NO_FOLDERS) &&
+      ob->oi.ObjectFormat == PTP_OFC_Association)
+    return 0;
+  if ((filter->flags & LIBMTP_CURSOR_MODIFIED) &&
+      ob->oi.ModificationDate < filter->modified_since)
+    return 0;
+  if ((filter->flags & LIBMTP_CURSOR_FILETYPE) &&
+      get_object_filetype(cursor->device, ob) != filter->filetype)
+    return 0;
+  return 1;
+}
+
+/**
+ * Helper function that finds a cached property of the current object
+ * of a cursor.
+ */
+static MTPObjectProp *cursor_find_prop(LIBMTP_cursor_t *cursor,
+				       LIBMTP_property_t property)
+{
+  PTPObject *ob = cursor->current;
+  uint16_t code = map_libmtp_property_to_ptp_property(property);
+  unsigned int i;
+
+  if (ob == NULL || code == 0)
+    return NULL;
+  for (i = 0; i < ob->mtp_props.len; i++) {
+    if (ob->mtp_props.val[i].PropCode == code)
+      return &ob->mtp_props.val[i];
+  }
+  return NULL;
+}
+
+/**
+ * This function opens a cursor that walks the objects in the object
+ * cache of a device in place, in order of their object IDs. Unlike
+ * the listing functions it copies nothing: each step hands out a view
+ * of an object, with its filename and properties borrowed from the
+ * cache, and a full LIBMTP_file_t or LIBMTP_track_t is only created
+ * when asked for. This is the cheap way to e.g. find what changed on
+ * a large device since the last synchronization:
+ *
+ * <pre>
+ * LIBMTP_cursor_filter_t filter = { 0 };
+ * LIBMTP_object_view_t view;
+ * LIBMTP_cursor_t *cursor;
+ *
+ * filter.flags = LIBMTP_CURSOR_MODIFIED | LIBMTP_CURSOR_NO_FOLDERS;
+ * filter.modified_since = last_sync;
+ * cursor = LIBMTP_Open_Cursor(device, &filter);
+ * while (LIBMTP_Cursor_Next(cursor, &view)) {
+ *   // Do something with view.item_id, view.filename...
+ * }
+ * LIBMTP_Close_Cursor(cursor);
+ * </pre>
+ *
+ * The cache is read locked while the cursor is open, so other threads
+ * may go on reading but their updates of the cache wait for the cursor
+ * to be closed. A cursor must be used and closed by the thread that
+ * opened it, and that thread must not change objects on the device
+ * while the cursor is open.
+ * @param device a pointer to the device to walk the objects of.
+ * @param filter the objects to walk, NULL for all of them.
+ * @return a cursor, or NULL if out of memory. Close it with
+ *         LIBMTP_Close_Cursor().
+ */
+LIBMTP_cursor_t *LIBMTP_Open_Cursor(LIBMTP_mtpdevice_t *device,
+				    LIBMTP_cursor_filter_t const *filter)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_cursor_t *cursor;
+
+  cursor = (LIBMTP_cursor_t *) calloc(1, sizeof(LIBMTP_cursor_t));
+  if (cursor == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Open_Cursor(): out of memory.");
+    return NULL;
+  }
+  cursor->device = device;
+  if (filter != NULL)
+    cursor->filter = *filter;
+
+  // Get all the handles if we haven't already done that, a lazily
+  // cached device only needs what the filter lets through
+  if (filter != NULL && (filter->flags & LIBMTP_CURSOR_PARENT))
+    cache_objects(device,
+		  (filter->flags & LIBMTP_CURSOR_STORAGE) ? filter->storage_id : 0,
+		  filter->parent_id, 0);
+  else if (filter != NULL && (filter->flags & LIBMTP_CURSOR_STORAGE))
+    cache_objects(device, filter->storage_id, 0, 1);
+  else
+    cache_objects(device, 0, 0, 1);
+  ptp_objects_sort(params);
+  ptp_cache_rdlock(params);
+  return cursor;
+}
+
+/**
+ * This function moves a cursor on to the next object that passes its
+ * filter.
+ * @param cursor the cursor to move.
+ * @param view the view to fill in with the object the cursor is on.
+ *        Its filename is only valid until the cursor moves on again.
+ * @return 1 if the cursor is on a new object, 0 if there are no
+ *         more objects.
+ */
+int LIBMTP_Cursor_Next(LIBMTP_cursor_t *cursor, LIBMTP_object_view_t *view)
+{
+  PTPParams *params = (PTPParams *) cursor->device->params;
+
+  cursor->current = NULL;
+  while (cursor->next < params->objects.len) {
+    PTPObject *ob = params->objects.val[cursor->next++];
+    unsigned int i;
+
+    if (!cursor_match(cursor, ob))
+      continue;
+
+    cursor->current = ob;
+    view->item_id = ob->oid;
+    view->parent_id = ob->oi.ParentObject;
+    view->storage_id = ob->oi.StorageID;
+    view->filetype = get_object_filetype(cursor->device, ob);
+    view->modificationdate = ob->oi.ModificationDate;
+    view->filename = ob->oi.Filename;
+    // The 64 bit property beats the 32 bit object info if cached
+    view->filesize = ob->oi.ObjectSize;
+    for (i = 0; i < ob->mtp_props.len; i++) {
+      MTPObjectProp *prop = &ob->mtp_props.val[i];
+
+      if (prop->PropCode == PTP_OPC_ObjectSize) {
+	if (prop->DataType == PTP_DTC_UINT64)
+	  view->filesize = prop->Value.u64;
+	else if (prop->DataType == PTP_DTC_UINT32)
+	  view->filesize = prop->Value.u32;
+	break;
+      }
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * This function retrieves a string property of the object a cursor
+ * is on, e.g. the title or artist of a track, if it is in the cache.
+ * This never talks to the device.
+ * @param cursor the cursor on the object.
+ * @param property the property to retrieve.
+ * @return the string, borrowed from the object cache and only valid
+ *         until the cursor moves on, or NULL if the property is not
+ *         cached.
+ */
+char const *LIBMTP_Cursor_Get_String(LIBMTP_cursor_t *cursor,
+				     LIBMTP_property_t property)
+{
+  MTPObjectProp *prop = cursor_find_prop(cursor, property);
+
+  if (prop == NULL || prop->DataType != PTP_DTC_STR)
+    return NULL;
+  return prop->Value.str;
+}
+
+/**
+ * This function retrieves an integer property of the object a cursor
+ * is on, e.g. the track number or duration of a track, if it is in
+ * the cache. This never talks to the device.
+ * @param cursor the cursor on the object.
+ * @param property the property to retrieve.
+ * @param value a pointer to the variable that will hold the value.
+ * @return 0 on success, any other value means the property is not
+ *         cached or is not an integer.
+ */
+int LIBMTP_Cursor_Get_Integer(LIBMTP_cursor_t *cursor,
+			      LIBMTP_property_t property, uint64_t *value)
+{
+  MTPObjectProp *prop = cursor_find_prop(cursor, property);
+
+  if (prop == NULL)
+    return -1;
+  switch (prop->DataType) {
+  case PTP_DTC_INT8:
+    *value = (uint64_t) prop->Value.i8;
+    break;
+  case PTP_DTC_UINT8:
+    *value = prop->Value.u8;
+    break;
+  case PTP_DTC_INT16:
+    *value = (uint64_t) prop->Value.i16;
+    break;
+  case PTP_DTC_UINT16:
+    *value = prop->Value.u16;
+    break;
+  case PTP_DTC_INT32:
+    *value = (uint64_t) prop->Value.i32;
+    break;
+  case PTP_DTC_UINT32:
+    *value = prop->Value.u32;
+    break;
+  case PTP_DTC_INT64:
+  case PTP_DTC_UINT64:
+    *value = prop->Value.u64;
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * This function creates the file metadata of the object a cursor is
+ * on, as LIBMTP_Get_Filemetadata() would.
+ * @param cursor the cursor on the object.
+ * @return a metadata entry to destroy with LIBMTP_destroy_file_t(),
+ *         or NULL if the cursor is on no object.
+ */
+LIBMTP_file_t *LIBMTP_Cursor_Get_File(LIBMTP_cursor_t *cursor)
+{
+  if (cursor->current == NULL)
+    return NULL;
+  return obj2file(cursor->device, cursor->current);
+}
+
+/**
+ * This function creates the track metadata of the object a cursor is
+ * on, as LIBMTP_Get_Trackmetadata() would, but only from the cache.
+ * This never talks to the device, as the cache can not be updated
+ * while the cursor holds it: properties that are not cached are left
+ * out. Use LIBMTP_Get_Trackmetadata() after closing the cursor to get
+ * all of them.
+ * @param cursor the cursor on the object.
+ * @return a metadata entry to destroy with LIBMTP_destroy_track_t(),
+ *         or NULL if the cursor is on no object or the object is not
+ *         a track.
+ */
+LIBMTP_track_t *LIBMTP_Cursor_Get_Track(LIBMTP_cursor_t *cursor)
+{
+  LIBMTP_track_t *track;
+  PTPObject *ob = cursor->current;
+  uint32_t i;
+
+  if (ob == NULL)
+    return NULL;
+  track = obj2track(cursor->device, ob);
+  if (track == NULL)
+    return NULL;
+  for (i = 0; i < ob->mtp_props.len; i++)
+    pick_property_to_track_metadata(cursor->device, &ob->mtp_props.val[i],
+				    track);
+  return track;
+}
+
+/**
+ * This function closes a cursor, after which views and strings
+ * borrowed from it are no longer valid.
+ * @param cursor the cursor to close.
+ */
+void LIBMTP_Close_Cursor(LIBMTP_cursor_t *cursor)
+{
+  if (cursor == NULL)
+    return;
+  ptp_cache_unlock((PTPParams *) cursor->device->params);
+  free(cursor);
+}
+
 /**
  * This function retrieves the contents of a certain folder
  * with id parent on a certain storage on a certain device.
  * The result contains both files and folders.
  * The device used with this operations must have been opened with
- * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
+ * LIBMTP_Open_Raw_Device_Uncached() or LIBMTP_Open_Raw_Device_Lazy()
+ * or it will fail.
  *
- * NOTE: the request will always perform I/O with the device.
+ * NOTE: the request will always perform I/O with an uncached device,
+ * a lazily cached one lists each folder only once.
  * @param device a pointer to the MTP device to report info from.
  * @param storage a storage on the device to report info from. If
  *        0 is passed in, the files for the given parent will be
@@ -4599,7 +5870,7 @@ LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
   uint16_t ret;
   unsigned int i = 0;
 
-  if (device->cached) {
+  if (device->cached == CACHE_FULL) {
     // This function is only supposed to be used by devices
     // opened as uncached!
     LIBMTP_ERROR("tried to use %s on a cached device!\n",
@@ -4607,18 +5878,36 @@ LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
     return NULL;
   }
 
-  if (storage == 0)
-    storageid = PTP_GOH_ALL_STORAGE;
-  else
-    storageid = storage;
-
-  ret = ptp_getobjecthandles(params,
-			     storageid,
-			     PTP_GOH_ALL_FORMATS,
-			     parent,
-			     &currentHandles);
+  if (device->cached == CACHE_LAZY) {
+    int loaded;
 
-  if (ret != PTP_RC_OK) {
+    if (ptp_cache_wrlock(params) < 0) {
+      LIBMTP_ERROR("%s: cache is in use by this thread\n", __func__);
+      return NULL;
+    }
+    loaded = load_folder(device, storage,
+			 parent == LIBMTP_FILES_AND_FOLDERS_ROOT ? 0 : parent,
+			 &currentHandles);
+    ptp_cache_unlock(params);
+    if (loaded < 0) {
+      free_array(&currentHandles);
+      return NULL;
+    }
+    ret = PTP_RC_OK;
+  } else {
+    if (storage == 0)
+      storageid = PTP_GOH_ALL_STORAGE;
+    else
+      storageid = storage;
+
+    ret = ptp_getobjecthandles(params,
+			       storageid,
+			       PTP_GOH_ALL_FORMATS,
+			       parent,
+			       &currentHandles);
+  }
+
+  if (ret != PTP_RC_OK) {
     char buf[80];
     sprintf(buf,"LIBMTP_Get_Files_And_Folders(): could not get object handles of %08x.", parent);
     add_ptp_error_to_errorstack(device, ret, buf);
@@ -4657,9 +5946,11 @@ LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
  * This function retrieves the list of ids of files and folders in a certain
  * folder with id parent on a certain storage on a certain device.
  * The device used with this operations must have been opened with
- * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
+ * LIBMTP_Open_Raw_Device_Uncached() or LIBMTP_Open_Raw_Device_Lazy()
+ * or it will fail.
  *
- * NOTE: the request will always perform I/O with the device.
+ * NOTE: the request will always perform I/O with an uncached device,
+ * a lazily cached one lists each folder only once.
  * @param device a pointer to the MTP device to report info from.
  * @param storage a storage on the device to report info from. If
  *        0 is passed in, the files for the given parent will be
@@ -4681,13 +5972,36 @@ int LIBMTP_Get_Children(LIBMTP_mtpdevice_t *device,
   uint32_t storageid;
   uint16_t ret;
 
-  if (device->cached) {
+  if (device->cached == CACHE_FULL) {
     // This function is only supposed to be used by devices
     // opened as uncached!
     LIBMTP_ERROR("tried to use %s on a cached device!\n", __func__);
     return -1;
   }
 
+  if (device->cached == CACHE_LAZY) {
+    int loaded;
+
+    if (ptp_cache_wrlock(params) < 0) {
+      LIBMTP_ERROR("%s: cache is in use by this thread\n", __func__);
+      return -1;
+    }
+    loaded = load_folder(device, storage,
+                         parent == LIBMTP_FILES_AND_FOLDERS_ROOT ? 0 : parent,
+                         &currentHandles);
+    ptp_cache_unlock(params);
+    if (loaded < 0) {
+      free_array(&currentHandles);
+      return -1;
+    }
+    if (currentHandles.len == 0) {
+      free_array(&currentHandles);
+      return 0;
+    }
+    *out = currentHandles.val;
+    return currentHandles.len;
+  }
+
   if (storage == 0)
     storageid = PTP_GOH_ALL_STORAGE;
   else
@@ -5083,9 +6397,10 @@ LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevi
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
   // Get all the handles if we haven't already done that
-  if (params->objects.len == 0) {
-    flush_handles(device);
-  }
+  cache_objects(device, storage_id, 0, 1);
+  ptp_objects_sort(params);
+  // Listings only read the cache, events may update it meanwhile
+  ptp_cache_rdlock(params);
 
   for (i = 0; i < params->objects.len; i++) {
     LIBMTP_track_t *track;
@@ -5095,7 +6410,7 @@ LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevi
     if (callback != NULL)
       callback(i, params->objects.len, data);
 
-    ob = &params->objects.val[i];
+    ob = params->objects.val[i];
     mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
 
     // Ignore stuff we don't know how to handle...
@@ -5173,6 +6488,7 @@ LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevi
     // double progressPercent = (double)i*(double)100.0 / (double)params->handles.n;
 
   } // Handle counting loop
+  ptp_cache_unlock(params);
   return retracks;
 }
 
@@ -5193,20 +6509,38 @@ LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevi
 LIBMTP_track_t *LIBMTP_Get_Trackmetadata(LIBMTP_mtpdevice_t *device, uint32_t const trackid)
 {
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
   PTPObject *ob;
   LIBMTP_track_t *track;
-  LIBMTP_filetype_t mtptype;
   uint16_t ret;
 
   // Get all the handles if we haven't already done that
-  if (params->objects.len == 0)
-    flush_handles(device);
+  // (Lazily cached devices load the one object on demand.)
+  if (device->cached == CACHE_FULL)
+    cache_objects(device, 0, 0, 1);
 
   ret = ptp_object_want (params, trackid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
   if (ret != PTP_RC_OK)
     return NULL;
 
+  track = obj2track(device, ob);
+  if (track != NULL)
+    get_track_metadata(device, ob->oi.ObjectFormat, track);
+  return track;
+}
+
+/**
+ * This function creates the track metadata of a cached object from its
+ * object info, without any of the track properties.
+ * @param device a pointer to the device the object is on.
+ * @param ob the object.
+ * @return a metadata entry, or NULL if the object is not a track.
+ */
+static LIBMTP_track_t *obj2track(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_track_t *track;
+  LIBMTP_filetype_t mtptype;
+
   mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
 
   // Ignore stuff we don't know how to handle...
@@ -5264,7 +6598,6 @@ LIBMTP_track_t *LIBMTP_Get_Trackmetadata(LIBMTP_mtpdevice_t *device, uint32_t co
       return NULL;
     }
   }
-  get_track_metadata(device, ob->oi.ObjectFormat, track);
   return track;
 }
 
@@ -5443,6 +6776,475 @@ int LIBMTP_Get_File_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
 
   return 0;
 }
+/**
+ * Size of the ranges fetched by LIBMTP_Get_File_To_File_Resumable().
+ */
+#define RANGE_DOWNLOAD_SIZE (8 * 1024 * 1024)
+/**
+ * Suffix of the journal kept beside a file being fetched in ranges.
+ */
+#define RESUME_JOURNAL_SUFFIX ".mtpresume"
+#define RESUME_JOURNAL_MAGIC 0x4a50544dU /* "MTPJ" */
+
+/**
+ * The journal of a download in ranges. It is rewritten after every range
+ * that reached the destination file, and records which object it is for,
+ * so that a download is only resumed if the object is still the same.
+ */
+typedef struct {
+  uint32_t magic; /**< RESUME_JOURNAL_MAGIC */
+  uint32_t object_id; /**< The object being fetched */
+  uint64_t filesize; /**< Size of the object */
+  int64_t modificationdate; /**< Modification date of the object */
+  uint64_t completed; /**< Bytes written to the destination file */
+} resume_journal_t;
+
+/**
+ * A buffer holding one range.
+ */
+typedef struct {
+  unsigned char *data; /**< Room for RANGE_DOWNLOAD_SIZE bytes */
+  uint64_t offset; /**< Offset of the range in the file */
+  uint32_t len; /**< Bytes in the buffer */
+  int busy; /**< Set while the range waits to be written */
+} range_buffer_t;
+
+/**
+ * State of a download in ranges. Two buffers take turns: while one is
+ * written to disk, the next range is fetched into the other.
+ */
+typedef struct {
+  int fd; /**< The destination file */
+  int journalfd; /**< The journal */
+  resume_journal_t journal; /**< Contents of the journal */
+  range_buffer_t buffers[2]; /**< The ranges in flight */
+  int error; /**< Set if writing failed */
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock; /**< Protects busy, error and done */
+  pthread_cond_t changed; /**< Signalled when any of them change */
+  pthread_t writer; /**< Thread writing the ranges */
+  int done; /**< Set when no more ranges will come */
+#endif
+} range_download_t;
+
+/**
+ * Writes data at an offset of a file.
+ * @return 0 on success, -1 on failure.
+ */
+static int write_at(int fd, unsigned char const *data, uint32_t len,
+		    uint64_t offset)
+{
+  while (len > 0) {
+    ssize_t written;
+
+#ifdef HAVE_PWRITE
+    written = pwrite(fd, data, len, (off_t) offset);
+#else
+    if (lseek(fd, (off_t) offset, SEEK_SET) == (off_t) -1) {
+      return -1;
+    }
+    written = write(fd, data, len);
+#endif
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return -1;
+    }
+    data += written;
+    len -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+/**
+ * Sets the size of a file, allocating the space where possible.
+ * @return 0 on success, -1 on failure.
+ */
+static int preallocate_file(int fd, uint64_t size)
+{
+  struct stat sb;
+
+  // posix_fallocate() never shrinks a file
+  if (fstat(fd, &sb) == 0 && (uint64_t) sb.st_size > size) {
+    return ftruncate(fd, (off_t) size) < 0 ? -1 : 0;
+  }
+#ifdef HAVE_POSIX_FALLOCATE
+  if (posix_fallocate(fd, 0, (off_t) size) == 0) {
+    return 0;
+  }
+#endif
+  return ftruncate(fd, (off_t) size) < 0 ? -1 : 0;
+}
+
+/**
+ * Flushes the data of a file to the disk.
+ * @return 0 on success, -1 on failure.
+ */
+static int sync_file(int fd)
+{
+#if defined(HAVE_FDATASYNC)
+  return fdatasync(fd) < 0 ? -1 : 0;
+#elif defined(HAVE_FSYNC)
+  return fsync(fd) < 0 ? -1 : 0;
+#elif defined(__WIN32__)
+  return _commit(fd) < 0 ? -1 : 0;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Writes a range to the destination file, then records it in the journal.
+ * Ranges complete in order, so the journal only needs the end of the
+ * latest one. The range is flushed to the disk first, so the journal
+ * never claims data a crash could still lose.
+ * @return 0 on success, -1 on failure.
+ */
+static int write_range(range_download_t *dl, range_buffer_t *buffer)
+{
+  if (write_at(dl->fd, buffer->data, buffer->len, buffer->offset) < 0) {
+    return -1;
+  }
+  if (sync_file(dl->fd) < 0) {
+    return -1;
+  }
+  dl->journal.completed = buffer->offset + buffer->len;
+  return write_at(dl->journalfd, (unsigned char *) &dl->journal,
+		  sizeof(resume_journal_t), 0);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *range_writer(void *data)
+{
+  range_download_t *dl = (range_download_t *) data;
+  int i = 0;
+
+  pthread_mutex_lock(&dl->lock);
+  for (;;) {
+    range_buffer_t *buffer = &dl->buffers[i];
+    int ret;
+
+    while (!buffer->busy && !dl->done) {
+      pthread_cond_wait(&dl->changed, &dl->lock);
+    }
+    if (!buffer->busy) {
+      break;
+    }
+    pthread_mutex_unlock(&dl->lock);
+    ret = write_range(dl, buffer);
+    pthread_mutex_lock(&dl->lock);
+    if (ret < 0) {
+      dl->error = 1;
+    }
+    buffer->busy = 0;
+    pthread_cond_broadcast(&dl->changed);
+    i ^= 1;
+  }
+  pthread_mutex_unlock(&dl->lock);
+  return NULL;
+}
+#endif
+
+/**
+ * Hands a fetched range over to be written.
+ * @return 0 on success, -1 if writing failed.
+ */
+static int queue_range(range_download_t *dl, range_buffer_t *buffer)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&dl->lock);
+  buffer->busy = 1;
+  pthread_cond_broadcast(&dl->changed);
+  pthread_mutex_unlock(&dl->lock);
+  return 0;
+#else
+  if (write_range(dl, buffer) < 0) {
+    dl->error = 1;
+    return -1;
+  }
+  return 0;
+#endif
+}
+
+/**
+ * Waits until a buffer may be filled again.
+ * @return 0 on success, -1 if writing failed meanwhile.
+ */
+static int wait_range(range_download_t *dl, range_buffer_t *buffer)
+{
+#ifdef HAVE_PTHREAD_H
+  int ret;
+
+  pthread_mutex_lock(&dl->lock);
+  while (buffer->busy) {
+    pthread_cond_wait(&dl->changed, &dl->lock);
+  }
+  ret = dl->error ? -1 : 0;
+  pthread_mutex_unlock(&dl->lock);
+  return ret;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Data handler filling a range buffer.
+ */
+static uint16_t range_put_func(PTPParams* params, void* priv,
+			       unsigned long sendlen, unsigned char *data)
+{
+  range_buffer_t *buffer = (range_buffer_t *) priv;
+
+  if (sendlen > RANGE_DOWNLOAD_SIZE - buffer->len) {
+    return PTP_ERROR_IO;
+  }
+  memcpy(buffer->data + buffer->len, data, sendlen);
+  buffer->len += sendlen;
+  return PTP_RC_OK;
+}
+
+/**
+ * Reads the journal of an earlier attempt to fetch an object.
+ * @return the number of bytes that can be kept, 0 to start over.
+ */
+static uint64_t read_resume_journal(int journalfd, int fd,
+				    resume_journal_t const *expected)
+{
+  resume_journal_t journal;
+  struct stat sb;
+
+  if (read(journalfd, &journal, sizeof(journal)) != sizeof(journal)) {
+    return 0;
+  }
+  if (journal.magic != expected->magic ||
+      journal.object_id != expected->object_id ||
+      journal.filesize != expected->filesize ||
+      journal.modificationdate != expected->modificationdate ||
+      journal.completed > expected->filesize) {
+    return 0;
+  }
+  // The file may have been truncated since
+  if (fstat(fd, &sb) < 0 || (uint64_t) sb.st_size < journal.completed) {
+    return 0;
+  }
+  return journal.completed;
+}
+
+/**
+ * This gets a file off the device to a local file in a way that can be
+ * resumed after an interruption.
+ *
+ * On devices supporting the Android GetPartialObject64 extension, the
+ * file is fetched in large ranges which are written straight into
+ * place, while the next range is already being fetched. A small journal
+ * named after the file with <code>.mtpresume</code> appended records
+ * how far the file was written. If a download is interrupted, calling
+ * this function again with the same object and path continues after the
+ * last complete range, provided the object has not changed meanwhile.
+ * The journal is removed once the file is complete. Unlike
+ * <code>LIBMTP_Get_File_To_File()</code>, a partial file is kept when
+ * the transfer fails or is cancelled.
+ *
+ * On other devices this simply calls
+ * <code>LIBMTP_Get_File_To_File()</code>.
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param path a filename to use for the retrieved file.
+ * @param callback a progress indicator function or NULL to ignore.
+ *        It is called once for every range, and with the bytes kept
+ *        from an earlier attempt first.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Get_File_To_File()
+ */
+int LIBMTP_Get_File_To_File_Resumable(LIBMTP_mtpdevice_t *device,
+				      uint32_t const id,
+				      char const * const path,
+				      LIBMTP_progressfunc_t const callback,
+				      void const * const data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_file_t *mtpfile;
+  range_download_t dl;
+  PTPDataHandler handler;
+  char *journalpath;
+  uint64_t offset;
+  uint16_t ptpret = PTP_RC_OK;
+  int ret = -1;
+  int i;
+
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Bad arguments, path was NULL.");
+    return -1;
+  }
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64)) {
+    return LIBMTP_Get_File_To_File(device, id, path, callback, data);
+  }
+
+  mtpfile = LIBMTP_Get_Filemetadata(device, id);
+  if (mtpfile == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not get object info.");
+    return -1;
+  }
+  if (mtpfile->filetype == LIBMTP_FILETYPE_FOLDER) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Bad object format.");
+    LIBMTP_destroy_file_t(mtpfile);
+    return -1;
+  }
+
+  memset(&dl, 0, sizeof(dl));
+  dl.journal.magic = RESUME_JOURNAL_MAGIC;
+  dl.journal.object_id = id;
+  dl.journal.filesize = mtpfile->filesize;
+  dl.journal.modificationdate = (int64_t) mtpfile->modificationdate;
+  LIBMTP_destroy_file_t(mtpfile);
+
+  journalpath = malloc(strlen(path) + sizeof(RESUME_JOURNAL_SUFFIX));
+  if (journalpath == NULL) {
+    return -1;
+  }
+  strcpy(journalpath, path);
+  strcat(journalpath, RESUME_JOURNAL_SUFFIX);
+
+  // Open the file without truncating it, it may hold an earlier attempt
+#ifdef __WIN32__
+  dl.fd = open(path, O_RDWR|O_CREAT|O_BINARY, S_IRWXU);
+  dl.journalfd = open(journalpath, O_RDWR|O_CREAT|O_BINARY, S_IRWXU);
+#else
+  dl.fd = open(path, O_RDWR|O_CREAT, S_IRWXU|S_IRGRP);
+  dl.journalfd = open(journalpath, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+#endif
+  if (dl.fd == -1 || dl.journalfd == -1) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not create file.");
+    goto out;
+  }
+
+  offset = read_resume_journal(dl.journalfd, dl.fd, &dl.journal);
+  if (offset > 0) {
+    LIBMTP_INFO("resuming download of object %u at byte %llu\n", id,
+		(unsigned long long) offset);
+  }
+  dl.journal.completed = offset;
+
+  /*
+   * Reserve the space up front, the ranges are written into place. A
+   * fresh download must not keep anything of a file it replaces.
+   */
+  if ((offset == 0 && ftruncate(dl.fd, 0) < 0) ||
+      preallocate_file(dl.fd, dl.journal.filesize) < 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not allocate the file.");
+    goto out;
+  }
+  if (write_at(dl.journalfd, (unsigned char *) &dl.journal,
+	       sizeof(resume_journal_t), 0) < 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not write the journal.");
+    goto out;
+  }
+
+  for (i = 0; i < 2; i++) {
+    dl.buffers[i].data = malloc(RANGE_DOWNLOAD_SIZE);
+    if (dl.buffers[i].data == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Get_File_To_File_Resumable(): Could not allocate the range buffers.");
+      goto out;
+    }
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&dl.lock, NULL);
+  pthread_cond_init(&dl.changed, NULL);
+  if (pthread_create(&dl.writer, NULL, range_writer, &dl) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not start the writer.");
+    pthread_cond_destroy(&dl.changed);
+    pthread_mutex_destroy(&dl.lock);
+    goto out;
+  }
+#endif
+
+  if (callback != NULL && callback(offset, dl.journal.filesize, data) != 0) {
+    ptpret = PTP_ERROR_CANCEL;
+  }
+  handler.getfunc = NULL;
+  handler.putfunc = range_put_func;
+  for (i = 0; ptpret == PTP_RC_OK && offset < dl.journal.filesize; i ^= 1) {
+    range_buffer_t *buffer = &dl.buffers[i];
+    uint32_t maxbytes = RANGE_DOWNLOAD_SIZE;
+
+    if (wait_range(&dl, buffer) < 0) {
+      break;
+    }
+    if (dl.journal.filesize - offset < maxbytes) {
+      maxbytes = dl.journal.filesize - offset;
+    }
+    // See LIBMTP_GetPartialObject() for this one
+    if ((params->device_flags & DEVICE_FLAG_SAMSUNG_OFFSET_BUG) &&
+	(maxbytes % PTP_USB_BULK_HS_MAX_PACKET_LEN_READ) == (PTP_USB_BULK_HS_MAX_PACKET_LEN_READ - PTP_USB_BULK_HDR_LEN)) {
+      maxbytes--;
+    }
+    buffer->offset = offset;
+    buffer->len = 0;
+    handler.priv = buffer;
+    ptpret = ptp_android_getpartialobject64_to_handler(params, id, offset,
+						       maxbytes, &handler);
+    if (ptpret != PTP_RC_OK) {
+      break;
+    }
+    if (buffer->len == 0) {
+      // The device has nothing more to give, do not spin on it
+      ptpret = PTP_RC_GeneralError;
+      break;
+    }
+    offset += buffer->len;
+    if (queue_range(&dl, buffer) < 0) {
+      break;
+    }
+    if (callback != NULL && callback(offset, dl.journal.filesize, data) != 0) {
+      ptpret = PTP_ERROR_CANCEL;
+    }
+  }
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&dl.lock);
+  dl.done = 1;
+  pthread_cond_broadcast(&dl.changed);
+  pthread_mutex_unlock(&dl.lock);
+  pthread_join(dl.writer, NULL);
+  pthread_cond_destroy(&dl.changed);
+  pthread_mutex_destroy(&dl.lock);
+#endif
+
+  if (ptpret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_To_File_Resumable(): Cancelled transfer.");
+  } else if (ptpret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ptpret, "LIBMTP_Get_File_To_File_Resumable(): Could not get file from device.");
+  } else if (dl.error) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not write to file.");
+  } else {
+    ret = 0;
+  }
+
+ out:
+  for (i = 0; i < 2; i++) {
+    free(dl.buffers[i].data);
+  }
+  if (dl.fd != -1) {
+    close(dl.fd);
+  }
+  if (dl.journalfd != -1) {
+    close(dl.journalfd);
+  }
+  if (ret == 0) {
+    unlink(journalpath);
+  }
+  free(journalpath);
+  return ret;
+}
+
 
 /**
  * This gets a file off the device and calls put_func
@@ -5681,58 +7483,59 @@ int LIBMTP_Send_Track_From_File(LIBMTP_mtpdevice_t *device,
 
 
 /**
- * This helper function checks if a filename already exists on the device
- * @param params the PTP params to check against
- * @param filename a string representing the filename
- * @return 0 if the filename doesn't exist, -1 if it does
- */
-static int check_filename_exists(PTPParams* params, char const * const filename)
-{
-  unsigned int i;
-
-  for (i = 0; i < params->objects.len; i++) {
-    char *fname = params->objects.val[i].oi.Filename;
-    if ((fname != NULL) && (strcmp(filename, fname) == 0))
-    {
-      return -1;
-    }
-  }
-
-  return 0;
-}
-
-/**
- * This helper function returns a unique filename, with a random string before the extension
- * @param params the PTP params to check against
+ * This helper function returns a unique filename for a folder, with a
+ * number appended before the extension if the name is taken. The
+ * objects it is checked against are loaded into the cache first.
+ * @param device a pointer to the device to check against
+ * @param storage_id the storage of the target folder, 0 for any
+ * @param parent_id the target folder, 0 if the device picks the folder,
+ *        in which case the name is made unique across all folders
  * @param filename string representing the original filename
  * @return a string representing the unique filename
  */
-static char *generate_unique_filename(PTPParams* params, char const * const filename)
+static char *generate_unique_filename(LIBMTP_mtpdevice_t *device,
+				      uint32_t storage_id, uint32_t parent_id,
+				      char const * const filename)
 {
-  int suffix;
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t parent = parent_id ? parent_id : PTP_HANDLER_SPECIAL;
+  uint32_t hash;
+  uint32_t suffix;
   const char * extension_position;
+  size_t baselen;
+  char *newname;
 
-  if (check_filename_exists(params, filename))
-  {
-    extension_position = strrchr(filename,'.');
-
-    char basename[extension_position - filename + 1];
-    strncpy(basename, filename, extension_position - filename);
-    basename[extension_position - filename] = '\0';
-
-    suffix = 1;
-    char newname[ strlen(basename) + 6 + strlen(extension_position)];
-    sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
-    while ((check_filename_exists(params, newname)) && (suffix < 1000000)) {
-      suffix++;
-      sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
-    }
-  return strdup(newname);
-  }
+  // A lazily cached device may not have listed the folder yet
+  if (parent_id != 0)
+    cache_objects(device, storage_id, parent_id, 0);
   else
-  {
+    cache_objects(device, storage_id, 0, 1);
+  if (!ptp_filename_in_cache(params, storage_id, parent, filename))
     return strdup(filename);
-  }
+
+  extension_position = strrchr(filename,'.');
+  if (extension_position == NULL)
+    extension_position = filename + strlen(filename);
+  baselen = extension_position - filename;
+  newname = malloc(baselen + 12 + strlen(extension_position));
+  if (newname == NULL)
+    return NULL;
+
+  /*
+   * Uploading the same name over and over again into one folder is the
+   * common case, so continue after the suffix handed out last time.
+   */
+  hash = ptp_filename_hash(filename) ^ parent ^ (storage_id * 2654435761U);
+  suffix = 1;
+  if (params->objects.suffixhash == hash)
+    suffix = params->objects.suffix + 1;
+  do {
+    sprintf(newname, "%.*s_%u%s", (int) baselen, filename, suffix, extension_position);
+  } while (ptp_filename_in_cache(params, storage_id, parent, newname) &&
+	   ++suffix < 1000000);
+  params->objects.suffixhash = hash;
+  params->objects.suffix = suffix;
+  return newname;
 }
 
 /**
@@ -5779,7 +7582,6 @@ int LIBMTP_Send_Track_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
   int subcall_ret;
   LIBMTP_file_t filedata;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  PTPParams *params = (PTPParams *) device->params;
 
   // Sanity check, is this really a track?
   if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
@@ -5793,7 +7595,9 @@ int LIBMTP_Send_Track_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
   filedata.parent_id = metadata->parent_id;
   filedata.storage_id = metadata->storage_id;
   if FLAG_UNIQUE_FILENAMES(ptp_usb) {
-    filedata.filename = generate_unique_filename(params, metadata->filename);
+    filedata.filename = generate_unique_filename(device, metadata->storage_id,
+						 metadata->parent_id,
+						 metadata->filename);
   }
   else {
     filedata.filename = metadata->filename;
@@ -5808,6 +7612,10 @@ int LIBMTP_Send_Track_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
 						      callback,
 						      data);
 
+  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
+    free(filedata.filename);
+  }
+
   if (subcall_ret != 0) {
     add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
 			    "LIBMTP_Send_Track_From_File_Descriptor(): "
@@ -5883,7 +7691,6 @@ int LIBMTP_Send_Track_From_Handler(LIBMTP_mtpdevice_t *device,
   int subcall_ret;
   LIBMTP_file_t filedata;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  PTPParams *params = (PTPParams *) device->params;
 
   // Sanity check, is this really a track?
   if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
@@ -5897,7 +7704,9 @@ int LIBMTP_Send_Track_From_Handler(LIBMTP_mtpdevice_t *device,
   filedata.parent_id = metadata->parent_id;
   filedata.storage_id = metadata->storage_id;
   if FLAG_UNIQUE_FILENAMES(ptp_usb) {
-    filedata.filename = generate_unique_filename(params, metadata->filename);
+    filedata.filename = generate_unique_filename(device, metadata->storage_id,
+						 metadata->parent_id,
+						 metadata->filename);
   }
   else {
     filedata.filename = metadata->filename;
@@ -5913,6 +7722,10 @@ int LIBMTP_Send_Track_From_Handler(LIBMTP_mtpdevice_t *device,
 					      callback,
 					      data);
 
+  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
+    free(filedata.filename);
+  }
+
   if (subcall_ret != 0) {
     add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
 			    "LIBMTP_Send_Track_From_Handler(): "
@@ -6393,8 +8206,7 @@ static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file
      *    0C 00 00 00 03 00 01 20 1C 00 00 00
      *    ... Then update metadata one-by one, actually (instead of sending it first!) ...
      */
-    MTPObjectProp *props = NULL;
-    int nrofprops = 0;
+    MTPObjectProps props = {0};
     MTPObjectProp *prop = NULL;
     uint16_t *properties = NULL;
     uint32_t propcnt = 0;
@@ -6418,7 +8230,7 @@ static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file
       } else if (opd.GetSet) {
 	switch (properties[i]) {
 	case PTP_OPC_ObjectFileName:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = filedata->item_id;
 	  prop->PropCode = PTP_OPC_ObjectFileName;
 	  prop->DataType = PTP_DTC_STR;
@@ -6430,21 +8242,21 @@ static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file
 	  }
 	  break;
 	case PTP_OPC_ProtectionStatus:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = filedata->item_id;
 	  prop->PropCode = PTP_OPC_ProtectionStatus;
 	  prop->DataType = PTP_DTC_UINT16;
 	  prop->Value.u16 = 0x0000U; /* Not protected */
 	  break;
 	case PTP_OPC_NonConsumable:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = filedata->item_id;
 	  prop->PropCode = PTP_OPC_NonConsumable;
 	  prop->DataType = PTP_DTC_UINT8;
 	  prop->Value.u8 = 0x00; /* It is supported, then it is consumable */
 	  break;
 	case PTP_OPC_Name:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = filedata->item_id;
 	  prop->PropCode = PTP_OPC_Name;
 	  prop->DataType = PTP_DTC_STR;
@@ -6454,7 +8266,7 @@ static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file
 	case PTP_OPC_DateModified:
 	  // Tag with current time if that is supported
 	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = filedata->item_id;
 	    prop->PropCode = PTP_OPC_DateModified;
 	    prop->DataType = PTP_DTC_STR;
@@ -6469,12 +8281,10 @@ static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file
     free(properties);
 
     ret = ptp_mtp_sendobjectproplist(params, &store, &localph, &filedata->item_id,
-				     of, filedata->filesize, props, nrofprops);
+				     of, filedata->filesize, props.val, props.len);
 
     /* Free property list */
-    for (i=0;i<nrofprops;i++) {
-      ptp_free_object_prop(&props[i]);
-    }
+    free_array_recusive(&props, ptp_free_object_prop);
 
     if (ret != PTP_RC_OK) {
       add_ptp_error_to_errorstack(device, ret, "send_file_object_info():"
@@ -6563,9 +8373,8 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
   }
   if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
       !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
-    MTPObjectProp *props = NULL;
+    MTPObjectProps props = {0};
     MTPObjectProp *prop = NULL;
-    int nrofprops = 0;
 
     for (i=0;i<propcnt;i++) {
       PTPObjectPropDesc opd;
@@ -6579,7 +8388,7 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
 	case PTP_OPC_Name:
 	  if (metadata->title == NULL)
 	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_Name;
 	  prop->DataType = PTP_DTC_STR;
@@ -6588,7 +8397,7 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
 	case PTP_OPC_AlbumName:
 	  if (metadata->album == NULL)
 	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_AlbumName;
 	  prop->DataType = PTP_DTC_STR;
@@ -6597,7 +8406,7 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
 	case PTP_OPC_Artist:
 	  if (metadata->artist == NULL)
 	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_Artist;
 	  prop->DataType = PTP_DTC_STR;
@@ -6606,7 +8415,7 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
 	case PTP_OPC_Composer:
 	  if (metadata->composer == NULL)
 	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_Composer;
 	  prop->DataType = PTP_DTC_STR;
@@ -6615,21 +8424,21 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
 	case PTP_OPC_Genre:
 	  if (metadata->genre == NULL)
 	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_Genre;
 	  prop->DataType = PTP_DTC_STR;
 	  prop->Value.str = strdup(metadata->genre);
 	  break;
 	case PTP_OPC_Duration:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_Duration;
 	  prop->DataType = PTP_DTC_UINT32;
 	  prop->Value.u32 = adjust_u32(metadata->duration, &opd);
 	  break;
 	case PTP_OPC_Track:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_Track;
 	  prop->DataType = PTP_DTC_UINT16;
@@ -6638,42 +8447,42 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
 	case PTP_OPC_OriginalReleaseDate:
 	  if (metadata->date == NULL)
 	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_OriginalReleaseDate;
 	  prop->DataType = PTP_DTC_STR;
 	  prop->Value.str = strdup(metadata->date);
 	  break;
 	case PTP_OPC_SampleRate:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_SampleRate;
 	  prop->DataType = PTP_DTC_UINT32;
 	  prop->Value.u32 = adjust_u32(metadata->samplerate, &opd);
 	  break;
 	case PTP_OPC_NumberOfChannels:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_NumberOfChannels;
 	  prop->DataType = PTP_DTC_UINT16;
 	  prop->Value.u16 = adjust_u16(metadata->nochannels, &opd);
 	  break;
 	case PTP_OPC_AudioWAVECodec:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_AudioWAVECodec;
 	  prop->DataType = PTP_DTC_UINT32;
 	  prop->Value.u32 = adjust_u32(metadata->wavecodec, &opd);
 	  break;
 	case PTP_OPC_AudioBitRate:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_AudioBitRate;
 	  prop->DataType = PTP_DTC_UINT32;
 	  prop->Value.u32 = adjust_u32(metadata->bitrate, &opd);
 	  break;
 	case PTP_OPC_BitRateType:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_BitRateType;
 	  prop->DataType = PTP_DTC_UINT16;
@@ -6683,14 +8492,14 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
 	  // TODO: shall this be set for rating 0?
 	  if (metadata->rating == 0)
 	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_Rating;
 	  prop->DataType = PTP_DTC_UINT16;
 	  prop->Value.u16 = adjust_u16(metadata->rating, &opd);
 	  break;
 	case PTP_OPC_UseCount:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = metadata->item_id;
 	  prop->PropCode = PTP_OPC_UseCount;
 	  prop->DataType = PTP_DTC_UINT32;
@@ -6699,7 +8508,7 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
 	case PTP_OPC_DateModified:
 	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
 	    // Tag with current time if that is supported
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = metadata->item_id;
 	    prop->PropCode = PTP_OPC_DateModified;
 	    prop->DataType = PTP_DTC_STR;
@@ -6716,11 +8525,9 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
     // NOTE: File size is not updated, this should not change anyway.
     // neither will we change the filename.
 
-    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+    ret = ptp_mtp_setobjectproplist(params, props.val, props.len);
 
-    for (i=0;i<nrofprops;i++) {
-      ptp_free_object_prop(&props[i]);
-    }
+    free_array_recusive(&props, ptp_free_object_prop);
 
     if (ret != PTP_RC_OK) {
       // TODO: return error of which property we couldn't set
@@ -6912,8 +8719,7 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
     return -1;
   }
 
-  // update cached object properties if metadata cache exists
-  update_metadata_cache(device, metadata->item_id);
+  // The cached object was updated along with each property set
 
   free(properties);
 
@@ -6929,7 +8735,8 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
  * expected that they will not be deleted, and will turn up in object
  * listings with parent set to a non-existant object ID. The safe way
  * to do this is to recursively delete all files (and folders) contained
- * in the folder, then the folder itself.
+ * in the folder, then the folder itself. The object cache forgets the
+ * contents of a deleted folder along with it either way.
  *
  * @param device a pointer to the device to delete the object from.
  * @param object_id the object to delete.
@@ -7013,13 +8820,28 @@ int LIBMTP_Copy_Object(LIBMTP_mtpdevice_t *device,
 {
   uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob;
+  uint32_t copy_id;
 
-  ret = ptp_copyobject(params, object_id, storage_id, parent_id);
+  ret = ptp_copyobject(params, object_id, storage_id, parent_id, &copy_id);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "LIBMTP_Copy_Object(): could not copy object.");
     return -1;
   }
 
+  // The copy of a folder comes with copies of everything in it, a fully
+  // cached device needs those in the cache too. A lazily cached one
+  // lists them when asked for.
+  if (device->cached == CACHE_FULL && copy_id != 0) {
+    if (ptp_cache_wrlock(params) < 0)
+      return 0;
+    if (ptp_object_want(params, copy_id, PTPOBJECT_OBJECTINFO_LOADED,
+			&ob) == PTP_RC_OK &&
+	ob->oi.ObjectFormat == PTP_OFC_Association)
+      get_handles_recursively(device, params, ob->oi.StorageID, copy_id);
+    ptp_cache_unlock(params);
+  }
+
   return 0;
 }
 
@@ -7061,21 +8883,18 @@ static int set_object_filename(LIBMTP_mtpdevice_t *device,
 
   if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
       !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
-    MTPObjectProp *props = NULL;
+    MTPObjectProps props = {0};
     MTPObjectProp *prop = NULL;
-    int nrofprops = 0;
 
-    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+    prop = ptp_get_new_object_prop_entry(&props);
     prop->ObjectHandle = object_id;
     prop->PropCode = PTP_OPC_ObjectFileName;
     prop->DataType = PTP_DTC_STR;
     prop->Value.str = newname;
 
-    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+    ret = ptp_mtp_setobjectproplist(params, props.val, props.len);
 
-    for (int i=0;i<nrofprops;i++) {
-      ptp_free_object_prop(&props[i]);
-    }
+    free_array_recusive(&props, ptp_free_object_prop);
 
     if (ret != PTP_RC_OK) {
         add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
@@ -7101,9 +8920,6 @@ static int set_object_filename(LIBMTP_mtpdevice_t *device,
 
   ptp_free_objectpropdesc(&opd);
 
-  // update cached object properties if metadata cache exists
-  update_metadata_cache(device, object_id);
-
   return 0;
 }
 
@@ -7387,63 +9203,53 @@ void LIBMTP_destroy_folder_t(LIBMTP_folder_t *folder)
  */
 LIBMTP_folder_t *LIBMTP_Find_Folder(LIBMTP_folder_t *folderlist, uint32_t id)
 {
-  LIBMTP_folder_t *ret = NULL;
-
-  if(folderlist == NULL) {
-    return NULL;
-  }
-
-  if(folderlist->folder_id == id) {
-    return folderlist;
-  }
+  LIBMTP_folder_t *ret;
 
-  if(folderlist->sibling) {
-    ret = LIBMTP_Find_Folder(folderlist->sibling, id);
-  }
-
-  if(folderlist->child && ret == NULL) {
-    ret = LIBMTP_Find_Folder(folderlist->child, id);
+  // Walk the siblings in a loop so only the tree depth recurses.
+  for (; folderlist != NULL; folderlist = folderlist->sibling) {
+    if (folderlist->folder_id == id) {
+      return folderlist;
+    }
+    if (folderlist->child != NULL) {
+      ret = LIBMTP_Find_Folder(folderlist->child, id);
+      if (ret != NULL) {
+	return ret;
+      }
+    }
   }
+  return NULL;
+}
 
-  return ret;
+/**
+ * Hash slot for a folder ID in a table of <code>size</code> entries,
+ * <code>size</code> being a power of two. This takes the top bits of
+ * the product, the low ones only depend on the low bits of the ID.
+ */
+static uint32_t folder_slot(uint32_t folder_id, uint32_t size)
+{
+  return (uint32_t) (((uint64_t) (uint32_t) (folder_id * 2654435761U) *
+		      size) >> 32);
 }
 
 /**
- * Function used to recursively get subfolders from params.
+ * Looks up a folder ID in the table built by
+ * LIBMTP_Get_Folder_List_For_Storage().
+ * @return the index into <code>folders</code> plus one, or 0 if
+ *         there is no such folder.
  */
-static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_t parent)
+static uint32_t find_folder_index(LIBMTP_folder_t **folders,
+				  uint32_t const *table, uint32_t size,
+				  uint32_t folder_id)
 {
-  LIBMTP_folder_t *retfolders = NULL;
-  LIBMTP_folder_t *children, *iter, *curr;
+  uint32_t slot = folder_slot(folder_id, size);
 
-  iter = list->sibling;
-  while(iter != list) {
-    if (iter->parent_id != parent) {
-      iter = iter->sibling;
-      continue;
+  while (table[slot] != 0) {
+    if (folders[table[slot] - 1]->folder_id == folder_id) {
+      return table[slot];
     }
-
-    /* We know that iter is a child of 'parent', therefore we can safely
-     * hold on to 'iter' locally since no one else will steal it
-     * from the 'list' as we recurse. */
-    children = get_subfolders_for_folder(list, iter->folder_id);
-
-    curr = iter;
-    iter = iter->sibling;
-
-    // Remove curr from the list.
-    curr->child->sibling = curr->sibling;
-    curr->sibling->child = curr->child;
-
-    // Attach the children to curr.
-    curr->child = children;
-
-    // Put this folder into the list of siblings.
-    curr->sibling = retfolders;
-    retfolders = curr;
+    slot = (slot + 1) & (size - 1);
   }
-
-  return retfolders;
+  return 0;
 }
 
 /**
@@ -7458,33 +9264,40 @@ static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_
 						    uint32_t const storage)
 {
   PTPParams *params = (PTPParams *) device->params;
-  LIBMTP_folder_t head, *rv;
-  unsigned int i;
+  LIBMTP_folder_t **folders = NULL;
+  uint32_t *table = NULL;
+  unsigned char *reached = NULL;
+  LIBMTP_folder_t *root = NULL;
+  LIBMTP_folder_t *bugroot = NULL;
+  LIBMTP_folder_t *rv;
+  uint32_t nfolders = 0;
+  uint32_t tablesize = 16;
+  uint32_t i;
 
   // Get all the handles if we haven't already done that
-  if (params->objects.len == 0) {
-    flush_handles(device);
-  }
+  cache_objects(device, storage, 0, 1);
+  ptp_objects_sort(params);
+  // Listings only read the cache, events may update it meanwhile
+  ptp_cache_rdlock(params);
 
   /*
-   * This creates a temporary list of the folders, this is in a
-   * reverse order and uses the Folder pointers that are already
-   * in the Folder structure. From this we can then build up the
-   * folder hierarchy with only looking at this temporary list,
-   * and removing the folders from this temporary list as we go.
-   * This significantly reduces the number of operations that we
-   * have to do in building the folder hierarchy. Also since the
-   * temp list is in reverse order, when we prepend to the sibling
-   * list things are in the same order as they were originally
-   * in the handle list.
+   * Collect the folders in handle order, and index them by folder ID
+   * in a small open addressing table so that every folder can find its
+   * parent in constant time. Then the hierarchy is built in a single
+   * backwards pass: prepending each folder to the child list of its
+   * parent keeps every sibling list in the original handle order.
    */
-  head.sibling = &head;
-  head.child = &head;
+  // Room for the folders and, behind them, the work stack used below.
+  folders = malloc((2 * params->objects.len + 1) * sizeof(LIBMTP_folder_t *));
+  if (folders == NULL) {
+    ptp_cache_unlock(params);
+    return NULL;
+  }
   for (i = 0; i < params->objects.len; i++) {
     LIBMTP_folder_t *folder;
     PTPObject *ob;
 
-    ob = &params->objects.val[i];
+    ob = params->objects.val[i];
     if (ob->oi.ObjectFormat != PTP_OFC_Association) {
       continue;
     }
@@ -7509,48 +9322,119 @@ static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_
     folder = LIBMTP_new_folder_t();
     if (folder == NULL) {
       // malloc failure or so.
-      return NULL;
+      ptp_cache_unlock(params);
+      goto fail;
     }
     folder->folder_id = ob->oid;
     folder->parent_id = ob->oi.ParentObject;
     folder->storage_id = ob->oi.StorageID;
     folder->name = (ob->oi.Filename) ? (char *)strdup(ob->oi.Filename) : NULL;
+    folders[nfolders++] = folder;
+  }
+  ptp_cache_unlock(params);
 
-    // pretend sibling says next, and child says prev.
-    folder->sibling = head.sibling;
-    folder->child = &head;
-    head.sibling->child = folder;
-    head.sibling = folder;
+  while (tablesize < nfolders * 2) {
+    tablesize *= 2;
   }
+  table = calloc(tablesize, sizeof(uint32_t));
+  reached = calloc(nfolders + 1, 1);
+  if (table == NULL || reached == NULL) {
+    goto fail;
+  }
+  for (i = 0; i < nfolders; i++) {
+    uint32_t slot = folder_slot(folders[i]->folder_id, tablesize);
+
+    while (table[slot] != 0) {
+      slot = (slot + 1) & (tablesize - 1);
+    }
+    table[slot] = i + 1;
+  }
+
+  i = nfolders;
+  while (i-- > 0) {
+    LIBMTP_folder_t *folder = folders[i];
+    uint32_t parent;
 
-  // We begin at the given root folder and get them all recursively
-  rv = get_subfolders_for_folder(&head, 0x00000000U);
+    if (folder->parent_id == 0x00000000U) {
+      folder->sibling = root;
+      root = folder;
+      continue;
+    }
+    if (folder->parent_id == 0xffffffffU) {
+      folder->sibling = bugroot;
+      bugroot = folder;
+      continue;
+    }
+    parent = find_folder_index(folders, table, tablesize, folder->parent_id);
+    if (parent != 0) {
+      folder->sibling = folders[parent - 1]->child;
+      folders[parent - 1]->child = folder;
+    }
+  }
 
   // Some buggy devices may have some files in the "root folder"
   // 0xffffffff so if 0x00000000 didn't return any folders,
   // look for children of the root 0xffffffffU
-  if (rv == NULL) {
-    rv = get_subfolders_for_folder(&head, 0xffffffffU);
-    if (rv != NULL)
-      LIBMTP_ERROR("Device have files in \"root folder\" 0xffffffffU - "
-		   "this is a firmware bug (but continuing)\n");
+  rv = root;
+  if (rv == NULL && bugroot != NULL) {
+    rv = bugroot;
+    LIBMTP_ERROR("Device have files in \"root folder\" 0xffffffffU - "
+		 "this is a firmware bug (but continuing)\n");
   }
 
-  // The temp list should be empty. Clean up any orphans just in case.
-  while(head.sibling != &head) {
-    LIBMTP_folder_t *curr = head.sibling;
+  /*
+   * Mark everything reachable from the returned root. Whatever is left
+   * unmarked has a missing parent or sits in a parent loop: those are
+   * the orphans.
+   */
+  {
+    LIBMTP_folder_t **stack = folders + nfolders;
+    uint32_t top = 0;
+    LIBMTP_folder_t *iter;
 
+    for (iter = rv; iter != NULL; iter = iter->sibling) {
+      stack[top++] = iter;
+    }
+    while (top > 0) {
+      LIBMTP_folder_t *folder = stack[--top];
+
+      reached[find_folder_index(folders, table, tablesize, folder->folder_id)] = 1;
+      for (iter = folder->child; iter != NULL; iter = iter->sibling) {
+	stack[top++] = iter;
+      }
+    }
+  }
+
+  // Clean up any orphans.
+  for (i = 0; i < nfolders; i++) {
+    LIBMTP_folder_t *curr = folders[i];
+
+    if (reached[i + 1]) {
+      continue;
+    }
     LIBMTP_INFO("Orphan folder with ID: 0x%08x name: \"%s\" encountered.\n",
 	   curr->folder_id,
 	   curr->name);
-    curr->sibling->child = curr->child;
-    curr->child->sibling = curr->sibling;
     curr->child = NULL;
     curr->sibling = NULL;
     LIBMTP_destroy_folder_t(curr);
   }
 
+  free(reached);
+  free(table);
+  free(folders);
   return rv;
+
+ fail:
+  for (i = 0; i < nfolders; i++) {
+    folders[i]->child = NULL;
+    folders[i]->sibling = NULL;
+    LIBMTP_destroy_folder_t(folders[i]);
+  }
+  free(reached);
+  free(table);
+  free(folders);
+  return NULL;
 }
 
 /**
@@ -7565,6 +9449,121 @@ LIBMTP_folder_t *LIBMTP_Get_Folder_List(LIBMTP_mtpdevice_t *device)
   return LIBMTP_Get_Folder_List_For_Storage(device, PTP_GOH_ALL_STORAGE);
 }
 
+/**
+ * This retrieves the metadata for a single folder off the device,
+ * without building the whole folder hierarchy. The <code>child</code>
+ * and <code>sibling</code> fields of the returned folder are always
+ * <code>NULL</code>.
+ *
+ * @param device a pointer to the device to get the folder metadata from.
+ * @param folder_id the object ID of the folder that you want the metadata for.
+ * @return a metadata entry on success or NULL on failure, also if the
+ *         object is not a folder.
+ * @see LIBMTP_Get_Folder_List()
+ */
+LIBMTP_folder_t *LIBMTP_Get_Folder_Metadata(LIBMTP_mtpdevice_t *device,
+					    uint32_t const folder_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_folder_t *folder;
+  uint16_t ret;
+  PTPObject *ob;
+
+  // Get all the handles if we haven't already done that
+  // (Lazily cached devices load the one object on demand.)
+  if (device->cached == CACHE_FULL)
+    cache_objects(device, 0, 0, 1);
+
+  ret = ptp_object_want(params, folder_id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK) {
+    return NULL;
+  }
+  if (ob->oi.ObjectFormat != PTP_OFC_Association) {
+    return NULL;
+  }
+
+  folder = LIBMTP_new_folder_t();
+  if (folder == NULL) {
+    return NULL;
+  }
+  folder->folder_id = ob->oid;
+  folder->parent_id = ob->oi.ParentObject;
+  folder->storage_id = ob->oi.StorageID;
+  folder->name = (ob->oi.Filename) ? (char *)strdup(ob->oi.Filename) : NULL;
+  return folder;
+}
+
+/**
+ * This looks up a folder by its path, such as
+ * <code>"/Music/Albums"</code>, one path component at a time through
+ * the object cache, without building the folder hierarchy. Leading,
+ * trailing and repeated slashes are ignored and the names are
+ * compared case sensitively. This only works on cached devices.
+ *
+ * @param device a pointer to the device to look the folder up on.
+ * @param storage the storage to look in, or 0 for any storage.
+ * @param path the path of the folder.
+ * @return the folder ID, 0 for the root folder, or 0xFFFFFFFF if
+ *         there is no such folder.
+ */
+uint32_t LIBMTP_Get_Folder_Id_For_Path(LIBMTP_mtpdevice_t *device,
+				       uint32_t const storage,
+				       char const * const path)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t folder_id = 0x00000000U;
+  char const *component = path;
+  char *name;
+
+  if (!device->cached) {
+    return 0xFFFFFFFFU;
+  }
+
+  // Get all the handles if we haven't already done that, a lazily
+  // cached device lists the folders along the path instead
+  if (device->cached == CACHE_FULL)
+    cache_objects(device, 0, 0, 1);
+
+  name = malloc(strlen(path) + 1);
+  if (name == NULL) {
+    return 0xFFFFFFFFU;
+  }
+  while (*component != '\0') {
+    char const *end;
+    PTPObject *ob;
+    uint16_t ret;
+
+    while (*component == '/') {
+      component++;
+    }
+    if (*component == '\0') {
+      break;
+    }
+    end = strchr(component, '/');
+    if (end == NULL) {
+      end = component + strlen(component);
+    }
+    memcpy(name, component, end - component);
+    name[end - component] = '\0';
+    component = end;
+
+    if (device->cached == CACHE_LAZY)
+      cache_objects(device, storage, folder_id, 0);
+    ret = ptp_find_object_by_filename(params, storage, folder_id, name, &ob);
+    // Some buggy devices put the top level folders in 0xffffffff
+    if (ret != PTP_RC_OK && folder_id == 0x00000000U) {
+      ret = ptp_find_object_by_filename(params, storage, 0xffffffffU, name, &ob);
+    }
+    if (ret != PTP_RC_OK || ob->oi.ObjectFormat != PTP_OFC_Association) {
+      folder_id = 0xFFFFFFFFU;
+      break;
+    }
+    folder_id = ob->oid;
+  }
+  free(name);
+  return folder_id;
+}
+
 /**
  * This create a folder on the current MTP device. The PTP name
  * for a folder is "association". The PTP/MTP devices does not
@@ -7728,16 +9727,17 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
   uint32_t i;
 
   // Get all the handles if we haven't already done that
-  if (params->objects.len == 0) {
-    flush_handles(device);
-  }
+  cache_objects(device, 0, 0, 1);
+  ptp_objects_sort(params);
+  // Listings only read the cache, events may update it meanwhile
+  ptp_cache_rdlock(params);
 
   for (i = 0; i < params->objects.len; i++) {
     LIBMTP_playlist_t *pl;
     PTPObject *ob;
     uint16_t ret;
 
-    ob = &params->objects.val[i];
+    ob = params->objects.val[i];
 
     // Ignore stuff that isn't playlists
 
@@ -7785,6 +9785,7 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
 
     // Call callback here if we decide to add that possibility...
   }
+  ptp_cache_unlock(params);
   return retlists;
 }
 
@@ -7806,9 +9807,11 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist(LIBMTP_mtpdevice_t *device, uint32_t cons
   uint16_t ret;
 
   // Get all the handles if we haven't already done that
-  if (params->objects.len == 0) {
-    flush_handles(device);
-  }
+  // (Lazily cached devices load the one object on demand, but the
+  // tracks of a .spl playlist are looked up by their paths, which
+  // needs the folders along them.)
+  if (device->cached == CACHE_FULL || REQ_SPL)
+    cache_objects(device, 0, 0, 1);
 
   ret = ptp_object_want (params, plid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
   if (ret != PTP_RC_OK)
@@ -7941,9 +9944,8 @@ static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
 
   if (ptp_operation_issupported(params, PTP_OC_MTP_SendObjectPropList) &&
       !FLAG_BROKEN_SEND_OBJECT_PROPLIST(ptp_usb)) {
-    MTPObjectProp *props = NULL;
+    MTPObjectProps props = {0};
     MTPObjectProp *prop = NULL;
-    int nrofprops = 0;
 
     *newid = 0x00000000U;
 
@@ -7959,7 +9961,7 @@ static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
       } else if (opd.GetSet) {
 	switch (properties[i]) {
 	case PTP_OPC_ObjectFileName:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = *newid;
 	  prop->PropCode = PTP_OPC_ObjectFileName;
 	  prop->DataType = PTP_DTC_STR;
@@ -7969,14 +9971,14 @@ static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
 	  }
 	  break;
 	case PTP_OPC_ProtectionStatus:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = *newid;
 	  prop->PropCode = PTP_OPC_ProtectionStatus;
 	  prop->DataType = PTP_DTC_UINT16;
 	  prop->Value.u16 = 0x0000U; /* Not protected */
 	  break;
 	case PTP_OPC_NonConsumable:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = *newid;
 	  prop->PropCode = PTP_OPC_NonConsumable;
 	  prop->DataType = PTP_DTC_UINT8;
@@ -7984,7 +9986,7 @@ static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
 	  break;
 	case PTP_OPC_Name:
 	  if (name != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = *newid;
 	    prop->PropCode = PTP_OPC_Name;
 	    prop->DataType = PTP_DTC_STR;
@@ -7993,7 +9995,7 @@ static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
 	  break;
 	case PTP_OPC_AlbumArtist:
 	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = *newid;
 	    prop->PropCode = PTP_OPC_AlbumArtist;
 	    prop->DataType = PTP_DTC_STR;
@@ -8002,7 +10004,7 @@ static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
 	  break;
 	case PTP_OPC_Artist:
 	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = *newid;
 	    prop->PropCode = PTP_OPC_Artist;
 	    prop->DataType = PTP_DTC_STR;
@@ -8011,7 +10013,7 @@ static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
 	  break;
 	case PTP_OPC_Composer:
 	  if (composer != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = *newid;
 	    prop->PropCode = PTP_OPC_Composer;
 	    prop->DataType = PTP_DTC_STR;
@@ -8020,7 +10022,7 @@ static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
 	  break;
 	case PTP_OPC_Genre:
 	  if (genre != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = *newid;
 	    prop->PropCode = PTP_OPC_Genre;
 	    prop->DataType = PTP_DTC_STR;
@@ -8030,7 +10032,7 @@ static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
  	case PTP_OPC_DateModified:
 	  // Tag with current time if that is supported
 	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = *newid;
 	    prop->PropCode = PTP_OPC_DateModified;
 	    prop->DataType = PTP_DTC_STR;
@@ -8044,12 +10046,10 @@ static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
     free(properties);
 
     ret = ptp_mtp_sendobjectproplist(params, &store, &localph, newid,
-				     objectformat, 0, props, nrofprops);
+				     objectformat, 0, props.val, props.len);
 
     /* Free property list */
-    for (i=0;i<nrofprops;i++) {
-      ptp_free_object_prop(&props[i]);
-    }
+    free_array_recusive(&props, ptp_free_object_prop);
 
     if (ret != PTP_RC_OK) {
       add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send object property list.");
@@ -8234,9 +10234,8 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
   }
   if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjPropList) &&
       !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
-    MTPObjectProp *props = NULL;
+    MTPObjectProps props = {0};
     MTPObjectProp *prop = NULL;
-    int nrofprops = 0;
 
     for (i=0;i<propcnt;i++) {
       PTPObjectPropDesc opd;
@@ -8248,7 +10247,7 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
       } else if (opd.GetSet) {
 	switch (properties[i]) {
 	case PTP_OPC_Name:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop = ptp_get_new_object_prop_entry(&props);
 	  prop->ObjectHandle = objecthandle;
 	  prop->PropCode = PTP_OPC_Name;
 	  prop->DataType = PTP_DTC_STR;
@@ -8257,7 +10256,7 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
 	  break;
 	case PTP_OPC_AlbumArtist:
 	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = objecthandle;
 	    prop->PropCode = PTP_OPC_AlbumArtist;
 	    prop->DataType = PTP_DTC_STR;
@@ -8266,7 +10265,7 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
 	  break;
 	case PTP_OPC_Artist:
 	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = objecthandle;
 	    prop->PropCode = PTP_OPC_Artist;
 	    prop->DataType = PTP_DTC_STR;
@@ -8275,7 +10274,7 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
 	  break;
 	case PTP_OPC_Composer:
 	  if (composer != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = objecthandle;
 	    prop->PropCode = PTP_OPC_Composer;
 	    prop->DataType = PTP_DTC_STR;
@@ -8284,7 +10283,7 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
 	  break;
 	case PTP_OPC_Genre:
 	  if (genre != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = objecthandle;
 	    prop->PropCode = PTP_OPC_Genre;
 	    prop->DataType = PTP_DTC_STR;
@@ -8294,7 +10293,7 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
  	case PTP_OPC_DateModified:
 	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
 	    // Tag with current time if that is supported
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop = ptp_get_new_object_prop_entry(&props);
 	    prop->ObjectHandle = objecthandle;
 	    prop->PropCode = PTP_OPC_DateModified;
 	    prop->DataType = PTP_DTC_STR;
@@ -8308,13 +10307,11 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
       ptp_free_objectpropdesc(&opd);
     }
 
-    // proplist could be NULL if we can't write any properties
-    if (props != NULL) {
-      ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+    // proplist could be empty if we can't write any properties
+    if (props.len) {
+      ret = ptp_mtp_setobjectproplist(params, props.val, props.len);
 
-      for (i=0;i<nrofprops;i++) {
-        ptp_free_object_prop(&props[i]);
-      }
+      free_array_recusive(&props, ptp_free_object_prop);
 
       if (ret != PTP_RC_OK) {
         // TODO: return error of which property we couldn't set
@@ -8403,8 +10400,6 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
 
   free(properties);
 
-  update_metadata_cache(device, objecthandle);
-
   return 0;
 }
 
@@ -8452,6 +10447,8 @@ int LIBMTP_Create_New_Playlist(LIBMTP_mtpdevice_t *device,
 
   // Samsung needs its own special type of playlists
   if(FLAG_PLAYLIST_SPL(ptp_usb)) {
+    // The track paths are looked up in the object cache
+    cache_objects(device, 0, 0, 1);
     return playlist_t_to_spl(device, metadata);
   }
 
@@ -8464,6 +10461,7 @@ int LIBMTP_Create_New_Playlist(LIBMTP_mtpdevice_t *device,
 				  localph,
 				  metadata->storage_id,
 				  PTP_OFC_MTP_AbstractAudioVideoPlaylist,
+				  ptp_usb->loopback != NULL ? ".pla" :
 				  get_playlist_extension(ptp_usb),
 				  &metadata->playlist_id,
 				  metadata->tracks,
@@ -8706,15 +10704,17 @@ LIBMTP_album_t *LIBMTP_Get_Album_List_For_Storage(LIBMTP_mtpdevice_t *device, ui
   uint32_t i;
 
   // Get all the handles if we haven't already done that
-  if (params->objects.len == 0)
-    flush_handles(device);
+  cache_objects(device, storage_id, 0, 1);
+  ptp_objects_sort(params);
+  // Listings only read the cache, events may update it meanwhile
+  ptp_cache_rdlock(params);
 
   for (i = 0; i < params->objects.len; i++) {
     LIBMTP_album_t *alb;
     PTPObject *ob;
     uint16_t ret;
 
-    ob = &params->objects.val[i];
+    ob = params->objects.val[i];
 
     // Ignore stuff that isn't an album
     if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioAlbum )
@@ -8751,6 +10751,7 @@ LIBMTP_album_t *LIBMTP_Get_Album_List_For_Storage(LIBMTP_mtpdevice_t *device, ui
     }
 
   }
+  ptp_cache_unlock(params);
   return retalbums;
 }
 
@@ -8769,8 +10770,9 @@ LIBMTP_album_t *LIBMTP_Get_Album(LIBMTP_mtpdevice_t *device, uint32_t const albi
   LIBMTP_album_t *alb;
 
   // Get all the handles if we haven't already done that
-  if (params->objects.len == 0)
-    flush_handles(device);
+  // (Lazily cached devices load the one object on demand.)
+  if (device->cached == CACHE_FULL)
+    cache_objects(device, 0, 0, 1);
 
   ret = ptp_object_want(params, albid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
   if (ret != PTP_RC_OK)
@@ -9354,7 +11356,8 @@ int LIBMTP_EndEditObject(LIBMTP_mtpdevice_t *device, uint32_t const id)
 
   ret = ptp_android_endeditobject(params, id);
   if (ret == PTP_RC_OK) {
-      // update cached object properties if metadata cache exists
+      // The device sets the new size and modification date itself,
+      // so this is the one change that has to be read back
       update_metadata_cache(device, id);
       return 0;
   }
@@ -9380,6 +11383,541 @@ int LIBMTP_TruncateObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
   return -1;
 }
 
+/**
+ * Size of the ranges sent by
+ * LIBMTP_Send_File_From_File_Descriptor_Resumable().
+ */
+#define RANGE_UPLOAD_SIZE (8 * 1024 * 1024)
+/**
+ * How often an upload is picked up again after the device failed.
+ */
+#define RANGE_UPLOAD_RETRIES 3
+
+/**
+ * A buffer holding one range of the source file.
+ */
+typedef struct {
+  unsigned char *data; /**< Room for RANGE_UPLOAD_SIZE bytes */
+  uint64_t offset; /**< Offset of the range in the file */
+  uint32_t len; /**< Bytes in the buffer */
+  int ready; /**< Set when the range has been read */
+} upload_buffer_t;
+
+/**
+ * State of an upload in ranges. With threads, the next range is read
+ * from the source file and checksummed while the current one is sent.
+ * The checksums let an upload that failed verify the data that made it
+ * to the device without reading the source file again.
+ */
+typedef struct {
+  int fd; /**< The source file */
+  uint64_t filesize; /**< Size of the source file */
+  uint32_t *checksums; /**< Adler-32 of every range */
+  unsigned char *checked; /**< Whether the entry in checksums is valid */
+  upload_buffer_t buffers[2]; /**< The ranges in flight */
+  int read_error; /**< Set if reading the source file failed */
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock; /**< Protects ready, read_error and stop */
+  pthread_cond_t changed; /**< Signalled when any of them change */
+  pthread_t reader; /**< Thread reading ahead */
+  uint64_t next; /**< Offset the reader starts at */
+  int stop; /**< Set when the reader shall exit */
+#endif
+} range_upload_t;
+
+/**
+ * Computes the Adler-32 checksum of a block of data.
+ */
+static uint32_t adler32(unsigned char const *data, uint32_t len)
+{
+  uint32_t a = 1;
+  uint32_t b = 0;
+
+  while (len > 0) {
+    // Largest run that cannot overflow before the modulo
+    uint32_t run = len < 5552 ? len : 5552;
+
+    len -= run;
+    while (run-- > 0) {
+      a += *data++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+/**
+ * Reads a range of the source file into a buffer and records its
+ * checksum.
+ * @return 0 on success, -1 on failure.
+ */
+static int read_upload_range(range_upload_t *ul, upload_buffer_t *buffer,
+			     uint64_t offset)
+{
+  uint32_t len = RANGE_UPLOAD_SIZE;
+  uint32_t got = 0;
+
+  if (ul->filesize - offset < len) {
+    len = ul->filesize - offset;
+  }
+  while (got < len) {
+    ssize_t n;
+
+#ifdef HAVE_PREAD
+    n = pread(ul->fd, buffer->data + got, len - got, (off_t) (offset + got));
+#else
+    if (lseek(ul->fd, (off_t) (offset + got), SEEK_SET) == (off_t) -1) {
+      return -1;
+    }
+    n = read(ul->fd, buffer->data + got, len - got);
+#endif
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // The file is shorter than announced
+      return -1;
+    }
+    got += n;
+  }
+  buffer->offset = offset;
+  buffer->len = len;
+  ul->checksums[offset / RANGE_UPLOAD_SIZE] = adler32(buffer->data, len);
+  ul->checked[offset / RANGE_UPLOAD_SIZE] = 1;
+  return 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *upload_reader(void *data)
+{
+  range_upload_t *ul = (range_upload_t *) data;
+  uint64_t offset = ul->next;
+  int i = 0;
+
+  pthread_mutex_lock(&ul->lock);
+  while (offset < ul->filesize && !ul->stop && !ul->read_error) {
+    upload_buffer_t *buffer = &ul->buffers[i];
+    int ret;
+
+    while (buffer->ready && !ul->stop) {
+      pthread_cond_wait(&ul->changed, &ul->lock);
+    }
+    if (ul->stop) {
+      break;
+    }
+    pthread_mutex_unlock(&ul->lock);
+    ret = read_upload_range(ul, buffer, offset);
+    pthread_mutex_lock(&ul->lock);
+    if (ret < 0) {
+      ul->read_error = 1;
+    } else {
+      buffer->ready = 1;
+      offset += buffer->len;
+    }
+    pthread_cond_broadcast(&ul->changed);
+    i ^= 1;
+  }
+  pthread_mutex_unlock(&ul->lock);
+  return NULL;
+}
+#endif
+
+/**
+ * Starts reading the source file at an offset.
+ * @return 0 on success, -1 on failure.
+ */
+static int start_upload_reader(range_upload_t *ul, uint64_t offset)
+{
+  ul->buffers[0].ready = 0;
+  ul->buffers[1].ready = 0;
+#ifdef HAVE_PTHREAD_H
+  ul->next = offset;
+  ul->stop = 0;
+  if (pthread_create(&ul->reader, NULL, upload_reader, ul) != 0) {
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+static void stop_upload_reader(range_upload_t *ul)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&ul->lock);
+  ul->stop = 1;
+  pthread_cond_broadcast(&ul->changed);
+  pthread_mutex_unlock(&ul->lock);
+  pthread_join(ul->reader, NULL);
+#endif
+}
+
+/**
+ * Gets the next range to send.
+ * @return the buffer holding the range, or NULL if reading failed, in
+ *         which case read_error is set.
+ */
+static upload_buffer_t *get_upload_range(range_upload_t *ul, int i,
+					 uint64_t offset)
+{
+  upload_buffer_t *buffer = &ul->buffers[i];
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&ul->lock);
+  while (!buffer->ready && !ul->read_error) {
+    pthread_cond_wait(&ul->changed, &ul->lock);
+  }
+  if (!buffer->ready) {
+    buffer = NULL;
+  }
+  pthread_mutex_unlock(&ul->lock);
+#else
+  if (ul->read_error || read_upload_range(ul, buffer, offset) < 0) {
+    ul->read_error = 1;
+    buffer = NULL;
+  }
+#endif
+  return buffer;
+}
+
+/**
+ * Gives a sent range back to the reader.
+ */
+static void put_upload_range(range_upload_t *ul, upload_buffer_t *buffer)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&ul->lock);
+  buffer->ready = 0;
+  pthread_cond_broadcast(&ul->changed);
+  pthread_mutex_unlock(&ul->lock);
+#endif
+}
+
+/**
+ * Asks the device for the current size of an object, bypassing the
+ * cache which does not follow partial writes.
+ * @return 0 on success, -1 on failure.
+ */
+static int get_remote_object_size(LIBMTP_mtpdevice_t *device, uint32_t id,
+				  uint64_t *size)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObjectInfo oi;
+  PTPPropValue propval;
+
+  if (ptp_operation_issupported(params, PTP_OC_MTP_GetObjectPropValue) &&
+      ptp_mtp_getobjectpropvalue(params, id, PTP_OPC_ObjectSize, &propval,
+				 PTP_DTC_UINT64) == PTP_RC_OK) {
+    *size = propval.u64;
+    return 0;
+  }
+  memset(&oi, 0, sizeof(oi));
+  if (ptp_getobjectinfo(params, id, &oi) != PTP_RC_OK) {
+    return -1;
+  }
+  *size = oi.ObjectSize;
+  ptp_free_objectinfo(&oi);
+  // Objects of 4 GiB and more do not fit in the ObjectInfo
+  return *size == 0xFFFFFFFFU ? -1 : 0;
+}
+
+/**
+ * Checks a range on the device against the source file.
+ * @return 1 if the range matches, 0 if not, -1 on failure.
+ */
+static int verify_upload_range(LIBMTP_mtpdevice_t *device, range_upload_t *ul,
+			       uint32_t id, uint64_t offset)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint64_t chunk = offset / RANGE_UPLOAD_SIZE;
+  uint32_t len = RANGE_UPLOAD_SIZE;
+  unsigned char *remote = NULL;
+  uint32_t remotelen = 0;
+  uint32_t checksum;
+
+  if (ul->filesize - offset < len) {
+    len = ul->filesize - offset;
+  }
+  if (!ul->checked[chunk] &&
+      read_upload_range(ul, &ul->buffers[0], offset) < 0) {
+    ul->read_error = 1;
+    return -1;
+  }
+  if (ptp_android_getpartialobject64(params, id, offset, len,
+				     &remote, &remotelen) != PTP_RC_OK) {
+    free(remote);
+    return -1;
+  }
+  checksum = adler32(remote, remotelen);
+  free(remote);
+  return (remotelen == len && checksum == ul->checksums[chunk]) ? 1 : 0;
+}
+
+/**
+ * Finds where to pick up an upload: after the last range that is on the
+ * device in full and matches the source file.
+ * @return the offset to continue at.
+ */
+static uint64_t find_upload_boundary(LIBMTP_mtpdevice_t *device,
+				     range_upload_t *ul, uint32_t id)
+{
+  uint64_t remote;
+  uint64_t boundary;
+  int tries;
+
+  if (get_remote_object_size(device, id, &remote) < 0 ||
+      remote > ul->filesize) {
+    return 0;
+  }
+  if (remote == ul->filesize) {
+    boundary = remote;
+  } else {
+    boundary = remote - remote % RANGE_UPLOAD_SIZE;
+  }
+  // Step back over ranges that do not match, but not forever
+  for (tries = 0; boundary > 0 && tries < 2; tries++) {
+    uint64_t start = (boundary - 1) - (boundary - 1) % RANGE_UPLOAD_SIZE;
+    int ret = verify_upload_range(device, ul, id, start);
+
+    if (ret == 1) {
+      return boundary;
+    }
+    if (ret < 0) {
+      break;
+    }
+    boundary = start;
+  }
+  return 0;
+}
+
+/**
+ * Sends the source file from an offset on, in one edit session.
+ * @return a PTP_RC_* code. If reading the source file failed, read_error
+ *         is set as well.
+ */
+static uint16_t send_upload_ranges(LIBMTP_mtpdevice_t *device,
+				   range_upload_t *ul, uint32_t id,
+				   uint64_t offset,
+				   LIBMTP_progressfunc_t const callback,
+				   void const * const data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+  int i;
+
+  ret = ptp_android_begineditobject(params, id);
+  if (ret != PTP_RC_OK) {
+    return ret;
+  }
+  ret = ptp_android_truncate(params, id, offset);
+  if (ret != PTP_RC_OK) {
+    ptp_android_endeditobject(params, id);
+    return ret;
+  }
+  if (start_upload_reader(ul, offset) < 0) {
+    ptp_android_endeditobject(params, id);
+    return PTP_RC_GeneralError;
+  }
+  for (i = 0; offset < ul->filesize; i ^= 1) {
+    upload_buffer_t *buffer = get_upload_range(ul, i, offset);
+
+    if (buffer == NULL) {
+      ret = PTP_RC_GeneralError;
+      break;
+    }
+    ret = ptp_android_sendpartialobject(params, id, offset,
+					buffer->data, buffer->len);
+    put_upload_range(ul, buffer);
+    if (ret != PTP_RC_OK) {
+      break;
+    }
+    offset += buffer->len;
+    if (callback != NULL && callback(offset, ul->filesize, data) != 0) {
+      ret = PTP_ERROR_CANCEL;
+      break;
+    }
+  }
+  stop_upload_reader(ul);
+  if (ret == PTP_RC_OK) {
+    ret = ptp_android_endeditobject(params, id);
+  } else {
+    // Keep what was sent so far, the next attempt verifies it
+    ptp_android_endeditobject(params, id);
+  }
+  return ret;
+}
+
+/**
+ * Data getter for the empty object an upload in ranges starts with.
+ */
+static uint16_t empty_get_func(void* params, void* priv,
+			       uint32_t wantlen, unsigned char *data,
+			       uint32_t *gotlen)
+{
+  *gotlen = 0;
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+/**
+ * This function sends a generic file from a file descriptor to an MTP
+ * device in a way that survives interruptions.
+ *
+ * On devices supporting the Android edit extensions, an empty object is
+ * created first and the file is then sent in large ranges, reading and
+ * checksumming the next range while the current one is sent. If the
+ * device fails in between, the size of the object is read back, the last
+ * complete range on the device is compared against the source file, and
+ * the upload continues after the last range that matches. The partial
+ * object is kept if the upload still fails, so that it can be continued
+ * later by calling this function again with
+ * <code>filedata-&gt;item_id</code> set to its ID.
+ *
+ * On other devices this simply calls
+ * <code>LIBMTP_Send_File_From_File_Descriptor()</code>.
+ *
+ * @param device a pointer to the device to send the file to.
+ * @param fd the file descriptor for a local file which will be sent.
+ *        It has to support pread() or seeking.
+ * @param filedata a file metadata set to be written along with the file.
+ *        If <code>filedata-&gt;item_id</code> is 0 a new object is
+ *        created and its ID stored there, otherwise the upload of that
+ *        object is continued. See
+ *        <code>LIBMTP_Send_File_From_File_Descriptor()</code> for the
+ *        other fields.
+ * @param callback a progress indicator function or NULL to ignore.
+ *        It is called once for every range.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_File_From_File_Descriptor()
+ */
+int LIBMTP_Send_File_From_File_Descriptor_Resumable(LIBMTP_mtpdevice_t *device,
+						    int const fd,
+						    LIBMTP_file_t * const filedata,
+						    LIBMTP_progressfunc_t const callback,
+						    void const * const data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  range_upload_t ul;
+  uint64_t offset = 0;
+  uint64_t nrofchunks;
+  uint16_t ret;
+  int attempt;
+  int i;
+
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_BeginEditObject) ||
+      !ptp_operation_issupported(params, PTP_OC_ANDROID_TruncateObject) ||
+      !ptp_operation_issupported(params, PTP_OC_ANDROID_SendPartialObject) ||
+      !ptp_operation_issupported(params, PTP_OC_ANDROID_EndEditObject) ||
+      !ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64)) {
+    return LIBMTP_Send_File_From_File_Descriptor(device, fd, filedata,
+						 callback, data);
+  }
+
+  memset(&ul, 0, sizeof(ul));
+  ul.fd = fd;
+  ul.filesize = filedata->filesize;
+  nrofchunks = ul.filesize / RANGE_UPLOAD_SIZE + 1;
+  ul.checksums = calloc(nrofchunks, sizeof(uint32_t));
+  ul.checked = calloc(nrofchunks, 1);
+  for (i = 0; i < 2; i++) {
+    ul.buffers[i].data = malloc(RANGE_UPLOAD_SIZE);
+  }
+  if (ul.checksums == NULL || ul.checked == NULL ||
+      ul.buffers[0].data == NULL || ul.buffers[1].data == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): Could not allocate the range buffers.");
+    ret = PTP_RC_GeneralError;
+    goto out;
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&ul.lock, NULL);
+  pthread_cond_init(&ul.changed, NULL);
+#endif
+
+  if (filedata->item_id == 0) {
+    /*
+     * Create the object empty and fill it through edit sessions, the
+     * storage is picked with the real size in mind though.
+     */
+    if (filedata->storage_id == 0) {
+      filedata->storage_id = get_suggested_storage_id(device, ul.filesize,
+						      filedata->parent_id);
+    }
+    filedata->filesize = 0;
+    if (LIBMTP_Send_File_From_Handler(device, empty_get_func, NULL, filedata,
+				      NULL, NULL) != 0) {
+      filedata->filesize = ul.filesize;
+      ret = PTP_RC_GeneralError;
+      goto out_locks;
+    }
+    filedata->filesize = ul.filesize;
+  } else {
+    offset = find_upload_boundary(device, &ul, filedata->item_id);
+    if (ul.read_error) {
+      // Do not truncate what is on the device for a file we cannot read
+      ret = PTP_RC_GeneralError;
+      goto out_locks;
+    }
+    if (offset > 0) {
+      LIBMTP_INFO("resuming upload of object %u at byte %llu\n",
+		  filedata->item_id, (unsigned long long) offset);
+    }
+  }
+
+  if (callback != NULL && callback(offset, ul.filesize, data) != 0) {
+    ret = PTP_ERROR_CANCEL;
+    goto out_locks;
+  }
+  for (attempt = 0; ; attempt++) {
+    ret = send_upload_ranges(device, &ul, filedata->item_id, offset,
+			     callback, data);
+    // Transport errors are retried too, only a bad source file is final
+    if (ret == PTP_RC_OK || ret == PTP_ERROR_CANCEL || ul.read_error ||
+	attempt == RANGE_UPLOAD_RETRIES) {
+      break;
+    }
+    LIBMTP_ERROR("LIBMTP_Send_File_From_File_Descriptor_Resumable(): "
+		 "upload failed with 0x%04x, retrying\n", ret);
+    offset = find_upload_boundary(device, &ul, filedata->item_id);
+    if (ul.read_error) {
+      break;
+    }
+  }
+
+ out_locks:
+#ifdef HAVE_PTHREAD_H
+  pthread_cond_destroy(&ul.changed);
+  pthread_mutex_destroy(&ul.lock);
+#endif
+ out:
+  for (i = 0; i < 2; i++) {
+    free(ul.buffers[i].data);
+  }
+  free(ul.checksums);
+  free(ul.checked);
+
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): Cancelled transfer.");
+    return -1;
+  }
+  if (ul.read_error) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): Could not read the source file.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): Could not send object.");
+    return -1;
+  }
+  // The cached object still has the size it was created with
+  update_metadata_cache(device, filedata->item_id);
+  return 0;
+}
+
+
 
 /**
  * This routine updates an album based on the metadata
@@ -9421,8 +11959,9 @@ void ptp_nikon_getptpipguid (unsigned char* guid) {
  * Add an object to cache.
  * @param device the device which may have a cache to which the object should be added.
  * @param object_id the object to add to the cache.
+ * @return 0 on success, any other value means failure.
  */
-static void add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id)
+static int add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id)
 {
   PTPParams *params = (PTPParams *)device->params;
   uint16_t ret;
@@ -9430,7 +11969,9 @@ static void add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id)
   ret = ptp_add_object_to_cache(params, object_id);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "add_object_to_cache(): couldn't add object to cache");
+    return -1;
   }
+  return 0;
 }
 
 
@@ -9442,9 +11983,199 @@ static void add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id)
 static void update_metadata_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id)
 {
   PTPParams *params = (PTPParams *)device->params;
-
+  PTPObject *ob;
+  uint32_t storage = 0;
+  uint32_t parent = 0xffffffffU;
+
+  if (ptp_cache_wrlock(params) < 0) {
+    // This thread is reading the cache, update it once it is done
+    PTPContainer event;
+
+    memset(&event, 0, sizeof(event));
+    event.Code = PTP_EC_ObjectInfoChanged;
+    event.Nparam = 1;
+    event.Param1 = object_id;
+    queue_cache_event(device, &event);
+    return;
+  }
+  if (ptp_find_object_in_cache(params, object_id, &ob) == PTP_RC_OK) {
+    storage = ob->oi.StorageID;
+    parent = ob->oi.ParentObject;
+  }
   ptp_remove_object_from_cache(params, object_id);
-  add_object_to_cache(device, object_id);
+  if (add_object_to_cache(device, object_id) != 0)
+    mark_cache_stale(device, storage, parent);
+  ptp_cache_unlock(params);
+}
+
+/**
+ * Makes the cache forget that it has listed a folder, after a change to
+ * it could not be applied, so the folder is listed again when it is next
+ * used. A fully cached device is scanned again as a whole. Call with the
+ * cache locked for writing.
+ * @param device a pointer to the MTP device.
+ * @param storage the storage of the folder, 0 if not known.
+ * @param parent the folder, 0 for the root folder, 0xffffffff if not
+ *        known, which makes all folders stale.
+ */
+static void mark_cache_stale(LIBMTP_mtpdevice_t *device, uint32_t storage,
+			     uint32_t parent)
+{
+  PTPParams *params = (PTPParams *)device->params;
+  PTPObject *ob;
+  uint32_t i;
+
+  params->objects.complete = 0;
+  if (device->cached != CACHE_LAZY)
+    return;
+  if (parent == 0xffffffffU) {
+    for (i = 0; i < params->objects.len; i++)
+      params->objects.val[i]->flags &=
+	~(PTPOBJECT_DIRECTORY_LOADED|PTPOBJECT_SUBTREE_LOADED);
+    ptp_clear_storage_loaded(params, 0,
+			     PTPOBJECT_DIRECTORY_LOADED|PTPOBJECT_SUBTREE_LOADED);
+    return;
+  }
+  if (parent == 0) {
+    ptp_clear_storage_loaded(params, storage,
+			     PTPOBJECT_DIRECTORY_LOADED|PTPOBJECT_SUBTREE_LOADED);
+    ptp_clear_storage_loaded(params, PTP_GOH_ALL_STORAGE,
+			     PTPOBJECT_DIRECTORY_LOADED|PTPOBJECT_SUBTREE_LOADED);
+    return;
+  }
+  // The folders above no longer have all of their subtree either
+  if (ptp_find_object_in_cache(params, parent, &ob) == PTP_RC_OK)
+    ob->flags &= ~PTPOBJECT_DIRECTORY_LOADED;
+  for (i = 0; ob != NULL && i < params->objects.len; i++) {
+    ob->flags &= ~PTPOBJECT_SUBTREE_LOADED;
+    if (ob->oi.ParentObject == 0 || ob->oi.ParentObject == 0xffffffffU ||
+	ptp_find_object_in_cache(params, ob->oi.ParentObject, &ob) != PTP_RC_OK)
+      break;
+  }
+  ptp_clear_storage_loaded(params, storage, PTPOBJECT_SUBTREE_LOADED);
+  ptp_clear_storage_loaded(params, PTP_GOH_ALL_STORAGE,
+			   PTPOBJECT_SUBTREE_LOADED);
+}
+
+/**
+ * Remember an event received from the device, so that the object cache
+ * can be updated for it later. This does no I/O and takes no cache lock,
+ * so it is safe to call from a transfer callback.
+ * @param device the device the event was received from.
+ * @param ptp_event the event.
+ */
+static void queue_cache_event(LIBMTP_mtpdevice_t *device, PTPContainer *ptp_event)
+{
+  PTPParams *params = (PTPParams *)device->params;
+
+  if (!device->cached)
+    return;
+  if (ptp_queue_cache_event(params, ptp_event) != PTP_RC_OK)
+    LIBMTP_ERROR("queue_cache_event(): could not queue event 0x%04x\n",
+		 ptp_event->Code);
+}
+
+/**
+ * Apply an event received from the device to the object cache and the
+ * storage list, so that they stay valid without a complete rescan.
+ * Only the objects and the storage named in the event are read again.
+ * Call with the cache locked for writing.
+ * @param device the device the event was received from.
+ * @param ptp_event the event.
+ */
+static void update_cache_on_event(LIBMTP_mtpdevice_t *device, PTPContainer *ptp_event)
+{
+  PTPParams *params = (PTPParams *)device->params;
+  LIBMTP_devicestorage_t *storage;
+  PTPObject *ob;
+  uint32_t param1 = ptp_event->Param1;
+  uint32_t i;
+  uint64_t freespace;
+
+  switch (ptp_event->Code) {
+  case PTP_EC_ObjectAdded:
+    // Objects we created ourselves are already in the cache. Where the
+    // new object went is not known if it can not be read.
+    if (ptp_find_object_in_cache(params, param1, &ob) != PTP_RC_OK &&
+	add_object_to_cache(device, param1) != 0)
+      mark_cache_stale(device, 0, 0xffffffffU);
+    break;
+  case PTP_EC_ObjectRemoved:
+    ptp_remove_object_subtree_from_cache(params, param1);
+    break;
+  case PTP_EC_ObjectInfoChanged:
+    update_metadata_cache(device, param1);
+    break;
+  case PTP_EC_StoreAdded:
+    LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
+    if (device->cached == CACHE_LAZY) {
+      // Listed when it is first used, like the storages there already
+      params->objects.complete = 0;
+      ptp_clear_storage_loaded(params, param1,
+			       PTPOBJECT_DIRECTORY_LOADED|PTPOBJECT_SUBTREE_LOADED);
+      ptp_clear_storage_loaded(params, PTP_GOH_ALL_STORAGE,
+			       PTPOBJECT_DIRECTORY_LOADED|PTPOBJECT_SUBTREE_LOADED);
+      break;
+    }
+    for (storage = device->storage; storage != NULL; storage = storage->next) {
+      if (storage->id == param1) {
+	get_handles_recursively(device, params, param1, PTP_GOH_ROOT_PARENT);
+	break;
+      }
+    }
+    break;
+  case PTP_EC_StoreRemoved:
+    // Removing swaps the last object into the hole, so walk backwards
+    for (i = params->objects.len; i > 0; i--) {
+      if (params->objects.val[i-1]->oi.StorageID == param1)
+	ptp_remove_object_from_cache(params, params->objects.val[i-1]->oid);
+    }
+    // A storage coming back under the same ID has to be listed again
+    ptp_clear_storage_loaded(params, param1,
+			     PTPOBJECT_DIRECTORY_LOADED|PTPOBJECT_SUBTREE_LOADED);
+    if (device->cached == CACHE_LAZY)
+      params->objects.complete = 0;
+    LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
+    break;
+  case PTP_EC_StorageInfoChanged:
+    for (storage = device->storage; storage != NULL; storage = storage->next) {
+      if (storage->id == param1) {
+	get_storage_freespace(device, storage, &freespace);
+	break;
+      }
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * Apply the events queued by queue_cache_event() to the object cache,
+ * in the order they were received. This is done from ordinary API calls
+ * and never from a transfer callback, as it may run transactions. If the
+ * calling thread holds the cache for reading the events are left queued
+ * for the next caller. The strings of objects removed so far are let go
+ * of here as well, once they make up enough of the string pool.
+ * @param device the device to update the cache of.
+ */
+static void apply_cache_events(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *)device->params;
+  PTPEvents events;
+  uint32_t i;
+
+  if (!device->cached)
+    return;
+  // Hold off listings in other threads until the events are applied
+  if (ptp_cache_events_pending(params) && ptp_cache_wrlock(params) == 0) {
+    ptp_take_cache_events(params, &events);
+    for (i = 0; i < events.len; i++)
+      update_cache_on_event(device, &events.val[i]);
+    free_array(&events);
+    ptp_cache_unlock(params);
+  }
+  ptp_objects_compact_strings(params);
 }
 
 
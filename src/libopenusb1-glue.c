@@ -1715,6 +1715,24 @@ int LIBMTP_Handle_Events_Timeout_Completed(struct timeval *tv, int *completed) {
 	return -12;
 }
 
+LIBMTP_device_monitor_t *LIBMTP_Start_Device_Monitor(LIBMTP_device_change_fn callback,
+						     void *user_data) {
+	/* Unsupported */
+	LIBMTP_ERROR("LIBMTP the device monitor needs libusb 1.0\n");
+	return NULL;
+}
+
+LIBMTP_error_number_t LIBMTP_Monitor_Raw_Devices(LIBMTP_device_monitor_t *monitor,
+						 LIBMTP_raw_device_t **devices,
+						 int *numdevs) {
+	/* Unsupported */
+	return LIBMTP_ERROR_GENERAL;
+}
+
+void LIBMTP_Stop_Device_Monitor(LIBMTP_device_monitor_t *monitor) {
+	/* Unsupported */
+}
+
 uint16_t
 ptp_usb_control_cancel_request(PTPParams *params, uint32_t transactionid) {
     PTP_USB *ptp_usb = (PTP_USB *) (params->data);
@@ -84,6 +84,8 @@ struct _PTP_USB {
   PTPParams *params;
 #ifdef HAVE_LIBUSB1
   libusb_device_handle* handle;
+  /** Reusable transfer buffers, see libusb1-glue.c */
+  struct ptp_transfer_pool *transfer_pool;
 #endif
 #ifdef HAVE_LIBUSB0
   usb_dev_handle* handle;
@@ -107,8 +109,17 @@ struct _PTP_USB {
   uint64_t current_transfer_complete;
   LIBMTP_progressfunc_t current_transfer_callback;
   void const * current_transfer_callback_data;
+  /** Bulk transfers kept queued during reads and writes and their sizes */
+  int read_queue_depth;
+  int read_transfer_size;
+  int write_queue_depth;
+  int write_transfer_size;
+  /** The simulated responder of a loopback device, see loopback-glue.c */
+  struct loopback_responder *loopback;
   /** Any special device flags, only used internally */
   LIBMTP_raw_device_t rawdevice;
+  /** The flags above that the device earned by refusing a request */
+  uint32_t learned_flags;
 };
 
 void dump_usbinfo(PTP_USB *ptp_usb);
@@ -41,6 +41,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "ptp-pack.c"
 
@@ -63,6 +67,34 @@ static inline int get_timeout(PTP_USB* ptp_usb)
   return USB_TIMEOUT_DEFAULT;
 }
 
+/*
+ * Default depth and transfer size of the asynchronous bulk-in and
+ * bulk-out queues, see ptp_read_func_async() and ptp_write_func_async().
+ * They can be overridden with the LIBMTP_READ_QUEUE_DEPTH,
+ * LIBMTP_READ_TRANSFER_SIZE, LIBMTP_WRITE_QUEUE_DEPTH and
+ * LIBMTP_WRITE_TRANSFER_SIZE environment variables, and for a single
+ * device with LIBMTP_Set_Transfer_Queue(). A depth of 1 turns the
+ * queue off.
+ */
+#define USB_READ_QUEUE_DEPTH	4
+#define USB_READ_TRANSFER_SIZE	0x40000
+#define USB_WRITE_QUEUE_DEPTH	4
+#define USB_WRITE_TRANSFER_SIZE	0x40000
+static int get_env_setting(const char *name, int defvalue, int minvalue)
+{
+  const char *env = getenv(name);
+  long value;
+
+  if (env == NULL)
+    return defvalue;
+  value = strtol(env, NULL, 0);
+  if (value < minvalue || value > INT_MAX) {
+    LIBMTP_ERROR("LIBMTP ignoring invalid %s value \"%s\"\n", name, env);
+    return defvalue;
+  }
+  return value;
+}
+
 /* USB Feature selector HALT */
 #ifndef USB_FEATURE_HALT
 #define USB_FEATURE_HALT	0x00
@@ -93,8 +125,19 @@ static const LIBMTP_device_entry_t mtp_device_table[] = {
 static const int mtp_device_table_size =
   sizeof(mtp_device_table) / sizeof(LIBMTP_device_entry_t);
 
+/*
+ * Open addressing hash of the device table on vendor and product ID,
+ * holding table index + 1 with 0 for an empty slot. Keep it at least
+ * twice as large as the device table or it will not be used.
+ */
+#define DEVICE_INDEX_BITS 12
+#define DEVICE_INDEX_SIZE (1 << DEVICE_INDEX_BITS)
+static uint16_t device_index[DEVICE_INDEX_SIZE];
+static int device_index_built = 0;
+
 // Local functions
 static LIBMTP_error_number_t init_usb();
+static void build_device_index(void);
 static void close_usb(PTP_USB* ptp_usb);
 static int find_interface_and_endpoints(libusb_device *dev,
 					uint8_t *conf,
@@ -161,6 +204,7 @@ static LIBMTP_error_number_t init_usb()
   }
 
   libusb1_initialized = 1;
+  build_device_index();
 
   if ((LIBMTP_debug & LIBMTP_DEBUG_USB) != 0)
     /*libusb_set_debug(libmtp_libusb_context,9);*/
@@ -501,6 +545,84 @@ static int probe_device_descriptor(libusb_device *dev, FILE *dumpfile)
   return 0;
 }
 
+/**
+ * Hashes a vendor and product ID to a slot in the device index.
+ */
+static unsigned int device_index_slot(uint16_t vendor_id, uint16_t product_id)
+{
+  uint32_t key = ((uint32_t) vendor_id << 16) | product_id;
+
+  // Multiplicative hashing, the top bits are the well mixed ones
+  return (uint32_t) (key * 2654435761U) >> (32 - DEVICE_INDEX_BITS);
+}
+
+/**
+ * Builds the hash index of the device table, so that looking up each
+ * device on the bus does not mean walking the whole table. Where the
+ * same device is listed more than once the first entry wins, as with
+ * a walk of the table.
+ */
+static void build_device_index(void)
+{
+  unsigned int slot;
+  int i;
+
+  if (device_index_built)
+    return;
+  if (mtp_device_table_size * 2 > DEVICE_INDEX_SIZE) {
+    LIBMTP_ERROR("LIBMTP device table too large for its index, "
+		"raise DEVICE_INDEX_BITS\n");
+    return;
+  }
+  for (i = 0; i < mtp_device_table_size; i++) {
+    slot = device_index_slot(mtp_device_table[i].vendor_id,
+			     mtp_device_table[i].product_id);
+    while (device_index[slot] != 0) {
+      LIBMTP_device_entry_t const *entry =
+	&mtp_device_table[device_index[slot] - 1];
+
+      if (entry->vendor_id == mtp_device_table[i].vendor_id &&
+	  entry->product_id == mtp_device_table[i].product_id)
+	break;
+      slot = (slot + 1) & (DEVICE_INDEX_SIZE - 1);
+    }
+    if (device_index[slot] == 0)
+      device_index[slot] = i + 1;
+  }
+  device_index_built = 1;
+}
+
+/**
+ * Looks up a device in the table of devices known to the developers.
+ * @param vendor_id the USB vendor ID of the device.
+ * @param product_id the USB product ID of the device.
+ * @return the index of the device in the table, -1 if it is not there.
+ */
+static int find_device_entry(uint16_t vendor_id, uint16_t product_id)
+{
+  unsigned int slot;
+  int i;
+
+  if (device_index_built) {
+    slot = device_index_slot(vendor_id, product_id);
+    while (device_index[slot] != 0) {
+      i = device_index[slot] - 1;
+      if (vendor_id == mtp_device_table[i].vendor_id &&
+	  product_id == mtp_device_table[i].product_id)
+	return i;
+      slot = (slot + 1) & (DEVICE_INDEX_SIZE - 1);
+    }
+    return -1;
+  }
+
+  for (i = 0; i < mtp_device_table_size; i++) {
+    if (vendor_id == mtp_device_table[i].vendor_id &&
+	product_id == mtp_device_table[i].product_id)
+      return i;
+  }
+  return -1;
+}
+
 /**
  * This function scans through the connected usb devices on a machine and
  * if they match known Vendor and Product identifiers appends them to the
@@ -534,25 +656,16 @@ static LIBMTP_error_number_t get_mtp_usb_device_list(mtpdevice_list_t ** mtp_dev
       if (ret != LIBUSB_SUCCESS) continue;
 
       if (desc.bDeviceClass != LIBUSB_CLASS_HUB) {
-	int i;
-        int found = 0;
-
 	// First check if we know about the device already.
 	// Devices well known to us will not have their descriptors
 	// probed, it caused problems with some devices.
-        for(i = 0; i < mtp_device_table_size; i++) {
-          if(desc.idVendor == mtp_device_table[i].vendor_id &&
-            desc.idProduct == mtp_device_table[i].product_id) {
-            /* Append this usb device to the MTP device list */
-            *mtp_device_list = append_to_mtpdevice_list(*mtp_device_list,
-							dev,
-							libusb_get_bus_number(dev));
-            found = 1;
-            break;
-          }
-        }
-	// If we didn't know it, try probing the "OS Descriptor".
-        if (!found) {
+        if (find_device_entry(desc.idVendor, desc.idProduct) >= 0) {
+          /* Append this usb device to the MTP device list */
+          *mtp_device_list = append_to_mtpdevice_list(*mtp_device_list,
+						      dev,
+						      libusb_get_bus_number(dev));
+        } else {
+	  // If we didn't know it, try probing the "OS Descriptor".
           if (probe_device_descriptor(dev, NULL)) {
             /* Append this usb device to the MTP USB Device List */
             *mtp_device_list = append_to_mtpdevice_list(*mtp_device_list,
@@ -614,6 +727,50 @@ int LIBMTP_Check_Specific_Device(int busno, int devno)
   return 0;
 }
 
+/**
+ * Fills in a raw device from a USB device, with the vendor and
+ * product names and the device flags if the device is in the device
+ * table.
+ * @param dev the USB device.
+ * @param desc the device descriptor of dev.
+ * @param number the number of the device in the messages printed.
+ * @param rawdevice the raw device to fill in.
+ */
+static void describe_raw_device(libusb_device *dev,
+				struct libusb_device_descriptor const *desc,
+				int number,
+				LIBMTP_raw_device_t *rawdevice)
+{
+  int j;
+
+  // Assign default device info
+  rawdevice->device_entry.vendor = NULL;
+  rawdevice->device_entry.vendor_id = desc->idVendor;
+  rawdevice->device_entry.product = NULL;
+  rawdevice->device_entry.product_id = desc->idProduct;
+  rawdevice->device_entry.device_flags = 0x00000000U;
+  // See if we can locate some additional vendor info and device flags
+  j = find_device_entry(desc->idVendor, desc->idProduct);
+  if (j >= 0) {
+    rawdevice->device_entry.vendor = mtp_device_table[j].vendor;
+    rawdevice->device_entry.product = mtp_device_table[j].product;
+    rawdevice->device_entry.device_flags = mtp_device_table[j].device_flags;
+
+    // This device is known to the developers
+    LIBMTP_INFO("Device %d (VID=%04x and PID=%04x) is a %s %s.\n",
+		number,
+		desc->idVendor,
+		desc->idProduct,
+		mtp_device_table[j].vendor,
+		mtp_device_table[j].product);
+  } else {
+    device_unknown(number, desc->idVendor, desc->idProduct);
+  }
+  // Save the location on the bus
+  rawdevice->bus_location = libusb_get_bus_number (dev);
+  rawdevice->devnum = libusb_get_device_address (dev);
+}
+
 /**
  * Detect the raw MTP device descriptors and return a list of
  * of the devices found.
@@ -637,7 +794,7 @@ LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t ** devices,
   LIBMTP_error_number_t ret;
   LIBMTP_raw_device_t *retdevs;
   int devs = 0;
-  int i, j;
+  int i;
 
   ret = get_mtp_usb_device_list(&devlist);
   if (ret == LIBMTP_ERROR_NO_DEVICE_ATTACHED) {
@@ -672,41 +829,10 @@ LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t ** devices,
   dev = devlist;
   i = 0;
   while (dev != NULL) {
-    int device_known = 0;
     struct libusb_device_descriptor desc;
 
     libusb_get_device_descriptor (dev->device, &desc);
-    // Assign default device info
-    retdevs[i].device_entry.vendor = NULL;
-    retdevs[i].device_entry.vendor_id = desc.idVendor;
-    retdevs[i].device_entry.product = NULL;
-    retdevs[i].device_entry.product_id = desc.idProduct;
-    retdevs[i].device_entry.device_flags = 0x00000000U;
-    // See if we can locate some additional vendor info and device flags
-    for(j = 0; j < mtp_device_table_size; j++) {
-      if(desc.idVendor == mtp_device_table[j].vendor_id &&
-	 desc.idProduct == mtp_device_table[j].product_id) {
-	device_known = 1;
-	retdevs[i].device_entry.vendor = mtp_device_table[j].vendor;
-	retdevs[i].device_entry.product = mtp_device_table[j].product;
-	retdevs[i].device_entry.device_flags = mtp_device_table[j].device_flags;
-
-	// This device is known to the developers
-	LIBMTP_INFO("Device %d (VID=%04x and PID=%04x) is a %s %s.\n",
-		i,
-		desc.idVendor,
-		desc.idProduct,
-		mtp_device_table[j].vendor,
-		mtp_device_table[j].product);
-	break;
-      }
-    }
-    if (!device_known) {
-      device_unknown(i, desc.idVendor, desc.idProduct);
-    }
-    // Save the location on the bus
-    retdevs[i].bus_location = libusb_get_bus_number (dev->device);
-    retdevs[i].devnum = libusb_get_device_address (dev->device);
+    describe_raw_device(dev->device, &desc, i, &retdevs[i]);
     i++;
     dev = dev->next;
   }
@@ -716,6 +842,404 @@ LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t ** devices,
   return LIBMTP_ERROR_NONE;
 }
 
+/**
+ * A USB device the device monitor has seen. MTP devices are reported,
+ * the others are remembered until they are unplugged so that they are
+ * not probed again.
+ */
+typedef struct monitored_device_struct monitored_device_t;
+struct monitored_device_struct {
+  libusb_device *device; /**< Referenced as long as it is monitored */
+  uint8_t bus; /**< Bus number */
+  uint8_t ports[7]; /**< Port numbers on the way from the root hub */
+  int numports; /**< Number of port numbers */
+  uint16_t vendor_id; /**< USB vendor ID */
+  uint16_t product_id; /**< USB product ID */
+  int is_mtp; /**< Whether this is an MTP device */
+  LIBMTP_raw_device_t rawdevice; /**< The raw device of an MTP device */
+  monitored_device_t *next; /**< Next device seen */
+};
+
+/**
+ * A device arriving or leaving, queued until the monitor gets to it.
+ */
+typedef struct monitor_event_struct monitor_event_t;
+struct monitor_event_struct {
+  libusb_device *device; /**< Referenced while queued */
+  int arrived; /**< 1 if the device arrived, 0 if it left */
+  monitor_event_t *next; /**< Next event */
+};
+
+/**
+ * The device monitor.
+ */
+struct LIBMTP_device_monitor_struct {
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock; /**< Serializes LIBMTP_Monitor_Raw_Devices() */
+  pthread_mutex_t events_lock; /**< Protects the event queue */
+#endif
+  int has_hotplug; /**< Whether libusb reports changes, else we poll */
+  libusb_hotplug_callback_handle hotplug; /**< The registered callback */
+  monitor_event_t *events; /**< Changes not looked at yet, oldest first */
+  monitor_event_t *last_event; /**< Last queued change */
+  monitored_device_t *devices; /**< Devices attached */
+  int numdevices; /**< Number of MTP devices among them */
+  int next_number; /**< Number of the next device in the messages */
+  LIBMTP_device_change_fn callback; /**< Called for MTP devices coming and going */
+  void *user_data; /**< Passed to the callback */
+};
+
+/**
+ * Queues a device arriving or leaving.
+ */
+static void monitor_queue_event(LIBMTP_device_monitor_t *monitor,
+				libusb_device *dev, int arrived)
+{
+  monitor_event_t *event;
+
+  event = (monitor_event_t *) malloc(sizeof(monitor_event_t));
+  if (event == NULL) {
+    LIBMTP_ERROR("LIBMTP PANIC: out of memory, lost a device change\n");
+    return;
+  }
+  event->device = libusb_ref_device(dev);
+  event->arrived = arrived;
+  event->next = NULL;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&monitor->events_lock);
+#endif
+  if (monitor->last_event != NULL)
+    monitor->last_event->next = event;
+  else
+    monitor->events = event;
+  monitor->last_event = event;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&monitor->events_lock);
+#endif
+}
+
+/**
+ * Hotplug callback, called by libusb from whatever thread handles its
+ * events. Opening devices is not safe in here, so the change is only
+ * queued.
+ */
+static int LIBUSB_CALL monitor_hotplug_cb(libusb_context *ctx,
+					  libusb_device *dev,
+					  libusb_hotplug_event event,
+					  void *user_data)
+{
+  monitor_queue_event((LIBMTP_device_monitor_t *) user_data, dev,
+		      event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+  return 0;
+}
+
+/**
+ * Queues the changes since the last call by comparing the device
+ * list against the devices seen, for when libusb has no hotplug
+ * support on this platform.
+ */
+static void monitor_poll(LIBMTP_device_monitor_t *monitor)
+{
+  libusb_device **devs = NULL;
+  monitored_device_t *seen;
+  ssize_t nrofdevs;
+  ssize_t i;
+
+  nrofdevs = libusb_get_device_list(libmtp_libusb_context, &devs);
+  if (nrofdevs < 0)
+    return;
+  for (seen = monitor->devices; seen != NULL; seen = seen->next) {
+    for (i = 0; i < nrofdevs; i++) {
+      if (devs[i] == seen->device)
+	break;
+    }
+    if (i == nrofdevs)
+      monitor_queue_event(monitor, seen->device, 0);
+  }
+  for (i = 0; i < nrofdevs; i++) {
+    for (seen = monitor->devices; seen != NULL; seen = seen->next) {
+      if (seen->device == devs[i])
+	break;
+    }
+    if (seen == NULL)
+      monitor_queue_event(monitor, devs[i], 1);
+  }
+  libusb_free_device_list(devs, 1);
+}
+
+/**
+ * Starts monitoring a device that arrived. It is probed unless it is
+ * in the device table, or it is a device that was found not to be an
+ * MTP device before and has not been unplugged since.
+ */
+static void monitor_attach(LIBMTP_device_monitor_t *monitor,
+			   libusb_device *dev)
+{
+  struct libusb_device_descriptor desc;
+  monitored_device_t *seen;
+  monitored_device_t *newdev;
+  int numports;
+
+  for (seen = monitor->devices; seen != NULL; seen = seen->next) {
+    if (seen->device == dev)
+      return;
+  }
+  if (libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS ||
+      desc.bDeviceClass == LIBUSB_CLASS_HUB)
+    return;
+
+  newdev = (monitored_device_t *) malloc(sizeof(monitored_device_t));
+  if (newdev == NULL) {
+    LIBMTP_ERROR("LIBMTP PANIC: out of memory, ignoring a device\n");
+    return;
+  }
+  memset(newdev, 0, sizeof(monitored_device_t));
+  newdev->bus = libusb_get_bus_number(dev);
+  numports = libusb_get_port_numbers(dev, newdev->ports,
+				     sizeof(newdev->ports));
+  newdev->numports = numports > 0 ? numports : 0;
+  newdev->vendor_id = desc.idVendor;
+  newdev->product_id = desc.idProduct;
+
+  // Known not to be MTP if the same device sits on the same port, the
+  // departure of the old one was missed
+  for (seen = monitor->devices; seen != NULL; seen = seen->next) {
+    if (!seen->is_mtp &&
+	seen->bus == newdev->bus &&
+	seen->numports == newdev->numports &&
+	!memcmp(seen->ports, newdev->ports, newdev->numports) &&
+	seen->vendor_id == newdev->vendor_id &&
+	seen->product_id == newdev->product_id) {
+      libusb_unref_device(seen->device);
+      seen->device = libusb_ref_device(dev);
+      free(newdev);
+      return;
+    }
+  }
+
+  newdev->device = libusb_ref_device(dev);
+  // Devices well known to us are not probed, as in
+  // get_mtp_usb_device_list()
+  newdev->is_mtp = find_device_entry(desc.idVendor, desc.idProduct) >= 0 ||
+    probe_device_descriptor(dev, NULL);
+  newdev->next = monitor->devices;
+  monitor->devices = newdev;
+  if (!newdev->is_mtp)
+    return;
+
+  describe_raw_device(dev, &desc, monitor->next_number++, &newdev->rawdevice);
+  monitor->numdevices++;
+  if (monitor->callback != NULL)
+    monitor->callback(&newdev->rawdevice, 1, monitor->user_data);
+}
+
+/**
+ * Stops monitoring a device that left.
+ */
+static void monitor_detach(LIBMTP_device_monitor_t *monitor,
+			   libusb_device *dev)
+{
+  monitored_device_t **prev;
+  monitored_device_t *seen;
+
+  for (prev = &monitor->devices; *prev != NULL; prev = &(*prev)->next) {
+    if ((*prev)->device == dev)
+      break;
+  }
+  seen = *prev;
+  if (seen == NULL)
+    return;
+  *prev = seen->next;
+  if (seen->is_mtp) {
+    monitor->numdevices--;
+    if (monitor->callback != NULL)
+      monitor->callback(&seen->rawdevice, 0, monitor->user_data);
+  }
+  libusb_unref_device(seen->device);
+  free(seen);
+}
+
+/**
+ * This starts watching the USB buses for MTP devices coming and going,
+ * an alternative to calling LIBMTP_Detect_Raw_Devices() over and over.
+ * Where libusb supports hotplug notifications only the devices that
+ * changed are looked at, elsewhere the device list is compared against
+ * the devices seen before. Either way each device is probed for an MTP
+ * descriptor only once while it is plugged in. Devices that turned out
+ * not to be MTP devices are not opened again until they are unplugged.
+ *
+ * Changes are picked up by LIBMTP_Monitor_Raw_Devices(), which is also
+ * where the callback is called from.
+ *
+ * @param callback a function to be called for each MTP device plugged
+ *        in or unplugged, or NULL.
+ * @param user_data a user-defined pointer that is passed along to
+ *        the callback.
+ * @return a new device monitor or NULL on failure. Release it with
+ *         LIBMTP_Stop_Device_Monitor().
+ * @see LIBMTP_Monitor_Raw_Devices()
+ */
+LIBMTP_device_monitor_t *LIBMTP_Start_Device_Monitor(LIBMTP_device_change_fn callback,
+						     void *user_data)
+{
+  LIBMTP_device_monitor_t *monitor;
+  int ret;
+
+  if (init_usb() != LIBMTP_ERROR_NONE)
+    return NULL;
+  monitor = (LIBMTP_device_monitor_t *) malloc(sizeof(LIBMTP_device_monitor_t));
+  if (monitor == NULL)
+    return NULL;
+  memset(monitor, 0, sizeof(LIBMTP_device_monitor_t));
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&monitor->lock, NULL);
+  pthread_mutex_init(&monitor->events_lock, NULL);
+#endif
+  monitor->callback = callback;
+  monitor->user_data = user_data;
+
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    // The devices already plugged in are reported right away
+    ret = libusb_hotplug_register_callback(libmtp_libusb_context,
+					   LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+					   LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					   LIBUSB_HOTPLUG_ENUMERATE,
+					   LIBUSB_HOTPLUG_MATCH_ANY,
+					   LIBUSB_HOTPLUG_MATCH_ANY,
+					   LIBUSB_HOTPLUG_MATCH_ANY,
+					   monitor_hotplug_cb, monitor,
+					   &monitor->hotplug);
+    if (ret == LIBUSB_SUCCESS)
+      monitor->has_hotplug = 1;
+    else
+      LIBMTP_INFO("LIBMTP no hotplug notifications (%d), polling the device list\n", ret);
+  }
+  return monitor;
+}
+
+/**
+ * This picks up the MTP devices plugged in and unplugged since the last
+ * call, calling the callback of the monitor for each, and returns the
+ * MTP devices currently attached. Unlike LIBMTP_Detect_Raw_Devices()
+ * this does not open any device that was looked at before, so it is
+ * cheap enough to be called often.
+ *
+ * The callback must not call back into the monitor.
+ *
+ * @param monitor the device monitor.
+ * @param devices a pointer to a variable that will hold the list of
+ *        raw devices attached, or NULL if only the callback is wanted.
+ *        The list may be NULL on return if there are no devices. The
+ *        user shall simply <code>free()</code> this variable when
+ *        finished with the raw devices, in order to release memory.
+ * @param numdevs a pointer to an integer that will hold the number
+ *        of devices in the list, or NULL.
+ * @return 0 if successful, any other value means failure.
+ * @see LIBMTP_Start_Device_Monitor()
+ */
+LIBMTP_error_number_t LIBMTP_Monitor_Raw_Devices(LIBMTP_device_monitor_t *monitor,
+						 LIBMTP_raw_device_t **devices,
+						 int *numdevs)
+{
+  struct timeval zero = { 0, 0 };
+  LIBMTP_raw_device_t *retdevs = NULL;
+  monitored_device_t *seen;
+  monitor_event_t *events;
+  int i = 0;
+
+  // Let libusb run the hotplug callback for whatever happened meanwhile
+  if (monitor->has_hotplug)
+    libusb_handle_events_timeout_completed(libmtp_libusb_context, &zero, NULL);
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&monitor->lock);
+#endif
+  if (!monitor->has_hotplug)
+    monitor_poll(monitor);
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&monitor->events_lock);
+#endif
+  events = monitor->events;
+  monitor->events = NULL;
+  monitor->last_event = NULL;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&monitor->events_lock);
+#endif
+  while (events != NULL) {
+    monitor_event_t *event = events;
+
+    if (event->arrived)
+      monitor_attach(monitor, event->device);
+    else
+      monitor_detach(monitor, event->device);
+    libusb_unref_device(event->device);
+    events = event->next;
+    free(event);
+  }
+
+  if (devices != NULL && monitor->numdevices > 0) {
+    retdevs = (LIBMTP_raw_device_t *) malloc(sizeof(LIBMTP_raw_device_t) *
+					     monitor->numdevices);
+    if (retdevs == NULL) {
+#ifdef HAVE_PTHREAD_H
+      pthread_mutex_unlock(&monitor->lock);
+#endif
+      *devices = NULL;
+      if (numdevs != NULL)
+	*numdevs = 0;
+      return LIBMTP_ERROR_MEMORY_ALLOCATION;
+    }
+    // The list is kept newest first, report in the order of arrival
+    i = monitor->numdevices;
+    for (seen = monitor->devices; seen != NULL; seen = seen->next) {
+      if (seen->is_mtp)
+	retdevs[--i] = seen->rawdevice;
+    }
+  }
+  i = monitor->numdevices;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&monitor->lock);
+#endif
+  if (devices != NULL)
+    *devices = retdevs;
+  if (numdevs != NULL)
+    *numdevs = i;
+  return LIBMTP_ERROR_NONE;
+}
+
+/**
+ * This stops a device monitor and releases it. No callbacks are made
+ * for the devices still attached.
+ * @param monitor the device monitor to stop.
+ */
+void LIBMTP_Stop_Device_Monitor(LIBMTP_device_monitor_t *monitor)
+{
+  monitor_event_t *event;
+  monitored_device_t *seen;
+
+  if (monitor == NULL)
+    return;
+  if (monitor->has_hotplug)
+    libusb_hotplug_deregister_callback(libmtp_libusb_context, monitor->hotplug);
+  while (monitor->events != NULL) {
+    event = monitor->events;
+    monitor->events = event->next;
+    libusb_unref_device(event->device);
+    free(event);
+  }
+  while (monitor->devices != NULL) {
+    seen = monitor->devices;
+    monitor->devices = seen->next;
+    libusb_unref_device(seen->device);
+    free(seen);
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_destroy(&monitor->events_lock);
+  pthread_mutex_destroy(&monitor->lock);
+#endif
+  free(monitor);
+}
+
 /**
  * This routine just dumps out low-level
  * USB information about the current device.
@@ -809,6 +1333,187 @@ libusb_glue_error (PTPParams *params, const char *format, ...)
 }
 
 
+/*
+ * Per-device pool of transfer buffers.
+ *
+ * Every bulk transfer used to allocate and free its own bounce buffer,
+ * which for property heavy workloads meant allocator traffic on each of
+ * tens of thousands of transactions. The buffers and the queued
+ * transfers of the asynchronous paths are instead allocated the first
+ * time they are needed and kept until the device is closed. Buffers are
+ * page aligned and rounded up to whole pages, which also makes them a
+ * multiple of any bulk endpoint packet size. Where libusb and the
+ * kernel support it the memory comes from libusb_dev_mem_alloc(), so
+ * transfers need no copy in the kernel.
+ */
+#define TRANSFER_BUFFER_ALIGN 4096
+
+struct ptp_transfer_buffer {
+  unsigned char *data;
+  size_t size;
+  int devmem;
+};
+
+struct ptp_transfer_slot {
+  struct libusb_transfer *transfer;
+  struct ptp_transfer_buffer buffer;
+  int done;
+};
+
+struct ptp_transfer_pool {
+  struct ptp_transfer_buffer read_buffer;
+  struct ptp_transfer_buffer write_buffer;
+  struct ptp_transfer_slot *read_slots;
+  int nread_slots;
+  struct ptp_transfer_slot *write_slots;
+  int nwrite_slots;
+};
+
+static void
+ptp_transfer_async_cb (struct libusb_transfer *t)
+{
+  *(int *) t->user_data = 1;
+}
+
+static int alloc_transfer_buffer(PTP_USB *ptp_usb,
+				 struct ptp_transfer_buffer *buffer,
+				 size_t size)
+{
+  size = (size + TRANSFER_BUFFER_ALIGN - 1) & ~(size_t) (TRANSFER_BUFFER_ALIGN - 1);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  buffer->data = libusb_dev_mem_alloc(ptp_usb->handle, size);
+  if (buffer->data != NULL) {
+    buffer->size = size;
+    buffer->devmem = 1;
+    return 0;
+  }
+#endif
+#ifdef HAVE_POSIX_MEMALIGN
+  if (posix_memalign((void **) &buffer->data, TRANSFER_BUFFER_ALIGN, size) != 0)
+    buffer->data = NULL;
+#else
+  buffer->data = malloc(size);
+#endif
+  if (buffer->data == NULL)
+    return -1;
+  buffer->size = size;
+  buffer->devmem = 0;
+  return 0;
+}
+
+static void free_transfer_buffer(PTP_USB *ptp_usb,
+				 struct ptp_transfer_buffer *buffer)
+{
+  if (buffer->data == NULL)
+    return;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  if (buffer->devmem)
+    libusb_dev_mem_free(ptp_usb->handle, buffer->data, buffer->size);
+  else
+#endif
+    free(buffer->data);
+  buffer->data = NULL;
+  buffer->size = 0;
+}
+
+static struct ptp_transfer_pool *get_transfer_pool(PTP_USB *ptp_usb)
+{
+  if (ptp_usb->transfer_pool == NULL)
+    ptp_usb->transfer_pool = calloc(1, sizeof(struct ptp_transfer_pool));
+  return ptp_usb->transfer_pool;
+}
+
+/**
+ * Get the bounce buffer used by synchronous reads or writes,
+ * at least CONTEXT_BLOCK_SIZE bytes large.
+ */
+static unsigned char *get_transfer_buffer(PTP_USB *ptp_usb, int write,
+					  size_t size)
+{
+  struct ptp_transfer_pool *pool = get_transfer_pool(ptp_usb);
+  struct ptp_transfer_buffer *buffer;
+
+  if (pool == NULL)
+    return NULL;
+  buffer = write ? &pool->write_buffer : &pool->read_buffer;
+  if (buffer->size < size) {
+    free_transfer_buffer(ptp_usb, buffer);
+    if (alloc_transfer_buffer(ptp_usb, buffer, size) != 0)
+      return NULL;
+  }
+  return buffer->data;
+}
+
+static void free_transfer_slots(PTP_USB *ptp_usb,
+				struct ptp_transfer_slot *slots, int nslots)
+{
+  int i;
+
+  if (slots == NULL)
+    return;
+  for (i = 0; i < nslots; i++) {
+    if (slots[i].transfer != NULL)
+      libusb_free_transfer(slots[i].transfer);
+    free_transfer_buffer(ptp_usb, &slots[i].buffer);
+  }
+  free(slots);
+}
+
+/**
+ * Get the queue of transfers used by asynchronous reads or writes,
+ * each with a buffer of at least size bytes.
+ */
+static struct ptp_transfer_slot *get_transfer_slots(PTP_USB *ptp_usb,
+						    int write, int nslots,
+						    size_t size)
+{
+  struct ptp_transfer_pool *pool = get_transfer_pool(ptp_usb);
+  struct ptp_transfer_slot **slots;
+  int *count;
+  int i;
+
+  if (pool == NULL)
+    return NULL;
+  slots = write ? &pool->write_slots : &pool->read_slots;
+  count = write ? &pool->nwrite_slots : &pool->nread_slots;
+  if (*slots != NULL && *count == nslots && (*slots)[0].buffer.size >= size)
+    return *slots;
+
+  free_transfer_slots(ptp_usb, *slots, *count);
+  *count = 0;
+  *slots = calloc(nslots, sizeof(struct ptp_transfer_slot));
+  if (*slots == NULL)
+    return NULL;
+  *count = nslots;
+  for (i = 0; i < nslots; i++) {
+    struct ptp_transfer_slot *slot = &(*slots)[i];
+
+    slot->transfer = libusb_alloc_transfer(0);
+    if (slot->transfer == NULL ||
+	alloc_transfer_buffer(ptp_usb, &slot->buffer, size) != 0) {
+      free_transfer_slots(ptp_usb, *slots, *count);
+      *slots = NULL;
+      *count = 0;
+      return NULL;
+    }
+  }
+  return *slots;
+}
+
+static void free_transfer_pool(PTP_USB *ptp_usb)
+{
+  struct ptp_transfer_pool *pool = ptp_usb->transfer_pool;
+
+  if (pool == NULL)
+    return;
+  free_transfer_buffer(ptp_usb, &pool->read_buffer);
+  free_transfer_buffer(ptp_usb, &pool->write_buffer);
+  free_transfer_slots(ptp_usb, pool->read_slots, pool->nread_slots);
+  free_transfer_slots(ptp_usb, pool->write_slots, pool->nwrite_slots);
+  free(pool);
+  ptp_usb->transfer_pool = NULL;
+}
+
 /*
  * ptp_read_func() and ptp_write_func() are
  * based on same functions usb.c in libgphoto2.
@@ -848,8 +1553,8 @@ ptp_read_func (
   unsigned char *bytes;
   int expect_terminator_byte = 0;
   unsigned long usb_inep_maxpacket_size;
-  unsigned long context_block_size_1;
-  unsigned long context_block_size_2;
+  unsigned long context_block_size_1 = CONTEXT_BLOCK_SIZE_1;
+  unsigned long context_block_size_2 = CONTEXT_BLOCK_SIZE_2;
   uint16_t ptp_dev_vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
 
   //"iRiver" device special handling
@@ -865,7 +1570,10 @@ ptp_read_func (
 	  }
   }
   // This is the largest block we'll need to read in.
-  bytes = malloc(CONTEXT_BLOCK_SIZE);
+  bytes = get_transfer_buffer(ptp_usb, 0, CONTEXT_BLOCK_SIZE);
+  if (!bytes) {
+    return PTP_ERROR_IO;
+  }
   while (curread < size) {
     LIBMTP_USB_DEBUG("Remaining size to read: 0x%04lx bytes\n", size - curread);
 
@@ -932,7 +1640,6 @@ ptp_read_func (
         if (handler_ret != PTP_RC_OK) {
             LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler."
                          "Not enough memory or temp/destination free space?");
-            free (bytes);
             return PTP_ERROR_CANCEL;
         }
     }
@@ -954,7 +1661,6 @@ ptp_read_func (
                                                  ptp_usb->current_transfer_callback_data);
         if (ret != 0) {
           LIBMTP_USB_DEBUG("ptp_read_func cancelled by user callback\n");
-          free (bytes);
           return PTP_ERROR_CANCEL;
         }
       }
@@ -966,7 +1672,208 @@ ptp_read_func (
 
   if (readbytes)
     *readbytes = curread;
-  free (bytes);
+
+  // there might be a zero packet waiting for us...
+  if (readzero &&
+    !FLAG_NO_ZERO_READS(ptp_usb) &&
+    curread % ptp_usb->inep_maxpacket == 0) {
+    unsigned char temp;
+    int zeroresult = 0, xread;
+
+    LIBMTP_USB_DEBUG("<==USB IN\n");
+    LIBMTP_USB_DEBUG("Zero Read\n");
+
+    zeroresult = USB_BULK_READ(ptp_usb->handle,
+                               ptp_usb->inep,
+                               &temp,
+                               0,
+                               &xread,
+                               ptp_usb->timeout);
+    if (zeroresult != LIBUSB_SUCCESS)
+      LIBMTP_INFO("LIBMTP panic: unable to read in zero packet, response 0x%04x", zeroresult);
+  }
+
+  return PTP_RC_OK;
+}
+
+/*
+ * Asynchronous variant of ptp_read_func() for reads of a known size.
+ *
+ * Instead of one synchronous bulk read at a time, up to
+ * ptp_usb->read_queue_depth transfers of ptp_usb->read_transfer_size
+ * bytes are kept submitted, so the device can keep sending while the
+ * previous block is handed to the data handler. Completed transfers
+ * are processed strictly in submission order. No transfer ever asks for
+ * more than the remaining data (plus the terminator byte on devices
+ * that cannot do zero reads), so the response container following the
+ * data phase is never picked up by a queued transfer.
+ */
+static int
+use_async_read(PTP_USB *ptp_usb, unsigned long size)
+{
+  uint16_t vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
+
+  // iRiver devices need the alternating block sizes of ptp_read_func()
+  if (vendor_id == 0x4102 || vendor_id == 0x1006)
+    return 0;
+  return ptp_usb->read_queue_depth > 1 &&
+    ptp_usb->inep_maxpacket > 0 &&
+    size > (unsigned long) ptp_usb->read_transfer_size;
+}
+
+static short
+ptp_read_func_async (
+	unsigned long size, PTPDataHandler *handler,void *data,
+	unsigned long *readbytes,
+	int readzero
+) {
+  PTP_USB *ptp_usb = (PTP_USB *)data;
+  struct ptp_transfer_slot *slots;
+  unsigned long blocksize;
+  unsigned long submitted = 0;
+  unsigned long curread = 0;
+  int nslots = ptp_usb->read_queue_depth;
+  int inflight = 0;
+  int head = 0;
+  int i;
+  short ret = PTP_RC_OK;
+
+  // Every block but the last must end on a packet boundary
+  blocksize = ptp_usb->read_transfer_size -
+    (ptp_usb->read_transfer_size % ptp_usb->inep_maxpacket);
+  if (blocksize == 0)
+    blocksize = ptp_usb->inep_maxpacket;
+
+  // One extra byte for a terminator byte on the last block
+  slots = get_transfer_slots(ptp_usb, 0, nslots, blocksize + 1);
+  if (slots == NULL)
+    return PTP_ERROR_IO;
+  for (i = 0; i < nslots; i++) {
+    libusb_fill_bulk_transfer(slots[i].transfer, ptp_usb->handle,
+			      ptp_usb->inep, slots[i].buffer.data, 0,
+			      ptp_transfer_async_cb, &slots[i].done,
+			      ptp_usb->timeout);
+  }
+
+  while (curread < size) {
+    struct libusb_transfer *t;
+    unsigned long toread;
+    unsigned long xread;
+
+    // Keep the queue full
+    while (inflight < nslots && submitted < size) {
+      struct ptp_transfer_slot *slot = &slots[(head + inflight) % nslots];
+
+      toread = size - submitted;
+      if (toread > blocksize)
+	toread = blocksize;
+      else if (readzero && FLAG_NO_ZERO_READS(ptp_usb) &&
+	       (toread % ptp_usb->inep_maxpacket) == 0)
+	toread += 1;
+      slot->transfer->length = toread;
+      slot->done = 0;
+      LIBMTP_USB_DEBUG("Queueing read of 0x%04lx bytes\n", toread);
+      if (libusb_submit_transfer(slot->transfer) != LIBUSB_SUCCESS) {
+	ret = PTP_ERROR_IO;
+	goto out;
+      }
+      submitted += blocksize < size - submitted ? blocksize : size - submitted;
+      inflight++;
+    }
+
+    while (!slots[head].done) {
+      if (libusb_handle_events_completed(libmtp_libusb_context,
+					 &slots[head].done) != LIBUSB_SUCCESS &&
+	  !slots[head].done) {
+	ret = PTP_ERROR_IO;
+	goto out;
+      }
+    }
+    t = slots[head].transfer;
+    head = (head + 1) % nslots;
+    inflight--;
+
+    LIBMTP_USB_DEBUG("Result of read: 0x%04x (%d bytes)\n", t->status,
+		     t->actual_length);
+    if (t->status == LIBUSB_TRANSFER_TIMED_OUT) {
+      ret = PTP_ERROR_TIMEOUT;
+      goto out;
+    } else if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+      ret = PTP_ERROR_IO;
+      goto out;
+    }
+
+    LIBMTP_USB_DEBUG("<==USB IN\n");
+    if (t->actual_length == 0)
+      LIBMTP_USB_DEBUG("Zero Read\n");
+    else
+      LIBMTP_USB_DATA(t->buffer, t->actual_length, 16);
+
+    // Drops the terminator byte, if any
+    xread = t->actual_length;
+    if (xread > size - curread) {
+      LIBMTP_USB_DEBUG("<==USB IN\nDiscarding extra byte\n");
+      xread = size - curread;
+    }
+
+    if (handler) {
+      if (handler->putfunc(NULL, handler->priv, xread, t->buffer) != PTP_RC_OK) {
+	LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler."
+		     "Not enough memory or temp/destination free space?");
+	ret = PTP_ERROR_CANCEL;
+	goto out;
+      }
+    }
+
+    if (ptp_usb->callback_active)
+      ptp_usb->current_transfer_complete += xread;
+    curread += xread;
+
+    // Increase counters, call callback
+    if (ptp_usb->callback_active) {
+      if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
+	// send last update and disable callback.
+	ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
+	ptp_usb->callback_active = 0;
+      }
+      if (ptp_usb->current_transfer_callback != NULL) {
+	if (ptp_usb->current_transfer_callback(ptp_usb->current_transfer_complete,
+					       ptp_usb->current_transfer_total,
+					       ptp_usb->current_transfer_callback_data) != 0) {
+	  LIBMTP_USB_DEBUG("ptp_read_func_async cancelled by user callback\n");
+	  ret = PTP_ERROR_CANCEL;
+	  goto out;
+	}
+      }
+    }
+
+    if (t->actual_length < t->length) {
+      /* short reads are common */
+      if (inflight)
+	LIBMTP_INFO("short read of 0x%04x bytes with 0x%04lx bytes left\n",
+		    t->actual_length, size - curread);
+      break;
+    }
+  }
+
+  if (readbytes)
+    *readbytes = curread;
+
+ out:
+  // Reap whatever is still queued, the slots are reused next time
+  for (i = 0; i < inflight; i++)
+    libusb_cancel_transfer(slots[(head + i) % nslots].transfer);
+  for (i = 0; i < inflight; i++) {
+    struct ptp_transfer_slot *slot = &slots[(head + i) % nslots];
+
+    while (!slot->done) {
+      if (libusb_handle_events_completed(libmtp_libusb_context,
+					 &slot->done) != LIBUSB_SUCCESS)
+	break;
+    }
+  }
+  if (ret != PTP_RC_OK)
+    return ret;
 
   // there might be a zero packet waiting for us...
   if (readzero &&
@@ -1068,7 +1975,7 @@ ptp_write_func (
   unsigned char *bytes;
 
   // This is the largest block we'll need to read in.
-  bytes = malloc(CONTEXT_BLOCK_SIZE);
+  bytes = get_transfer_buffer(ptp_usb, 1, CONTEXT_BLOCK_SIZE);
   if (!bytes) {
     return PTP_ERROR_IO;
   }
@@ -1087,7 +1994,6 @@ ptp_write_func (
     }
     int getfunc_ret = handler->getfunc(NULL, handler->priv,towrite,bytes,&towrite);
     if (getfunc_ret != PTP_RC_OK) {
-      free(bytes);
       return getfunc_ret;
     }
     while (usbwritten < towrite) {
@@ -1101,7 +2007,6 @@ ptp_write_func (
 	    LIBMTP_USB_DEBUG("USB OUT==>\n");
 
 	    if (ret != LIBUSB_SUCCESS) {
-              free(bytes);
 	      return PTP_ERROR_IO;
 	    }
 	    LIBMTP_USB_DATA(bytes+usbwritten, xwritten, 16);
@@ -1124,7 +2029,6 @@ ptp_write_func (
 						 ptp_usb->current_transfer_total,
 						 ptp_usb->current_transfer_callback_data);
 	if (ret != 0) {
-          free(bytes);
 	  return PTP_ERROR_CANCEL;
 	}
       }
@@ -1132,7 +2036,6 @@ ptp_write_func (
     if (xwritten < towrite) /* short writes happen */
       break;
   }
-  free (bytes);
   if (written) {
     *written = curwrite;
   }
@@ -1159,10 +2062,188 @@ ptp_write_func (
   return PTP_RC_OK;
 }
 
+/*
+ * Asynchronous variant of ptp_write_func() for object uploads.
+ *
+ * A ring of ptp_usb->write_queue_depth buffers of
+ * ptp_usb->write_transfer_size bytes is used: while the transfers
+ * already submitted drain to the device, the data handler fills the
+ * next free buffer, so reading the source and writing to the bus
+ * overlap. Blocks are cut exactly like ptp_write_func() does, so the
+ * packets on the wire are the same.
+ */
+static int
+use_async_write(PTP_USB *ptp_usb, unsigned long size)
+{
+  return ptp_usb->write_queue_depth > 1 &&
+    ptp_usb->outep_maxpacket > 0 &&
+    size > (unsigned long) ptp_usb->write_transfer_size;
+}
+
+static short
+ptp_write_func_async (
+        unsigned long   size,
+        PTPDataHandler  *handler,
+        void            *data,
+        unsigned long   *written
+) {
+  PTP_USB *ptp_usb = (PTP_USB *)data;
+  struct ptp_transfer_slot *slots;
+  unsigned long blocksize;
+  unsigned long towrite = 0;
+  unsigned long queued = 0;
+  unsigned long curwrite = 0;
+  int nslots = ptp_usb->write_queue_depth;
+  int inflight = 0;
+  int head = 0;
+  int eof = 0;
+  int i;
+  short ret = PTP_RC_OK;
+
+  blocksize = ptp_usb->write_transfer_size -
+    (ptp_usb->write_transfer_size % ptp_usb->outep_maxpacket);
+  if (blocksize == 0)
+    blocksize = ptp_usb->outep_maxpacket;
+
+  slots = get_transfer_slots(ptp_usb, 1, nslots, blocksize);
+  if (slots == NULL)
+    return PTP_ERROR_IO;
+  for (i = 0; i < nslots; i++) {
+    libusb_fill_bulk_transfer(slots[i].transfer, ptp_usb->handle,
+			      ptp_usb->outep, slots[i].buffer.data, 0,
+			      ptp_transfer_async_cb, &slots[i].done,
+			      ptp_usb->timeout);
+  }
+
+  while (curwrite < size) {
+    struct libusb_transfer *t;
+
+    // Fill and submit free buffers while the queued ones drain
+    while (inflight < nslots && queued < size && !eof) {
+      struct ptp_transfer_slot *slot = &slots[(head + inflight) % nslots];
+      unsigned long wanted;
+      uint16_t getfunc_ret;
+
+      towrite = size - queued;
+      if (towrite > blocksize) {
+	towrite = blocksize;
+      } else {
+	// This magic makes packets the same size that WMP send them.
+	if (towrite > ptp_usb->outep_maxpacket && towrite % ptp_usb->outep_maxpacket != 0) {
+	  towrite -= towrite % ptp_usb->outep_maxpacket;
+	}
+      }
+      wanted = towrite;
+      getfunc_ret = handler->getfunc(NULL, handler->priv, towrite,
+				     slot->transfer->buffer, &towrite);
+      if (getfunc_ret != PTP_RC_OK) {
+	ret = getfunc_ret;
+	goto out;
+      }
+      if (towrite < wanted)
+	eof = 1;
+      if (towrite == 0)
+	break;
+      slot->transfer->length = towrite;
+      slot->done = 0;
+      if (libusb_submit_transfer(slot->transfer) != LIBUSB_SUCCESS) {
+	ret = PTP_ERROR_IO;
+	goto out;
+      }
+      LIBMTP_USB_DEBUG("USB OUT==>\n");
+      LIBMTP_USB_DATA(slot->transfer->buffer, towrite, 16);
+      queued += towrite;
+      inflight++;
+    }
+    if (inflight == 0)
+      break;
+
+    while (!slots[head].done) {
+      if (libusb_handle_events_completed(libmtp_libusb_context,
+					 &slots[head].done) != LIBUSB_SUCCESS &&
+	  !slots[head].done) {
+	ret = PTP_ERROR_IO;
+	goto out;
+      }
+    }
+    t = slots[head].transfer;
+    head = (head + 1) % nslots;
+    inflight--;
+
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+      ret = PTP_ERROR_IO;
+      goto out;
+    }
+    // Increase counters
+    ptp_usb->current_transfer_complete += t->actual_length;
+    curwrite += t->actual_length;
+
+    // call callback
+    if (ptp_usb->callback_active) {
+      if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
+	// send last update and disable callback.
+	ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
+	ptp_usb->callback_active = 0;
+      }
+      if (ptp_usb->current_transfer_callback != NULL) {
+	if (ptp_usb->current_transfer_callback(ptp_usb->current_transfer_complete,
+					       ptp_usb->current_transfer_total,
+					       ptp_usb->current_transfer_callback_data) != 0) {
+	  ret = PTP_ERROR_CANCEL;
+	  goto out;
+	}
+      }
+    }
+    if (t->actual_length < t->length) { /* short writes happen */
+      ret = PTP_ERROR_IO;
+      goto out;
+    }
+  }
+  if (written) {
+    *written = curwrite;
+  }
+
+ out:
+  // Reap whatever is still queued, the slots are reused next time
+  for (i = 0; i < inflight; i++)
+    libusb_cancel_transfer(slots[(head + i) % nslots].transfer);
+  for (i = 0; i < inflight; i++) {
+    struct ptp_transfer_slot *slot = &slots[(head + i) % nslots];
+
+    while (!slot->done) {
+      if (libusb_handle_events_completed(libmtp_libusb_context,
+					 &slot->done) != LIBUSB_SUCCESS)
+	break;
+    }
+  }
+  if (ret != PTP_RC_OK)
+    return ret;
+
+  // If this is the last transfer send a zero write if required
+  if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
+    if ((towrite % ptp_usb->outep_maxpacket) == 0) {
+      int xwritten;
+
+      LIBMTP_USB_DEBUG("USB OUT==>\n");
+      LIBMTP_USB_DEBUG("Zero Write\n");
+
+      if (USB_BULK_WRITE(ptp_usb->handle,
+			 ptp_usb->outep,
+			 (unsigned char *) "x",
+			 0,
+			 &xwritten,
+			 ptp_usb->timeout) != LIBUSB_SUCCESS)
+	return PTP_ERROR_IO;
+    }
+  }
+  return PTP_RC_OK;
+}
+
 /* memory data get/put handler */
 typedef struct {
 	unsigned char	*data;
 	unsigned long	size, curoff;
+	unsigned long	alloc;	/* allocated size of data, >= size */
 } PTPMemHandlerPrivate;
 
 static uint16_t
@@ -1187,29 +2268,26 @@ memory_putfunc(PTPParams* params, void* private,
 ) {
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)private;
 
-	if (priv->curoff + sendlen > priv->size) {
-		priv->data = realloc (priv->data, priv->curoff+sendlen);
-		priv->size = priv->curoff + sendlen;
+	if (priv->curoff + sendlen > priv->alloc) {
+		/* grow geometrically, data usually arrives in many small chunks */
+		unsigned long newalloc = priv->alloc ? priv->alloc * 2 : 512;
+		unsigned char *newdata;
+
+		if (newalloc < priv->curoff + sendlen)
+			newalloc = priv->curoff + sendlen;
+		newdata = realloc (priv->data, newalloc);
+		if (!newdata)
+			return PTP_RC_GeneralError;
+		priv->data = newdata;
+		priv->alloc = newalloc;
 	}
+	if (priv->curoff + sendlen > priv->size)
+		priv->size = priv->curoff + sendlen;
 	memcpy (priv->data + priv->curoff, data, sendlen);
 	priv->curoff += sendlen;
 	return PTP_RC_OK;
 }
 
-/* init private struct for receiving data. */
-static uint16_t
-ptp_init_recv_memory_handler(PTPDataHandler *handler) {
-	PTPMemHandlerPrivate* priv;
-	priv = malloc (sizeof(PTPMemHandlerPrivate));
-	handler->priv = priv;
-	handler->getfunc = memory_getfunc;
-	handler->putfunc = memory_putfunc;
-	priv->data = NULL;
-	priv->size = 0;
-	priv->curoff = 0;
-	return PTP_RC_OK;
-}
-
 /* init private struct and put data in for sending data.
  * data is still owned by caller.
  */
@@ -1226,6 +2304,7 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	handler->putfunc = memory_putfunc;
 	priv->data = data;
 	priv->size = len;
+	priv->alloc = len;
 	priv->curoff = 0;
 	return PTP_RC_OK;
 }
@@ -1239,18 +2318,6 @@ ptp_exit_send_memory_handler (PTPDataHandler *handler) {
 	return PTP_RC_OK;
 }
 
-/* hand over our internal data to caller */
-static uint16_t
-ptp_exit_recv_memory_handler (PTPDataHandler *handler,
-	unsigned char **data, unsigned long *size
-) {
-	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)handler->priv;
-	*data = priv->data;
-	*size = priv->size;
-	free (priv);
-	return PTP_RC_OK;
-}
-
 /* send / receive functions */
 
 uint16_t
@@ -1359,8 +2426,12 @@ ptp_usb_senddata (PTPParams* params, PTPContainer* ptp,
 	ret = PTP_RC_OK;
 	while(bytes_left_to_transfer > 0) {
 		unsigned long max_long_transfer = ULONG_MAX + 1 - packet_size;
-		ret = ptp_write_func (bytes_left_to_transfer > max_long_transfer ? max_long_transfer : bytes_left_to_transfer,
-			handler, params->data, &written);
+		unsigned long towrite = bytes_left_to_transfer > max_long_transfer ? max_long_transfer : bytes_left_to_transfer;
+
+		if (use_async_write(ptp_usb, towrite))
+			ret = ptp_write_func_async (towrite, handler, params->data, &written);
+		else
+			ret = ptp_write_func (towrite, handler, params->data, &written);
 		if (ret != PTP_RC_OK)
 			break;
 		if (written == 0) {
@@ -1378,8 +2449,7 @@ static uint16_t ptp_usb_getpacket(PTPParams *params,
 		PTPUSBBulkContainer *packet, unsigned long *rlen)
 {
 	PTPDataHandler	memhandler;
-	uint16_t	ret;
-	unsigned char	*x = NULL;
+	PTPMemHandlerPrivate priv;
 	unsigned long packet_size;
 	PTP_USB *ptp_usb = (PTP_USB *) params->data;
 
@@ -1396,14 +2466,17 @@ static uint16_t ptp_usb_getpacket(PTPParams *params,
 		/* Here this signifies a "virtual read" */
 		return PTP_RC_OK;
 	}
-	ptp_init_recv_memory_handler (&memhandler);
-	ret = ptp_read_func(packet_size, &memhandler, params->data, rlen, 0);
-	ptp_exit_recv_memory_handler (&memhandler, &x, rlen);
-	if (x) {
-		memcpy (packet, x, *rlen);
-		free (x);
-	}
-	return ret;
+	/* Read straight into the packet, it is large enough for any endpoint */
+	if (packet_size > sizeof(*packet))
+		packet_size = sizeof(*packet);
+	priv.data = (unsigned char *) packet;
+	priv.size = 0;
+	priv.alloc = sizeof(*packet);
+	priv.curoff = 0;
+	memhandler.getfunc = memory_getfunc;
+	memhandler.putfunc = memory_putfunc;
+	memhandler.priv = &priv;
+	return ptp_read_func(packet_size, &memhandler, params->data, rlen, 0);
 }
 
 uint16_t
@@ -1466,6 +2539,19 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 			return PTP_RC_OK;
 
 		  /* stuff data directly to passed data handler */
+		  if (dtoh32(usbdata.length) != 0xffffffffU &&
+		      use_async_read(ptp_usb, dtoh32(usbdata.length) - rlen)) {
+		    unsigned long readdata;
+
+		    ret = ptp_read_func_async(dtoh32(usbdata.length) - rlen,
+					      handler,
+					      params->data,
+					      &readdata,
+					      1);
+		    if (ret == PTP_ERROR_CANCEL)
+			return ptp_read_cancel_func(params, ptp->Transaction_ID);
+		    return ret;
+		  }
 		  while (1) {
 		    unsigned long readdata;
 
@@ -1574,7 +2660,14 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 		  break;
 		}
 
-		ret = ptp_read_func(len - (rlen - PTP_USB_BULK_HDR_LEN),
+		if (use_async_read(ptp_usb, len - (rlen - PTP_USB_BULK_HDR_LEN)))
+			ret = ptp_read_func_async(len - (rlen - PTP_USB_BULK_HDR_LEN),
+						  handler,
+						  params->data,
+						  &rlen,
+						  1);
+		else
+			ret = ptp_read_func(len - (rlen - PTP_USB_BULK_HDR_LEN),
 							handler,
 							params->data,
 							&rlen,
@@ -1919,6 +3012,14 @@ static int init_ptp_usb(PTPParams* params, PTP_USB* ptp_usb, libusb_device* dev)
   params->byteorder = PTP_DL_LE;
 
   ptp_usb->timeout = get_timeout(ptp_usb);
+  ptp_usb->read_queue_depth = get_env_setting("LIBMTP_READ_QUEUE_DEPTH",
+					      USB_READ_QUEUE_DEPTH, 1);
+  ptp_usb->read_transfer_size = get_env_setting("LIBMTP_READ_TRANSFER_SIZE",
+						USB_READ_TRANSFER_SIZE, 1);
+  ptp_usb->write_queue_depth = get_env_setting("LIBMTP_WRITE_QUEUE_DEPTH",
+					       USB_WRITE_QUEUE_DEPTH, 1);
+  ptp_usb->write_transfer_size = get_env_setting("LIBMTP_WRITE_TRANSFER_SIZE",
+						 USB_WRITE_TRANSFER_SIZE, 1);
 
   ret = libusb_open(dev, &device_handle);
   if (ret != LIBUSB_SUCCESS) {
@@ -2110,6 +3211,7 @@ static void close_usb(PTP_USB* ptp_usb)
      */
     libusb_reset_device (ptp_usb->handle);
   }
+  free_transfer_pool(ptp_usb);
   libusb_close(ptp_usb->handle);
 }
 
@@ -0,0 +1,2012 @@
+/**
+ * \file loopback-glue.c
+ * Loopback transport towards a simulated in-process MTP responder.
+ *
+ * The responder answers the PTP transactions of libmtp from memory
+ * instead of over USB, so that the cache, listing and transfer code
+ * can be exercised and timed without any hardware. Its storage is
+ * filled with generated folders and files when the device is opened,
+ * the content of a generated file is a fixed pattern so it costs no
+ * memory. Objects sent to the device are kept in memory unless the
+ * device is told to discard their content.
+ *
+ * Each transaction can be delayed by a fixed latency and the data
+ * phases limited to a given bandwidth, and the responder can mimic
+ * some of the bugs seen in real devices. The datasets are packed and
+ * unpacked by the responder itself rather than by the code in
+ * ptp-pack.c, so that it checks that code instead of mirroring it.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+#include "config.h"
+#include "libmtp.h"
+#include "libusb-glue.h"
+#include "loopback-glue.h"
+#include "util.h"
+#include "ptp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* Loopback devices that can be registered, devnum is a byte */
+#define LOOPBACK_MAX_DEVICES 255
+/* Object properties a loopback device can support at most */
+#define LOOPBACK_MAX_PROPERTIES 32
+/* The one storage of a loopback device */
+#define LOOPBACK_STORAGE_ID 0x00010001U
+/* Storage capacity unless configured */
+#define LOOPBACK_DEFAULT_CAPACITY (64ULL*1024*1024*1024)
+/* Data phases are handed to the data handlers in pieces of this size */
+#define LOOPBACK_CHUNK_SIZE (64*1024)
+/* Events kept for the initiator at most, later ones are dropped */
+#define LOOPBACK_MAX_EVENTS 256
+/* Modification time of generated objects, 2020-01-01 plus the object ID */
+#define LOOPBACK_EPOCH 1577836800
+
+/* Property groups reported by GetObjectPropDesc */
+#define LOOPBACK_GROUP_BASIC 1
+#define LOOPBACK_GROUP_MEDIA 2
+
+/**
+ * A registered loopback device, copied into every responder opened
+ * for it so that the configuration may go away after registration.
+ */
+typedef struct loopback_entry_struct {
+  LIBMTP_loopback_config_t config; /**< The configuration */
+  uint16_t properties[LOOPBACK_MAX_PROPERTIES]; /**< Supported properties */
+  uint32_t numproperties; /**< Number of supported properties */
+} loopback_entry_t;
+
+/**
+ * An object on the simulated storage.
+ */
+typedef struct loopback_object_struct {
+  uint32_t oid; /**< Object handle */
+  uint32_t parent; /**< Parent folder, 0 in the root folder */
+  uint16_t format; /**< PTP object format */
+  uint64_t size; /**< Size in bytes */
+  time_t modified; /**< Modification time */
+  char *filename; /**< File name */
+  char *name; /**< Name property, NULL for the generated one */
+  char *artist; /**< Artist, NULL for the generated one */
+  char *album; /**< Album name, NULL for the generated one */
+  char *genre; /**< Genre, NULL for the generated one */
+  uint16_t track; /**< Track number */
+  uint32_t duration; /**< Duration in milliseconds */
+  int generated; /**< Created with the device rather than sent to it */
+  int editing; /**< Inside BeginEditObject/EndEditObject */
+  unsigned char *data; /**< Content, NULL for the generated pattern */
+  uint32_t *refs; /**< Object references */
+  uint32_t numrefs; /**< Number of object references */
+} loopback_object_t;
+
+/**
+ * A growing little-endian buffer for the datasets of the responder.
+ */
+typedef struct loopback_buffer_struct {
+  unsigned char *data;
+  uint32_t len;
+  uint32_t alloc;
+  int failed; /**< Set when memory ran out, the content is then invalid */
+} loopback_buffer_t;
+
+/**
+ * The simulated responder behind one opened loopback device. It is
+ * only touched from within transactions, which the PTP layer runs one
+ * at a time, except for the event queue which has a lock of its own.
+ */
+struct loopback_responder {
+  loopback_entry_t entry; /**< Configuration of the device */
+  uint8_t devnum; /**< Device number, used in the serial number */
+  loopback_object_t *objects; /**< The objects, sorted by handle */
+  uint32_t numobjects; /**< Number of objects */
+  uint32_t allocobjects; /**< Allocated object slots */
+  uint32_t next_oid; /**< Handle of the next new object */
+  uint64_t capacity; /**< Storage capacity */
+  uint64_t used; /**< Bytes used on the storage */
+  uint32_t session; /**< Open session, 0 if none */
+  uint32_t pending; /**< Object announced by SendObjectInfo, 0 if none */
+  /* The transaction in progress */
+  PTPContainer request; /**< The request */
+  uint16_t dataphase; /**< Its data phase, PTP_DP_* */
+  PTPContainer response; /**< The response, set by the operation */
+  loopback_buffer_t out; /**< Dataset sent to the initiator */
+  loopback_buffer_t in; /**< Dataset received from the initiator */
+  uint32_t read_oid; /**< Object whose content is sent, 0 if none */
+  uint64_t read_offset; /**< First byte of the content sent */
+  uint64_t read_length; /**< Bytes of content sent */
+  uint32_t write_oid; /**< Object whose content is received, 0 if none */
+  uint64_t write_offset; /**< Where the received content goes */
+  struct timeval phase_start; /**< Start of the current data phase */
+  uint64_t phase_bytes; /**< Bytes moved in the current data phase */
+  /* Events for the initiator */
+  PTPContainer *events; /**< Queued events */
+  uint32_t numevents; /**< Number of queued events */
+  int closing; /**< Set when the device is being closed */
+  int waiters; /**< Threads waiting for an event */
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t event_lock; /**< Protects the fields above */
+  pthread_cond_t event_cond; /**< Signalled on new events and on close */
+#endif
+};
+
+typedef struct loopback_responder loopback_responder_t;
+
+/**
+ * Properties known to the responder. The media properties are only
+ * present on files, folders only have the basic ones.
+ */
+static const struct {
+  uint16_t code;
+  uint16_t datatype;
+  uint32_t group;
+  int settable;
+} loopback_property_table[] = {
+  { PTP_OPC_StorageID, PTP_DTC_UINT32, LOOPBACK_GROUP_BASIC, 0 },
+  { PTP_OPC_ObjectFormat, PTP_DTC_UINT16, LOOPBACK_GROUP_BASIC, 0 },
+  { PTP_OPC_ProtectionStatus, PTP_DTC_UINT16, LOOPBACK_GROUP_BASIC, 0 },
+  { PTP_OPC_ObjectSize, PTP_DTC_UINT64, LOOPBACK_GROUP_BASIC, 0 },
+  { PTP_OPC_ObjectFileName, PTP_DTC_STR, LOOPBACK_GROUP_BASIC, 1 },
+  { PTP_OPC_DateModified, PTP_DTC_STR, LOOPBACK_GROUP_BASIC, 0 },
+  { PTP_OPC_ParentObject, PTP_DTC_UINT32, LOOPBACK_GROUP_BASIC, 0 },
+  { PTP_OPC_Name, PTP_DTC_STR, LOOPBACK_GROUP_BASIC, 1 },
+  { PTP_OPC_Artist, PTP_DTC_STR, LOOPBACK_GROUP_MEDIA, 1 },
+  { PTP_OPC_AlbumName, PTP_DTC_STR, LOOPBACK_GROUP_MEDIA, 1 },
+  { PTP_OPC_Genre, PTP_DTC_STR, LOOPBACK_GROUP_MEDIA, 1 },
+  { PTP_OPC_Track, PTP_DTC_UINT16, LOOPBACK_GROUP_MEDIA, 1 },
+  { PTP_OPC_Duration, PTP_DTC_UINT32, LOOPBACK_GROUP_MEDIA, 1 },
+};
+#define LOOPBACK_NUM_PROPERTIES \
+  (sizeof(loopback_property_table) / sizeof(loopback_property_table[0]))
+/* The first ones in the table form the default set */
+#define LOOPBACK_NUM_BASIC_PROPERTIES 8
+
+static const uint16_t loopback_operations[] = {
+  PTP_OC_GetDeviceInfo,
+  PTP_OC_OpenSession,
+  PTP_OC_CloseSession,
+  PTP_OC_GetStorageIDs,
+  PTP_OC_GetStorageInfo,
+  PTP_OC_GetObjectHandles,
+  PTP_OC_GetObjectInfo,
+  PTP_OC_GetObject,
+  PTP_OC_DeleteObject,
+  PTP_OC_SendObjectInfo,
+  PTP_OC_SendObject,
+  PTP_OC_GetPartialObject,
+  PTP_OC_MTP_GetObjectPropsSupported,
+  PTP_OC_MTP_GetObjectPropDesc,
+  PTP_OC_MTP_GetObjectPropValue,
+  PTP_OC_MTP_SetObjectPropValue,
+  PTP_OC_MTP_GetObjectReferences,
+  PTP_OC_MTP_SetObjectReferences,
+};
+
+static const uint16_t loopback_android_operations[] = {
+  PTP_OC_ANDROID_GetPartialObject64,
+  PTP_OC_ANDROID_SendPartialObject,
+  PTP_OC_ANDROID_TruncateObject,
+  PTP_OC_ANDROID_BeginEditObject,
+  PTP_OC_ANDROID_EndEditObject,
+};
+
+static const uint16_t loopback_events[] = {
+  PTP_EC_ObjectAdded,
+  PTP_EC_ObjectRemoved,
+  PTP_EC_ObjectInfoChanged,
+};
+
+static const uint16_t loopback_formats[] = {
+  PTP_OFC_Undefined,
+  PTP_OFC_Association,
+  PTP_OFC_MP3,
+  PTP_OFC_EXIF_JPEG,
+  PTP_OFC_MTP_AbstractAudioAlbum,
+  PTP_OFC_MTP_AbstractAudioVideoPlaylist,
+};
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+/* The registered loopback devices, devnum is the index plus one */
+static loopback_entry_t loopback_devices[LOOPBACK_MAX_DEVICES];
+static int loopback_numdevices = 0;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t loopback_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Dataset packing, always little endian.
+ */
+
+static unsigned char *buffer_reserve(loopback_buffer_t *buf, uint32_t len)
+{
+  unsigned char *p;
+
+  if (buf->failed) {
+    return NULL;
+  }
+  if (buf->len + len > buf->alloc) {
+    uint32_t newalloc = buf->alloc ? buf->alloc * 2 : 256;
+    unsigned char *newdata;
+
+    while (newalloc < buf->len + len) {
+      newalloc *= 2;
+    }
+    newdata = realloc(buf->data, newalloc);
+    if (newdata == NULL) {
+      buf->failed = 1;
+      return NULL;
+    }
+    buf->data = newdata;
+    buf->alloc = newalloc;
+  }
+  p = buf->data + buf->len;
+  buf->len += len;
+  return p;
+}
+
+static void buffer_put8(loopback_buffer_t *buf, uint8_t val)
+{
+  unsigned char *p = buffer_reserve(buf, 1);
+
+  if (p != NULL) {
+    p[0] = val;
+  }
+}
+
+static void buffer_put16(loopback_buffer_t *buf, uint16_t val)
+{
+  unsigned char *p = buffer_reserve(buf, 2);
+
+  if (p != NULL) {
+    p[0] = val & 0xFF;
+    p[1] = val >> 8;
+  }
+}
+
+static void buffer_put32(loopback_buffer_t *buf, uint32_t val)
+{
+  unsigned char *p = buffer_reserve(buf, 4);
+  int i;
+
+  if (p != NULL) {
+    for (i = 0; i < 4; i++) {
+      p[i] = (val >> (8 * i)) & 0xFF;
+    }
+  }
+}
+
+/**
+ * Overwrites a 32 bit value packed earlier, used for counts that are
+ * only known once the elements are packed.
+ */
+static void buffer_set32(loopback_buffer_t *buf, uint32_t pos, uint32_t val)
+{
+  int i;
+
+  if (!buf->failed) {
+    for (i = 0; i < 4; i++) {
+      buf->data[pos + i] = (val >> (8 * i)) & 0xFF;
+    }
+  }
+}
+
+static void buffer_put64(loopback_buffer_t *buf, uint64_t val)
+{
+  buffer_put32(buf, val & 0xFFFFFFFFU);
+  buffer_put32(buf, val >> 32);
+}
+
+/**
+ * Packs a PTP string: a length byte counting the terminator, then
+ * UCS-2 characters. UTF-8 outside the basic plane is replaced.
+ */
+static void buffer_put_string(loopback_buffer_t *buf, char const *str)
+{
+  unsigned char const *s = (unsigned char const *) str;
+  uint32_t lenpos;
+  uint8_t chars = 0;
+
+  if (str == NULL || *str == '\0') {
+    buffer_put8(buf, 0);
+    return;
+  }
+  lenpos = buf->len;
+  buffer_put8(buf, 0);
+  while (*s != '\0' && chars < 254) {
+    uint32_t c = *s++;
+
+    if (c >= 0xE0 && s[0] != '\0' && s[1] != '\0') {
+      c = ((c & 0x0F) << 12) | ((s[0] & 0x3F) << 6) | (s[1] & 0x3F);
+      if (*(s - 1) >= 0xF0) {
+	// Four byte sequence, skip the rest of it
+	s++;
+	c = 0xFFFD;
+      }
+      s += 2;
+    } else if (c >= 0xC0 && s[0] != '\0') {
+      c = ((c & 0x1F) << 6) | (s[0] & 0x3F);
+      s++;
+    } else if (c >= 0x80) {
+      c = 0xFFFD;
+    }
+    buffer_put16(buf, (uint16_t) c);
+    chars++;
+  }
+  buffer_put16(buf, 0);
+  chars++;
+  if (!buf->failed) {
+    buf->data[lenpos] = chars;
+  }
+}
+
+static void buffer_put16_array(loopback_buffer_t *buf, uint16_t const *vals,
+			       uint32_t n)
+{
+  uint32_t i;
+
+  buffer_put32(buf, n);
+  for (i = 0; i < n; i++) {
+    buffer_put16(buf, vals[i]);
+  }
+}
+
+/*
+ * Dataset unpacking. All of these check the length of the data and
+ * return 0 if it is too short.
+ */
+
+static int get16(unsigned char const *data, uint32_t len, uint32_t *offset,
+		 uint16_t *val)
+{
+  if (*offset + 2 > len) {
+    return 0;
+  }
+  *val = data[*offset] | (data[*offset + 1] << 8);
+  *offset += 2;
+  return 1;
+}
+
+static int get32(unsigned char const *data, uint32_t len, uint32_t *offset,
+		 uint32_t *val)
+{
+  if (*offset + 4 > len) {
+    return 0;
+  }
+  *val = (uint32_t) data[*offset] | ((uint32_t) data[*offset + 1] << 8) |
+    ((uint32_t) data[*offset + 2] << 16) | ((uint32_t) data[*offset + 3] << 24);
+  *offset += 4;
+  return 1;
+}
+
+/**
+ * Unpacks a PTP string into a newly allocated UTF-8 string.
+ */
+static int get_string(unsigned char const *data, uint32_t len,
+		      uint32_t *offset, char **str)
+{
+  uint32_t start;
+  uint8_t chars;
+  char *out;
+  char *p;
+  int i;
+
+  if (*offset + 1 > len) {
+    return 0;
+  }
+  chars = data[*offset];
+  start = *offset + 1;
+  if (start + 2 * chars > len) {
+    return 0;
+  }
+  out = malloc(3 * chars + 1);
+  if (out == NULL) {
+    return 0;
+  }
+  p = out;
+  for (i = 0; i < chars; i++) {
+    uint16_t c = data[start + 2 * i] | (data[start + 2 * i + 1] << 8);
+
+    if (c == 0) {
+      break;
+    }
+    if (c < 0x80) {
+      *p++ = c;
+    } else if (c < 0x800) {
+      *p++ = 0xC0 | (c >> 6);
+      *p++ = 0x80 | (c & 0x3F);
+    } else {
+      *p++ = 0xE0 | (c >> 12);
+      *p++ = 0x80 | ((c >> 6) & 0x3F);
+      *p++ = 0x80 | (c & 0x3F);
+    }
+  }
+  *offset = start + 2 * chars;
+  *p = '\0';
+  *str = out;
+  return 1;
+}
+
+/*
+ * The simulated storage.
+ */
+
+/**
+ * Finds an object by its handle.
+ */
+static loopback_object_t *find_object(loopback_responder_t *lb, uint32_t oid)
+{
+  uint32_t lo = 0;
+  uint32_t hi = lb->numobjects;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (lb->objects[mid].oid == oid) {
+      return &lb->objects[mid];
+    }
+    if (lb->objects[mid].oid < oid) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Adds an object with the next free handle. The returned pointer is
+ * valid until the next object is added or removed.
+ */
+static loopback_object_t *add_object(loopback_responder_t *lb, uint32_t parent,
+				     uint16_t format, uint64_t size,
+				     char const *filename)
+{
+  loopback_object_t *ob;
+
+  if (lb->numobjects == lb->allocobjects) {
+    uint32_t newalloc = lb->allocobjects ? lb->allocobjects * 2 : 64;
+    loopback_object_t *tmp = realloc(lb->objects,
+				     newalloc * sizeof(loopback_object_t));
+
+    if (tmp == NULL) {
+      return NULL;
+    }
+    lb->objects = tmp;
+    lb->allocobjects = newalloc;
+  }
+  ob = &lb->objects[lb->numobjects];
+  memset(ob, 0, sizeof(loopback_object_t));
+  ob->filename = strdup(filename);
+  if (ob->filename == NULL) {
+    return NULL;
+  }
+  ob->oid = lb->next_oid++;
+  ob->parent = parent;
+  ob->format = format;
+  ob->size = size;
+  ob->modified = LOOPBACK_EPOCH + ob->oid;
+  lb->used += size;
+  lb->numobjects++;
+  return ob;
+}
+
+static void free_object(loopback_object_t *ob)
+{
+  free(ob->filename);
+  free(ob->name);
+  free(ob->artist);
+  free(ob->album);
+  free(ob->genre);
+  free(ob->data);
+  free(ob->refs);
+}
+
+/**
+ * Tells how many levels below a folder an object is, 0 if it is not
+ * below it at all. Folder 0 is the root folder.
+ */
+static uint32_t object_depth(loopback_responder_t *lb, loopback_object_t *ob,
+			     uint32_t folder, uint32_t maxdepth)
+{
+  uint32_t depth = 1;
+
+  while (depth <= maxdepth) {
+    if (ob->parent == folder) {
+      return depth;
+    }
+    if (ob->parent == 0) {
+      return 0;
+    }
+    ob = find_object(lb, ob->parent);
+    if (ob == NULL) {
+      return 0;
+    }
+    depth++;
+  }
+  return 0;
+}
+
+/**
+ * Copies content of an object, either stored or the generated
+ * pattern in which the byte at offset n is (handle + n) & 0xFF.
+ */
+static void read_content(loopback_object_t *ob, uint64_t offset,
+			 unsigned char *buf, uint32_t len)
+{
+  uint32_t i;
+
+  if (ob->data != NULL) {
+    memcpy(buf, ob->data + offset, len);
+    return;
+  }
+  for (i = 0; i < len; i++) {
+    buf[i] = (unsigned char) (ob->oid + offset + i);
+  }
+}
+
+/**
+ * Resizes an object. Unless content is discarded the content is kept
+ * in memory from now on, new bytes are zero.
+ * @return 0 on success, -1 when out of memory.
+ */
+static int resize_object(loopback_responder_t *lb, loopback_object_t *ob,
+			 uint64_t size)
+{
+  if (!(lb->entry.config.flags & LIBMTP_LOOPBACK_DISCARD_DATA)) {
+    unsigned char *data;
+
+    if (size != (size_t) size) {
+      return -1;
+    }
+    data = realloc(ob->data, size ? size : 1);
+    if (data == NULL) {
+      return -1;
+    }
+    if (ob->data == NULL) {
+      uint64_t keep = ob->size < size ? ob->size : size;
+      uint64_t off;
+
+      for (off = 0; off < keep; off += LOOPBACK_CHUNK_SIZE) {
+	uint64_t n = keep - off;
+
+	if (n > LOOPBACK_CHUNK_SIZE) {
+	  n = LOOPBACK_CHUNK_SIZE;
+	}
+	read_content(ob, off, data + off, n);
+      }
+    }
+    if (size > ob->size) {
+      memset(data + ob->size, 0, size - ob->size);
+    }
+    ob->data = data;
+  }
+  lb->used = lb->used - ob->size + size;
+  ob->size = size;
+  return 0;
+}
+
+static void queue_event(loopback_responder_t *lb, uint16_t code,
+			uint32_t param1)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&lb->event_lock);
+#endif
+  if (lb->numevents < LOOPBACK_MAX_EVENTS) {
+    PTPContainer *event = &lb->events[lb->numevents++];
+
+    memset(event, 0, sizeof(PTPContainer));
+    event->Code = code;
+    event->SessionID = lb->session;
+    event->Param1 = param1;
+    event->Nparam = 1;
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_cond_broadcast(&lb->event_cond);
+  pthread_mutex_unlock(&lb->event_lock);
+#endif
+}
+
+/**
+ * Fills the storage with the folders and files of the configuration.
+ */
+static int populate_storage(loopback_responder_t *lb)
+{
+  LIBMTP_loopback_config_t const *config = &lb->entry.config;
+  char name[32];
+  uint32_t i;
+
+  lb->next_oid = 1;
+  for (i = 0; i < config->folders; i++) {
+    snprintf(name, sizeof(name), "Folder%04u", i + 1);
+    if (add_object(lb, 0, PTP_OFC_Association, 0, name) == NULL) {
+      return -1;
+    }
+  }
+  for (i = 0; i < config->files; i++) {
+    uint32_t parent = config->folders ? 1 + i % config->folders : 0;
+    loopback_object_t *ob;
+
+    snprintf(name, sizeof(name), "file%06u.mp3", i + 1);
+    ob = add_object(lb, parent, PTP_OFC_MP3, config->filesize, name);
+    if (ob == NULL) {
+      return -1;
+    }
+    ob->generated = 1;
+    ob->track = ob->oid % 20 + 1;
+    ob->duration = 180000 + (ob->oid % 60) * 1000;
+  }
+  lb->capacity = config->capacity ? config->capacity :
+    LOOPBACK_DEFAULT_CAPACITY;
+  if (lb->capacity < lb->used) {
+    lb->capacity = lb->used;
+  }
+  return 0;
+}
+
+/*
+ * Object properties.
+ */
+
+static int property_index(uint16_t code)
+{
+  unsigned int i;
+
+  for (i = 0; i < LOOPBACK_NUM_PROPERTIES; i++) {
+    if (loopback_property_table[i].code == code) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Tells whether an object of some format has a property.
+ */
+static int has_property(loopback_responder_t *lb, uint16_t format,
+			uint16_t code)
+{
+  uint32_t i;
+
+  for (i = 0; i < lb->entry.numproperties; i++) {
+    if (lb->entry.properties[i] == code) {
+      break;
+    }
+  }
+  if (i == lb->entry.numproperties) {
+    return 0;
+  }
+  if (format == PTP_OFC_Association &&
+      loopback_property_table[property_index(code)].group ==
+      LOOPBACK_GROUP_MEDIA) {
+    return 0;
+  }
+  return 1;
+}
+
+static void put_date(loopback_buffer_t *buf, time_t t)
+{
+  char date[20];
+  struct tm *tm = localtime(&t);
+
+  if (tm == NULL) {
+    buffer_put_string(buf, "");
+    return;
+  }
+  strftime(date, sizeof(date), "%Y%m%dT%H%M%S", tm);
+  buffer_put_string(buf, date);
+}
+
+static void put_generated_string(loopback_buffer_t *buf, loopback_object_t *ob,
+				 char const *set, char const *prefix,
+				 uint32_t modulo)
+{
+  char tmp[32];
+
+  if (set != NULL || !ob->generated) {
+    buffer_put_string(buf, set);
+    return;
+  }
+  snprintf(tmp, sizeof(tmp), "%s %u", prefix, ob->oid % modulo + 1);
+  buffer_put_string(buf, tmp);
+}
+
+/**
+ * Packs the value of a property of an object.
+ */
+static void put_property_value(loopback_buffer_t *buf, loopback_object_t *ob,
+			       uint16_t code)
+{
+  switch (code) {
+  case PTP_OPC_StorageID:
+    buffer_put32(buf, LOOPBACK_STORAGE_ID);
+    break;
+  case PTP_OPC_ObjectFormat:
+    buffer_put16(buf, ob->format);
+    break;
+  case PTP_OPC_ProtectionStatus:
+    buffer_put16(buf, 0);
+    break;
+  case PTP_OPC_ObjectSize:
+    buffer_put64(buf, ob->size);
+    break;
+  case PTP_OPC_ObjectFileName:
+    buffer_put_string(buf, ob->filename);
+    break;
+  case PTP_OPC_DateModified:
+    put_date(buf, ob->modified);
+    break;
+  case PTP_OPC_ParentObject:
+    buffer_put32(buf, ob->parent);
+    break;
+  case PTP_OPC_Name:
+    buffer_put_string(buf, ob->name != NULL ? ob->name : ob->filename);
+    break;
+  case PTP_OPC_Artist:
+    put_generated_string(buf, ob, ob->artist, "Artist", 50);
+    break;
+  case PTP_OPC_AlbumName:
+    put_generated_string(buf, ob, ob->album, "Album", 200);
+    break;
+  case PTP_OPC_Genre:
+    put_generated_string(buf, ob, ob->genre, "Genre", 10);
+    break;
+  case PTP_OPC_Track:
+    buffer_put16(buf, ob->track);
+    break;
+  case PTP_OPC_Duration:
+    buffer_put32(buf, ob->duration);
+    break;
+  }
+}
+
+/**
+ * Unpacks and sets the value of a settable property of an object.
+ */
+static uint16_t set_property_value(loopback_object_t *ob, uint16_t code,
+				   unsigned char const *data, uint32_t len)
+{
+  uint32_t offset = 0;
+  char **field = NULL;
+  char *str;
+
+  switch (code) {
+  case PTP_OPC_Track:
+    return get16(data, len, &offset, &ob->track) ?
+      PTP_RC_OK : PTP_RC_MTP_Invalid_ObjectProp_Format;
+  case PTP_OPC_Duration:
+    return get32(data, len, &offset, &ob->duration) ?
+      PTP_RC_OK : PTP_RC_MTP_Invalid_ObjectProp_Format;
+  case PTP_OPC_ObjectFileName:
+    field = &ob->filename;
+    break;
+  case PTP_OPC_Name:
+    field = &ob->name;
+    break;
+  case PTP_OPC_Artist:
+    field = &ob->artist;
+    break;
+  case PTP_OPC_AlbumName:
+    field = &ob->album;
+    break;
+  case PTP_OPC_Genre:
+    field = &ob->genre;
+    break;
+  default:
+    return PTP_RC_AccessDenied;
+  }
+  if (!get_string(data, len, &offset, &str)) {
+    return PTP_RC_MTP_Invalid_ObjectProp_Format;
+  }
+  if (code == PTP_OPC_ObjectFileName && *str == '\0') {
+    free(str);
+    return PTP_RC_MTP_Invalid_ObjectProp_Value;
+  }
+  free(*field);
+  *field = str;
+  return PTP_RC_OK;
+}
+
+/**
+ * Packs an object property list, as GetObjPropList returns it.
+ */
+static uint16_t get_object_prop_list(loopback_responder_t *lb,
+				     uint32_t handle, uint32_t format,
+				     uint32_t code, uint32_t group,
+				     uint32_t depth)
+{
+  uint16_t props[LOOPBACK_MAX_PROPERTIES];
+  uint32_t numprops = 0;
+  uint32_t count = 0;
+  uint32_t countpos;
+  uint32_t i, j;
+
+  if ((lb->entry.config.flags & LIBMTP_LOOPBACK_BROKEN_OBJPROPLIST_ALL) &&
+      handle == 0xFFFFFFFFU) {
+    return PTP_RC_GeneralError;
+  }
+  for (i = 0; i < lb->entry.numproperties; i++) {
+    uint16_t prop = lb->entry.properties[i];
+
+    if (code == 0xFFFFFFFFU || code == prop ||
+	(code == 0 && loopback_property_table[property_index(prop)].group ==
+	 group)) {
+      props[numprops++] = prop;
+    }
+  }
+  if (numprops == 0) {
+    if (code == 0) {
+      return PTP_RC_MTP_Specification_By_Group_Unsupported;
+    }
+    return PTP_RC_MTP_ObjectProp_Not_Supported;
+  }
+  if (handle != 0 && handle != 0xFFFFFFFFU && find_object(lb, handle) == NULL) {
+    return PTP_RC_InvalidObjectHandle;
+  }
+
+  countpos = lb->out.len;
+  buffer_put32(&lb->out, 0);
+  for (i = 0; i < lb->numobjects; i++) {
+    loopback_object_t *ob = &lb->objects[i];
+
+    if (format != 0 && ob->format != format) {
+      continue;
+    }
+    if (handle == 0xFFFFFFFFU) {
+      // All objects
+    } else if (depth == 0) {
+      if (ob->oid != handle) {
+	continue;
+      }
+    } else if (object_depth(lb, ob, handle, depth) == 0) {
+      continue;
+    }
+    for (j = 0; j < numprops; j++) {
+      if (!has_property(lb, ob->format, props[j])) {
+	continue;
+      }
+      buffer_put32(&lb->out, ob->oid);
+      buffer_put16(&lb->out, props[j]);
+      buffer_put16(&lb->out,
+		   loopback_property_table[property_index(props[j])].datatype);
+      put_property_value(&lb->out, ob, props[j]);
+      count++;
+    }
+  }
+  buffer_set32(&lb->out, countpos, count);
+  return lb->out.failed ? PTP_RC_GeneralError : PTP_RC_OK;
+}
+
+/*
+ * Datasets.
+ */
+
+static int supports_android(loopback_responder_t *lb)
+{
+  return (lb->entry.config.flags &
+	  (LIBMTP_LOOPBACK_ANDROID | LIBMTP_LOOPBACK_EDIT_OPS)) != 0;
+}
+
+static int supports_operation(loopback_responder_t *lb, uint16_t code)
+{
+  unsigned int i;
+
+  if (code == PTP_OC_MTP_GetObjPropList) {
+    return !(lb->entry.config.flags & LIBMTP_LOOPBACK_NO_OBJPROPLIST);
+  }
+  for (i = 0; i < ARRAY_LEN(loopback_operations); i++) {
+    if (loopback_operations[i] == code) {
+      return 1;
+    }
+  }
+  for (i = 0; i < ARRAY_LEN(loopback_android_operations); i++) {
+    if (loopback_android_operations[i] == code) {
+      return supports_android(lb);
+    }
+  }
+  return 0;
+}
+
+static void put_device_info(loopback_responder_t *lb)
+{
+  loopback_buffer_t *buf = &lb->out;
+  uint16_t ops[ARRAY_LEN(loopback_operations) +
+	       ARRAY_LEN(loopback_android_operations) + 1];
+  uint32_t numops = 0;
+  char serial[32];
+  unsigned int i;
+
+  for (i = 0; i < ARRAY_LEN(loopback_operations); i++) {
+    ops[numops++] = loopback_operations[i];
+  }
+  if (supports_operation(lb, PTP_OC_MTP_GetObjPropList)) {
+    ops[numops++] = PTP_OC_MTP_GetObjPropList;
+  }
+  if (supports_android(lb)) {
+    for (i = 0; i < ARRAY_LEN(loopback_android_operations); i++) {
+      ops[numops++] = loopback_android_operations[i];
+    }
+  }
+  snprintf(serial, sizeof(serial), "LOOPBACK%08u", lb->devnum);
+
+  buffer_put16(buf, 100);
+  buffer_put32(buf, 0x00000006);
+  buffer_put16(buf, 100);
+  if (lb->entry.config.flags & LIBMTP_LOOPBACK_ANDROID) {
+    buffer_put_string(buf, "microsoft.com: 1.0; android.com: 1.0;");
+  } else {
+    buffer_put_string(buf, "microsoft.com: 1.0;");
+  }
+  buffer_put16(buf, 0);
+  buffer_put16_array(buf, ops, numops);
+  buffer_put16_array(buf, loopback_events, ARRAY_LEN(loopback_events));
+  buffer_put32(buf, 0);
+  buffer_put32(buf, 0);
+  buffer_put16_array(buf, loopback_formats, ARRAY_LEN(loopback_formats));
+  buffer_put_string(buf, "libmtp");
+  buffer_put_string(buf, "Loopback device");
+  buffer_put_string(buf, LIBMTP_VERSION_STRING);
+  buffer_put_string(buf, serial);
+}
+
+static void put_storage_info(loopback_responder_t *lb)
+{
+  loopback_buffer_t *buf = &lb->out;
+
+  buffer_put16(buf, PTP_ST_FixedRAM);
+  buffer_put16(buf, PTP_FST_GenericHierarchical);
+  buffer_put16(buf, PTP_AC_ReadWrite);
+  buffer_put64(buf, lb->capacity);
+  buffer_put64(buf, lb->capacity > lb->used ? lb->capacity - lb->used : 0);
+  buffer_put32(buf, 0xFFFFFFFFU);
+  buffer_put_string(buf, "Loopback storage");
+  buffer_put_string(buf, "");
+}
+
+static void put_object_info(loopback_responder_t *lb, loopback_object_t *ob)
+{
+  loopback_buffer_t *buf = &lb->out;
+
+  buffer_put32(buf, LOOPBACK_STORAGE_ID);
+  buffer_put16(buf, ob->format);
+  buffer_put16(buf, 0);
+  buffer_put32(buf, ob->size > 0xFFFFFFFFU ? 0xFFFFFFFFU : ob->size);
+  buffer_put16(buf, 0);
+  buffer_put32(buf, 0);
+  buffer_put32(buf, 0);
+  buffer_put32(buf, 0);
+  buffer_put32(buf, 0);
+  buffer_put32(buf, 0);
+  buffer_put32(buf, 0);
+  buffer_put32(buf, ob->parent);
+  buffer_put16(buf, ob->format == PTP_OFC_Association ?
+	       PTP_AT_GenericFolder : 0);
+  buffer_put32(buf, 0);
+  buffer_put32(buf, 0);
+  buffer_put_string(buf, ob->filename);
+  buffer_put_string(buf, "");
+  put_date(buf, ob->modified);
+  buffer_put_string(buf, "");
+}
+
+static void put_object_prop_desc(loopback_responder_t *lb, uint16_t code)
+{
+  loopback_buffer_t *buf = &lb->out;
+  int i = property_index(code);
+
+  buffer_put16(buf, code);
+  buffer_put16(buf, loopback_property_table[i].datatype);
+  buffer_put8(buf, loopback_property_table[i].settable ?
+	      PTP_DPGS_GetSet : PTP_DPGS_Get);
+  switch (loopback_property_table[i].datatype) {
+  case PTP_DTC_UINT16:
+    buffer_put16(buf, 0);
+    break;
+  case PTP_DTC_UINT32:
+    buffer_put32(buf, 0);
+    break;
+  case PTP_DTC_UINT64:
+    buffer_put64(buf, 0);
+    break;
+  default:
+    buffer_put_string(buf, "");
+    break;
+  }
+  buffer_put32(buf, loopback_property_table[i].group);
+  buffer_put8(buf, PTP_OPFF_None);
+}
+
+/*
+ * Operations.
+ */
+
+/**
+ * Removes an object and everything below it, queueing an event for
+ * each object removed. Handle 0xFFFFFFFF removes all objects.
+ * @return 0 on success, -1 when out of memory.
+ */
+static int delete_object(loopback_responder_t *lb, uint32_t handle)
+{
+  unsigned char *doomed;
+  uint32_t i, j;
+
+  doomed = calloc(lb->numobjects ? lb->numobjects : 1, 1);
+  if (doomed == NULL) {
+    return -1;
+  }
+  // Decide first, the ancestry of the objects is needed until then
+  for (i = 0; i < lb->numobjects; i++) {
+    loopback_object_t *ob = &lb->objects[i];
+
+    doomed[i] = handle == 0xFFFFFFFFU || ob->oid == handle ||
+      object_depth(lb, ob, handle, 0xFFFFFFFFU) != 0;
+  }
+  for (i = 0, j = 0; i < lb->numobjects; i++) {
+    if (doomed[i]) {
+      queue_event(lb, PTP_EC_ObjectRemoved, lb->objects[i].oid);
+      lb->used -= lb->objects[i].size;
+      if (lb->pending == lb->objects[i].oid) {
+	lb->pending = 0;
+      }
+      free_object(&lb->objects[i]);
+      continue;
+    }
+    if (i != j) {
+      lb->objects[j] = lb->objects[i];
+    }
+    j++;
+  }
+  lb->numobjects = j;
+  free(doomed);
+  return 0;
+}
+
+/**
+ * Runs the operation of the current request, with the dataset the
+ * initiator sent if any. The response and the data to return are
+ * left in the responder.
+ */
+static void run_operation(loopback_responder_t *lb, unsigned char const *data,
+			  uint32_t len)
+{
+  PTPContainer *req = &lb->request;
+  PTPContainer *resp = &lb->response;
+  loopback_object_t *ob = NULL;
+  uint32_t i;
+
+  memset(resp, 0, sizeof(PTPContainer));
+  resp->Code = PTP_RC_OK;
+
+  if (!supports_operation(lb, req->Code)) {
+    resp->Code = PTP_RC_OperationNotSupported;
+    return;
+  }
+  if (req->Code != PTP_OC_GetDeviceInfo && req->Code != PTP_OC_OpenSession &&
+      lb->session == 0) {
+    resp->Code = PTP_RC_SessionNotOpen;
+    return;
+  }
+
+  switch (req->Code) {
+  case PTP_OC_GetDeviceInfo:
+    put_device_info(lb);
+    break;
+
+  case PTP_OC_OpenSession:
+    if (lb->session != 0) {
+      resp->Code = PTP_RC_SessionAlreadyOpened;
+    } else if (req->Param1 == 0) {
+      resp->Code = PTP_RC_InvalidParameter;
+    } else {
+      lb->session = req->Param1;
+    }
+    break;
+
+  case PTP_OC_CloseSession:
+    lb->session = 0;
+    lb->pending = 0;
+    break;
+
+  case PTP_OC_GetStorageIDs:
+    buffer_put32(&lb->out, 1);
+    buffer_put32(&lb->out, LOOPBACK_STORAGE_ID);
+    break;
+
+  case PTP_OC_GetStorageInfo:
+    if (req->Param1 != LOOPBACK_STORAGE_ID) {
+      resp->Code = PTP_RC_InvalidStorageId;
+      break;
+    }
+    put_storage_info(lb);
+    break;
+
+  case PTP_OC_GetObjectHandles:
+    {
+      uint32_t countpos;
+      uint32_t count = 0;
+
+      if (req->Param1 != 0xFFFFFFFFU && req->Param1 != LOOPBACK_STORAGE_ID) {
+	resp->Code = PTP_RC_InvalidStorageId;
+	break;
+      }
+      if (req->Param3 != 0 && req->Param3 != 0xFFFFFFFFU) {
+	ob = find_object(lb, req->Param3);
+	if (ob == NULL || ob->format != PTP_OFC_Association) {
+	  resp->Code = PTP_RC_InvalidParentObject;
+	  break;
+	}
+      }
+      countpos = lb->out.len;
+      buffer_put32(&lb->out, 0);
+      for (i = 0; i < lb->numobjects; i++) {
+	loopback_object_t *o = &lb->objects[i];
+
+	if (req->Param2 != 0 && o->format != req->Param2) {
+	  continue;
+	}
+	if (req->Param3 == 0xFFFFFFFFU && o->parent != 0) {
+	  continue;
+	}
+	if (req->Param3 != 0 && req->Param3 != 0xFFFFFFFFU &&
+	    o->parent != req->Param3) {
+	  continue;
+	}
+	buffer_put32(&lb->out, o->oid);
+	count++;
+      }
+      buffer_set32(&lb->out, countpos, count);
+    }
+    break;
+
+  case PTP_OC_GetObjectInfo:
+    ob = find_object(lb, req->Param1);
+    if (ob == NULL) {
+      resp->Code = PTP_RC_InvalidObjectHandle;
+      break;
+    }
+    put_object_info(lb, ob);
+    break;
+
+  case PTP_OC_GetObject:
+  case PTP_OC_GetPartialObject:
+  case PTP_OC_ANDROID_GetPartialObject64:
+    {
+      uint64_t offset = 0;
+      uint64_t length;
+
+      ob = find_object(lb, req->Param1);
+      if (ob == NULL) {
+	resp->Code = PTP_RC_InvalidObjectHandle;
+	break;
+      }
+      length = ob->size;
+      if (req->Code == PTP_OC_GetPartialObject) {
+	offset = req->Param2;
+	length = req->Param3;
+      } else if (req->Code == PTP_OC_ANDROID_GetPartialObject64) {
+	offset = req->Param2 | ((uint64_t) req->Param3 << 32);
+	length = req->Param4;
+      }
+      if (offset > ob->size) {
+	resp->Code = PTP_RC_InvalidParameter;
+	break;
+      }
+      if (length > ob->size - offset) {
+	length = ob->size - offset;
+      }
+      lb->read_oid = ob->oid;
+      lb->read_offset = offset;
+      lb->read_length = length;
+      if (req->Code != PTP_OC_GetObject) {
+	resp->Param1 = (uint32_t) length;
+	resp->Nparam = 1;
+      }
+    }
+    break;
+
+  case PTP_OC_DeleteObject:
+    if (req->Param1 != 0xFFFFFFFFU && find_object(lb, req->Param1) == NULL) {
+      resp->Code = PTP_RC_InvalidObjectHandle;
+      break;
+    }
+    if (delete_object(lb, req->Param1) < 0) {
+      resp->Code = PTP_RC_GeneralError;
+    }
+    break;
+
+  case PTP_OC_SendObjectInfo:
+    {
+      uint32_t offset = 0;
+      uint32_t parent = req->Param2;
+      uint16_t format;
+      uint32_t size;
+      char *filename;
+
+      if (req->Param1 != 0 && req->Param1 != LOOPBACK_STORAGE_ID) {
+	resp->Code = PTP_RC_InvalidStorageId;
+	break;
+      }
+      if (parent == 0xFFFFFFFFU) {
+	parent = 0;
+      }
+      if (parent != 0) {
+	ob = find_object(lb, parent);
+	if (ob == NULL || ob->format != PTP_OFC_Association) {
+	  resp->Code = PTP_RC_InvalidParentObject;
+	  break;
+	}
+      }
+      // StorageID, format, protection status, compressed size
+      offset = 4;
+      if (!get16(data, len, &offset, &format) ||
+	  (offset += 2, !get32(data, len, &offset, &size))) {
+	resp->Code = PTP_RC_MTP_Invalid_Dataset;
+	break;
+      }
+      // Skip to the filename, after the sequence number
+      offset = 52;
+      if (!get_string(data, len, &offset, &filename)) {
+	resp->Code = PTP_RC_MTP_Invalid_Dataset;
+	break;
+      }
+      if (*filename == '\0') {
+	free(filename);
+	resp->Code = PTP_RC_MTP_Invalid_Dataset;
+	break;
+      }
+      if (format == PTP_OFC_Association) {
+	size = 0;
+      }
+      if (lb->used + size > lb->capacity) {
+	free(filename);
+	resp->Code = PTP_RC_StoreFull;
+	break;
+      }
+      ob = add_object(lb, parent, format, size, filename);
+      free(filename);
+      if (ob == NULL) {
+	resp->Code = PTP_RC_GeneralError;
+	break;
+      }
+      ob->modified = time(NULL);
+      lb->pending = format == PTP_OFC_Association ? 0 : ob->oid;
+      resp->Param1 = LOOPBACK_STORAGE_ID;
+      resp->Param2 = parent;
+      resp->Param3 = ob->oid;
+      resp->Nparam = 3;
+      queue_event(lb, PTP_EC_ObjectAdded, ob->oid);
+    }
+    break;
+
+  case PTP_OC_SendObject:
+    // The content went into the object during the data phase
+    lb->pending = 0;
+    break;
+
+  case PTP_OC_MTP_GetObjectPropsSupported:
+    {
+      uint16_t props[LOOPBACK_MAX_PROPERTIES];
+      uint32_t n = 0;
+
+      for (i = 0; i < lb->entry.numproperties; i++) {
+	if (has_property(lb, req->Param1, lb->entry.properties[i])) {
+	  props[n++] = lb->entry.properties[i];
+	}
+      }
+      buffer_put16_array(&lb->out, props, n);
+    }
+    break;
+
+  case PTP_OC_MTP_GetObjectPropDesc:
+    if (!has_property(lb, req->Param2, req->Param1)) {
+      resp->Code = PTP_RC_MTP_ObjectProp_Not_Supported;
+      break;
+    }
+    put_object_prop_desc(lb, req->Param1);
+    break;
+
+  case PTP_OC_MTP_GetObjectPropValue:
+    ob = find_object(lb, req->Param1);
+    if (ob == NULL) {
+      resp->Code = PTP_RC_InvalidObjectHandle;
+      break;
+    }
+    if (!has_property(lb, ob->format, req->Param2)) {
+      resp->Code = PTP_RC_MTP_ObjectProp_Not_Supported;
+      break;
+    }
+    put_property_value(&lb->out, ob, req->Param2);
+    break;
+
+  case PTP_OC_MTP_SetObjectPropValue:
+    ob = find_object(lb, req->Param1);
+    if (ob == NULL) {
+      resp->Code = PTP_RC_InvalidObjectHandle;
+      break;
+    }
+    if (!has_property(lb, ob->format, req->Param2)) {
+      resp->Code = PTP_RC_MTP_ObjectProp_Not_Supported;
+      break;
+    }
+    resp->Code = set_property_value(ob, req->Param2, data, len);
+    if (resp->Code == PTP_RC_OK) {
+      queue_event(lb, PTP_EC_ObjectInfoChanged, ob->oid);
+    }
+    break;
+
+  case PTP_OC_MTP_GetObjectReferences:
+    ob = find_object(lb, req->Param1);
+    if (ob == NULL) {
+      resp->Code = PTP_RC_InvalidObjectHandle;
+      break;
+    }
+    buffer_put32(&lb->out, ob->numrefs);
+    for (i = 0; i < ob->numrefs; i++) {
+      buffer_put32(&lb->out, ob->refs[i]);
+    }
+    break;
+
+  case PTP_OC_MTP_SetObjectReferences:
+    {
+      uint32_t offset = 0;
+      uint32_t n;
+      uint32_t *refs;
+
+      ob = find_object(lb, req->Param1);
+      if (ob == NULL) {
+	resp->Code = PTP_RC_InvalidObjectHandle;
+	break;
+      }
+      if (!get32(data, len, &offset, &n) || n > (len - offset) / 4) {
+	resp->Code = PTP_RC_MTP_Invalid_Dataset;
+	break;
+      }
+      refs = malloc((n ? n : 1) * sizeof(uint32_t));
+      if (refs == NULL) {
+	resp->Code = PTP_RC_GeneralError;
+	break;
+      }
+      for (i = 0; i < n; i++) {
+	get32(data, len, &offset, &refs[i]);
+      }
+      free(ob->refs);
+      ob->refs = refs;
+      ob->numrefs = n;
+    }
+    break;
+
+  case PTP_OC_MTP_GetObjPropList:
+    resp->Code = get_object_prop_list(lb, req->Param1, req->Param2,
+				      req->Param3, req->Param4, req->Param5);
+    break;
+
+  case PTP_OC_ANDROID_BeginEditObject:
+  case PTP_OC_ANDROID_EndEditObject:
+  case PTP_OC_ANDROID_TruncateObject:
+  case PTP_OC_ANDROID_SendPartialObject:
+    ob = find_object(lb, req->Param1);
+    if (ob == NULL || ob->format == PTP_OFC_Association) {
+      resp->Code = PTP_RC_InvalidObjectHandle;
+      break;
+    }
+    if (req->Code == PTP_OC_ANDROID_BeginEditObject) {
+      ob->editing = 1;
+    } else if (!ob->editing) {
+      resp->Code = PTP_RC_GeneralError;
+    } else if (req->Code == PTP_OC_ANDROID_EndEditObject) {
+      ob->editing = 0;
+      ob->modified = time(NULL);
+      queue_event(lb, PTP_EC_ObjectInfoChanged, ob->oid);
+    } else if (req->Code == PTP_OC_ANDROID_TruncateObject) {
+      uint64_t size = req->Param2 | ((uint64_t) req->Param3 << 32);
+
+      if (resize_object(lb, ob, size) < 0) {
+	resp->Code = PTP_RC_GeneralError;
+      }
+    }
+    // The content of SendPartialObject went in during the data phase
+    break;
+
+  default:
+    resp->Code = PTP_RC_OperationNotSupported;
+    break;
+  }
+
+  if (lb->out.failed) {
+    resp->Code = PTP_RC_GeneralError;
+  }
+}
+
+/**
+ * Checks an incoming SendObject or SendPartialObject before its data
+ * phase and sets up where its content goes.
+ */
+static void prepare_write(loopback_responder_t *lb, uint64_t size)
+{
+  PTPContainer *req = &lb->request;
+  PTPContainer *resp = &lb->response;
+  loopback_object_t *ob;
+  uint64_t offset = 0;
+  uint64_t end;
+
+  memset(resp, 0, sizeof(PTPContainer));
+  resp->Code = PTP_RC_OK;
+  lb->write_oid = 0;
+
+  if (!supports_operation(lb, req->Code)) {
+    resp->Code = PTP_RC_OperationNotSupported;
+    return;
+  }
+  if (lb->session == 0) {
+    resp->Code = PTP_RC_SessionNotOpen;
+    return;
+  }
+  if (req->Code == PTP_OC_SendObject) {
+    ob = find_object(lb, lb->pending);
+    if (ob == NULL) {
+      resp->Code = PTP_RC_NoValidObjectInfo;
+      return;
+    }
+  } else {
+    ob = find_object(lb, req->Param1);
+    if (ob == NULL || ob->format == PTP_OFC_Association) {
+      resp->Code = PTP_RC_InvalidObjectHandle;
+      return;
+    }
+    if (!ob->editing) {
+      resp->Code = PTP_RC_GeneralError;
+      return;
+    }
+    offset = req->Param2 | ((uint64_t) req->Param3 << 32);
+  }
+  end = offset + size;
+  if (end > ob->size && lb->used - ob->size + end > lb->capacity) {
+    resp->Code = PTP_RC_StoreFull;
+    return;
+  }
+  if (req->Code == PTP_OC_SendObject) {
+    // Whatever was announced, the object is what arrives now
+    lb->used -= ob->size;
+    ob->size = 0;
+    free(ob->data);
+    ob->data = NULL;
+    ob->generated = 0;
+    if (resize_object(lb, ob, size) < 0) {
+      resp->Code = PTP_RC_GeneralError;
+      return;
+    }
+  } else if (end > ob->size || ob->data == NULL) {
+    // Generated content is kept in memory from the first change on
+    if (resize_object(lb, ob, end > ob->size ? end : ob->size) < 0) {
+      resp->Code = PTP_RC_GeneralError;
+      return;
+    }
+  }
+  lb->write_oid = ob->oid;
+  lb->write_offset = offset;
+}
+
+/*
+ * Timing and progress.
+ */
+
+static void sleep_usec(uint64_t usec)
+{
+  while (usec > 0) {
+    uint64_t n = usec > 500000 ? 500000 : usec;
+
+    usleep((useconds_t) n);
+    usec -= n;
+  }
+}
+
+static void start_phase(loopback_responder_t *lb)
+{
+  gettimeofday(&lb->phase_start, NULL);
+  lb->phase_bytes = 0;
+}
+
+/**
+ * Accounts for bytes moved in a data phase: waits as long as the
+ * configured bandwidth demands and reports the progress of a file
+ * transfer, the same way the USB glue does.
+ * @return 0 to go on, any other value if the transfer was cancelled.
+ */
+static int account_bytes(PTP_USB *ptp_usb, uint64_t bytes)
+{
+  loopback_responder_t *lb = ptp_usb->loopback;
+
+  lb->phase_bytes += bytes;
+  if (lb->entry.config.bandwidth != 0) {
+    struct timeval now;
+    uint64_t elapsed;
+    uint64_t due;
+
+    gettimeofday(&now, NULL);
+    elapsed = (uint64_t) (now.tv_sec - lb->phase_start.tv_sec) * 1000000 +
+      now.tv_usec - lb->phase_start.tv_usec;
+    due = lb->phase_bytes * 1000000 / lb->entry.config.bandwidth;
+    if (due > elapsed) {
+      sleep_usec(due - elapsed);
+    }
+  }
+
+  if (ptp_usb->callback_active) {
+    ptp_usb->current_transfer_complete += bytes;
+    if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
+      // send last update and disable callback.
+      ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
+      ptp_usb->callback_active = 0;
+    }
+    if (ptp_usb->current_transfer_callback != NULL &&
+	ptp_usb->current_transfer_callback(ptp_usb->current_transfer_complete,
+					   ptp_usb->current_transfer_total,
+					   ptp_usb->current_transfer_callback_data) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * The PTPParams transport functions.
+ */
+
+static void reset_transaction(loopback_responder_t *lb)
+{
+  lb->out.len = 0;
+  lb->out.failed = 0;
+  lb->in.len = 0;
+  lb->in.failed = 0;
+  lb->read_oid = 0;
+  lb->write_oid = 0;
+}
+
+static uint16_t
+loopback_sendreq (PTPParams* params, PTPContainer* req, int dataphase)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+  loopback_responder_t *lb = ptp_usb->loopback;
+
+  LIBMTP_USB_DEBUG("REQUEST: 0x%04x\n", req->Code);
+  reset_transaction(lb);
+  lb->request = *req;
+  lb->dataphase = dataphase & PTP_DP_DATA_MASK;
+  memset(&lb->response, 0, sizeof(PTPContainer));
+
+  start_phase(lb);
+  if (account_bytes(ptp_usb, PTP_USB_BULK_HDR_LEN +
+		    sizeof(uint32_t) * req->Nparam)) {
+    return PTP_ERROR_CANCEL;
+  }
+  // Requests without a dataset to receive run right away
+  if (lb->dataphase != PTP_DP_SENDDATA) {
+    run_operation(lb, NULL, 0);
+  }
+  return PTP_RC_OK;
+}
+
+static uint16_t
+loopback_senddata (PTPParams* params, PTPContainer* ptp,
+		   uint64_t size, PTPDataHandler *handler)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+  loopback_responder_t *lb = ptp_usb->loopback;
+  int streamed = ptp->Code == PTP_OC_SendObject ||
+    ptp->Code == PTP_OC_ANDROID_SendPartialObject;
+  unsigned char *chunk;
+  uint64_t done = 0;
+  int cancelled = 0;
+
+  LIBMTP_USB_DEBUG("SEND DATA PHASE: %llu bytes\n", (unsigned long long) size);
+  if (streamed) {
+    prepare_write(lb, size);
+  }
+  chunk = malloc(LOOPBACK_CHUNK_SIZE);
+  if (chunk == NULL) {
+    return PTP_ERROR_IO;
+  }
+  start_phase(lb);
+  if (account_bytes(ptp_usb, PTP_USB_BULK_HDR_LEN)) {
+    cancelled = 1;
+  }
+  while (!cancelled && done < size) {
+    unsigned long want = size - done > LOOPBACK_CHUNK_SIZE ?
+      LOOPBACK_CHUNK_SIZE : size - done;
+    unsigned long got = 0;
+    uint16_t ret;
+
+    ret = handler->getfunc(params, handler->priv, want, chunk, &got);
+    if (ret != PTP_RC_OK) {
+      free(chunk);
+      return PTP_ERROR_CANCEL;
+    }
+    if (got == 0) {
+      free(chunk);
+      return PTP_ERROR_IO;
+    }
+    if (streamed) {
+      loopback_object_t *ob = find_object(lb, lb->write_oid);
+
+      if (ob != NULL && ob->data != NULL) {
+	memcpy(ob->data + lb->write_offset + done, chunk, got);
+      }
+    } else {
+      unsigned char *p = buffer_reserve(&lb->in, got);
+
+      if (p != NULL) {
+	memcpy(p, chunk, got);
+      }
+    }
+    done += got;
+    if (account_bytes(ptp_usb, got)) {
+      cancelled = 1;
+    }
+  }
+  free(chunk);
+  if (cancelled) {
+    return PTP_ERROR_CANCEL;
+  }
+  if (!streamed) {
+    if (lb->in.failed) {
+      memset(&lb->response, 0, sizeof(PTPContainer));
+      lb->response.Code = PTP_RC_GeneralError;
+    } else {
+      run_operation(lb, lb->in.data, lb->in.len);
+    }
+  } else if (lb->response.Code == PTP_RC_OK) {
+    run_operation(lb, NULL, 0);
+  }
+  return PTP_RC_OK;
+}
+
+static uint16_t
+loopback_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+  loopback_responder_t *lb = ptp_usb->loopback;
+  loopback_object_t *ob = NULL;
+  unsigned char *chunk = NULL;
+  uint64_t total;
+  uint64_t done = 0;
+
+  // A failed operation sends its response instead of data
+  if (lb->response.Code != PTP_RC_OK) {
+    return lb->response.Code;
+  }
+  if (lb->read_oid != 0) {
+    ob = find_object(lb, lb->read_oid);
+    total = lb->read_length;
+    chunk = malloc(LOOPBACK_CHUNK_SIZE);
+    if (ob == NULL || chunk == NULL) {
+      free(chunk);
+      return PTP_ERROR_IO;
+    }
+  } else {
+    total = lb->out.len;
+  }
+  LIBMTP_USB_DEBUG("GET DATA PHASE: %llu bytes\n", (unsigned long long) total);
+
+  start_phase(lb);
+  if (account_bytes(ptp_usb, PTP_USB_BULK_HDR_LEN)) {
+    free(chunk);
+    return PTP_ERROR_CANCEL;
+  }
+  while (done < total) {
+    uint32_t n = total - done > LOOPBACK_CHUNK_SIZE ?
+      LOOPBACK_CHUNK_SIZE : total - done;
+    unsigned char *p;
+
+    if (ob != NULL) {
+      read_content(ob, lb->read_offset + done, chunk, n);
+      p = chunk;
+    } else {
+      p = lb->out.data + done;
+    }
+    if (handler->putfunc(params, handler->priv, n, p) != PTP_RC_OK) {
+      LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler."
+		   "Not enough memory or temp/destination free space?");
+      free(chunk);
+      return PTP_ERROR_CANCEL;
+    }
+    done += n;
+    if (account_bytes(ptp_usb, n)) {
+      free(chunk);
+      return PTP_ERROR_CANCEL;
+    }
+  }
+  free(chunk);
+  return PTP_RC_OK;
+}
+
+static uint16_t
+loopback_getresp (PTPParams* params, PTPContainer* resp)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+  loopback_responder_t *lb = ptp_usb->loopback;
+  uint16_t code = lb->response.Code;
+
+  if (lb->entry.config.latency != 0) {
+    sleep_usec(lb->entry.config.latency);
+  }
+  LIBMTP_USB_DEBUG("RESPONSE: 0x%04x\n", code);
+  reset_transaction(lb);
+  if (code != PTP_RC_OK) {
+    return code;
+  }
+  resp->Code = code;
+  resp->SessionID = params->session_id;
+  resp->Transaction_ID = lb->request.Transaction_ID;
+  resp->Param1 = lb->response.Param1;
+  resp->Param2 = lb->response.Param2;
+  resp->Param3 = lb->response.Param3;
+  resp->Param4 = lb->response.Param4;
+  resp->Param5 = lb->response.Param5;
+  resp->Nparam = lb->response.Nparam;
+  return code;
+}
+
+static uint16_t
+loopback_event (PTPParams* params, PTPContainer* event, int wait)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+  loopback_responder_t *lb = ptp_usb->loopback;
+  uint16_t ret = PTP_RC_OK;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&lb->event_lock);
+  lb->waiters++;
+  while (wait && lb->numevents == 0 && !lb->closing) {
+    pthread_cond_wait(&lb->event_cond, &lb->event_lock);
+  }
+#endif
+  if (lb->closing) {
+    ret = PTP_ERROR_IO;
+  } else if (lb->numevents == 0) {
+    ret = wait ? PTP_ERROR_IO : PTP_ERROR_TIMEOUT;
+  } else {
+    *event = lb->events[0];
+    lb->numevents--;
+    memmove(&lb->events[0], &lb->events[1],
+	    lb->numevents * sizeof(PTPContainer));
+  }
+#ifdef HAVE_PTHREAD_H
+  lb->waiters--;
+  pthread_cond_broadcast(&lb->event_cond);
+  pthread_mutex_unlock(&lb->event_lock);
+#endif
+  return ret;
+}
+
+static uint16_t
+loopback_event_check (PTPParams* params, PTPContainer* event)
+{
+  return loopback_event(params, event, 0);
+}
+
+static uint16_t
+loopback_event_wait (PTPParams* params, PTPContainer* event)
+{
+  return loopback_event(params, event, 1);
+}
+
+static uint16_t
+loopback_cancelreq (PTPParams* params, uint32_t transaction_id)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+
+  reset_transaction(ptp_usb->loopback);
+  return PTP_RC_OK;
+}
+
+static uint16_t
+loopback_devstatreq (PTPParams* params)
+{
+  return PTP_RC_OK;
+}
+
+/*
+ * Device management.
+ */
+
+/**
+ * Registers a loopback device.
+ * @param config the configuration of the device.
+ * @param properties the PTP codes of the object properties to support.
+ * @param numproperties the number of properties.
+ * @param device the raw device to fill in.
+ * @return 0 on success, -1 when no more devices can be registered.
+ */
+int add_loopback_device(LIBMTP_loopback_config_t const *config,
+			uint16_t const *properties, uint32_t numproperties,
+			LIBMTP_raw_device_t *device)
+{
+  loopback_entry_t *entry;
+  uint32_t i;
+  int ret = -1;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&loopback_devices_lock);
+#endif
+  if (loopback_numdevices < LOOPBACK_MAX_DEVICES) {
+    entry = &loopback_devices[loopback_numdevices++];
+    memset(entry, 0, sizeof(loopback_entry_t));
+    entry->config = *config;
+    // The property list is copied, do not keep the caller's pointer
+    entry->config.properties = NULL;
+    for (i = 0; i < numproperties && i < LOOPBACK_MAX_PROPERTIES; i++) {
+      if (property_index(properties[i]) >= 0) {
+	entry->properties[entry->numproperties++] = properties[i];
+      }
+    }
+    if (properties == NULL) {
+      for (i = 0; i < LOOPBACK_NUM_BASIC_PROPERTIES; i++) {
+	entry->properties[i] = loopback_property_table[i].code;
+      }
+      entry->numproperties = LOOPBACK_NUM_BASIC_PROPERTIES;
+    }
+
+    memset(device, 0, sizeof(LIBMTP_raw_device_t));
+    device->device_entry.vendor = "libmtp";
+    device->device_entry.product = "Loopback device";
+    device->bus_location = LOOPBACK_BUS_LOCATION;
+    device->devnum = loopback_numdevices;
+    ret = 0;
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&loopback_devices_lock);
+#endif
+  return ret;
+}
+
+/**
+ * Tells whether a raw device is a registered loopback device.
+ */
+int is_loopback_device(LIBMTP_raw_device_t const *device)
+{
+  int ret;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&loopback_devices_lock);
+#endif
+  ret = device->bus_location == LOOPBACK_BUS_LOCATION &&
+    device->devnum >= 1 && device->devnum <= loopback_numdevices;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&loopback_devices_lock);
+#endif
+  return ret;
+}
+
+static void free_responder(loopback_responder_t *lb)
+{
+  uint32_t i;
+
+  for (i = 0; i < lb->numobjects; i++) {
+    free_object(&lb->objects[i]);
+  }
+  free(lb->objects);
+  free(lb->out.data);
+  free(lb->in.data);
+  free(lb->events);
+#ifdef HAVE_PTHREAD_H
+  pthread_cond_destroy(&lb->event_cond);
+  pthread_mutex_destroy(&lb->event_lock);
+#endif
+  free(lb);
+}
+
+/**
+ * Opens a loopback device, the counterpart of configure_usb_device().
+ * This creates the responder, hooks it into the PTP parameters and
+ * opens the session.
+ */
+LIBMTP_error_number_t configure_loopback_device(LIBMTP_raw_device_t *device,
+						PTPParams *params,
+						void **usbinfo)
+{
+  PTP_USB *ptp_usb;
+  loopback_responder_t *lb;
+  uint16_t ret;
+
+  if (!is_loopback_device(device)) {
+    return LIBMTP_ERROR_NO_DEVICE_ATTACHED;
+  }
+  ptp_usb = (PTP_USB *) calloc(1, sizeof(PTP_USB));
+  lb = (loopback_responder_t *) calloc(1, sizeof(loopback_responder_t));
+  if (ptp_usb == NULL || lb == NULL) {
+    free(ptp_usb);
+    free(lb);
+    return LIBMTP_ERROR_MEMORY_ALLOCATION;
+  }
+  lb->events = (PTPContainer *) malloc(LOOPBACK_MAX_EVENTS *
+				       sizeof(PTPContainer));
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&lb->event_lock, NULL);
+  pthread_cond_init(&lb->event_cond, NULL);
+  pthread_mutex_lock(&loopback_devices_lock);
+#endif
+  lb->entry = loopback_devices[device->devnum - 1];
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&loopback_devices_lock);
+#endif
+  lb->devnum = device->devnum;
+  if (lb->events == NULL || populate_storage(lb) < 0) {
+    LIBMTP_ERROR("LIBMTP PANIC: Unable to create loopback storage\n");
+    free_responder(lb);
+    free(ptp_usb);
+    return LIBMTP_ERROR_MEMORY_ALLOCATION;
+  }
+
+  memcpy(&ptp_usb->rawdevice, device, sizeof(LIBMTP_raw_device_t));
+  ptp_usb->loopback = lb;
+  ptp_usb->bcdusb = 0x0200;
+  ptp_usb->inep_maxpacket = PTP_USB_BULK_HS_MAX_PACKET_LEN_READ;
+  ptp_usb->outep_maxpacket = PTP_USB_BULK_HS_MAX_PACKET_LEN_WRITE;
+
+  params->sendreq_func = loopback_sendreq;
+  params->senddata_func = loopback_senddata;
+  params->getresp_func = loopback_getresp;
+  params->getdata_func = loopback_getdata;
+  params->event_check = loopback_event_check;
+  params->event_check_queue = loopback_event_check;
+  params->event_wait = loopback_event_wait;
+  params->cancelreq_func = loopback_cancelreq;
+  params->devstatreq_func = loopback_devstatreq;
+  params->data = ptp_usb;
+  params->transaction_id = 0;
+  params->byteorder = PTP_DL_LE;
+
+  ret = ptp_opensession(params, 1);
+  if (ret != PTP_RC_OK) {
+    LIBMTP_ERROR("LIBMTP PANIC: Could not open session! "
+		 "(Return code %d)\n", ret);
+    free_responder(lb);
+    free(ptp_usb);
+    return LIBMTP_ERROR_CONNECTING;
+  }
+  *usbinfo = (void *) ptp_usb;
+  return LIBMTP_ERROR_NONE;
+}
+
+/**
+ * Closes a loopback device, the counterpart of close_device(). Threads
+ * waiting for events are woken up and fail.
+ */
+void close_loopback_device(PTP_USB *ptp_usb, PTPParams *params)
+{
+  loopback_responder_t *lb = ptp_usb->loopback;
+
+  if (ptp_closesession(params) != PTP_RC_OK)
+    LIBMTP_ERROR("ERROR: Could not close session!\n");
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&lb->event_lock);
+  lb->closing = 1;
+  pthread_cond_broadcast(&lb->event_cond);
+  while (lb->waiters > 0) {
+    pthread_cond_wait(&lb->event_cond, &lb->event_lock);
+  }
+  pthread_mutex_unlock(&lb->event_lock);
+#endif
+  free_responder(lb);
+  ptp_usb->loopback = NULL;
+}
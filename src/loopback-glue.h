@@ -0,0 +1,50 @@
+/**
+ * \file loopback-glue.h
+ * Loopback transport towards a simulated in-process MTP responder.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+#ifndef LOOPBACK_GLUE_H
+#define LOOPBACK_GLUE_H
+
+#include "ptp.h"
+#include "libmtp.h"
+#include "libusb-glue.h"
+
+/* Make functions available for C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/**
+ * Bus location of all loopback raw devices, no USB bus has this one.
+ */
+#define LOOPBACK_BUS_LOCATION 0xFFFFFFFFU
+
+int add_loopback_device(LIBMTP_loopback_config_t const *config,
+			uint16_t const *properties, uint32_t numproperties,
+			LIBMTP_raw_device_t *device);
+int is_loopback_device(LIBMTP_raw_device_t const *device);
+LIBMTP_error_number_t configure_loopback_device(LIBMTP_raw_device_t *device,
+						PTPParams *params,
+						void **usbinfo);
+void close_loopback_device(PTP_USB *ptp_usb, PTPParams *params);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif //  LOOPBACK_GLUE_H
@@ -69,13 +69,13 @@ static void write_from_spl_text_t(LIBMTP_mtpdevice_t *device, const int fd, text
 static void free_spl_text_t(text_t* p);
 static void print_spl_text_t(text_t* p);
 static uint32_t trackno_spl_text_t(text_t* p);
-static void tracks_from_spl_text_t(text_t* p, uint32_t* tracks, LIBMTP_folder_t* folders, LIBMTP_file_t* files);
-static void spl_text_t_from_tracks(text_t** p, uint32_t* tracks, const uint32_t trackno, const uint32_t ver_major, const uint32_t ver_minor, char* dnse, LIBMTP_folder_t* folders, LIBMTP_file_t* files);
+static void tracks_from_spl_text_t(text_t* p, uint32_t* tracks, PTPParams* params);
+static void spl_text_t_from_tracks(text_t** p, uint32_t* tracks, const uint32_t trackno, const uint32_t ver_major, const uint32_t ver_minor, char* dnse, PTPParams* params);
 
-static uint32_t discover_id_from_filepath(const char* s, LIBMTP_folder_t* folders, LIBMTP_file_t* files); // TODO add file/dir cached args
-static void discover_filepath_from_id(char** p, uint32_t track, LIBMTP_folder_t* folders, LIBMTP_file_t* files);
-static void find_folder_name(LIBMTP_folder_t* folders, uint32_t* id, char** name);
-static uint32_t find_folder_id(LIBMTP_folder_t* folders, uint32_t parent, char* name);
+static uint32_t discover_id_from_filepath(const char* s, PTPParams* params);
+static void discover_filepath_from_id(char** p, uint32_t track, PTPParams* params);
+static void find_folder_name(PTPParams* params, uint32_t* id, char** name);
+static uint32_t find_folder_id(PTPParams* params, uint32_t parent, char* name);
 
 static void append_text_t(text_t** t, char* s);
 
@@ -152,17 +152,11 @@ void spl_to_playlist_t(LIBMTP_mtpdevice_t* device, PTPObjectInfo *oi,
   text_t* p = read_into_spl_text_t(device, fd);
   close(fd);
 
-  // FIXME cache these somewhere else so we don't keep calling this!
-  LIBMTP_folder_t *folders;
-  LIBMTP_file_t *files;
-  folders = LIBMTP_Get_Folder_List(device);
-  files = LIBMTP_Get_Filelisting_With_Callback(device, NULL, NULL);
-
   // convert the playlist listing to track ids
   pl->no_tracks = trackno_spl_text_t(p);
   LIBMTP_PLST_DEBUG("%u track%s found\n", pl->no_tracks, pl->no_tracks==1?"":"s");
   pl->tracks = malloc(sizeof(uint32_t)*(pl->no_tracks));
-  tracks_from_spl_text_t(p, pl->tracks, folders, files);
+  tracks_from_spl_text_t(p, pl->tracks, (PTPParams *) device->params);
 
   free_spl_text_t(p);
 
@@ -183,10 +177,6 @@ int playlist_t_to_spl(LIBMTP_mtpdevice_t *device,
                       LIBMTP_playlist_t * const pl)
 {
   text_t* t;
-  LIBMTP_folder_t *folders;
-  LIBMTP_file_t *files;
-  folders = LIBMTP_Get_Folder_List(device);
-  files = LIBMTP_Get_Filelisting_With_Callback(device, NULL, NULL);
 
   char tmpname[] = "/tmp/mtp-spl2pl-XXXXXX"; // must be a var since mkstemp modifies it
 
@@ -213,7 +203,7 @@ int playlist_t_to_spl(LIBMTP_mtpdevice_t *device,
   LIBMTP_PLST_DEBUG(".spl version %d.%02d\n", ver_major, ver_minor);
 
   // create the text for the playlist
-  spl_text_t_from_tracks(&t, pl->tracks, pl->no_tracks, ver_major, ver_minor, NULL, folders, files);
+  spl_text_t_from_tracks(&t, pl->tracks, pl->no_tracks, ver_major, ver_minor, NULL, (PTPParams *) device->params);
   write_from_spl_text_t(device, fd, t);
   free_spl_text_t(t); // done with the text
 
@@ -287,20 +277,25 @@ int update_spl_playlist(LIBMTP_mtpdevice_t *device,
     LIBMTP_PLST_DEBUG("new tracks detected:\n");
     LIBMTP_PLST_DEBUG("delete old playlist and build a new one\n");
     LIBMTP_PLST_DEBUG(" NOTE: new playlist_id will result!\n");
-    if(LIBMTP_Delete_Object(device, old->playlist_id) != 0)
+    if(LIBMTP_Delete_Object(device, old->playlist_id) != 0) {
+      LIBMTP_destroy_playlist_t(old);
       return -1;
+    }
 
     if(strcmp(old->name,newlist->name) == 0)
       LIBMTP_PLST_DEBUG("name unchanged\n");
     else
       LIBMTP_PLST_DEBUG("name is changing too -> %s\n",newlist->name);
 
+    LIBMTP_destroy_playlist_t(old);
     return LIBMTP_Create_New_Playlist(device, newlist);
   }
 
 
   // update the name only
-  if(strcmp(old->name,newlist->name) != 0) {
+  delta = strcmp(old->name,newlist->name) != 0;
+  LIBMTP_destroy_playlist_t(old);
+  if(delta) {
     LIBMTP_PLST_DEBUG("ONLY name is changing -> %s\n",newlist->name);
     LIBMTP_PLST_DEBUG("playlist_id will remain unchanged\n");
     char* s = malloc(sizeof(char)*(strlen(newlist->name)+5));
@@ -554,19 +549,17 @@ static uint32_t trackno_spl_text_t(text_t* p) {
  * @param tracks returned list of track id's for the playlist_t, must be large
  *               enough to accomodate all the tracks as reported by
  *               trackno_spl_text_t()
- * @param folders the folders list for the device
- * @param files the files list for the device
+ * @param params the PTP parameters holding the object cache
  * @see spl_to_playlist_t()
  */
 static void tracks_from_spl_text_t(text_t* p,
                                    uint32_t* tracks,
-                                   LIBMTP_folder_t* folders,
-                                   LIBMTP_file_t* files)
+                                   PTPParams* params)
 {
   uint32_t c = 0;
   while(p != NULL) {
     if(p->text[0] == '\\' ) {
-      tracks[c] = discover_id_from_filepath(p->text, folders, files);
+      tracks[c] = discover_id_from_filepath(p->text, params);
       LIBMTP_PLST_DEBUG("track %d = %s (%u)\n", c+1, p->text, tracks[c]);
       c++;
     }
@@ -581,8 +574,7 @@ static void tracks_from_spl_text_t(text_t* p,
  *
  * @param p the text to search
  * @param tracks list of track id's to look up
- * @param folders the folders list for the device
- * @param files the files list for the device
+ * @param params the PTP parameters holding the object cache
  * @see playlist_t_to_spl()
  */
 static void spl_text_t_from_tracks(text_t** p,
@@ -591,8 +583,7 @@ static void spl_text_t_from_tracks(text_t** p,
                                    const uint32_t ver_major,
                                    const uint32_t ver_minor,
                                    char* dnse,
-                                   LIBMTP_folder_t* folders,
-                                   LIBMTP_file_t* files)
+                                   PTPParams* params)
 {
 
   // HEADER
@@ -610,7 +601,7 @@ static void spl_text_t_from_tracks(text_t** p,
   unsigned int i;
   char* f;
   for(i=0;i<trackno;i++) {
-    discover_filepath_from_id(&f, tracks[i], folders, files);
+    discover_filepath_from_id(&f, tracks[i], params);
 
     if(f != NULL) {
       append_text_t(&c, f);
@@ -652,16 +643,14 @@ static void spl_text_t_from_tracks(text_t** p,
  * @param p returns the file path (ie: \Music\song.mp3),
  *          (*p) == NULL if the look up fails
  * @param track track id to look up
- * @param folders the folders list for the device
- * @param files the files list for the device
+ * @param params the PTP parameters holding the object cache
  * @see spl_text_t_from_tracks()
  */
 
 // returns p = NULL on failure, else the filepath to the track including track name, allocated as a correct length string
 static void discover_filepath_from_id(char** p,
                                       uint32_t track,
-                                      LIBMTP_folder_t* folders,
-                                      LIBMTP_file_t* files)
+                                      PTPParams* params)
 {
   // fill in a string from the right side since we don't know the root till the end
   const int M = 1024;
@@ -673,24 +662,23 @@ static void discover_filepath_from_id(char** p,
 
 
   // find the right file
-  while(files != NULL && files->item_id != track) {
-    files = files->next;
-  }
-  // if we didn't find a matching file, abort
-  if(files == NULL)
+  PTPObject* ob;
+  if(ptp_find_object_in_cache(params, track, &ob) != PTP_RC_OK ||
+     ob->oi.ObjectFormat == PTP_OFC_Association ||
+     ob->oi.Filename == NULL)
     return;
 
   // stuff the filename into our string
   // FIXME: check for string overflow before it occurs
-  iw = iw - (strlen(files->filename) +1); // leave room for '\0' at the end
-  strcpy(iw,files->filename);
+  iw = iw - (strlen(ob->oi.Filename) +1); // leave room for '\0' at the end
+  strcpy(iw,ob->oi.Filename);
 
   // next follow the directories to the root
   // prepending folders to the path as we go
-  uint32_t id = files->parent_id;
+  uint32_t id = ob->oi.ParentObject;
   char* f = NULL;
   while(id != 0) {
-    find_folder_name(folders, &id, &f);
+    find_folder_name(params, &id, &f);
     if(f == NULL) return; // fail if the next part of the path couldn't be found
     iw = iw - (strlen(f) +1);
     // FIXME: check for string overflow before it occurs
@@ -714,12 +702,12 @@ static void discover_filepath_from_id(char** p,
  *
  * @param s file path to look up (ie: \Music\song.mp3),
  *          (*p) == NULL if the look up fails
- * @param folders the folders list for the device
- * @param files the files list for the device
+ * @param params the PTP parameters holding the object cache, the folders
+ *          along the path must already be in it
  * @return track id, 0 means failure
  * @see tracks_from_spl_text_t()
  */
-static uint32_t discover_id_from_filepath(const char* s, LIBMTP_folder_t* folders, LIBMTP_file_t* files)
+static uint32_t discover_id_from_filepath(const char* s, PTPParams* params)
 {
   // abort if this isn't a path
   if(s[0] != '\\')
@@ -744,18 +732,15 @@ static uint32_t discover_id_from_filepath(const char* s, LIBMTP_folder_t* folder
     // if its the last part of the string, its the filename
     if(sci + strlen(sci) == sc + len) {
 
-      while(files != NULL) {
-        // check parent matches id and name matches sci
-        if( (files->parent_id == id) &&
-            (strcmp(files->filename, sci) == 0) ) { // found it!
-          id = files->item_id;
-          break;
-        }
-        files = files->next;
+      PTPObject* ob;
+      // check parent matches id and name matches sci
+      if( (ptp_find_object_by_filename(params, 0, id, sci, &ob) == PTP_RC_OK) &&
+          (ob->oi.ObjectFormat != PTP_OFC_Association) ) { // found it!
+        id = ob->oid;
       }
     }
     else { // otherwise its part of the directory path
-      id = find_folder_id(folders, id, sci);
+      id = find_folder_id(params, id, sci);
     }
 
     // move to next folder/file
@@ -775,23 +760,23 @@ static uint32_t discover_id_from_filepath(const char* s, LIBMTP_folder_t* folder
 /**
  * Find the folder name given the folder's id.
  *
- * @param folders the folders list for the device
+ * @param params the PTP parameters holding the object cache
  * @param id the folder_id to look up, returns the folder's parent folder_id
  * @param name returns the name of the folder or NULL on failure
  * @see discover_filepath_from_id()
  */
-static void find_folder_name(LIBMTP_folder_t* folders, uint32_t* id, char** name)
+static void find_folder_name(PTPParams* params, uint32_t* id, char** name)
 {
+  PTPObject* ob;
 
-  // FIXME this function is exactly LIBMTP_Find_Folder
-
-  LIBMTP_folder_t* f = LIBMTP_Find_Folder(folders, *id);
-  if(f == NULL) {
+  if( (ptp_find_object_in_cache(params, *id, &ob) != PTP_RC_OK) ||
+      (ob->oi.ObjectFormat != PTP_OFC_Association) ||
+      (ob->oi.Filename == NULL) ) {
     *name = NULL;
   }
   else { // found it!
-    *name = strdup(f->name);
-    *id = f->parent_id;
+    *name = strdup(ob->oi.Filename);
+    *id = ob->oi.ParentObject;
   }
 }
 
@@ -799,33 +784,21 @@ static void find_folder_name(LIBMTP_folder_t* folders, uint32_t* id, char** name
 /**
  * Find the folder id given the folder's name and parent id.
  *
- * @param folders the folders list for the device
+ * @param params the PTP parameters holding the object cache
  * @param parent the folder's parent's id
  * @param name the name of the folder
  * @return the folder_id or 0 on failure
  * @see discover_filepath_from_id()
  */
-static uint32_t find_folder_id(LIBMTP_folder_t* folders, uint32_t parent, char* name) {
+static uint32_t find_folder_id(PTPParams* params, uint32_t parent, char* name) {
 
-  if(folders == NULL)
-    return 0;
-
-  // found it!
-  else if( (folders->parent_id == parent) &&
-           (strcmp(folders->name, name) == 0) )
-    return folders->folder_id;
+  PTPObject* ob;
 
-  // no luck so far, search both siblings and children
-  else {
-    uint32_t id = 0;
+  if( (ptp_find_object_by_filename(params, 0, parent, name, &ob) == PTP_RC_OK) &&
+      (ob->oi.ObjectFormat == PTP_OFC_Association) )
+    return ob->oid;
 
-    if(folders->sibling != NULL)
-      id = find_folder_id(folders->sibling, parent, name);
-    if( (id == 0) && (folders->child != NULL) )
-      id = find_folder_id(folders->child, parent, name);
-
-    return id;
-  }
+  return 0;
 }
 
 
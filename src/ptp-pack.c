@@ -79,6 +79,23 @@ ptp_unpack_string(PTPParams *params, const unsigned char* data, uint32_t *offset
 	if (*offset + ucs2len * sizeof(ucs2src[0]) > size)
 		return 0;
 
+	if (params->utf8_strings) {
+		/* straight into the result, which is trimmed afterwards */
+		unsigned int	n;
+		char		*str, *shrunk;
+
+		str = malloc (3 * ucs2len + 1);
+		if (!str)
+			return 0;
+		n = ptp_utf16le_to_utf8 (data + *offset, ucs2len, str);
+		str[n] = '\0';
+		if (n < 3 * ucs2len && (shrunk = realloc (str, n + 1)))
+			str = shrunk;
+		*result = str;
+		*offset += 2 * ucs2len;
+		return 1;
+	}
+
 	/* copy to string[] to ensure correct alignment for iconv(3) */
 	memcpy(ucs2src, data + *offset, ucs2len * sizeof(ucs2src[0]));
 	ucs2src[ucs2len] = 0;   /* be paranoid!  add a terminator. */
@@ -128,6 +145,24 @@ ptp_pack_string(PTPParams *params, const char *string, unsigned char* data, uint
 		return;
 	}
 
+	if (params->utf8_strings) {
+		unsigned int units;
+
+		/* straight into data, there is room for one unit per byte of string */
+		switch (ptp_utf8_to_utf16le (string, convlen, &data[offset+1], PTP_MAXSTRLEN-1, &units)) {
+		case -1:	/* like a failing iconv(3) */
+			units = 0;
+			break;
+		case -2:
+			*len = 0;
+			return;
+		}
+		htod8a(&data[offset], units+1);
+		htod16a(&data[offset+units*2+1], 0x0000);
+		*len = (uint8_t) units+1;
+		return;
+	}
+
 	/* Cannot exceed 255 (PTP_MAXSTRLEN) since it is a single byte, duh ... */
 	memset(ucs2strp, 0, sizeof(ucs2str));  /* XXX: necessary? */
 #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
@@ -40,6 +40,9 @@
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
 
 /*#include "libgphoto2/i18n.h"*/
 #define _(x) x
@@ -124,6 +127,9 @@ static uint16_t ptp_exit_recv_memory_handler (PTPDataHandler*,unsigned char**,un
 static uint16_t ptp_init_recv_memory_handler(PTPDataHandler*);
 static uint16_t ptp_init_send_memory_handler(PTPDataHandler*,unsigned char*,unsigned long len);
 static uint16_t ptp_exit_send_memory_handler (PTPDataHandler *handler);
+static void _ob_names_add (PTPObjects *objects, uint32_t key, uint32_t oid);
+static uint32_t _ob_name_key_of (PTPObject const *ob);
+static void _ob_names_update (PTPObjects *objects, PTPObject *ob, int hadname, uint32_t oldkey);
 
 void
 ptp_debug (PTPParams *params, const char *format, ...)
@@ -190,10 +196,637 @@ ptp_debug_data(PTPParams *params, const uint8_t* data, int size)
 	}
 }
 
+/*
+ * String conversion without iconv(3), used by ptp-pack.c when the host
+ * side is UTF-8 (params->utf8_strings). The device side is UTF-16LE, of
+ * which older devices only use the UCS-2 subset. Most names are plain
+ * ASCII, so both directions first check a machine word at a time whether
+ * they can just widen or narrow the bytes.
+ */
+
+/* Returns the number of leading units of src below 0x80. */
+static inline unsigned int
+ptp_utf16le_ascii_prefix (const unsigned char *src, unsigned int units)
+{
+	/* a unit is not ASCII if bit 7 of its low or any bit of its high byte is set */
+	static const unsigned char nonascii[8] = { 0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff };
+	uint64_t	mask, w;
+	unsigned int	i = 0;
+
+	memcpy (&mask, nonascii, sizeof(mask));
+	for (; i + 4 <= units; i += 4) {
+		memcpy (&w, src + 2*i, sizeof(w));
+		if (w & mask)
+			break;
+	}
+	while (i < units && src[2*i] < 0x80 && !src[2*i+1])
+		i++;
+	return i;
+}
+
+/**
+ * ptp_utf16le_to_utf8:
+ *		src	- UTF-16LE string
+ *		units	- number of 16 bit units in src
+ *		dest	- buffer of at least 3 * units bytes
+ *
+ * Converts units of src to UTF-8, unpaired surrogates become U+FFFD.
+ * dest is not terminated.
+ *
+ * Return values: the number of bytes written to dest.
+ **/
+unsigned int
+ptp_utf16le_to_utf8 (const unsigned char *src, unsigned int units, char *dest)
+{
+	unsigned char	*d = (unsigned char *) dest;
+	unsigned int	i, n = ptp_utf16le_ascii_prefix (src, units);
+
+	for (i = 0; i < n; i++)
+		d[i] = src[2*i];
+	d += n;
+	for (i = n; i < units; i++) {
+		uint32_t	c = src[2*i] | (src[2*i+1] << 8);
+
+		if (c < 0x80) {
+			*d++ = c;
+		} else if (c < 0x800) {
+			*d++ = 0xc0 | (c >> 6);
+			*d++ = 0x80 | (c & 0x3f);
+		} else if (c >= 0xd800 && c < 0xdc00 && i + 1 < units &&
+			   (src[2*i+3] & 0xfc) == 0xdc) {
+			c = 0x10000 + ((c - 0xd800) << 10) + ((src[2*i+2] | (src[2*i+3] << 8)) - 0xdc00);
+			i++;
+			*d++ = 0xf0 | (c >> 18);
+			*d++ = 0x80 | ((c >> 12) & 0x3f);
+			*d++ = 0x80 | ((c >> 6) & 0x3f);
+			*d++ = 0x80 | (c & 0x3f);
+		} else {
+			if (c >= 0xd800 && c < 0xe000)
+				c = 0xfffd;
+			*d++ = 0xe0 | (c >> 12);
+			*d++ = 0x80 | ((c >> 6) & 0x3f);
+			*d++ = 0x80 | (c & 0x3f);
+		}
+	}
+	return d - (unsigned char *) dest;
+}
+
+/**
+ * ptp_utf8_to_utf16le:
+ *		src	- UTF-8 string
+ *		len	- number of bytes in src
+ *		dest	- buffer for max units, at most len units are written
+ *		max	- maximum number of units to write
+ *		units	- returns the number of units written
+ *
+ * Converts src to UTF-16LE, characters outside the BMP become surrogate
+ * pairs. dest is not terminated. On errors *units tells how far the
+ * conversion got.
+ *
+ * Return values: 0 on success, -1 if src is not valid UTF-8, -2 if
+ * the result does not fit into max units.
+ **/
+int
+ptp_utf8_to_utf16le (const char *src, size_t len, unsigned char *dest, unsigned int max, unsigned int *units)
+{
+	const unsigned char	*s = (const unsigned char *) src;
+	size_t			i = 0;
+	unsigned int		n = 0, k;
+	int			ret = 0;
+
+	while (i < len) {
+		uint32_t	c = s[i], min;
+		unsigned int	more;
+		uint64_t	w;
+
+		if (i + 8 <= len && n + 8 <= max) {
+			memcpy (&w, s + i, sizeof(w));
+			if (!(w & 0x8080808080808080ULL)) {
+				for (k = 0; k < 8; k++, n++) {
+					dest[2*n] = s[i+k];
+					dest[2*n+1] = 0;
+				}
+				i += 8;
+				continue;
+			}
+		}
+		if (c < 0x80) {
+			more = 0; min = 0;
+		} else if ((c & 0xe0) == 0xc0) {
+			more = 1; min = 0x80; c &= 0x1f;
+		} else if ((c & 0xf0) == 0xe0) {
+			more = 2; min = 0x800; c &= 0x0f;
+		} else if ((c & 0xf8) == 0xf0) {
+			more = 3; min = 0x10000; c &= 0x07;
+		} else {
+			ret = -1;
+			break;
+		}
+		for (k = 1; k <= more; k++) {
+			if (i + k >= len || (s[i+k] & 0xc0) != 0x80)
+				break;
+			c = (c << 6) | (s[i+k] & 0x3f);
+		}
+		/* truncated, overlong, surrogate or beyond Unicode */
+		if (k <= more || c < min || c > 0x10ffff || (c >= 0xd800 && c < 0xe000)) {
+			ret = -1;
+			break;
+		}
+		if (n + (c >= 0x10000 ? 2 : 1) > max) {
+			ret = -2;
+			break;
+		}
+		i += more + 1;
+		if (c >= 0x10000) {
+			c -= 0x10000;
+			dest[2*n] = (0xd800 | (c >> 10)) & 0xff;
+			dest[2*n+1] = (0xd800 | (c >> 10)) >> 8;
+			n++;
+			c = 0xdc00 | (c & 0x3ff);
+		}
+		dest[2*n] = c & 0xff;
+		dest[2*n+1] = c >> 8;
+		n++;
+	}
+	*units = n;
+	return ret;
+}
+
 /* Pack / unpack functions */
 
 #include "ptp-pack.c"
 
+/* locking */
+
+/*
+ * A device may be used from several threads at once, typically an event
+ * thread beside one doing transfers. Three locks protect it, always taken
+ * in this order:
+ *
+ * - the cache lock, a reader/writer lock over the structure of
+ *   params->objects. Listings hold it for reading, anything that adds,
+ *   removes or reorders objects holds it for writing. The writer may
+ *   take it again, for reading or writing. A reader can not upgrade:
+ *   ptp_cache_wrlock() then fails instead of deadlocking, and readers
+ *   must therefore only look at objects already in the cache. Cached
+ *   objects are only changed under the write lock as well, readers
+ *   that need more of an object have it loaded once they are done.
+ * - the fill lock, a recursive mutex over the string pool and the
+ *   filename index, which readers build on the fly.
+ * - the transaction lock, a recursive mutex held for every transaction,
+ *   which also covers transaction_id and the transport state.
+ *
+ * Apart from these the events lock guards params->cache_events. It is
+ * never held while taking another lock or doing I/O, so it may be taken
+ * from transfer callbacks.
+ */
+#ifdef HAVE_PTHREAD_H
+struct _PTPLocks {
+	pthread_mutex_t	transaction;
+	pthread_mutex_t	events;
+	pthread_mutex_t	fill;
+	pthread_mutex_t	cache;		/* protects the fields below */
+	pthread_cond_t	cache_cond;
+	unsigned int	readers;
+	unsigned int	writers;	/* recursion depth of the writer */
+	pthread_t	writer;
+	pthread_key_t	reading;	/* per thread read depth */
+};
+
+static int
+_ptp_init_recursive_mutex (pthread_mutex_t *mutex)
+{
+	pthread_mutexattr_t	attr;
+	int			ret;
+
+	if (pthread_mutexattr_init (&attr))
+		return -1;
+	pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+	ret = pthread_mutex_init (mutex, &attr);
+	pthread_mutexattr_destroy (&attr);
+	return ret ? -1 : 0;
+}
+
+int
+ptp_init_locks (PTPParams *params)
+{
+	PTPLocks *locks = calloc (1, sizeof(PTPLocks));
+
+	if (!locks)
+		return -1;
+	if (_ptp_init_recursive_mutex (&locks->transaction))
+		goto fail;
+	if (_ptp_init_recursive_mutex (&locks->fill))
+		goto fail_transaction;
+	if (pthread_mutex_init (&locks->cache, NULL))
+		goto fail_fill;
+	if (pthread_cond_init (&locks->cache_cond, NULL))
+		goto fail_cache;
+	if (pthread_key_create (&locks->reading, NULL))
+		goto fail_cond;
+	if (pthread_mutex_init (&locks->events, NULL))
+		goto fail_key;
+	params->locks = locks;
+	return 0;
+
+fail_key:
+	pthread_key_delete (locks->reading);
+fail_cond:
+	pthread_cond_destroy (&locks->cache_cond);
+fail_cache:
+	pthread_mutex_destroy (&locks->cache);
+fail_fill:
+	pthread_mutex_destroy (&locks->fill);
+fail_transaction:
+	pthread_mutex_destroy (&locks->transaction);
+fail:
+	free (locks);
+	return -1;
+}
+
+void
+ptp_free_locks (PTPParams *params)
+{
+	PTPLocks *locks = params->locks;
+
+	if (!locks)
+		return;
+	pthread_mutex_destroy (&locks->events);
+	pthread_key_delete (locks->reading);
+	pthread_cond_destroy (&locks->cache_cond);
+	pthread_mutex_destroy (&locks->cache);
+	pthread_mutex_destroy (&locks->fill);
+	pthread_mutex_destroy (&locks->transaction);
+	free (locks);
+	params->locks = NULL;
+}
+
+void
+ptp_cache_rdlock (PTPParams *params)
+{
+	PTPLocks	*locks = params->locks;
+	uintptr_t	depth;
+
+	if (!locks)
+		return;
+	pthread_mutex_lock (&locks->cache);
+	if (locks->writers && pthread_equal (locks->writer, pthread_self ())) {
+		/* the writer reads too */
+		locks->writers++;
+	} else {
+		depth = (uintptr_t) pthread_getspecific (locks->reading);
+		/* nested readers go ahead, a waiting writer would deadlock them */
+		while (locks->writers && !depth)
+			pthread_cond_wait (&locks->cache_cond, &locks->cache);
+		locks->readers++;
+		pthread_setspecific (locks->reading, (void *) (depth + 1));
+	}
+	pthread_mutex_unlock (&locks->cache);
+}
+
+/* Returns 0 on success, -1 if the calling thread holds the lock for reading. */
+int
+ptp_cache_wrlock (PTPParams *params)
+{
+	PTPLocks	*locks = params->locks;
+	int		ret = 0;
+
+	if (!locks)
+		return 0;
+	pthread_mutex_lock (&locks->cache);
+	if (locks->writers && pthread_equal (locks->writer, pthread_self ())) {
+		locks->writers++;
+	} else if (pthread_getspecific (locks->reading)) {
+		ret = -1;
+	} else {
+		while (locks->readers || locks->writers)
+			pthread_cond_wait (&locks->cache_cond, &locks->cache);
+		locks->writer = pthread_self ();
+		locks->writers = 1;
+	}
+	pthread_mutex_unlock (&locks->cache);
+	return ret;
+}
+
+void
+ptp_cache_unlock (PTPParams *params)
+{
+	PTPLocks	*locks = params->locks;
+
+	if (!locks)
+		return;
+	pthread_mutex_lock (&locks->cache);
+	if (locks->writers && pthread_equal (locks->writer, pthread_self ())) {
+		if (!--locks->writers)
+			pthread_cond_broadcast (&locks->cache_cond);
+	} else {
+		uintptr_t depth = (uintptr_t) pthread_getspecific (locks->reading);
+
+		pthread_setspecific (locks->reading, (void *) (depth - 1));
+		if (!--locks->readers)
+			pthread_cond_broadcast (&locks->cache_cond);
+	}
+	pthread_mutex_unlock (&locks->cache);
+}
+
+/* Whether the calling thread holds the cache lock for reading only. */
+static int
+_ptp_cache_reading (PTPParams *params)
+{
+	return params->locks && pthread_getspecific (params->locks->reading);
+}
+
+static void
+_ptp_lock (PTPParams *params, size_t offset)
+{
+	if (params && params->locks)
+		pthread_mutex_lock ((pthread_mutex_t *) ((char *) params->locks + offset));
+}
+
+static void
+_ptp_unlock (PTPParams *params, size_t offset)
+{
+	if (params && params->locks)
+		pthread_mutex_unlock ((pthread_mutex_t *) ((char *) params->locks + offset));
+}
+#define ptp_transaction_lock(params)	_ptp_lock (params, offsetof(PTPLocks, transaction))
+#define ptp_transaction_unlock(params)	_ptp_unlock (params, offsetof(PTPLocks, transaction))
+#define ptp_fill_lock(params)		_ptp_lock (params, offsetof(PTPLocks, fill))
+#define ptp_fill_unlock(params)		_ptp_unlock (params, offsetof(PTPLocks, fill))
+#define ptp_events_lock(params)		_ptp_lock (params, offsetof(PTPLocks, events))
+#define ptp_events_unlock(params)	_ptp_unlock (params, offsetof(PTPLocks, events))
+#else
+int ptp_init_locks (PTPParams *params) { return 0; }
+void ptp_free_locks (PTPParams *params) { }
+void ptp_cache_rdlock (PTPParams *params) { }
+int ptp_cache_wrlock (PTPParams *params) { return 0; }
+void ptp_cache_unlock (PTPParams *params) { }
+#define _ptp_cache_reading(params)	0
+#define ptp_transaction_lock(params)
+#define ptp_transaction_unlock(params)
+#define ptp_fill_lock(params)
+#define ptp_fill_unlock(params)
+#define ptp_events_lock(params)
+#define ptp_events_unlock(params)
+#endif
+
+/* Transaction statistics
+ *
+ * Every transaction is timed from its request to its response, the
+ * time spent in the data handlers, which read and write the files and
+ * memory on the host, is measured separately and taken off, the rest
+ * is what the device and the link took. This is cheap enough to always
+ * be on; the trace ring buffer has to be switched on explicitly.
+ * Everything here is done under the transaction lock.
+ */
+
+typedef struct {
+	PTPDataHandler	*handler;	/* the handler of the caller */
+	uint64_t	bytes;
+	uint64_t	usec;
+} PTPTimedHandlerPrivate;
+
+static uint64_t
+ptp_stats_now (void)
+{
+	struct timeval	tv;
+
+	gettimeofday (&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Some USB glue calls the handlers without params, do not rely on it */
+static uint16_t
+ptp_timed_getfunc (PTPParams* params, void* private,
+		   unsigned long wantlen, unsigned char *data,
+		   unsigned long *gotlen
+) {
+	PTPTimedHandlerPrivate	*priv = (PTPTimedHandlerPrivate*) private;
+	uint64_t		start = ptp_stats_now ();
+	uint16_t		ret;
+
+	ret = priv->handler->getfunc (params, priv->handler->priv, wantlen, data, gotlen);
+	priv->usec += ptp_stats_now () - start;
+	if (ret == PTP_RC_OK)
+		priv->bytes += *gotlen;
+	return ret;
+}
+
+static uint16_t
+ptp_timed_putfunc (PTPParams* params, void* private,
+		   unsigned long sendlen, unsigned char *data
+) {
+	PTPTimedHandlerPrivate	*priv = (PTPTimedHandlerPrivate*) private;
+	uint64_t		start = ptp_stats_now ();
+	uint16_t		ret;
+
+	ret = priv->handler->putfunc (params, priv->handler->priv, sendlen, data);
+	priv->usec += ptp_stats_now () - start;
+	if (ret == PTP_RC_OK)
+		priv->bytes += sendlen;
+	return ret;
+}
+
+static PTPOpStats*
+ptp_stats_find (PTPStats *stats, uint16_t opcode)
+{
+	unsigned int	i, slot;
+
+	slot = (opcode * 2654435761U) >> 26;	/* 64 slots */
+	for (i = 0; i < PTP_STATS_OPCODES; i++) {
+		PTPOpStats *op = &stats->ops[(slot + i) % PTP_STATS_OPCODES];
+
+		if (op->opcode == opcode)
+			return op;
+		if (!op->count) {
+			op->opcode = opcode;
+			return op;
+		}
+	}
+	return &stats->other;
+}
+
+static void
+ptp_stats_record (PTPParams *params, PTPContainer *req, uint16_t ret, uint16_t flags,
+		  uint64_t start, uint64_t end, PTPTimedHandlerPrivate *timed)
+{
+	PTPStats	*stats = params->stats;
+	PTPOpStats	*op;
+	uint64_t	device_usec, bytes_in = 0, bytes_out = 0;
+	unsigned int	bucket;
+
+	if (!stats) {
+		stats = params->stats = calloc (1, sizeof(PTPStats));
+		if (!stats)
+			return;
+	}
+	device_usec = end - start;
+	if (device_usec > timed->usec)
+		device_usec -= timed->usec;
+	else
+		device_usec = 0;
+	if ((flags & PTP_DP_DATA_MASK) == PTP_DP_GETDATA)
+		bytes_in = timed->bytes;
+	else if ((flags & PTP_DP_DATA_MASK) == PTP_DP_SENDDATA)
+		bytes_out = timed->bytes;
+
+	op = ptp_stats_find (stats, req->Code);
+	op->count++;
+	if (ret != PTP_RC_OK)
+		op->errors++;
+	op->bytes_in += bytes_in;
+	op->bytes_out += bytes_out;
+	op->device_usec += device_usec;
+	op->handler_usec += timed->usec;
+	if (device_usec > op->max_usec)
+		op->max_usec = device_usec;
+	for (bucket = 0; bucket < PTP_STATS_BUCKETS - 1 && (device_usec >> bucket); bucket++)
+		;
+	op->histogram[bucket]++;
+
+	if (stats->trace) {
+		PTPTraceEntry *entry = &stats->trace[stats->tracenext];
+
+		entry->start = start;
+		entry->opcode = req->Code;
+		entry->response = ret;
+		entry->param[0] = req->Param1;
+		entry->param[1] = req->Param2;
+		entry->param[2] = req->Param3;
+		entry->param[3] = req->Param4;
+		entry->param[4] = req->Param5;
+		entry->nparam = req->Nparam;
+		entry->bytes_in = bytes_in;
+		entry->bytes_out = bytes_out;
+		entry->device_usec = device_usec;
+		entry->handler_usec = timed->usec;
+		stats->tracenext = (stats->tracenext + 1) % stats->tracesize;
+		if (stats->traceused < stats->tracesize)
+			stats->traceused++;
+	}
+}
+
+/**
+ * ptp_stats_get:
+ * params:	PTPParams*
+ *		ops	- newly allocated copy of the opcode statistics
+ *		nops	- number of entries in ops
+ *
+ * Copies the statistics of all opcodes used so far, opcodes beyond
+ * the ones tracked are summed up under opcode 0.
+ *
+ * Return values: 0 on success, -1 if out of memory.
+ **/
+int
+ptp_stats_get (PTPParams *params, PTPOpStats **ops, unsigned int *nops)
+{
+	unsigned int	i, n = 0;
+
+	*ops = NULL;
+	*nops = 0;
+	ptp_transaction_lock (params);
+	if (params->stats) {
+		*ops = malloc ((PTP_STATS_OPCODES + 1) * sizeof(PTPOpStats));
+		if (!*ops) {
+			ptp_transaction_unlock (params);
+			return -1;
+		}
+		for (i = 0; i < PTP_STATS_OPCODES; i++)
+			if (params->stats->ops[i].count)
+				(*ops)[n++] = params->stats->ops[i];
+		if (params->stats->other.count)
+			(*ops)[n++] = params->stats->other;
+	}
+	ptp_transaction_unlock (params);
+	*nops = n;
+	return 0;
+}
+
+/**
+ * ptp_stats_reset:
+ * params:	PTPParams*
+ *
+ * Clears the statistics and the trace.
+ **/
+void
+ptp_stats_reset (PTPParams *params)
+{
+	ptp_transaction_lock (params);
+	if (params->stats) {
+		memset (params->stats->ops, 0, sizeof(params->stats->ops));
+		memset (&params->stats->other, 0, sizeof(params->stats->other));
+		params->stats->tracenext = 0;
+		params->stats->traceused = 0;
+	}
+	ptp_transaction_unlock (params);
+}
+
+/**
+ * ptp_stats_set_trace:
+ * params:	PTPParams*
+ *		size	- number of transactions to keep, 0 turns tracing off
+ *
+ * Sets up the trace ring buffer, dropping what was traced before.
+ *
+ * Return values: 0 on success, -1 if out of memory.
+ **/
+int
+ptp_stats_set_trace (PTPParams *params, unsigned int size)
+{
+	PTPTraceEntry	*trace = NULL;
+	int		ret = 0;
+
+	ptp_transaction_lock (params);
+	if (!params->stats)
+		params->stats = calloc (1, sizeof(PTPStats));
+	if (!params->stats) {
+		ret = -1;
+	} else if (size && !(trace = calloc (size, sizeof(PTPTraceEntry)))) {
+		ret = -1;
+	} else {
+		free (params->stats->trace);
+		params->stats->trace = trace;
+		params->stats->tracesize = size;
+		params->stats->tracenext = 0;
+		params->stats->traceused = 0;
+	}
+	ptp_transaction_unlock (params);
+	return ret;
+}
+
+/**
+ * ptp_stats_get_trace:
+ * params:	PTPParams*
+ *		entries		- newly allocated copy of the trace, oldest first
+ *		nentries	- number of entries
+ *
+ * Return values: 0 on success, -1 if out of memory.
+ **/
+int
+ptp_stats_get_trace (PTPParams *params, PTPTraceEntry **entries, unsigned int *nentries)
+{
+	PTPStats	*stats;
+	unsigned int	i, first;
+
+	*entries = NULL;
+	*nentries = 0;
+	ptp_transaction_lock (params);
+	stats = params->stats;
+	if (stats && stats->traceused) {
+		*entries = malloc (stats->traceused * sizeof(PTPTraceEntry));
+		if (!*entries) {
+			ptp_transaction_unlock (params);
+			return -1;
+		}
+		first = (stats->tracenext + stats->tracesize - stats->traceused) % stats->tracesize;
+		for (i = 0; i < stats->traceused; i++)
+			(*entries)[i] = stats->trace[(first + i) % stats->tracesize];
+		*nentries = stats->traceused;
+	}
+	ptp_transaction_unlock (params);
+	return 0;
+}
+
 /* major PTP functions */
 
 /**
@@ -224,10 +857,10 @@ ptp_debug_data(PTPParams *params, const uint8_t* data, int size)
  * Upon success PTPContainer* ptp contains PTP Response Phase container with
  * all fields filled in.
  **/
-uint16_t
-ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
-		     uint16_t flags, uint64_t sendlen,
-		     PTPDataHandler *handler
+static uint16_t
+_ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
+		      uint16_t flags, uint64_t sendlen,
+		      PTPDataHandler *handler
 ) {
 	int 		tries;
 	uint16_t	cmd;
@@ -303,10 +936,41 @@ ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 	return ptp->Code;
 }
 
+uint16_t
+ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
+		     uint16_t flags, uint64_t sendlen,
+		     PTPDataHandler *handler
+) {
+	uint16_t	ret;
+
+	PTPContainer		req = *ptp;
+	PTPTimedHandlerPrivate	timed = { handler, 0, 0 };
+	PTPDataHandler		timedhandler;
+	uint64_t		start;
+
+	/* time the data handlers apart from the device */
+	if ((flags & PTP_DP_DATA_MASK) == PTP_DP_SENDDATA ||
+	    (flags & PTP_DP_DATA_MASK) == PTP_DP_GETDATA) {
+		timedhandler.getfunc = ptp_timed_getfunc;
+		timedhandler.putfunc = ptp_timed_putfunc;
+		timedhandler.priv = &timed;
+		handler = &timedhandler;
+	}
+
+	/* one transaction at a time per device */
+	ptp_transaction_lock (params);
+	start = ptp_stats_now ();
+	ret = _ptp_transaction_new (params, ptp, flags, sendlen, handler);
+	ptp_stats_record (params, &req, ret, flags, start, ptp_stats_now (), &timed);
+	ptp_transaction_unlock (params);
+	return ret;
+}
+
 /* memory data get/put handler */
 typedef struct {
 	unsigned char	*data;
 	unsigned long	size, curoff;
+	unsigned long	alloc;	/* allocated size of data, >= size */
 } PTPMemHandlerPrivate;
 
 static uint16_t
@@ -331,12 +995,21 @@ memory_putfunc(PTPParams* params, void* private,
 ) {
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)private;
 
-	if (priv->curoff + sendlen > priv->size) {
-		priv->data = realloc (priv->data, priv->curoff+sendlen);
-		if (!priv->data)
+	if (priv->curoff + sendlen > priv->alloc) {
+		/* grow geometrically, data usually arrives in many small chunks */
+		unsigned long newalloc = priv->alloc ? priv->alloc * 2 : 512;
+		unsigned char *newdata;
+
+		if (newalloc < priv->curoff + sendlen)
+			newalloc = priv->curoff + sendlen;
+		newdata = realloc (priv->data, newalloc);
+		if (!newdata)
 			return PTP_RC_GeneralError;
-		priv->size = priv->curoff + sendlen;
+		priv->data = newdata;
+		priv->alloc = newalloc;
 	}
+	if (priv->curoff + sendlen > priv->size)
+		priv->size = priv->curoff + sendlen;
 	memcpy (priv->data + priv->curoff, data, sendlen);
 	priv->curoff += sendlen;
 	return PTP_RC_OK;
@@ -355,6 +1028,7 @@ ptp_init_recv_memory_handler(PTPDataHandler *handler)
 	handler->putfunc = memory_putfunc;
 	priv->data = NULL;
 	priv->size = 0;
+	priv->alloc = 0;
 	priv->curoff = 0;
 	return PTP_RC_OK;
 }
@@ -375,6 +1049,7 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	handler->putfunc = memory_putfunc;
 	priv->data = data;
 	priv->size = len;
+	priv->alloc = len;
 	priv->curoff = 0;
 	return PTP_RC_OK;
 }
@@ -2058,13 +2733,25 @@ ptp_free_params (PTPParams *params)
 	free (params->wifi_profiles);
 	free_array (&params->storageids);
 	free_array (&params->events);
+	free_array (&params->cache_events);
 
-	free_array_recusive (&params->objects, ptp_free_object);
+	ptp_objects_clear (params);
 	free_array_recusive (&params->canon_props, ptp_free_devicepropdesc);
 	free_array_recusive (&params->eos_events, ptp_free_eos_event);
 	free_array_recusive (&params->dpd_cache, ptp_free_devicepropdesc);
+	for_each (PTPFormatProps*, fp, params->props_supported)
+		free (fp->props);
+	free_array (&params->props_supported);
+	for_each (PTPPropDescData*, dd, params->opd_cache)
+		free (dd->data);
+	free_array (&params->opd_cache);
 
 	ptp_free_deviceinfo (&params->deviceinfo);
+	if (params->stats) {
+		free (params->stats->trace);
+		free (params->stats);
+		params->stats = NULL;
+	}
 }
 
 /**
@@ -2561,8 +3248,9 @@ ptp_deleteobject (PTPParams* params, uint32_t handle, uint32_t ofc)
 
 	PTP_CNT_INIT(ptp, PTP_OC_DeleteObject, handle, ofc);
 	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_NODATA, 0, NULL, NULL));
-	/* If the object is cached and could be removed, cleanse cache. */
-	ptp_remove_object_from_cache(params, handle);
+	/* If the object is cached and could be removed, cleanse cache,
+	 * of the contents of a folder as well. */
+	ptp_remove_object_subtree_from_cache(params, handle);
 	return PTP_RC_OK;
 }
 
@@ -2586,8 +3274,8 @@ ptp_moveobject (PTPParams* params, uint32_t handle, uint32_t storage, uint32_t p
 
 	PTP_CNT_INIT(ptp, PTP_OC_MoveObject, handle, storage, parent);
 	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_NODATA, 0, NULL, NULL));
-	/* If the object is cached and could be removed, cleanse cache. */
-	ptp_remove_object_from_cache(params, handle);
+	/* If the object is cached, move it in the cache as well. */
+	ptp_move_object_in_cache(params, handle, storage, parent);
 	return PTP_RC_OK;
 }
 
@@ -2597,20 +3285,31 @@ ptp_moveobject (PTPParams* params, uint32_t handle, uint32_t storage, uint32_t p
  *		handle			- source ObjectHandle
  *		storage			- destination StorageID
  *		parent			- destination parent ObjectHandle
+ *		newhandle		- returns the ObjectHandle of the copy, may be NULL
  *
  * Copy an object to a new location under the specified parent.
  * Note that unlike most calls, 0 must be passed for the parent if the destination
  * is the Storage root.
  *
  * Return values: Some PTP_RC_* code.
+ * Upon success : uint32_t* newhandle	- the copy, 0 if the device did not tell
  **/
 uint16_t
-ptp_copyobject (PTPParams* params, uint32_t handle, uint32_t storage, uint32_t parent)
+ptp_copyobject (PTPParams* params, uint32_t handle, uint32_t storage, uint32_t parent,
+		uint32_t *newhandle)
 {
 	PTPContainer ptp;
+	uint32_t copy;
 
 	PTP_CNT_INIT(ptp, PTP_OC_CopyObject, handle, storage, parent);
-	return ptp_transaction(params, &ptp, PTP_DP_NODATA, 0, NULL, NULL);
+	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_NODATA, 0, NULL, NULL));
+	copy = (ptp.Nparam >= 1) ? ptp.Param1 : 0;
+	if (newhandle)
+		*newhandle = copy;
+	/* If the original is cached, cache the copy as well. */
+	if (copy)
+		ptp_copy_object_in_cache(params, handle, copy, storage, parent);
+	return PTP_RC_OK;
 }
 
 /**
@@ -3205,7 +3904,7 @@ ptp_add_event (PTPParams *params, PTPContainer *event)
  * ObjectInfos instead of just a list of handles that have to be queried then one by one.*/
 static uint16_t
 ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle, PTPObjectHandles *children) {
-	unsigned int	last = 0, changed = 0;
+	uint16_t	ret;
 	PTPCANONFolderEntry *tmp = NULL;
 	unsigned int	nroftmp = 0;
 
@@ -3220,33 +3919,26 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle, PTPOb
 	/* convert read entries into objectinfos */
 	for (unsigned int i=0; i<nroftmp; i++) {
 		PTPObject	*ob = NULL;
-		unsigned int	j;
 
 		if (children)
 			children->val[children->len++] = tmp[i].ObjectHandle;
 
-		/* TODO: the following is actually slow when adding new entries, as the complete list needs to be traversed.
-			* Make better use of the fact that the list is sorted. */
-		for (j=0; j<params->objects.len; j++) {
-			if (params->objects.val[(last+j) % params->objects.len].oid == tmp[i].ObjectHandle)  {
-				ob = &params->objects.val[(last+j) % params->objects.len];
-				break;
-			}
-		}
-		if (ob == NULL) {
-			ptp_debug (params, "adding new object: handle 0x%08x (nrofobs=%d,j=%d)", tmp[i].ObjectHandle, params->objects.len, j);
-
-			array_push_back_empty (&params->objects, &ob);
+		if (ptp_find_object_in_cache (params, tmp[i].ObjectHandle, &ob) != PTP_RC_OK) {
+			ptp_debug (params, "adding new object: handle 0x%08x (nrofobs=%d)", tmp[i].ObjectHandle, params->objects.len);
 
-			ob->oid = tmp[i].ObjectHandle;
-			ob->oi.Handle = tmp[i].ObjectHandle;
-			ob->flags = 0;
+			ret = ptp_find_or_insert_object_in_cache (params, tmp[i].ObjectHandle, &ob);
+			if (ret != PTP_RC_OK) {
+				free (tmp);
+				return ret;
+			}
 
 			ob->oi.StorageID = storage;
 			ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 			ob->oi.ParentObject = handle == PTP_HANDLER_SPECIAL ? 0 : handle;
 			ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
-			ob->oi.Filename = strdup(tmp[i].Filename);
+			ob->oi.Filename = ptp_intern_string (params, tmp[i].Filename);
+			if (ob->oi.Filename)
+				_ob_names_add (&params->objects, _ob_name_key_of (ob), ob->oid);
 			ob->oi.ObjectFormat = tmp[i].ObjectFormatCode;
 
 			ptp_debug (params, "   flags %x", tmp[i].Flags);
@@ -3261,12 +3953,11 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle, PTPOb
 			ob->flags |= PTPOBJECT_OBJECTINFO_LOADED;
 
 			/*log_objectinfo(params, &ob->oi);*/
-			last = params->objects.len;
-			changed = 1;
 		} else {
-			ptp_debug (params, "adding old object: handle 0x%08x (nrofobs=%d,j=%d)", tmp[i].ObjectHandle, params->objects.len, j);
-			/* for speeding up search */
-			last = (last+j) % params->objects.len;
+			int		hadname = ob->oi.Filename != NULL;
+			uint32_t	namekey = hadname ? _ob_name_key_of (ob) : 0;
+
+			ptp_debug (params, "adding old object: handle 0x%08x (nrofobs=%d)", tmp[i].ObjectHandle, params->objects.len);
 			if (handle != PTP_HANDLER_SPECIAL) {
 				ob->oi.ParentObject = handle;
 				ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
@@ -3275,19 +3966,16 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle, PTPOb
 				ob->oi.StorageID = storage;
 				ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 			}
+			_ob_names_update (&params->objects, ob, hadname, namekey);
 		}
 	}
 	free (tmp);
 
-	if (changed)
-		ptp_objects_sort (params);
-
 	return PTP_RC_OK;
 }
 
 uint16_t
 ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle, PTPObjectHandles *children) {
-	unsigned int		changed, last;
 	uint16_t		ret;
 	uint32_t		xhandle = handle;
 	PTPObjectHandles	handles = {0};
@@ -3305,9 +3993,10 @@ ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle, PTPObject
 	 * subsequent calls asking for the root folder will simply return the cached list. This only works since we
 	 * assume the entries in the root folder can never change. */
 	if (!handle && children && params->objects.len != 0) {
-		for_each (PTPObject*, pob, params->objects)
-			if (pob->oi.ParentObject == 0 && pob->oi.StorageID == storage)
-				array_push_back(children, pob->oid);
+		ptp_objects_sort (params);
+		for_each (PTPObject**, pob, params->objects)
+			if ((*pob)->oi.ParentObject == 0 && (*pob)->oi.StorageID == storage)
+				array_push_back(children, (*pob)->oid);
 		return PTP_RC_OK;
 	}
 
@@ -3321,9 +4010,10 @@ ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle, PTPObject
 			return PTP_RC_GeneralError;
 		if (ob->flags & PTPOBJECT_DIRECTORY_LOADED) {
 			if (children) {
-				for_each (PTPObject*, pob, params->objects)
-					if (pob->oi.ParentObject == handle)
-						array_push_back(children, pob->oid);
+				ptp_objects_sort (params);
+				for_each (PTPObject**, pob, params->objects)
+					if ((*pob)->oi.ParentObject == handle)
+						array_push_back(children, (*pob)->oid);
 			}
 			return PTP_RC_OK;
 		}
@@ -3416,27 +4106,17 @@ fallback:
 	}
 	if (ret != PTP_RC_OK)
 		return ret;
-	last = changed = 0;
 	for_each (uint32_t*, phandle, handles) {
 		PTPObject	*ob = NULL;
-		unsigned int	j;
-
-		/* TODO: the following actually slow when adding new entries, as the complete list needs to be traversed.
-		 * Make better use of the fact that the list is sorted. */
-		for (j=0;j<params->objects.len;j++) {
-			if (params->objects.val[(last+j) % params->objects.len].oid == *phandle)  {
-				ob = &params->objects.val[(last+j) % params->objects.len];
-				break;
-			}
-		}
-		if (ob == NULL) {
-			ptp_debug (params, "adding new object: handle 0x%08x (nrofobs=%d,j=%d)", *phandle, params->objects.len, j);
 
-			array_push_back_empty (&params->objects, &ob);
+		if (ptp_find_object_in_cache (params, *phandle, &ob) != PTP_RC_OK) {
+			ptp_debug (params, "adding new object: handle 0x%08x (nrofobs=%d)", *phandle, params->objects.len);
 
-			ob->oid = *phandle;
-			ob->oi.Handle = *phandle;
-			ob->flags = 0;
+			ret = ptp_find_or_insert_object_in_cache (params, *phandle, &ob);
+			if (ret != PTP_RC_OK) {
+				free_array (&handles);
+				return ret;
+			}
 			/* root directory list files might return all files, so avoid tagging it */
 			if (handle != PTP_HANDLER_SPECIAL && handle) {
 				ptp_debug (params, "  parent 0x%08x", handle);
@@ -3452,11 +4132,11 @@ fallback:
 				ob->oi.StorageID = storage;
 				ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 			}
-			changed = 1;
 		} else {
-			ptp_debug (params, "adding old object: handle 0x%08x (nrofobs=%d,j=%d)", *phandle, params->objects.len, j);
-			/* for speeding up search */
-			last = (last+j) % params->objects.len;
+			int		hadname = ob->oi.Filename != NULL;
+			uint32_t	namekey = hadname ? _ob_name_key_of (ob) : 0;
+
+			ptp_debug (params, "adding old object: handle 0x%08x (nrofobs=%d)", *phandle, params->objects.len);
 			if (handle != PTP_HANDLER_SPECIAL) {
 				ob->oi.ParentObject = handle;
 				ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
@@ -3465,10 +4145,9 @@ fallback:
 				ob->oi.StorageID = storage;
 				ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 			}
+			_ob_names_update (&params->objects, ob, hadname, namekey);
 		}
 	}
-	if (changed)
-		ptp_objects_sort (params);
 	if (children)
 		*children = handles;
 	else
@@ -3499,7 +4178,7 @@ handle_event_internal (PTPParams *params, PTPContainer *event)
 
 		/* free object storage as it might be associated with the storage ids */
 		/* FIXME: enhance and just delete the ones from the storage */
-		free_array_recusive (&params->objects, ptp_free_object);
+		ptp_objects_clear (params);
 
 		params->storagechanged		= 1;
 		break;
@@ -3637,6 +4316,74 @@ ptp_get_one_event(PTPParams *params, PTPContainer *event)
 	return 1;
 }
 
+static int
+_ptp_push_cache_event (PTPParams *params, PTPContainer *event)
+{
+	array_push_back (&params->cache_events, *event);
+	return 0;
+}
+
+/**
+ * ptp_queue_cache_event:
+ *
+ * Queue an event for the object cache to be updated for later, by the
+ * next caller of ptp_take_cache_events(). Takes no lock but the events
+ * lock and does no I/O, so this is safe in transfer callbacks.
+ *
+ * params:	PTPParams*
+ * 		event		in: event container
+ *
+ * Return values: Some PTP_RC_* code.
+ */
+uint16_t
+ptp_queue_cache_event (PTPParams *params, PTPContainer *event)
+{
+	int	ret;
+
+	ptp_events_lock (params);
+	ret = _ptp_push_cache_event (params, event);
+	ptp_events_unlock (params);
+	return ret < 0 ? PTP_RC_GeneralError : PTP_RC_OK;
+}
+
+/**
+ * ptp_take_cache_events:
+ *
+ * Take all events queued by ptp_queue_cache_event(), oldest first.
+ *
+ * params:	PTPParams*
+ * 		events		out: the events, free_array() them after use
+ *
+ * Return values: the number of events.
+ */
+unsigned int
+ptp_take_cache_events (PTPParams *params, PTPEvents *events)
+{
+	ptp_events_lock (params);
+	*events = params->cache_events;
+	array_init (&params->cache_events);
+	ptp_events_unlock (params);
+	return events->len;
+}
+
+/**
+ * ptp_cache_events_pending:
+ *
+ * params:	PTPParams*
+ *
+ * Return values: the number of events queued by ptp_queue_cache_event().
+ */
+unsigned int
+ptp_cache_events_pending (PTPParams *params)
+{
+	unsigned int	len;
+
+	ptp_events_lock (params);
+	len = params->cache_events.len;
+	ptp_events_unlock (params);
+	return len;
+}
+
 /**
  * ptp_get_one_event_by_type:
  *
@@ -5201,12 +5948,89 @@ ptp_mtp_getobjectpropssupported (PTPParams* params, uint16_t ofc,
 	PTPContainer	ptp;
 	unsigned char	*data = NULL;
 	unsigned int	xsize = 0, offset = 0;
+	uint16_t	ret;
 
-	PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectPropsSupported, ofc);
-	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &xsize));
-	if (!data) return PTP_RC_GeneralError;
-	ptp_unpack_uint16_t_array (params, data, &offset, xsize, props, propnum);
-	free(data);
+	/* The answer never changes while connected, ask only once per format */
+	ptp_transaction_lock (params);
+	for_each (PTPFormatProps*, fp, params->props_supported) {
+		if (fp->ofc != ofc)
+			continue;
+		*propnum = fp->propnum;
+		*props = NULL;
+		if (fp->propnum) {
+			*props = malloc (fp->propnum * sizeof(uint16_t));
+			if (!*props) {
+				*propnum = 0;
+				ptp_transaction_unlock (params);
+				return PTP_RC_GeneralError;
+			}
+			memcpy (*props, fp->props, fp->propnum * sizeof(uint16_t));
+		}
+		ptp_transaction_unlock (params);
+		return PTP_RC_OK;
+	}
+
+	PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectPropsSupported, ofc);
+	ret = ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &xsize);
+	if (ret == PTP_RC_OK && !data)
+		ret = PTP_RC_GeneralError;
+	if (ret == PTP_RC_OK &&
+	    ptp_unpack_uint16_t_array (params, data, &offset, xsize, props, propnum))
+		/* Not worth failing over, the next call asks again */
+		ptp_mtp_add_objectpropssupported (params, ofc, *propnum, *props);
+	ptp_transaction_unlock (params);
+	free(data);
+	return ret;
+}
+
+static int
+_ptp_push_format_props (PTPParams *params, PTPFormatProps **fp)
+{
+	array_push_back_empty (&params->props_supported, fp);
+	return 0;
+}
+
+/**
+ * ptp_mtp_add_objectpropssupported:
+ *
+ * Remembers the object properties an object format supports, so that
+ * ptp_mtp_getobjectpropssupported() need not ask the device. Formats
+ * already known are left alone.
+ *
+ * params:	PTPParams*
+ *	uint16_t ofc		- object format code
+ *	uint32_t propnum	- number of elements in props
+ *	uint16_t *props		- array of supported properties, copied
+ *
+ * Return values: Some PTP_RC_* code.
+ *
+ **/
+uint16_t
+ptp_mtp_add_objectpropssupported (PTPParams *params, uint16_t ofc,
+				  uint32_t propnum, uint16_t const *props)
+{
+	PTPFormatProps	*fp;
+	uint16_t	*copy;
+
+	ptp_transaction_lock (params);
+	for_each (PTPFormatProps*, known, params->props_supported) {
+		if (known->ofc == ofc) {
+			ptp_transaction_unlock (params);
+			return PTP_RC_OK;
+		}
+	}
+	copy = malloc (propnum * sizeof(uint16_t) + 1);
+	if (!copy || _ptp_push_format_props (params, &fp) < 0) {
+		ptp_transaction_unlock (params);
+		free (copy);
+		return PTP_RC_GeneralError;
+	}
+	if (propnum)
+		memcpy (copy, props, propnum * sizeof(uint16_t));
+	fp->ofc = ofc;
+	fp->propnum = propnum;
+	fp->props = copy;
+	ptp_transaction_unlock (params);
 	return PTP_RC_OK;
 }
 
@@ -5228,12 +6052,81 @@ ptp_mtp_getobjectpropdesc (
 ) {
 	PTPContainer	ptp;
 	unsigned char	*data = NULL;
-	unsigned int	size;
+	unsigned int	size = 0;
+	uint16_t	ret;
+
+	/* Kept as the device sent it, unpacking gives the caller its own copy */
+	ptp_transaction_lock (params);
+	for_each (PTPPropDescData*, dd, params->opd_cache) {
+		if (dd->ofc != ofc || dd->opc != opc)
+			continue;
+		ptp_unpack_OPD (params, dd->data, opd, dd->size);
+		ptp_transaction_unlock (params);
+		return PTP_RC_OK;
+	}
 
 	PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectPropDesc, opc, ofc);
-	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &size));
-	ptp_unpack_OPD (params, data, opd, size);
+	ret = ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &size);
+	if (ret == PTP_RC_OK) {
+		ptp_unpack_OPD (params, data, opd, size);
+		if (data && size)
+			/* Not worth failing over either */
+			ptp_mtp_add_objectpropdesc (params, opc, ofc, data, size);
+	}
+	ptp_transaction_unlock (params);
 	free(data);
+	return ret;
+}
+
+static int
+_ptp_push_prop_desc (PTPParams *params, PTPPropDescData **dd)
+{
+	array_push_back_empty (&params->opd_cache, dd);
+	return 0;
+}
+
+/**
+ * ptp_mtp_add_objectpropdesc:
+ *
+ * Remembers the description of an object property in an object format,
+ * so that ptp_mtp_getobjectpropdesc() need not ask the device. Properties
+ * already known are left alone.
+ *
+ * params:	PTPParams*
+ *	uint16_t opc		- object property code
+ *	uint16_t ofc		- object format code
+ *	unsigned char *data	- the ObjectPropDesc dataset, copied
+ *	uint32_t size		- size of data
+ *
+ * Return values: Some PTP_RC_* code.
+ *
+ **/
+uint16_t
+ptp_mtp_add_objectpropdesc (PTPParams *params, uint16_t opc, uint16_t ofc,
+			    unsigned char const *data, uint32_t size)
+{
+	PTPPropDescData	*dd;
+	unsigned char	*copy;
+
+	ptp_transaction_lock (params);
+	for_each (PTPPropDescData*, known, params->opd_cache) {
+		if (known->ofc == ofc && known->opc == opc) {
+			ptp_transaction_unlock (params);
+			return PTP_RC_OK;
+		}
+	}
+	copy = malloc (size + 1);
+	if (!copy || _ptp_push_prop_desc (params, &dd) < 0) {
+		ptp_transaction_unlock (params);
+		free (copy);
+		return PTP_RC_GeneralError;
+	}
+	memcpy (copy, data, size);
+	dd->ofc = ofc;
+	dd->opc = opc;
+	dd->size = size;
+	dd->data = copy;
+	ptp_transaction_unlock (params);
 	return PTP_RC_OK;
 }
 
@@ -5295,6 +6188,9 @@ ptp_mtp_setobjectpropvalue (
 	size = ptp_pack_DPV(params, value, &data, datatype);
 	ret = ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL);
 	free(data);
+	/* If the object is cached, update it as well. */
+	if (ret == PTP_RC_OK)
+		ptp_set_object_prop_in_cache (params, handle, opc, datatype, value);
 	return ret;
 }
 
@@ -5370,6 +6266,289 @@ ptp_mtp_getobjectproplist_single (PTPParams* params, uint32_t handle, MTPObjectP
 	return ptp_mtp_getobjectproplist_level(params, handle, 0, &props->val, (int*)&props->len);
 }
 
+/* Streaming GetObjPropList decoder.
+ *
+ * Instead of collecting the whole (potentially multi megabyte) dataset in memory,
+ * unpacking it into an MTPObjectProp array and copying that into the object cache,
+ * the records are decoded while the USB chunks arrive and are stored straight into
+ * the PTPObject entries of params->objects. Only a record that straddles a chunk
+ * boundary gets copied into a small carry buffer.
+ */
+typedef struct {
+	PTPParams	*params;
+	unsigned char	*carry;		/* incomplete record left over from the previous chunk */
+	uint32_t	carrylen, carrysize;
+	uint32_t	prop_count;	/* number of properties announced in the dataset header */
+	uint32_t	props_done;
+	int		have_count;
+	uint32_t	lasthandle;
+	unsigned int	nrofobjects;
+	PTPObject	*ob;		/* object the previous property was stored into */
+	int		merge;		/* ob already had a proplist, skip properties it has */
+} PTPOPLStreamPrivate;
+
+/* bytes appended to the carry buffer per decode attempt */
+#define PTP_OPL_CARRY_STEP	512
+
+static uint16_t
+ptp_opl_stream_store (PTPOPLStreamPrivate *priv, MTPObjectProp *prop)
+{
+	PTPParams	*params = priv->params;
+	PTPObject	*ob = priv->ob;
+	int		hadname;
+	uint32_t	namekey;
+
+	if (!ob || priv->lasthandle != prop->ObjectHandle) {
+		CHECK_PTP_RC(ptp_find_or_insert_object_in_cache (params, prop->ObjectHandle, &ob));
+		priv->ob = ob;
+		priv->lasthandle = prop->ObjectHandle;
+		priv->nrofobjects++;
+		/* filtered requests (by format, folder or group) can overlap */
+		priv->merge = (ob->flags & PTPOBJECT_MTPPROPLIST_LOADED) != 0;
+	}
+	hadname = ob->oi.Filename != NULL;
+	namekey = hadname ? _ob_name_key_of (ob) : 0;
+
+	switch (prop->PropCode) {
+	case PTP_OPC_ParentObject:
+		ob->oi.ParentObject = prop->Value.u32;
+		ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+		_ob_names_update (&params->objects, ob, hadname, namekey);
+		break;
+	case PTP_OPC_ObjectFormat:
+		ob->oi.ObjectFormat = prop->Value.u16;
+		break;
+	case PTP_OPC_ObjectSize:
+		if (prop->DataType == PTP_DTC_UINT64)
+			ob->oi.ObjectSize = prop->Value.u64;
+		else if (prop->DataType == PTP_DTC_UINT32)
+			ob->oi.ObjectSize = prop->Value.u32;
+		break;
+	case PTP_OPC_StorageID:
+		ob->oi.StorageID = prop->Value.u32;
+		ob->flags |= PTPOBJECT_STORAGEID_LOADED;
+		_ob_names_update (&params->objects, ob, hadname, namekey);
+		break;
+	case PTP_OPC_ObjectFileName:
+		if (prop->Value.str) {
+			ob->oi.Filename = ptp_intern_string (params, prop->Value.str);
+			_ob_names_update (&params->objects, ob, hadname, namekey);
+			if (!ob->oi.Filename)
+				return PTP_RC_GeneralError;
+		}
+		break;
+	case PTP_OPC_DateModified:
+		/* filled in for modification date filters, kept as a property as well */
+		if ((prop->DataType == PTP_DTC_STR) && prop->Value.str)
+			ob->oi.ModificationDate = ptp_unpack_PTPTIME (prop->Value.str);
+		/* fall through */
+	default:
+		if (priv->merge) {
+			for_each (MTPObjectProp*, have, ob->mtp_props) {
+				if (have->PropCode == prop->PropCode) {
+					ptp_free_object_prop (prop);
+					return PTP_RC_OK;
+				}
+			}
+		}
+		/* all other properties go into the per-object proplist, which takes ownership */
+		if ((prop->DataType == PTP_DTC_STR) && prop->Value.str) {
+			char *pooled = ptp_intern_string (params, prop->Value.str);
+
+			if (!pooled)
+				return PTP_RC_GeneralError;
+			free (prop->Value.str);
+			prop->Value.str = pooled;
+		}
+		array_push_back (&ob->mtp_props, *prop);
+		ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED;
+		ob->flags |= PTPOBJECT_OBJECTINFO_LOADED;
+		return PTP_RC_OK;
+	}
+	ob->flags |= PTPOBJECT_OBJECTINFO_LOADED;
+	ptp_free_object_prop (prop);
+	return PTP_RC_OK;
+}
+
+#define PTP_OPL_UNDECODABLE	UINT64_MAX
+
+/* Bytes a property value at offset takes, 0 if that cannot be told from the
+ * len bytes there are yet, or PTP_OPL_UNDECODABLE for a value that
+ * ptp_unpack_DPV() will never decode, however much data arrives. */
+static uint64_t
+ptp_opl_value_size (const unsigned char *data, uint32_t offset, uint32_t len, uint16_t datatype)
+{
+	static const uint8_t	sizes[] = { 0, 1, 1, 2, 2, 4, 4, 8, 8, 16, 16 };
+	uint32_t		n;
+
+	if (datatype == PTP_DTC_STR) {
+		if (len - offset < 1)
+			return 0;
+		return 1 + 2 * (uint64_t) dtoh8a (data + offset);
+	}
+	if (!(datatype & PTP_DTC_ARRAY_MASK)) {
+		if (datatype == PTP_DTC_UNDEF || datatype > PTP_DTC_UINT128)
+			return PTP_OPL_UNDECODABLE;
+		return sizes[datatype];
+	}
+	datatype &= ~PTP_DTC_ARRAY_MASK;
+	/* arrays of 128 bit values are not unpacked */
+	if (datatype == PTP_DTC_UNDEF || datatype > PTP_DTC_UINT64)
+		return PTP_OPL_UNDECODABLE;
+	if (len - offset < sizeof(uint32_t))
+		return 0;
+	n = dtoh32a (data + offset);
+	if (n >= UINT_MAX / sizeof(PTPPropValue))
+		return PTP_OPL_UNDECODABLE;
+	return sizeof(uint32_t) + (uint64_t) n * sizes[datatype];
+}
+
+/* Decode as many complete records from data as possible, *consumed is set to
+ * the number of bytes used up. */
+static uint16_t
+ptp_opl_stream_decode (PTPOPLStreamPrivate *priv, const unsigned char *data, uint32_t len, uint32_t *consumed)
+{
+	unsigned int offset = 0;
+
+	if (!priv->have_count) {
+		if (len < sizeof(uint32_t)) {
+			*consumed = 0;
+			return PTP_RC_OK;
+		}
+		priv->prop_count = dtoh32o(data, offset);
+		priv->have_count = 1;
+		ptp_debug (priv->params, "Streaming MTP OPL (prop_count %d)", priv->prop_count);
+	}
+	while (priv->props_done < priv->prop_count && len >= offset + 4 + 2 + 2) {
+		MTPObjectProp	prop;
+		unsigned int	recoff = offset;
+
+		memset (&prop, 0, sizeof(prop));
+		prop.ObjectHandle = dtoh32o(data, recoff);
+		prop.PropCode     = dtoh16o(data, recoff);
+		prop.DataType     = dtoh16o(data, recoff);
+		if (!ptp_unpack_DPV(priv->params, data, &recoff, len, &prop.Value, prop.DataType)) {
+			uint64_t need = ptp_opl_value_size (data, offset + 8, len, prop.DataType);
+
+			/* the value is incomplete, wait for the next chunk */
+			if (need != PTP_OPL_UNDECODABLE && (!need || len - (offset + 8) < need))
+				break;
+			/* otherwise nothing that follows would ever be decoded */
+			ptp_error (priv->params, "Cannot decode MTP OPL record %u (handle %08x, property %04x, datatype %04x)",
+				   priv->props_done, prop.ObjectHandle, prop.PropCode, prop.DataType);
+			return PTP_RC_GeneralError;
+		}
+		offset = recoff;
+		priv->props_done++;
+		if (ptp_opl_stream_store (priv, &prop) != PTP_RC_OK) {
+			ptp_free_object_prop (&prop);
+			return PTP_RC_GeneralError;
+		}
+	}
+	/* trailing bytes after the last announced property are ignored */
+	*consumed = priv->props_done < priv->prop_count ? offset : len;
+	return PTP_RC_OK;
+}
+
+static uint16_t
+opl_stream_putfunc(PTPParams* params, void* private,
+		   unsigned long sendlen, unsigned char *data
+) {
+	PTPOPLStreamPrivate	*priv = (PTPOPLStreamPrivate*)private;
+	unsigned long		off = 0;
+	uint32_t		consumed;
+
+	/* first complete the record that straddled the previous chunk boundary */
+	while (priv->carrylen && off < sendlen) {
+		unsigned long n = MIN(sendlen - off, PTP_OPL_CARRY_STEP);
+
+		if (priv->carrylen + n > priv->carrysize) {
+			unsigned char *carry = realloc (priv->carry, priv->carrylen + n + PTP_OPL_CARRY_STEP);
+			if (!carry)
+				return PTP_RC_GeneralError;
+			priv->carry = carry;
+			priv->carrysize = priv->carrylen + n + PTP_OPL_CARRY_STEP;
+		}
+		memcpy (priv->carry + priv->carrylen, data + off, n);
+		priv->carrylen += n;
+		off += n;
+		CHECK_PTP_RC(ptp_opl_stream_decode (priv, priv->carry, priv->carrylen, &consumed));
+		if (consumed) {
+			/* the record in the carry buffer is complete, whatever follows
+			 * it came from data and gets decoded in place below. */
+			off -= priv->carrylen - consumed;
+			priv->carrylen = 0;
+		}
+	}
+	if (off == sendlen)
+		return PTP_RC_OK;
+
+	CHECK_PTP_RC(ptp_opl_stream_decode (priv, data + off, sendlen - off, &consumed));
+	off += consumed;
+	if (off < sendlen) {
+		unsigned long rest = sendlen - off;
+
+		if (rest > priv->carrysize) {
+			free (priv->carry);
+			priv->carry = malloc (rest + PTP_OPL_CARRY_STEP);
+			if (!priv->carry) {
+				priv->carrysize = 0;
+				return PTP_RC_GeneralError;
+			}
+			priv->carrysize = rest + PTP_OPL_CARRY_STEP;
+		}
+		memcpy (priv->carry, data + off, rest);
+		priv->carrylen = rest;
+	}
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_mtp_getobjectproplist_to_cache:
+ *
+ * Same request as ptp_mtp_getobjectproplist_generic(), but the received
+ * property list is decoded while it arrives and stored directly into the
+ * object cache (params->objects). ParentObject, ObjectFormat, ObjectSize,
+ * StorageID and ObjectFileName end up in the ObjectInfo of the object, all
+ * other properties in its mtp_props list.
+ *
+ * nrofobjects - returns the number of objects the device reported properties for
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_mtp_getobjectproplist_to_cache (PTPParams* params, uint32_t handle, uint32_t formats, uint32_t properties,
+	uint32_t propertygroups, uint32_t level, unsigned int *nrofobjects)
+{
+	PTPContainer		ptp;
+	PTPDataHandler		handler;
+	PTPOPLStreamPrivate	priv;
+	uint16_t		ret;
+
+	memset (&priv, 0, sizeof(priv));
+	priv.params = params;
+	handler.priv = &priv;
+	handler.getfunc = NULL;
+	handler.putfunc = opl_stream_putfunc;
+
+	/* objects are inserted from within the transaction, so take the cache
+	 * lock before the transaction lock, see the lock order above */
+	if (ptp_cache_wrlock (params) < 0)
+		return PTP_RC_GeneralError;
+	PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjPropList, handle, formats, properties, propertygroups, level);
+	ret = ptp_transaction_new (params, &ptp, PTP_DP_GETDATA, 0, &handler);
+	ptp_cache_unlock (params);
+	if (ret == PTP_RC_OK && priv.props_done < priv.prop_count) {
+		ptp_debug (params ,"short MTP Object Property List at property %d (of %d)", priv.props_done, priv.prop_count);
+		ptp_debug (params ,"device probably needs DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL");
+		ptp_debug (params ,"or even DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST");
+	}
+	free (priv.carry);
+	if (nrofobjects)
+		*nrofobjects = priv.nrofobjects;
+	return ret;
+}
+
 uint16_t
 ptp_mtp_sendobjectproplist (PTPParams* params, uint32_t* store, uint32_t* parenthandle, uint32_t* handle,
 			    uint16_t objecttype, uint64_t objectsize, MTPObjectProp *props, int nrofprops)
@@ -5401,11 +6580,16 @@ ptp_mtp_setobjectproplist (PTPParams* params, MTPObjectProp *props, int nrofprop
 	uint16_t	ret;
 	unsigned char	*data = NULL;
 	uint32_t	size;
+	int		i;
 
 	PTP_CNT_INIT(ptp, PTP_OC_MTP_SetObjPropList);
 	size = ptp_pack_OPL(params,props,nrofprops,&data);
 	ret = ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL);
 	free(data);
+	/* If the objects are cached, update them as well. */
+	for (i = 0; ret == PTP_RC_OK && i < nrofprops; i++)
+		ptp_set_object_prop_in_cache (params, props[i].ObjectHandle, props[i].PropCode,
+					      props[i].DataType, &props[i].Value);
 	return ret;
 }
 
@@ -5718,6 +6902,32 @@ ptp_android_getpartialobject64 (PTPParams* params, uint32_t handle, uint64_t off
 	return ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, object, len);
 }
 
+/**
+ * ptp_android_getpartialobject64_to_handler:
+ * params:	PTPParams*
+ *		handle			- Object handle
+ *		offset			- Offset into object
+ *		maxbytes		- Maximum of bytes to read
+ *		handler			- a ptp data handler
+ *
+ * Get object 'handle' from device and send the data to the
+ * data handler. Start from offset and read at most maxbytes.
+ *
+ * This is a 64bit offset version of ptp_getpartialobject_to_handler.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_android_getpartialobject64_to_handler (PTPParams* params, uint32_t handle, uint64_t offset,
+				uint32_t maxbytes, PTPDataHandler *handler)
+{
+	PTPContainer ptp;
+
+	/* casts due to varargs otherwise pushing 64bit values on the stack */
+	PTP_CNT_INIT(ptp, PTP_OC_ANDROID_GetPartialObject64, handle, ((uint32_t)offset & 0xFFFFFFFF), (uint32_t)(offset >> 32), maxbytes);
+	return ptp_transaction_new(params, &ptp, PTP_DP_GETDATA, 0, handler);
+}
+
 uint16_t
 ptp_android_sendpartialobject (PTPParams* params, uint32_t handle, uint64_t offset,
 				unsigned char* object,	uint32_t len)
@@ -5866,13 +7076,17 @@ ptp_free_objectinfo (PTPObjectInfo *oi)
 	free (oi->Keywords); oi->Keywords = NULL;
 }
 
+/* Frees a cached object, its strings belong to the string pool of the cache. */
 void
 ptp_free_object (PTPObject *ob)
 {
 	if (!ob) return;
 
-	ptp_free_objectinfo (&ob->oi);
-	free_array_recusive (&ob->mtp_props, ptp_free_object_prop);
+	ob->oi.Filename = ob->oi.Keywords = NULL;
+	for_each (MTPObjectProp*, prop, ob->mtp_props)
+		if ((prop->DataType & 0xFFF0) == PTP_DTC_ARRAY_MASK)
+			ptp_free_object_prop (prop);
+	free_array (&ob->mtp_props);
 	ob->flags = 0;
 }
 
@@ -9417,23 +10631,24 @@ ptp_free_object_prop(MTPObjectProp *prop)
 /*
  * Allocate and default-initialize a few object properties.
  */
+static int
+_new_object_prop_entry(MTPObjectProps *props, MTPObjectProp **prop)
+{
+	array_push_back_empty(props, prop);
+	return 0;
+}
+
 MTPObjectProp *
-ptp_get_new_object_prop_entry(MTPObjectProp **props, int *nrofprops)
+ptp_get_new_object_prop_entry(MTPObjectProps *props)
 {
-	MTPObjectProp *newprops;
 	MTPObjectProp *prop;
 
-	newprops = realloc(*props,sizeof(MTPObjectProp)*(*nrofprops+1));
-	if (newprops == NULL)
+	if (_new_object_prop_entry(props, &prop) < 0)
 		return NULL;
-	prop = &newprops[*nrofprops];
 	prop->PropCode = PTP_OPC_StorageID; /* Should be "unknown" */
 	prop->DataType = PTP_DTC_UNDEF;
 	prop->ObjectHandle = 0x00000000U;
 	prop->Value.str = NULL;
-
-	(*props) = newprops;
-	(*nrofprops)++;
 	return prop;
 }
 
@@ -9457,181 +10672,1073 @@ ptp_find_object_prop_in_cache(PTPParams *params, uint32_t const handle, uint32_t
 }
 #endif
 
-uint16_t
-ptp_remove_object_from_cache(PTPParams *params, uint32_t handle)
-{
-	PTPObject	*ob;
+/* Object cache, see PTPObjects in ptp.h */
 
-	CHECK_PTP_RC(ptp_find_object_in_cache (params, handle, &ob));
-	ptp_free_object (ob);
-	array_remove(&params->objects, ob);
-
-	return PTP_RC_OK;
+/*
+ * Knuth's multiplicative hash. Only the top bits of the product are well
+ * mixed, the low ones depend on the low bits of the key alone, and many
+ * devices keep the storage in the low bits of a handle or stride them.
+ */
+static inline uint32_t
+_ob_hash (uint32_t key, uint32_t shift)
+{
+	return (key * 2654435761U) >> shift;
 }
 
-static int _cmp_ob (const void *a, const void *b)
+/* The shift for _ob_hash() into a table of size (a power of 2) slots. */
+static inline uint32_t
+_ob_hash_shift (uint32_t size)
 {
-	PTPObject *oa = (PTPObject*)a;
-	PTPObject *ob = (PTPObject*)b;
+	uint32_t	shift = 32;
 
-	/* Do not subtract the oids and return ...
-	 * the unsigned int -> int conversion will overflow in cases
-	 * like 0xfffc0000 vs 0x0004000. */
-	if (oa->oid > ob->oid) return 1;
-	if (oa->oid < ob->oid) return -1;
-	return 0;
+	while (size > 1) {
+		size >>= 1;
+		shift--;
+	}
+	return shift;
 }
 
-void
-ptp_objects_sort (PTPParams *params)
+/* Returns the index slot of oid, or the free slot where it would go. */
+static PTPObjectIndexEntry *
+_ob_index_slot (PTPObjects *objects, uint32_t oid)
 {
-	qsort (params->objects.val, params->objects.len, sizeof(PTPObject), _cmp_ob);
+	uint32_t	i = _ob_hash (oid, objects->indexshift);
+
+	while (objects->index[i].oid && objects->index[i].oid != oid)
+		i = (i + 1) & (objects->indexsize - 1);
+	return &objects->index[i];
 }
 
-/* Binary search in objects. Needs "objects" to be a sorted by oid!  */
-uint16_t
-ptp_find_object_in_cache (PTPParams *params, uint32_t handle, PTPObject **retob)
+static uint16_t
+_ob_index_grow (PTPObjects *objects)
 {
-	PTPObject	tmpob;
+	PTPObjectIndexEntry	*old = objects->index;
+	uint32_t		oldsize = objects->indexsize, i;
+	uint32_t		newsize = oldsize ? oldsize * 2 : 2 * PTP_OBJECT_CHUNK_SIZE;
 
-	tmpob.oid = handle;
-	*retob = bsearch (&tmpob, params->objects.val, params->objects.len, sizeof(tmpob), _cmp_ob);
-	if (!*retob)
+	objects->index = calloc (newsize, sizeof(objects->index[0]));
+	if (!objects->index) {
+		objects->index = old;
 		return PTP_RC_GeneralError;
+	}
+	objects->indexsize = newsize;
+	objects->indexshift = _ob_hash_shift (newsize);
+	for (i = 0; i < oldsize; i++)
+		if (old[i].oid)
+			*_ob_index_slot (objects, old[i].oid) = old[i];
+	free (old);
 	return PTP_RC_OK;
 }
 
-/* Binary search in objects + insert if not found. Needs "objects" to be a sorted by oid!  */
-uint16_t
-ptp_find_or_insert_object_in_cache (PTPParams *params, uint32_t handle, PTPObject **retob)
+/* Remove an index entry, moving the following entries of the probe sequence
+ * back so no tombstones are needed. */
+static void
+_ob_index_remove (PTPObjects *objects, PTPObjectIndexEntry *entry)
 {
-	unsigned int 	begin, end, cursor;
-	unsigned int	insertat;
+	uint32_t	mask = objects->indexsize - 1;
+	uint32_t	hole = entry - objects->index, i = hole;
 
-	if (!handle) return PTP_RC_GeneralError;
-	*retob = NULL;
-	if (!params->objects.len) {
-		array_push_back_empty (&params->objects, retob);
-		(*retob)->oid = handle;
-		(*retob)->oi.Handle = handle;
-		return PTP_RC_OK;
-	}
-	begin = 0;
-	end = params->objects.len-1;
-	/*ptp_debug (params, "searching %08x, total=%d", handle, params->objects.len);*/
 	while (1) {
-		cursor = (end-begin)/2+begin;
-		/*ptp_debug (params, "ob %d: %08x [%d-%d]", cursor, params->objects[cursor].oid, begin, end);*/
-		if (params->objects.val[cursor].oid == handle) {
-			*retob = &params->objects.val[cursor];
-			return PTP_RC_OK;
-		}
-		if (params->objects.val[cursor].oid < handle)
-			begin = cursor;
-		else
-			end = cursor;
-		if ((end - begin) <= 1)
+		uint32_t	home;
+
+		i = (i + 1) & mask;
+		if (!objects->index[i].oid)
 			break;
+		home = _ob_hash (objects->index[i].oid, objects->indexshift);
+		/* can the entry at i be moved to the hole without leaving its probe sequence? */
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			objects->index[hole] = objects->index[i];
+			hole = i;
+		}
 	}
-	if (params->objects.val[begin].oid == handle) {
-		*retob = &params->objects.val[begin];
-		return PTP_RC_OK;
-	}
-	if (params->objects.val[end].oid == handle) {
-		*retob = &params->objects.val[end];
-		return PTP_RC_OK;
-	}
-	if ((begin == 0) && (handle < params->objects.val[0].oid)) {
-		insertat=begin;
-	} else {
-		if ((end == params->objects.len-1) && (handle > params->objects.val[end].oid))
-			insertat=end+1;
-		else
-			insertat=begin+1;
-	}
-	/*ptp_debug (params, "inserting oid %x at [%x,%x], begin=%d, end=%d, insertat=%d\n", handle, params->objects[begin].oid, params->objects[end].oid, begin, end, insertat);*/
-	array_extend_capacity (&params->objects, 1);
-	if (insertat < params->objects.len)
-		memmove (&params->objects.val[insertat+1], &params->objects.val[insertat], (params->objects.len-insertat)*sizeof(PTPObject));
-	*retob = &params->objects.val[insertat];
-	memset(*retob, 0, sizeof(PTPObject));
-	(*retob)->oid = handle;
-	(*retob)->oi.Handle = handle;
-	params->objects.len++;
-	return PTP_RC_OK;
+	objects->index[hole].oid = 0;
 }
 
-uint16_t
-ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObject **retob)
+/*
+ * Filename index: open addressing table of (key, oid) entries, reusing
+ * PTPObjectIndexEntry with the key in pos. The key hashes the storage,
+ * the parent folder and the filename together, so a lookup in one folder
+ * only meets objects of that name in that folder, however common the
+ * name is elsewhere. Several entries can share a key, and entries may go
+ * stale when an object changes behind our back, so every hit is checked
+ * against the object itself.
+ */
+uint32_t
+ptp_filename_hash (char const *filename)
 {
-	uint16_t	ret;
-	PTPObject	*ob;
+	uint32_t	h = 2166136261U;	/* FNV-1a */
 
-	/* If GetObjectInfo is broken, force GetPropList */
-	if (params->device_flags & DEVICE_FLAG_PROPLIST_OVERRIDES_OI)
-		want |= PTPOBJECT_MTPPROPLIST_LOADED;
+	while (*filename)
+		h = (h ^ (unsigned char) *filename++) * 16777619U;
+	return h;
+}
 
-	*retob = NULL;
-	if (!handle) {
-		ptp_debug (params, "ptp_object_want: querying handle 0?\n");
-		return PTP_RC_GeneralError;
-	}
-	CHECK_PTP_RC(ptp_find_or_insert_object_in_cache (params, handle, &ob));
-	*retob = ob;
-	/* Do we have all of it already? */
-	if ((ob->flags & want) == want)
-		return PTP_RC_OK;
+static uint32_t
+_ob_name_key (uint32_t storage, uint32_t parent, char const *filename)
+{
+	uint32_t	h = ptp_filename_hash (filename);
 
-#define X (PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED|PTPOBJECT_PARENTOBJECT_LOADED)
-	if ((want & X) && ((ob->flags & X) != X)) {
-		uint32_t	saveparent = 0;
+	h = (h ^ parent) * 2654435761U;
+	h = (h ^ storage) * 2246822519U;
+	return h ^ (h >> 15);
+}
 
-		/* One EOS issue, where getobjecthandles(root) returns obs without root flag. */
-		if (ob->flags & PTPOBJECT_PARENTOBJECT_LOADED)
-			saveparent = ob->oi.ParentObject;
+static uint32_t
+_ob_name_key_of (PTPObject const *ob)
+{
+	return _ob_name_key (ob->oi.StorageID, ob->oi.ParentObject, ob->oi.Filename);
+}
 
-		ret = ptp_getobjectinfo (params, handle, &ob->oi);
-		if (ret != PTP_RC_OK) {
-			/* kill it from the internal list ... */
-			ptp_remove_object_from_cache(params, handle);
-			return ret;
-		}
-		if (!ob->oi.Filename)
-			ob->oi.Filename = strdup("<none>");
-		if (ob->flags & PTPOBJECT_PARENTOBJECT_LOADED) {
-			if (ob->oi.ParentObject != saveparent)
-				ptp_debug (params, "saved parent %08x is not the same as read via getobjectinfo %08x", ob->oi.ParentObject, saveparent);
-			ob->oi.ParentObject = saveparent;
-		}
+static void
+_ob_names_insert (PTPObjects *objects, uint32_t hash, uint32_t oid)
+{
+	uint32_t	i = _ob_hash (hash, objects->namesshift);
 
-		/* Second EOS issue, 0x20000000 has 0x20000000 as parent */
-		if (ob->oi.ParentObject == handle)
-			ob->oi.ParentObject = 0;
+	while (objects->names[i].oid)
+		i = (i + 1) & (objects->namessize - 1);
+	objects->names[i].oid = oid;
+	objects->names[i].pos = hash;
+	objects->namesused++;
+}
 
-		/* Detect if the file is larger than 4GB ... indicator is size 0xffffffff ...
-		 * In that case explicitly request the MTP object proplist to get the right size */
-		if (ob->oi.ObjectSize == 0xffffffffUL) {
-			uint64_t	newsize;
-			if (	(params->deviceinfo.VendorExtensionID == PTP_VENDOR_NIKON)	&&
-				ptp_operation_issupported(params,PTP_OC_NIKON_GetObjectSize)	&&
-				(PTP_RC_OK == ptp_nikon_getobjectsize(params, handle, &newsize))
-			) {
-				ob->oi.ObjectSize = newsize;
-			} else {
+static uint16_t
+_ob_names_resize (PTPObjects *objects, uint32_t newsize)
+{
+	PTPObjectIndexEntry	*old = objects->names;
+	uint32_t		oldsize = objects->namessize, i;
+
+	objects->names = calloc (newsize, sizeof(objects->names[0]));
+	if (!objects->names) {
+		objects->names = old;
+		return PTP_RC_GeneralError;
+	}
+	objects->namessize = newsize;
+	objects->namesshift = _ob_hash_shift (newsize);
+	objects->namesused = 0;
+	for (i = 0; i < oldsize; i++)
+		if (old[i].oid)
+			_ob_names_insert (objects, old[i].pos, old[i].oid);
+	free (old);
+	return PTP_RC_OK;
+}
+
+static void
+_ob_names_add (PTPObjects *objects, uint32_t hash, uint32_t oid)
+{
+	if (!objects->namessize)
+		return;
+	if ((objects->namesused + 1) * 2 > objects->namessize &&
+	    _ob_names_resize (objects, objects->namessize * 2) != PTP_RC_OK) {
+		/* drop the index, it is rebuilt on the next lookup */
+		free (objects->names);
+		objects->names = NULL;
+		objects->namessize = objects->namesused = 0;
+		return;
+	}
+	_ob_names_insert (objects, hash, oid);
+}
+
+static void
+_ob_names_remove (PTPObjects *objects, uint32_t hash, uint32_t oid)
+{
+	uint32_t	mask = objects->namessize - 1;
+	uint32_t	hole, i;
+
+	if (!objects->namessize)
+		return;
+	for (hole = _ob_hash (hash, objects->namesshift); objects->names[hole].oid; hole = (hole + 1) & mask)
+		if (objects->names[hole].oid == oid && objects->names[hole].pos == hash)
+			break;
+	if (!objects->names[hole].oid)
+		return;
+	/* same backward shift as _ob_index_remove() */
+	for (i = hole; ; ) {
+		uint32_t	home;
+
+		i = (i + 1) & mask;
+		if (!objects->names[i].oid)
+			break;
+		home = _ob_hash (objects->names[i].pos, objects->namesshift);
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			objects->names[hole] = objects->names[i];
+			hole = i;
+		}
+	}
+	objects->names[hole].oid = 0;
+	objects->namesused--;
+}
+
+static uint16_t
+_ob_names_build (PTPObjects *objects)
+{
+	uint32_t	size = 2 * PTP_OBJECT_CHUNK_SIZE, i;
+
+	while (size < objects->len * 2)
+		size *= 2;
+	free (objects->names);
+	objects->names = NULL;
+	objects->namessize = 0;
+	CHECK_PTP_RC(_ob_names_resize (objects, size));
+	for (i = 0; i < objects->len; i++)
+		if (objects->val[i]->oi.Filename)
+			_ob_names_insert (objects, _ob_name_key_of (objects->val[i]), objects->val[i]->oid);
+	return PTP_RC_OK;
+}
+
+/* Keep the filename index in step after the name, the parent or the
+ * storage of ob may have changed. */
+static void
+_ob_names_update (PTPObjects *objects, PTPObject *ob, int hadname, uint32_t oldkey)
+{
+	uint32_t	newkey;
+
+	if (!objects->namessize)
+		return;
+	newkey = ob->oi.Filename ? _ob_name_key_of (ob) : 0;
+	if (hadname && (!ob->oi.Filename || newkey != oldkey))
+		_ob_names_remove (objects, oldkey, ob->oid);
+	if (ob->oi.Filename && (!hadname || newkey != oldkey))
+		_ob_names_add (objects, newkey, ob->oid);
+}
+
+/*
+ * String pool: the filenames, keywords and string properties of cached
+ * objects are interned, stored once in large chunks and shared. The artist,
+ * album and genre that hundreds of tracks have in common take memory only
+ * once, and clearing the cache frees a handful of chunks instead of every
+ * single string. Pooled strings are never freed on their own, those of
+ * removed objects stay until the pool is rebuilt from the objects left,
+ * see ptp_objects_compact_strings().
+ */
+static int
+_ob_strings_add_chunk (PTPObjects *objects, char *chunk, uint32_t size)
+{
+	array_push_back (&objects->strchunks, chunk);
+	if (size == PTP_STRING_CHUNK_SIZE) {
+		objects->strfree = size;
+	} else if (objects->strfree) {
+		/* an oversized string, the chunk with room left stays last */
+		uint32_t last = objects->strchunks.len - 1;
+
+		objects->strchunks.val[last] = objects->strchunks.val[last - 1];
+		objects->strchunks.val[last - 1] = chunk;
+	}
+	return 0;
+}
+
+static char *
+_ob_strings_alloc (PTPObjects *objects, uint32_t len)
+{
+	char		*chunk;
+	uint32_t	size;
+
+	if (len > objects->strfree) {
+		size = len > PTP_STRING_CHUNK_SIZE / 4 ? len : PTP_STRING_CHUNK_SIZE;
+		chunk = malloc (size);
+		if (!chunk)
+			return NULL;
+		if (_ob_strings_add_chunk (objects, chunk, size) < 0) {
+			free (chunk);
+			return NULL;
+		}
+		if (size != PTP_STRING_CHUNK_SIZE)
+			return chunk;
+	}
+	chunk = objects->strchunks.val[objects->strchunks.len - 1] + PTP_STRING_CHUNK_SIZE - objects->strfree;
+	objects->strfree -= len;
+	return chunk;
+}
+
+static uint16_t
+_ob_strings_resize (PTPObjects *objects, uint32_t newsize)
+{
+	char		**old = objects->strings;
+	uint32_t	oldsize = objects->stringssize, i, j;
+
+	objects->strings = calloc (newsize, sizeof(objects->strings[0]));
+	if (!objects->strings) {
+		objects->strings = old;
+		return PTP_RC_GeneralError;
+	}
+	objects->stringssize = newsize;
+	objects->stringsshift = _ob_hash_shift (newsize);
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i])
+			continue;
+		for (j = _ob_hash (ptp_filename_hash (old[i]), objects->stringsshift); objects->strings[j]; j = (j + 1) & (newsize - 1))
+			;
+		objects->strings[j] = old[i];
+	}
+	free (old);
+	return PTP_RC_OK;
+}
+
+static char *
+_ob_strings_intern (PTPObjects *objects, char const *str)
+{
+	uint32_t	len, i;
+	char		*pooled;
+
+	if ((objects->stringsused + 1) * 2 > objects->stringssize &&
+	    _ob_strings_resize (objects, objects->stringssize ? objects->stringssize * 2 : 2 * PTP_OBJECT_CHUNK_SIZE) != PTP_RC_OK)
+		return NULL;
+	for (i = _ob_hash (ptp_filename_hash (str), objects->stringsshift); objects->strings[i]; i = (i + 1) & (objects->stringssize - 1)) {
+		if (!strcmp (objects->strings[i], str))
+			return objects->strings[i];
+	}
+	len = strlen (str) + 1;
+	pooled = _ob_strings_alloc (objects, len);
+	if (!pooled)
+		return NULL;
+	memcpy (pooled, str, len);
+	objects->strings[i] = pooled;
+	objects->stringsused++;
+	return pooled;
+}
+
+/* The number of pooled strings an object refers to. */
+static uint32_t
+_ob_strings_refs (PTPObject const *ob)
+{
+	uint32_t	refs = 0;
+
+	if (ob->oi.Filename)
+		refs++;
+	if (ob->oi.Keywords)
+		refs++;
+	for_each (MTPObjectProp*, prop, ob->mtp_props)
+		if (prop->DataType == PTP_DTC_STR && prop->Value.str)
+			refs++;
+	return refs;
+}
+
+/* Count references to pooled strings that are let go of, the strings
+ * stay in the pool until it is rebuilt. */
+static void
+_ob_strings_drop (PTPParams *params, uint32_t refs)
+{
+	PTPObjects	*objects = &params->objects;
+
+	ptp_fill_lock (params);
+	objects->strdropped += refs;
+	objects->strrefs -= refs < objects->strrefs ? refs : objects->strrefs;
+	ptp_fill_unlock (params);
+}
+
+/* Intern each string of an object into the pool, and make the object use
+ * the pooled copy if replace is set. */
+static int
+_ob_strings_reintern (PTPObjects *objects, PTPObject *ob, int replace)
+{
+	char	**strs[2] = { &ob->oi.Filename, &ob->oi.Keywords };
+	char	*pooled;
+	int	i;
+
+	for (i = 0; i < 2; i++) {
+		if (!*strs[i])
+			continue;
+		if (!(pooled = _ob_strings_intern (objects, *strs[i])))
+			return -1;
+		if (replace)
+			*strs[i] = pooled;
+		objects->strrefs++;
+	}
+	for_each (MTPObjectProp*, prop, ob->mtp_props) {
+		if (prop->DataType != PTP_DTC_STR || !prop->Value.str)
+			continue;
+		if (!(pooled = _ob_strings_intern (objects, prop->Value.str)))
+			return -1;
+		if (replace)
+			prop->Value.str = pooled;
+		objects->strrefs++;
+	}
+	return 0;
+}
+
+/* Build a new pool holding just the strings the cached objects use. The
+ * objects are only switched over once all their strings were copied, so
+ * running out of memory leaves the old pool in place. */
+static uint16_t
+_ob_strings_rebuild (PTPObjects *objects)
+{
+	PTPObjects	old = *objects;
+	uint32_t	i;
+
+	memset (&objects->strchunks, 0, sizeof(objects->strchunks));
+	objects->strfree = 0;
+	objects->strings = NULL;
+	objects->stringssize = objects->stringsshift = objects->stringsused = 0;
+	objects->strrefs = 0;
+	for (i = 0; i < objects->len; i++)
+		if (_ob_strings_reintern (objects, objects->val[i], 0) < 0)
+			goto fail;
+	objects->strrefs = 0;
+	for (i = 0; i < objects->len; i++)
+		_ob_strings_reintern (objects, objects->val[i], 1);	/* all found */
+	objects->strdropped = 0;
+	for (i = 0; i < old.strchunks.len; i++)
+		free (old.strchunks.val[i]);
+	free_array (&old.strchunks);
+	free (old.strings);
+	return PTP_RC_OK;
+
+fail:
+	for (i = 0; i < objects->strchunks.len; i++)
+		free (objects->strchunks.val[i]);
+	free_array (&objects->strchunks);
+	free (objects->strings);
+	objects->strchunks = old.strchunks;
+	objects->strfree = old.strfree;
+	objects->strings = old.strings;
+	objects->stringssize = old.stringssize;
+	objects->stringsshift = old.stringsshift;
+	objects->stringsused = old.stringsused;
+	objects->strrefs = old.strrefs;
+	return PTP_RC_GeneralError;
+}
+
+/**
+ * ptp_intern_string:
+ * params:	PTPParams*
+ *		str	- string to intern
+ *
+ * Looks up str in the string pool of the object cache and adds a copy
+ * if it is not there yet. The returned string belongs to the pool, it
+ * must neither be changed nor freed and stays valid while the cache is
+ * read locked, or until the cache is next changed by the calling thread.
+ * Only strings stored in cached objects belong in the pool.
+ *
+ * Return values: the pooled string, NULL if str is NULL or out of memory.
+ **/
+char *
+ptp_intern_string (PTPParams *params, char const *str)
+{
+	char		*pooled;
+
+	if (!str)
+		return NULL;
+	ptp_fill_lock (params);		/* objects are filled in under the cache read lock */
+	pooled = _ob_strings_intern (&params->objects, str);
+	if (pooled)
+		params->objects.strrefs++;
+	ptp_fill_unlock (params);
+	return pooled;
+}
+
+/**
+ * ptp_objects_compact_strings:
+ * params:	PTPParams*
+ *
+ * Rebuilds the string pool of the object cache from the objects in it
+ * once more references to pooled strings were dropped, by removing or
+ * changing objects, than are left. At that point up to half the pool
+ * may be dead, and the rebuild, which takes as long as interning the
+ * strings left, is paid for by the drops that led to it. Nothing is
+ * done if the calling thread holds the cache for reading.
+ **/
+void
+ptp_objects_compact_strings (PTPParams *params)
+{
+	PTPObjects	*objects = &params->objects;
+	int		wasteful;
+
+	ptp_fill_lock (params);
+	wasteful = objects->strchunks.len > 1 && objects->strdropped > objects->strrefs;
+	ptp_fill_unlock (params);
+	if (!wasteful || ptp_cache_wrlock (params) < 0)
+		return;
+	ptp_fill_lock (params);
+	if (objects->strchunks.len > 1 && objects->strdropped > objects->strrefs) {
+		uint32_t	chunks = objects->strchunks.len;
+
+		if (_ob_strings_rebuild (objects) == PTP_RC_OK)
+			ptp_debug (params, "rebuilt string pool: %u chunks down to %u", chunks, objects->strchunks.len);
+	}
+	ptp_fill_unlock (params);
+	ptp_cache_unlock (params);
+}
+
+/* Replace the malloc()ed string values of props, starting at from, by
+ * their pooled copies. */
+static uint16_t
+_ob_intern_props (PTPParams *params, MTPObjectProps *props, uint32_t from)
+{
+	uint16_t	ret = PTP_RC_OK;
+	uint32_t	i;
+
+	for (i = from; i < props->len; i++) {
+		MTPObjectProp	*prop = &props->val[i];
+		char		*pooled;
+
+		if (prop->DataType != PTP_DTC_STR || !prop->Value.str)
+			continue;
+		pooled = ptp_intern_string (params, prop->Value.str);
+		if (!pooled)
+			ret = PTP_RC_GeneralError;
+		free (prop->Value.str);
+		prop->Value.str = pooled;
+	}
+	return ret;
+}
+
+static int
+_ob_name_matches (PTPObject const *ob, uint32_t storage, uint32_t parent, char const *filename)
+{
+	return ob->oi.Filename && !strcmp (ob->oi.Filename, filename) &&
+		(parent == PTP_HANDLER_SPECIAL || ob->oi.ParentObject == parent) &&
+		(!storage || ob->oi.StorageID == storage);
+}
+
+/**
+ * ptp_find_object_by_filename:
+ * params:	PTPParams*
+ *		storage		- storage to look in, 0 for any storage
+ *		parent		- folder to look in, PTP_HANDLER_SPECIAL for any folder
+ *		filename	- filename to look for
+ *		retob		- returned the first matching object
+ *
+ * Looks up a cached object by name through the filename index.
+ * The root folders of different storages are told apart by storage.
+ * Looking in any folder, or in the root folder of any storage, can not
+ * use the index and goes through all cached objects.
+ *
+ * Return values: PTP_RC_OK if found, PTP_RC_InvalidObjectHandle if not.
+ **/
+uint16_t
+ptp_find_object_by_filename (PTPParams *params, uint32_t storage, uint32_t parent,
+			     char const *filename, PTPObject **retob)
+{
+	PTPObjects	*objects = &params->objects;
+	PTPObject	*ob;
+	uint32_t	key, i;
+	uint16_t	ret = PTP_RC_InvalidObjectHandle;
+
+	ptp_cache_rdlock (params);
+	ptp_fill_lock (params);		/* the index is built and updated on the fly */
+	if (!objects->len)
+		goto out;
+	/* a folder and what is in it are on the same storage */
+	if (!storage && parent != 0 && parent != PTP_HANDLER_SPECIAL &&
+	    ptp_find_object_in_cache (params, parent, &ob) == PTP_RC_OK)
+		storage = ob->oi.StorageID;
+	if (!storage || parent == PTP_HANDLER_SPECIAL ||
+	    (!objects->namessize && _ob_names_build (objects) != PTP_RC_OK)) {
+		/* no single key to look for, or out of memory */
+		for (i = 0; i < objects->len; i++) {
+			if (_ob_name_matches (objects->val[i], storage, parent, filename)) {
+				*retob = objects->val[i];
+				ret = PTP_RC_OK;
+				goto out;
+			}
+		}
+		goto out;
+	}
+	key = _ob_name_key (storage, parent, filename);
+	for (i = _ob_hash (key, objects->namesshift); objects->names[i].oid; i = (i + 1) & (objects->namessize - 1)) {
+		if (objects->names[i].pos != key)
+			continue;
+		if (ptp_find_object_in_cache (params, objects->names[i].oid, &ob) != PTP_RC_OK)
+			continue;
+		if (_ob_name_matches (ob, storage, parent, filename)) {
+			*retob = ob;
+			ret = PTP_RC_OK;
+			goto out;
+		}
+	}
+out:
+	ptp_fill_unlock (params);
+	ptp_cache_unlock (params);
+	return ret;
+}
+
+/**
+ * ptp_filename_in_cache:
+ * params:	PTPParams*
+ *		storage		- storage to look in, 0 for any storage
+ *		parent		- folder to look in, PTP_HANDLER_SPECIAL for any folder
+ *		filename	- filename to look for
+ *
+ * Checks whether a cached object of the given name exists in a folder.
+ *
+ * Return values: 1 if the name is taken, 0 if not.
+ **/
+int
+ptp_filename_in_cache (PTPParams *params, uint32_t storage, uint32_t parent, char const *filename)
+{
+	PTPObject	*ob;
+
+	return ptp_find_object_by_filename (params, storage, parent, filename, &ob) == PTP_RC_OK;
+}
+
+/* Hand out a zeroed PTPObject from the chunked store. */
+static int
+_ob_alloc (PTPObjects *objects, PTPObject **retob)
+{
+	if (objects->freeobs.len) {
+		*retob = objects->freeobs.val[--objects->freeobs.len];
+	} else {
+		if (!objects->chunks.len || objects->chunkfill == PTP_OBJECT_CHUNK_SIZE) {
+			PTPObject *chunk = malloc (PTP_OBJECT_CHUNK_SIZE * sizeof(PTPObject));
+
+			if (!chunk)
+				return GP_ERROR_NO_MEMORY;
+			array_push_back (&objects->chunks, chunk);
+			objects->chunkfill = 0;
+		}
+		*retob = &objects->chunks.val[objects->chunks.len-1][objects->chunkfill++];
+	}
+	memset (*retob, 0, sizeof(PTPObject));
+	return 0;
+}
+
+static int
+_ob_push_back (PTPObjects *objects, PTPObject *ob)
+{
+	array_push_back (objects, ob);
+	return 0;
+}
+
+static int
+_ob_release (PTPObjects *objects, PTPObject *ob)
+{
+	array_push_back (&objects->freeobs, ob);
+	return 0;
+}
+
+uint16_t
+ptp_remove_object_from_cache(PTPParams *params, uint32_t handle)
+{
+	PTPObjects		*objects = &params->objects;
+	PTPObjectIndexEntry	*entry;
+	PTPObject		*ob;
+	uint32_t		pos;
+
+	if (!handle || !objects->indexsize)
+		return PTP_RC_GeneralError;
+	if (ptp_cache_wrlock (params) < 0) {
+		ptp_debug (params, "can not remove 0x%08x while reading the cache", handle);
+		return PTP_RC_GeneralError;
+	}
+	entry = _ob_index_slot (objects, handle);
+	if (!entry->oid) {
+		ptp_cache_unlock (params);
+		return PTP_RC_GeneralError;
+	}
+	pos = entry->pos;
+	ob = objects->val[pos];
+	_ob_index_remove (objects, entry);
+	if (ob->oi.Filename)
+		_ob_names_remove (objects, _ob_name_key_of (ob), handle);
+
+	/* fill the gap with the last object, this breaks the ordering */
+	if (pos != objects->len - 1) {
+		objects->val[pos] = objects->val[objects->len - 1];
+		_ob_index_slot (objects, objects->val[pos]->oid)->pos = pos;
+		objects->sorted = 0;
+	}
+	objects->len--;
+
+	_ob_strings_drop (params, _ob_strings_refs (ob));
+	ptp_free_object (ob);
+	if (_ob_release (objects, ob) < 0) {
+		/* only loses the slot for reuse */
+		ptp_debug (params, "could not recycle object slot of 0x%08x", handle);
+	}
+	ptp_cache_unlock (params);
+	return PTP_RC_OK;
+}
+
+static int _cmp_ob (const void *a, const void *b)
+{
+	PTPObject *oa = *(PTPObject**)a;
+	PTPObject *ob = *(PTPObject**)b;
+
+	/* Do not subtract the oids and return ...
+	 * the unsigned int -> int conversion will overflow in cases
+	 * like 0xfffc0000 vs 0x0004000. */
+	if (oa->oid > ob->oid) return 1;
+	if (oa->oid < ob->oid) return -1;
+	return 0;
+}
+
+/* Sort the object list by oid. Only needed before iterating the list in
+ * handle order, lookups go through the index. */
+void
+ptp_objects_sort (PTPParams *params)
+{
+	PTPObjects	*objects = &params->objects;
+	uint32_t	i;
+
+	if (objects->sorted || !objects->len)
+		return;
+	/* readers have to make do with the current order */
+	if (ptp_cache_wrlock (params) < 0)
+		return;
+	if (!objects->sorted) {
+		qsort (objects->val, objects->len, sizeof(objects->val[0]), _cmp_ob);
+		for (i = 0; i < objects->len; i++)
+			_ob_index_slot (objects, objects->val[i]->oid)->pos = i;
+		objects->sorted = 1;
+	}
+	ptp_cache_unlock (params);
+}
+
+/* Drop all objects and release all memory of the object cache. */
+void
+ptp_objects_clear (PTPParams *params)
+{
+	PTPObjects	*objects = &params->objects;
+	uint32_t	i;
+
+	if (ptp_cache_wrlock (params) < 0) {
+		ptp_debug (params, "can not clear the object cache while reading it");
+		return;
+	}
+	for (i = 0; i < objects->len; i++)
+		ptp_free_object (objects->val[i]);
+	free_array (objects);
+	for (i = 0; i < objects->chunks.len; i++)
+		free (objects->chunks.val[i]);
+	free_array (&objects->chunks);
+	free_array (&objects->freeobs);
+	for (i = 0; i < objects->strchunks.len; i++)
+		free (objects->strchunks.val[i]);
+	free_array (&objects->strchunks);
+	free (objects->strings);
+	free_array (&objects->storages);
+	free (objects->index);
+	free (objects->names);
+	memset (objects, 0, sizeof(*objects));
+	ptp_cache_unlock (params);
+}
+
+/* Returns the PTPOBJECT_*_LOADED flags of a storage, see PTPStorageLoaded. */
+unsigned int
+ptp_storage_loaded (PTPParams *params, uint32_t storage)
+{
+	unsigned int	flags = 0;
+
+	ptp_cache_rdlock (params);
+	for_each (PTPStorageLoaded*, loaded, params->objects.storages) {
+		if (loaded->storage == storage) {
+			flags = loaded->flags;
+			break;
+		}
+	}
+	ptp_cache_unlock (params);
+	return flags;
+}
+
+static int
+_ob_storage_loaded_add (PTPObjects *objects, uint32_t storage, unsigned int flags)
+{
+	PTPStorageLoaded	*loaded;
+
+	array_push_back_empty (&objects->storages, &loaded);
+	loaded->storage = storage;
+	loaded->flags = flags;
+	return 0;
+}
+
+/* Adds flags to the PTPOBJECT_*_LOADED flags of a storage. */
+uint16_t
+ptp_set_storage_loaded (PTPParams *params, uint32_t storage, unsigned int flags)
+{
+	uint16_t	ret = PTP_RC_OK;
+
+	if (ptp_cache_wrlock (params) < 0)
+		return PTP_RC_GeneralError;
+	for_each (PTPStorageLoaded*, loaded, params->objects.storages) {
+		if (loaded->storage == storage) {
+			loaded->flags |= flags;
+			ptp_cache_unlock (params);
+			return PTP_RC_OK;
+		}
+	}
+	if (_ob_storage_loaded_add (&params->objects, storage, flags) < 0)
+		ret = PTP_RC_GeneralError;
+	ptp_cache_unlock (params);
+	return ret;
+}
+
+/* Takes flags off the PTPOBJECT_*_LOADED flags of a storage, of all
+ * storages if storage is 0. */
+uint16_t
+ptp_clear_storage_loaded (PTPParams *params, uint32_t storage, unsigned int flags)
+{
+	if (ptp_cache_wrlock (params) < 0)
+		return PTP_RC_GeneralError;
+	for_each (PTPStorageLoaded*, loaded, params->objects.storages) {
+		if (!storage || loaded->storage == storage)
+			loaded->flags &= ~flags;
+	}
+	ptp_cache_unlock (params);
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_find_object_in_cache:
+ * params:	PTPParams*
+ * 		handle		object handle
+ * 		retob		out: the cached object
+ *
+ * Looks up an object in the object cache. The object belongs to the
+ * cache, any thread that write locks the cache may change or remove
+ * it. Unless no other thread uses the device, the caller has to hold
+ * the cache lock, for reading or writing, from before the call for as
+ * long as it uses the object.
+ *
+ * Return values: PTP_RC_OK if the object is cached.
+ **/
+uint16_t
+ptp_find_object_in_cache (PTPParams *params, uint32_t handle, PTPObject **retob)
+{
+	PTPObjectIndexEntry	*entry;
+	uint16_t		ret = PTP_RC_GeneralError;
+
+	*retob = NULL;
+	if (!handle)
+		return PTP_RC_GeneralError;
+	ptp_cache_rdlock (params);
+	if (params->objects.indexsize) {
+		entry = _ob_index_slot (&params->objects, handle);
+		if (entry->oid) {
+			*retob = params->objects.val[entry->pos];
+			ret = PTP_RC_OK;
+		}
+	}
+	ptp_cache_unlock (params);
+	return ret;
+}
+
+uint16_t
+ptp_find_or_insert_object_in_cache (PTPParams *params, uint32_t handle, PTPObject **retob)
+{
+	PTPObjects		*objects = &params->objects;
+	PTPObjectIndexEntry	*entry;
+	PTPObject		*ob;
+
+	if (ptp_find_object_in_cache (params, handle, retob) == PTP_RC_OK)
+		return PTP_RC_OK;
+	if (!handle) return PTP_RC_GeneralError;
+
+	if (ptp_cache_wrlock (params) < 0) {
+		ptp_debug (params, "can not add 0x%08x while reading the cache", handle);
+		return PTP_RC_GeneralError;
+	}
+	/* someone else may have added it meanwhile */
+	if (ptp_find_object_in_cache (params, handle, retob) == PTP_RC_OK) {
+		ptp_cache_unlock (params);
+		return PTP_RC_OK;
+	}
+	/* keep the load factor of the index at or below 1/2 */
+	if ((objects->len + 1) * 2 > objects->indexsize &&
+	    _ob_index_grow (objects) != PTP_RC_OK) {
+		ptp_cache_unlock (params);
+		return PTP_RC_GeneralError;
+	}
+	if (_ob_alloc (objects, &ob) < 0) {
+		ptp_cache_unlock (params);
+		return PTP_RC_GeneralError;
+	}
+	if (_ob_push_back (objects, ob) < 0) {
+		_ob_release (objects, ob);
+		ptp_cache_unlock (params);
+		return PTP_RC_GeneralError;
+	}
+	ob->oid = handle;
+	ob->oi.Handle = handle;
+
+	if (objects->len == 1)
+		objects->sorted = 1;
+	else if (objects->val[objects->len - 2]->oid > handle)
+		objects->sorted = 0;
+
+	entry = _ob_index_slot (objects, handle);
+	entry->oid = handle;
+	entry->pos = objects->len - 1;
+	*retob = ob;
+	ptp_cache_unlock (params);
+	return PTP_RC_OK;
+}
+
+/* Copy a property that duplicates an ObjectInfo field into the ObjectInfo. */
+static void
+_ob_prop_to_oi (PTPObject *ob, MTPObjectProp const *prop)
+{
+	switch (prop->PropCode) {
+	case PTP_OPC_StorageID:
+		ob->oi.StorageID = prop->Value.u32;
+		break;
+	case PTP_OPC_ObjectFormat:
+		ob->oi.ObjectFormat = prop->Value.u16;
+		break;
+	case PTP_OPC_ProtectionStatus:
+		ob->oi.ProtectionStatus = prop->Value.u16;
+		break;
+	case PTP_OPC_ObjectSize:
+		if (prop->DataType == PTP_DTC_UINT64) {
+			ob->oi.ObjectSize = prop->Value.u64;
+		} else if (prop->DataType == PTP_DTC_UINT32) {
+			ob->oi.ObjectSize = prop->Value.u32;
+		}
+		break;
+	case PTP_OPC_AssociationType:
+		ob->oi.AssociationType = prop->Value.u16;
+		break;
+	case PTP_OPC_AssociationDesc:
+		ob->oi.AssociationDesc = prop->Value.u32;
+		break;
+	case PTP_OPC_ObjectFileName:
+		if (prop->Value.str)
+			ob->oi.Filename = prop->Value.str;	/* both pooled */
+		break;
+	case PTP_OPC_DateCreated:
+		ob->oi.CaptureDate = ptp_unpack_PTPTIME(prop->Value.str);
+		break;
+	case PTP_OPC_DateModified:
+		ob->oi.ModificationDate = ptp_unpack_PTPTIME(prop->Value.str);
+		break;
+	case PTP_OPC_Keywords:
+		if (prop->Value.str)
+			ob->oi.Keywords = prop->Value.str;
+		break;
+	case PTP_OPC_ParentObject:
+		ob->oi.ParentObject = prop->Value.u32;
+		break;
+	}
+}
+
+/* Free properties that were not stored in the cache. */
+static void
+_ob_props_free (MTPObjectProps *props)
+{
+	for_each (MTPObjectProp*, prop, *props)
+		ptp_free_object_prop (prop);
+	free_array (props);
+}
+
+/* Leave out what the device can not be asked for. */
+static unsigned int
+_ob_want_supported (PTPParams *params, unsigned int want)
+{
+	if ((params->device_flags & DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST) ||
+	    !ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList))
+		want &= ~PTPOBJECT_MTPPROPLIST_LOADED;
+	return want;
+}
+
+/* Let go of the properties of a cached object. */
+static void
+_ob_props_release (PTPParams *params, PTPObject *ob)
+{
+	uint32_t	refs = 0;
+
+	for_each (MTPObjectProp*, prop, ob->mtp_props) {
+		if (prop->DataType == PTP_DTC_STR && prop->Value.str)
+			refs++;
+		else if ((prop->DataType & 0xFFF0) == PTP_DTC_ARRAY_MASK)
+			ptp_free_object_prop (prop);
+	}
+	_ob_strings_drop (params, refs);
+	free_array (&ob->mtp_props);
+}
+
+/**
+ * ptp_object_want:
+ * params:	PTPParams*
+ * 		handle		object handle
+ * 		want		PTPOBJECT_*_LOADED flags of the data needed
+ * 		retob		out: the cached object
+ *
+ * Makes sure the object cache holds the wanted data of an object, adding
+ * the object and loading what is missing from the device. The data is
+ * read into local copies and only stored into the cached object under
+ * the cache write lock. A thread that holds the cache for reading can
+ * not do that: it gets the object as cached, and the object is queued
+ * to be read again once the cache is no longer in use, as with a
+ * PTP_EC_ObjectInfoChanged event.
+ *
+ * The object returned belongs to the cache, see
+ * ptp_find_object_in_cache() for how long it may be used.
+ *
+ * Return values: PTP_RC_OK if the object holds all wanted data.
+ **/
+uint16_t
+ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObject **retob)
+{
+	uint16_t	ret;
+	PTPObject	*ob;
+	PTPObjectInfo	oi;
+	MTPObjectProps	props;
+	uint32_t	canon_flags = 0;
+	unsigned int	have = 0, loaded = 0;
+	int		hadname;
+	uint32_t	namekey;
+
+	/* If GetObjectInfo is broken, force GetPropList */
+	if (params->device_flags & DEVICE_FLAG_PROPLIST_OVERRIDES_OI)
+		want |= PTPOBJECT_MTPPROPLIST_LOADED;
+	want = _ob_want_supported (params, want);
+
+	*retob = NULL;
+	if (!handle) {
+		ptp_debug (params, "ptp_object_want: querying handle 0?\n");
+		return PTP_RC_GeneralError;
+	}
+	CHECK_PTP_RC(ptp_find_or_insert_object_in_cache (params, handle, &ob));
+
+	/* Do we have all of it already? */
+	ptp_cache_rdlock (params);
+	if (ptp_find_object_in_cache (params, handle, &ob) == PTP_RC_OK)
+		have = ob->flags;
+	ptp_cache_unlock (params);
+	if (!ob)
+		return PTP_RC_GeneralError;
+	*retob = ob;
+	if ((have & want) == want)
+		return PTP_RC_OK;
+
+	if (_ptp_cache_reading (params)) {
+		PTPContainer	event;
+
+		ptp_debug (params, "ptp_object_want: 0x%08x is read again once the cache is not read", handle);
+		memset (&event, 0, sizeof(event));
+		event.Code = PTP_EC_ObjectInfoChanged;
+		event.Nparam = 1;
+		event.Param1 = handle;
+		ptp_queue_cache_event (params, &event);
+		return PTP_RC_GeneralError;
+	}
+
+	memset (&oi, 0, sizeof(oi));
+	array_init (&props);
+#define X (PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED|PTPOBJECT_PARENTOBJECT_LOADED)
+	if ((want & X) && ((have & X) != X)) {
+		ret = ptp_getobjectinfo (params, handle, &oi);
+		if (ret != PTP_RC_OK) {
+			/* kill it from the internal list ... */
+			ptp_remove_object_from_cache(params, handle);
+			*retob = NULL;
+			return ret;
+		}
+		loaded |= X;
+
+		/* Detect if the file is larger than 4GB ... indicator is size 0xffffffff ...
+		 * In that case explicitly request the MTP object proplist to get the right size */
+		if (oi.ObjectSize == 0xffffffffUL) {
+			uint64_t	newsize;
+			if (	(params->deviceinfo.VendorExtensionID == PTP_VENDOR_NIKON)	&&
+				ptp_operation_issupported(params,PTP_OC_NIKON_GetObjectSize)	&&
+				(PTP_RC_OK == ptp_nikon_getobjectsize(params, handle, &newsize))
+			) {
+				oi.ObjectSize = newsize;
+			} else {
 				/* more methods like e.g. for Canon */
 				/* if not try MTP method */
 				want |= PTPOBJECT_MTPPROPLIST_LOADED;
 				params->device_flags |= DEVICE_FLAG_PROPLIST_OVERRIDES_OI; /* FIXME: wild hack so below code works, needs review. */
-			}
-		}
-
-		/* Apple iOS X does that for the root folder. */
-		if (ob->oi.ParentObject == ob->oi.StorageID) {
-			PTPObject *parentob;
-
-			if (ptp_find_object_in_cache (params, ob->oi.ParentObject, &parentob) != PTP_RC_OK) {
-				ptp_debug (params, "parent %08x of %s has same id as storage id. and no object found ... rewriting to 0.", ob->oi.ParentObject, ob->oi.Filename);
-				ob->oi.ParentObject = 0;
+				want = _ob_want_supported (params, want);
 			}
 		}
 
@@ -9642,98 +11749,108 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 			uint32_t            numents = 0;
 
 			ret = ptp_canon_getobjectinfo(params,
-				ob->oi.StorageID,0,
-				ob->oi.ParentObject,handle,
+				oi.StorageID,0,
+				oi.ParentObject,handle,
 				&ents,&numents
 			);
 			if ((ret == PTP_RC_OK) && (numents >= 1))
-				ob->canon_flags = ents[0].Flags;
+				canon_flags = ents[0].Flags;
 			free (ents);
 		}
-
-		ob->flags |= X;
-	}
-#undef X
-
-	if ((params->device_flags & DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST) ||
-	    !ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList)
-	) {
-		want &= ~PTPOBJECT_MTPPROPLIST_LOADED;
 	}
 
-	if ((want & PTPOBJECT_MTPPROPLIST_LOADED) && (!(ob->flags & PTPOBJECT_MTPPROPLIST_LOADED))
+	if ((want & PTPOBJECT_MTPPROPLIST_LOADED) && (!(have & PTPOBJECT_MTPPROPLIST_LOADED))
 	) {
 		ptp_debug (params, "ptp2/mtpfast: reading mtp proplist of %08x", handle);
 		/* We just want this one object, not all at once. */
-		if (PTP_RC_OK == ptp_mtp_getobjectproplist_single (params, handle, &ob->mtp_props))
-			ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED;
+		if (PTP_RC_OK == ptp_mtp_getobjectproplist_single (params, handle, &props))
+			loaded |= PTPOBJECT_MTPPROPLIST_LOADED;
+	}
+
+	/* Store what was read, unless another thread got there first */
+	if (ptp_cache_wrlock (params) < 0) {
+		ptp_free_objectinfo (&oi);
+		_ob_props_free (&props);
+		return PTP_RC_GeneralError;
+	}
+	if (ptp_find_object_in_cache (params, handle, &ob) != PTP_RC_OK) {
+		ptp_cache_unlock (params);
+		ptp_free_objectinfo (&oi);
+		_ob_props_free (&props);
+		*retob = NULL;
+		return PTP_RC_GeneralError;
+	}
+	*retob = ob;
+	ptp_fill_lock (params);
+	hadname = ob->oi.Filename != NULL;
+	namekey = hadname ? _ob_name_key_of (ob) : 0;
+
+	if ((loaded & X) && ((ob->flags & X) != X)) {
+		/* One EOS issue, where getobjecthandles(root) returns obs without root flag. */
+		if (ob->flags & PTPOBJECT_PARENTOBJECT_LOADED) {
+			if (oi.ParentObject != ob->oi.ParentObject)
+				ptp_debug (params, "saved parent %08x is not the same as read via getobjectinfo %08x", ob->oi.ParentObject, oi.ParentObject);
+			oi.ParentObject = ob->oi.ParentObject;
+		}
+
+		/* Second EOS issue, 0x20000000 has 0x20000000 as parent */
+		if (oi.ParentObject == handle)
+			oi.ParentObject = 0;
+
+		/* Apple iOS X does that for the root folder. */
+		if (oi.ParentObject == oi.StorageID) {
+			PTPObject *parentob;
+
+			if (ptp_find_object_in_cache (params, oi.ParentObject, &parentob) != PTP_RC_OK) {
+				ptp_debug (params, "parent %08x of %s has same id as storage id. and no object found ... rewriting to 0.", oi.ParentObject, oi.Filename);
+				oi.ParentObject = 0;
+			}
+		}
+
+		_ob_strings_drop (params, (ob->oi.Filename != NULL) + (ob->oi.Keywords != NULL));
+		ob->oi = oi;
+		ob->oi.Filename = ptp_intern_string (params, oi.Filename ? oi.Filename : "<none>");
+		ob->oi.Keywords = ptp_intern_string (params, oi.Keywords);
+		if (canon_flags)
+			ob->canon_flags = canon_flags;
+		ob->flags |= X;
+	}
+#undef X
+	ptp_free_objectinfo (&oi);
+
+	if ((loaded & PTPOBJECT_MTPPROPLIST_LOADED) && !(ob->flags & PTPOBJECT_MTPPROPLIST_LOADED)) {
+		_ob_props_release (params, ob);
+		_ob_intern_props (params, &props, 0);
+		move (ob->mtp_props, props);
+		ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED;
 
 		/* Override the ObjectInfo data with data from properties */
-		if ((ob->flags & PTPOBJECT_MTPPROPLIST_LOADED) && (params->device_flags & DEVICE_FLAG_PROPLIST_OVERRIDES_OI)) {
+		if (params->device_flags & DEVICE_FLAG_PROPLIST_OVERRIDES_OI) {
 
 			for_each (MTPObjectProp*, prop, ob->mtp_props) {
 				/* in case we got all subtree objects.
 				 * FIXME: we explicitly requested props for a single object, so this seems outdated. */
 				if (prop->ObjectHandle != handle) continue;
 
-				switch (prop->PropCode) {
-				case PTP_OPC_StorageID:
-					ob->oi.StorageID = prop->Value.u32;
-					break;
-				case PTP_OPC_ObjectFormat:
-					ob->oi.ObjectFormat = prop->Value.u16;
-					break;
-				case PTP_OPC_ProtectionStatus:
-					ob->oi.ProtectionStatus = prop->Value.u16;
-					break;
-				case PTP_OPC_ObjectSize:
-					if (prop->DataType == PTP_DTC_UINT64) {
-						ob->oi.ObjectSize = prop->Value.u64;
-					} else if (prop->DataType == PTP_DTC_UINT32) {
-						ob->oi.ObjectSize = prop->Value.u32;
-					}
-					break;
-				case PTP_OPC_AssociationType:
-					ob->oi.AssociationType = prop->Value.u16;
-					break;
-				case PTP_OPC_AssociationDesc:
-					ob->oi.AssociationDesc = prop->Value.u32;
-					break;
-				case PTP_OPC_ObjectFileName:
-					if (prop->Value.str) {
-						free(ob->oi.Filename);
-						ob->oi.Filename = strdup(prop->Value.str);
-					}
-					break;
-				case PTP_OPC_DateCreated:
-					ob->oi.CaptureDate = ptp_unpack_PTPTIME(prop->Value.str);
-					break;
-				case PTP_OPC_DateModified:
-					ob->oi.ModificationDate = ptp_unpack_PTPTIME(prop->Value.str);
-					break;
-				case PTP_OPC_Keywords:
-					if (prop->Value.str) {
-						free(ob->oi.Keywords);
-						ob->oi.Keywords = strdup(prop->Value.str);
-					}
-					break;
-				case PTP_OPC_ParentObject:
-					ob->oi.ParentObject = prop->Value.u32;
-					break;
-				}
+				_ob_prop_to_oi (ob, prop);
 			}
 		}
 	}
+	_ob_props_free (&props);
 
-	if ((ob->flags & want) != want) {
-		ptp_debug (params, "ptp_object_want: handle 0x%08x, want flags %x, have only %x?", handle, want, ob->flags);
+	_ob_names_update (&params->objects, ob, hadname, namekey);
+	have = ob->flags;
+	ptp_fill_unlock (params);
+	ptp_cache_unlock (params);
+
+	if ((have & want) != want) {
+		ptp_debug (params, "ptp_object_want: handle 0x%08x, want flags %x, have only %x?", handle, want, have);
 		return PTP_RC_GeneralError;
 	}
 
 	return PTP_RC_OK;
 }
 
-
 uint16_t
 ptp_add_object_to_cache(PTPParams *params, uint32_t handle)
 {
@@ -9741,6 +11858,333 @@ ptp_add_object_to_cache(PTPParams *params, uint32_t handle)
 	return ptp_object_want (params, handle, PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_MTPPROPLIST_LOADED, &ob);
 }
 
+/*
+ * Write-through: after a successful change on the device the cached object
+ * is changed the same way instead of being read again.
+ */
+
+/* Copy a property value, strings go to the string pool. */
+static int
+_ob_copy_value (PTPParams *params, uint16_t datatype, PTPPropValue *dst, PTPPropValue const *src)
+{
+	if (datatype == PTP_DTC_STR) {
+		dst->str = src->str ? ptp_intern_string (params, src->str) : NULL;
+		return (src->str && !dst->str) ? GP_ERROR_NO_MEMORY : 0;
+	}
+	if ((datatype & 0xFFF0) == PTP_DTC_ARRAY_MASK) {
+		dst->a.count = 0;
+		dst->a.v = NULL;
+		if (!src->a.count)
+			return 0;
+		dst->a.v = malloc (src->a.count * sizeof(src->a.v[0]));
+		if (!dst->a.v)
+			return GP_ERROR_NO_MEMORY;
+		memcpy (dst->a.v, src->a.v, src->a.count * sizeof(src->a.v[0]));
+		dst->a.count = src->a.count;
+		return 0;
+	}
+	*dst = *src;
+	return 0;
+}
+
+/* Set a property of a cached object. A property the cache does not hold
+ * is only added if the cache holds all properties of the object, the
+ * ObjectInfo fields follow the property either way. */
+static uint16_t
+_ob_set_prop (PTPParams *params, PTPObject *ob, uint16_t propcode, uint16_t datatype,
+	      PTPPropValue const *value)
+{
+	MTPObjectProp	*prop = NULL, tmp;
+
+	for_each (MTPObjectProp*, cached, ob->mtp_props) {
+		if (cached->ObjectHandle == ob->oid && cached->PropCode == propcode) {
+			prop = cached;
+			break;
+		}
+	}
+	if (!prop && (ob->flags & PTPOBJECT_MTPPROPLIST_LOADED)) {
+		prop = ptp_get_new_object_prop_entry (&ob->mtp_props);
+		if (!prop)
+			return PTP_RC_GeneralError;
+		prop->ObjectHandle = ob->oid;
+		prop->PropCode = propcode;
+	}
+	if (!prop) {
+		if ((datatype & 0xFFF0) == PTP_DTC_ARRAY_MASK)
+			return PTP_RC_OK;
+		prop = &tmp;
+		tmp.ObjectHandle = ob->oid;
+		tmp.PropCode = propcode;
+	} else if ((prop->DataType & 0xFFF0) == PTP_DTC_ARRAY_MASK) {
+		ptp_free_object_prop (prop);
+	} else if (prop->DataType == PTP_DTC_STR && prop->Value.str) {
+		_ob_strings_drop (params, 1);
+	}
+	prop->DataType = datatype;
+	if (_ob_copy_value (params, datatype, &prop->Value, value) < 0) {
+		prop->DataType = PTP_DTC_UNDEF;
+		prop->Value.str = NULL;
+		return PTP_RC_GeneralError;
+	}
+	_ob_prop_to_oi (ob, prop);
+	return PTP_RC_OK;
+}
+
+/* Collect the handles of all cached objects below a folder. */
+static int
+_ob_collect_subtree (PTPParams *params, uint32_t handle, PTPObjectHandles *subtree)
+{
+	PTPObjects	*objects = &params->objects;
+	uint32_t	i, depth;
+
+	for (i = 0; i < objects->len; i++) {
+		PTPObject	*parent = objects->val[i];
+
+		/* walk up the parent chain, the depth limit protects against loops */
+		for (depth = 0; depth < objects->len; depth++) {
+			uint32_t	parentid = parent->oi.ParentObject;
+
+			if (parentid == handle) {
+				array_push_back (subtree, objects->val[i]->oid);
+				break;
+			}
+			if (!parentid || parentid == parent->oid ||
+			    ptp_find_object_in_cache (params, parentid, &parent) != PTP_RC_OK)
+				break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * ptp_remove_object_subtree_from_cache:
+ * params:	PTPParams*
+ *		handle		- object handle
+ *
+ * Removes an object from the cache, and if it is a folder everything
+ * cached below it as well.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_remove_object_subtree_from_cache (PTPParams *params, uint32_t handle)
+{
+	PTPObjectHandles	subtree;
+	PTPObject		*ob;
+	uint16_t		ret;
+	uint32_t		i;
+
+	if (ptp_cache_wrlock (params) < 0) {
+		ptp_debug (params, "can not remove 0x%08x while reading the cache", handle);
+		return PTP_RC_GeneralError;
+	}
+	if (ptp_find_object_in_cache (params, handle, &ob) != PTP_RC_OK) {
+		ptp_cache_unlock (params);
+		return PTP_RC_GeneralError;
+	}
+	if (ob->oi.ObjectFormat == PTP_OFC_Association) {
+		/* collect first, removing objects reorders the list */
+		array_init (&subtree);
+		if (_ob_collect_subtree (params, handle, &subtree) < 0)
+			ptp_debug (params, "could not collect all objects below 0x%08x", handle);
+		for (i = 0; i < subtree.len; i++)
+			ptp_remove_object_from_cache (params, subtree.val[i]);
+		free_array (&subtree);
+	}
+	ret = ptp_remove_object_from_cache (params, handle);
+	ptp_cache_unlock (params);
+	return ret;
+}
+
+/**
+ * ptp_set_object_prop_in_cache:
+ * params:	PTPParams*
+ *		handle		- object handle
+ *		propcode	- object property code
+ *		datatype	- PTP_DTC_* type of the value
+ *		value		- the value the device accepted
+ *
+ * Writes a property value through to the cached object. An object that
+ * is not cached is left alone, one that can not be updated is dropped
+ * from the cache so that it is read again when needed.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_set_object_prop_in_cache (PTPParams *params, uint32_t handle, uint16_t propcode,
+			      uint16_t datatype, PTPPropValue const *value)
+{
+	PTPObject	*ob;
+	uint16_t	ret;
+	int		hadname;
+	uint32_t	namekey;
+
+	if (ptp_cache_wrlock (params) < 0) {
+		ptp_debug (params, "can not update 0x%08x while reading the cache", handle);
+		return PTP_RC_GeneralError;
+	}
+	if (ptp_find_object_in_cache (params, handle, &ob) != PTP_RC_OK) {
+		ptp_cache_unlock (params);
+		return PTP_RC_OK;
+	}
+	hadname = ob->oi.Filename != NULL;
+	namekey = hadname ? _ob_name_key_of (ob) : 0;
+	ret = _ob_set_prop (params, ob, propcode, datatype, value);
+	if (ret == PTP_RC_OK)
+		_ob_names_update (&params->objects, ob, hadname, namekey);
+	else
+		ptp_remove_object_from_cache (params, handle);
+	ptp_cache_unlock (params);
+	return ret;
+}
+
+/**
+ * ptp_move_object_in_cache:
+ * params:	PTPParams*
+ *		handle		- object handle
+ *		storage		- destination StorageID, 0 if unchanged
+ *		parent		- destination parent ObjectHandle, 0 for the root
+ *
+ * Moves a cached object, and everything cached below it, like the device
+ * did with ptp_moveobject().
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_move_object_in_cache (PTPParams *params, uint32_t handle, uint32_t storage, uint32_t parent)
+{
+	PTPObjectHandles	subtree;
+	PTPPropValue		value;
+	PTPObject		*ob, *child;
+	uint16_t		ret = PTP_RC_OK;
+	uint32_t		i, namekey;
+	int			hadname;
+
+	if (ptp_cache_wrlock (params) < 0) {
+		ptp_debug (params, "can not move 0x%08x while reading the cache", handle);
+		return PTP_RC_GeneralError;
+	}
+	if (ptp_find_object_in_cache (params, handle, &ob) != PTP_RC_OK) {
+		ptp_cache_unlock (params);
+		return PTP_RC_OK;
+	}
+	if (storage && storage != ob->oi.StorageID) {
+		value.u32 = storage;
+		/* the contents of a folder move to the other storage along with it */
+		if (ob->oi.ObjectFormat == PTP_OFC_Association) {
+			array_init (&subtree);
+			if (_ob_collect_subtree (params, handle, &subtree) < 0)
+				ret = PTP_RC_GeneralError;
+			for (i = 0; i < subtree.len && ret == PTP_RC_OK; i++) {
+				if (ptp_find_object_in_cache (params, subtree.val[i], &child) != PTP_RC_OK)
+					continue;
+				hadname = child->oi.Filename != NULL;
+				namekey = hadname ? _ob_name_key_of (child) : 0;
+				ret = _ob_set_prop (params, child, PTP_OPC_StorageID, PTP_DTC_UINT32, &value);
+				_ob_names_update (&params->objects, child, hadname, namekey);
+			}
+			free_array (&subtree);
+		}
+		hadname = ob->oi.Filename != NULL;
+		namekey = hadname ? _ob_name_key_of (ob) : 0;
+		if (ret == PTP_RC_OK)
+			ret = _ob_set_prop (params, ob, PTP_OPC_StorageID, PTP_DTC_UINT32, &value);
+		_ob_names_update (&params->objects, ob, hadname, namekey);
+	}
+	value.u32 = parent;
+	hadname = ob->oi.Filename != NULL;
+	namekey = hadname ? _ob_name_key_of (ob) : 0;
+	if (ret == PTP_RC_OK)
+		ret = _ob_set_prop (params, ob, PTP_OPC_ParentObject, PTP_DTC_UINT32, &value);
+	_ob_names_update (&params->objects, ob, hadname, namekey);
+	if (ret != PTP_RC_OK)
+		ptp_remove_object_subtree_from_cache (params, handle);
+	ptp_cache_unlock (params);
+	return ret;
+}
+
+/* Copy the cached properties of one object to another. */
+static int
+_ob_copy_props (PTPParams *params, PTPObject *from, PTPObject *to)
+{
+	for_each (MTPObjectProp*, prop, from->mtp_props) {
+		MTPObjectProp	*copy;
+
+		if (prop->ObjectHandle != from->oid)
+			continue;
+		array_push_back_empty (&to->mtp_props, &copy);
+		copy->PropCode = prop->PropCode;
+		copy->ObjectHandle = to->oid;
+		copy->DataType = prop->DataType;
+		if (_ob_copy_value (params, prop->DataType, &copy->Value, &prop->Value) < 0) {
+			copy->DataType = PTP_DTC_UNDEF;
+			copy->Value.str = NULL;
+			return GP_ERROR_NO_MEMORY;
+		}
+	}
+	return 0;
+}
+
+/**
+ * ptp_copy_object_in_cache:
+ * params:	PTPParams*
+ *		handle		- source ObjectHandle
+ *		newhandle	- ObjectHandle of the copy
+ *		storage		- destination StorageID
+ *		parent		- destination parent ObjectHandle, 0 for the root
+ *
+ * Caches the copy ptp_copyobject() made of a cached object. The copy of a
+ * folder is cached without its contents, it is not known what the device
+ * named them.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_copy_object_in_cache (PTPParams *params, uint32_t handle, uint32_t newhandle,
+			  uint32_t storage, uint32_t parent)
+{
+	PTPPropValue	value;
+	PTPObject	*ob, *copy;
+	uint16_t	ret = PTP_RC_OK;
+
+	if (ptp_cache_wrlock (params) < 0) {
+		ptp_debug (params, "can not copy 0x%08x while reading the cache", handle);
+		return PTP_RC_GeneralError;
+	}
+	if (ptp_find_object_in_cache (params, handle, &ob) != PTP_RC_OK) {
+		ptp_cache_unlock (params);
+		return PTP_RC_OK;
+	}
+	if (ptp_find_or_insert_object_in_cache (params, newhandle, &copy) != PTP_RC_OK) {
+		ptp_cache_unlock (params);
+		return PTP_RC_GeneralError;
+	}
+	/* already read, e.g. when handling the ObjectAdded event */
+	if (copy->flags) {
+		ptp_cache_unlock (params);
+		return PTP_RC_OK;
+	}
+	copy->oi = ob->oi;		/* the strings are pooled */
+	copy->oi.Handle = newhandle;
+	copy->canon_flags = ob->canon_flags;
+	copy->flags = ob->flags & ~(PTPOBJECT_DIRECTORY_LOADED|PTPOBJECT_SUBTREE_LOADED);
+	if (_ob_copy_props (params, ob, copy) < 0)
+		ret = PTP_RC_GeneralError;
+	if (ret == PTP_RC_OK && storage) {
+		value.u32 = storage;
+		ret = _ob_set_prop (params, copy, PTP_OPC_StorageID, PTP_DTC_UINT32, &value);
+	}
+	if (ret == PTP_RC_OK) {
+		value.u32 = parent;
+		ret = _ob_set_prop (params, copy, PTP_OPC_ParentObject, PTP_DTC_UINT32, &value);
+	}
+	_ob_names_update (&params->objects, copy, 0, 0);
+	if (ret != PTP_RC_OK)
+		ptp_remove_object_from_cache (params, newhandle);
+	ptp_cache_unlock (params);
+	return ret;
+}
+
 
 /*
  * Local Variables:
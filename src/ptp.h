@@ -3889,7 +3889,10 @@ struct _PTPObject {
 #define PTPOBJECT_DIRECTORY_LOADED	(1<<3)
 #define PTPOBJECT_PARENTOBJECT_LOADED	(1<<4)
 #define PTPOBJECT_STORAGEID_LOADED	(1<<5)
+#define PTPOBJECT_SUBTREE_LOADED	(1<<6)	/* all objects below this folder are cached */
 
+	/* the strings of cached objects are in the string pool of the cache,
+	 * see ptp_intern_string() */
 	PTPObjectInfo	oi;
 	uint32_t	canon_flags;
 	MTPObjectProps mtp_props;
@@ -3926,9 +3929,128 @@ typedef struct _PanasonicLiveViewSize PanasonicLiveViewSize;
 #define PTP_DP_GETDATA          0x0002  /* receiving data */
 #define PTP_DP_DATA_MASK        0x00ff  /* data phase mask */
 
-typedef ARRAY_OF(PTPObject) PTPObjects;
+/* The object cache. The PTPObject structs are allocated in chunks and never
+ * move, so pointers returned by the cache functions stay valid until the
+ * object is removed. val lists all cached objects, it is only sorted by oid
+ * after ptp_objects_sort(). index is an open addressing hash table (linear
+ * probing) that maps an oid to its position in val, oid 0 marks a free slot.
+ * The strings of all cached objects are interned into strchunks, strings is
+ * the open addressing hash table over them. The pool is rebuilt from the
+ * objects once more references to it were dropped than are left, see
+ * ptp_objects_compact_strings(). */
+#define PTP_OBJECT_CHUNK_SIZE	256
+#define PTP_STRING_CHUNK_SIZE	16384
+
+typedef struct _PTPObjectIndexEntry {
+	uint32_t	oid;
+	uint32_t	pos;
+} PTPObjectIndexEntry;
+
+/* How much of a storage is cached: PTPOBJECT_DIRECTORY_LOADED once the
+ * objects in its root folder are, PTPOBJECT_SUBTREE_LOADED once all of
+ * them are. Folders keep the same flags in their PTPObject. */
+typedef struct _PTPStorageLoaded {
+	uint32_t	storage;
+	unsigned int	flags;
+} PTPStorageLoaded;
+
+typedef struct _PTPObjects {
+	PTPObject		**val;
+	uint32_t		len;
+	uint32_t		cap;
+	int			sorted;
+	PTPObjectIndexEntry	*index;
+	uint32_t		indexsize;	/* 0 or a power of 2 */
+	uint32_t		indexshift;	/* 32 - log2(indexsize) */
+	struct {
+		PTPObject	**val;
+		uint32_t	len;
+		uint32_t	cap;
+	} chunks, freeobs;
+	uint32_t		chunkfill;	/* used entries in the last chunk */
+	PTPObjectIndexEntry	*names;		/* (storage, parent, filename) key (in pos) to oid, built on first use */
+	uint32_t		namessize;	/* 0 or a power of 2 */
+	uint32_t		namesshift;	/* 32 - log2(namessize) */
+	uint32_t		namesused;
+	uint32_t		suffixhash;	/* last name made unique, see generate_unique_filename() */
+	uint32_t		suffix;
+	struct {
+		char		**val;
+		uint32_t	len;
+		uint32_t	cap;
+	} strchunks;
+	uint32_t		strfree;	/* bytes left in the last chunk */
+	char			**strings;	/* NULL marks a free slot */
+	uint32_t		stringssize;	/* 0 or a power of 2 */
+	uint32_t		stringsshift;	/* 32 - log2(stringssize) */
+	uint32_t		stringsused;
+	uint32_t		strrefs;	/* references from cached objects */
+	uint32_t		strdropped;	/* references dropped since the pool was built */
+	int			complete;	/* all objects of the device are cached */
+	struct {
+		PTPStorageLoaded	*val;
+		uint32_t		len;
+		uint32_t		cap;
+	} storages;
+} PTPObjects;
+/* The MTP object properties an object format supports, as returned by
+ * GetObjectPropsSupported. They do not change while connected. */
+typedef struct _PTPFormatProps {
+	uint16_t	ofc;
+	uint32_t	propnum;
+	uint16_t	*props;
+} PTPFormatProps;
+typedef ARRAY_OF(PTPFormatProps) PTPFormatPropsList;
+/* The description of an MTP object property in an object format, kept
+ * as the dataset GetObjectPropDesc returned. It does not change while
+ * connected either. */
+typedef struct _PTPPropDescData {
+	uint16_t	ofc;
+	uint16_t	opc;
+	uint32_t	size;
+	unsigned char	*data;
+} PTPPropDescData;
+typedef ARRAY_OF(PTPPropDescData) PTPPropDescDataList;
 typedef ARRAY_OF(PTPContainer) PTPEvents;
 typedef ARRAY_OF(PTPCanonEOSEvent) PTPCanonEOSEvents;
+typedef struct _PTPLocks PTPLocks;
+
+/* Transaction statistics, kept per opcode, see ptp_stats_get() */
+#define PTP_STATS_OPCODES	64	/* opcodes tracked, the rest count as opcode 0 */
+#define PTP_STATS_BUCKETS	32	/* bucket n: device time below 2^n usec */
+typedef struct _PTPOpStats {
+	uint16_t	opcode;
+	uint32_t	count;
+	uint32_t	errors;		/* transactions not answered with PTP_RC_OK */
+	uint64_t	bytes_in;	/* data phase bytes from the device */
+	uint64_t	bytes_out;	/* data phase bytes to the device */
+	uint64_t	device_usec;	/* time spent on the wire and in the device */
+	uint64_t	handler_usec;	/* time spent in the data handlers */
+	uint64_t	max_usec;	/* slowest device time */
+	uint32_t	histogram[PTP_STATS_BUCKETS];
+} PTPOpStats;
+
+/* One transaction in the trace ring buffer */
+typedef struct _PTPTraceEntry {
+	uint64_t	start;		/* usec since the epoch */
+	uint16_t	opcode;
+	uint16_t	response;
+	uint32_t	param[5];
+	uint8_t		nparam;
+	uint64_t	bytes_in;
+	uint64_t	bytes_out;
+	uint64_t	device_usec;
+	uint64_t	handler_usec;
+} PTPTraceEntry;
+
+typedef struct _PTPStats {
+	PTPOpStats	ops[PTP_STATS_OPCODES];	/* open addressing on the opcode */
+	PTPOpStats	other;
+	PTPTraceEntry	*trace;		/* NULL if tracing is off */
+	uint32_t	tracesize;
+	uint32_t	tracenext;	/* slot of the next entry */
+	uint32_t	traceused;
+} PTPStats;
 typedef ARRAY_OF(PTPDevicePropDesc) PTPDevicePropDescs;
 
 struct _PTPParams {
@@ -3983,6 +4105,9 @@ struct _PTPParams {
 	/* PTP: the current event queue */
 	PTPEvents	events;
 
+	/* MTP: events the object cache is yet to be updated for */
+	PTPEvents	cache_events;
+
 	/* Capture count for SDRAM capture style images */
 	unsigned int		capcnt;
 
@@ -3999,6 +4124,11 @@ struct _PTPParams {
 	/* PTP: Device Property Caching */
 	PTPDevicePropDescs	dpd_cache;
 
+	/* MTP: Object properties supported per format, filled on first use */
+	PTPFormatPropsList	props_supported;
+	/* MTP: Object property descriptions per format, filled on first use */
+	PTPPropDescDataList	opd_cache;
+
 	/* PTP: Canon specific flags list */
 	PTPDevicePropDescs	canon_props;
 	int			canon_viewfinder_on;
@@ -4037,6 +4167,9 @@ struct _PTPParams {
 	char		*olympus_reply;
 	struct _PTPParams *outer_params;
 
+	/* PTP: the host side of strings is UTF-8, convert them without iconv */
+	int		utf8_strings;
+
 #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
 	/* PTP: iconv converters */
 	iconv_t	cd_locale_to_ucs2;
@@ -4048,6 +4181,12 @@ struct _PTPParams {
 	 */
 	uint8_t		*response_packet;
 	uint16_t	response_packet_size;
+
+	/* Locking for concurrent users, NULL if not set up, see ptp_init_locks() */
+	PTPLocks	*locks;
+
+	/* Transaction statistics and trace, allocated by the first transaction */
+	PTPStats	*stats;
 };
 
 /* Asynchronous event callback */
@@ -4193,7 +4332,8 @@ uint16_t ptp_moveobject		(PTPParams* params, uint32_t handle,
 				uint32_t storage, uint32_t parent);
 
 uint16_t ptp_copyobject		(PTPParams* params, uint32_t handle,
-				uint32_t storage, uint32_t parent);
+				uint32_t storage, uint32_t parent,
+				uint32_t *newhandle);
 
 uint16_t ptp_sendobjectinfo	(PTPParams* params, uint32_t* store,
 				uint32_t* parenthandle, uint32_t* handle,
@@ -4255,6 +4395,9 @@ uint16_t ptp_wait_event (PTPParams *params);
 uint16_t ptp_add_event (PTPParams *params, PTPContainer *event);
 int ptp_get_one_event (PTPParams *params, PTPContainer *evt);
 int ptp_get_one_event_by_type(PTPParams *params, uint16_t code, PTPContainer *event);
+uint16_t ptp_queue_cache_event (PTPParams *params, PTPContainer *event);
+unsigned int ptp_take_cache_events (PTPParams *params, PTPEvents *events);
+unsigned int ptp_cache_events_pending (PTPParams *params);
 uint16_t ptp_check_eos_events (PTPParams *params);
 int ptp_get_one_eos_event (PTPParams *params, PTPCanonEOSEvent *eos_event);
 
@@ -4272,6 +4415,7 @@ uint16_t ptp_mtp_getobjectproplist_generic (PTPParams* params, uint32_t handle,
 uint16_t ptp_mtp_getobjectproplist_level (PTPParams* params, uint32_t handle, uint32_t level, MTPObjectProp **props, int *nrofprops);
 uint16_t ptp_mtp_getobjectproplist (PTPParams* params, uint32_t handle, MTPObjectProp **props, int *nrofprops);
 uint16_t ptp_mtp_getobjectproplist_single (PTPParams* params, uint32_t handle, MTPObjectProps *props);
+uint16_t ptp_mtp_getobjectproplist_to_cache (PTPParams* params, uint32_t handle, uint32_t formats, uint32_t properties, uint32_t propertygroups, uint32_t level, unsigned int *nrofobjects);
 uint16_t ptp_mtp_sendobjectproplist (PTPParams* params, uint32_t* store, uint32_t* parenthandle, uint32_t* handle,
 				     uint16_t objecttype, uint64_t objectsize, MTPObjectProp *props, int nrofprops);
 uint16_t ptp_mtp_setobjectproplist (PTPParams* params, MTPObjectProp *props, int nrofprops);
@@ -4902,6 +5046,8 @@ uint16_t ptp_mtp_getobjectpropssupported (PTPParams* params, uint16_t ofc, uint3
 uint16_t ptp_android_getpartialobject64	(PTPParams* params, uint32_t handle, uint64_t offset,
 					uint32_t maxbytes, unsigned char** object,
 					uint32_t *len);
+uint16_t ptp_android_getpartialobject64_to_handler (PTPParams* params, uint32_t handle,
+					uint64_t offset, uint32_t maxbytes, PTPDataHandler *handler);
 #define ptp_android_begineditobject(params,handle) ptp_generic_no_data (params, PTP_OC_ANDROID_BeginEditObject, 1, handle)
 #define ptp_android_truncate(params,handle,offset) ptp_generic_no_data (params, PTP_OC_ANDROID_TruncateObject, 3, handle, (offset & 0xFFFFFFFF), (offset >> 32))
 uint16_t ptp_android_sendpartialobject (PTPParams *params, uint32_t handle,
@@ -5004,20 +5150,58 @@ int ptp_render_ofc(PTPParams* params, uint16_t ofc, int spaceleft, char *txt);
 int ptp_render_mtp_propname(uint16_t propid, int spaceleft, char *txt);
 void ptp_free_object_prop(MTPObjectProp *prop);
 #if 1
-MTPObjectProp *ptp_get_new_object_prop_entry(MTPObjectProp **props, int *nrofprops);
+MTPObjectProp *ptp_get_new_object_prop_entry(MTPObjectProps *props);
 MTPObjectProp *ptp_find_object_prop_in_cache(PTPParams *params, uint32_t const handle, uint32_t const attribute_id);
 #endif
 
 uint16_t ptp_remove_object_from_cache(PTPParams *params, uint32_t handle);
 uint16_t ptp_add_object_to_cache(PTPParams *params, uint32_t handle);
+uint16_t ptp_remove_object_subtree_from_cache (PTPParams *params, uint32_t handle);
+uint16_t ptp_set_object_prop_in_cache (PTPParams *params, uint32_t handle, uint16_t propcode,
+				       uint16_t datatype, PTPPropValue const *value);
+uint16_t ptp_move_object_in_cache (PTPParams *params, uint32_t handle, uint32_t storage, uint32_t parent);
+uint16_t ptp_copy_object_in_cache (PTPParams *params, uint32_t handle, uint32_t newhandle,
+				   uint32_t storage, uint32_t parent);
 uint16_t ptp_object_want (PTPParams *, uint32_t handle, unsigned int want, PTPObject**retob);
 void ptp_objects_sort (PTPParams *);
+void ptp_objects_clear (PTPParams *);
 uint16_t ptp_find_object_in_cache (PTPParams *params, uint32_t handle, PTPObject **retob);
+unsigned int ptp_storage_loaded (PTPParams *params, uint32_t storage);
+uint16_t ptp_set_storage_loaded (PTPParams *params, uint32_t storage, unsigned int flags);
+uint16_t ptp_clear_storage_loaded (PTPParams *params, uint32_t storage, unsigned int flags);
+uint16_t ptp_mtp_add_objectpropssupported (PTPParams *params, uint16_t ofc,
+					   uint32_t propnum, uint16_t const *props);
+uint16_t ptp_mtp_add_objectpropdesc (PTPParams *params, uint16_t opc, uint16_t ofc,
+				     unsigned char const *data, uint32_t size);
+
+/* Locking, all of these do nothing if ptp_init_locks() was not called */
+int ptp_init_locks (PTPParams *);
+void ptp_free_locks (PTPParams *);
+void ptp_cache_rdlock (PTPParams *);
+int ptp_cache_wrlock (PTPParams *);
+void ptp_cache_unlock (PTPParams *);
+
+/* Transaction statistics, these take the transaction lock */
+int ptp_stats_get (PTPParams *, PTPOpStats **ops, unsigned int *nops);
+void ptp_stats_reset (PTPParams *);
+int ptp_stats_set_trace (PTPParams *, unsigned int size);
+int ptp_stats_get_trace (PTPParams *, PTPTraceEntry **entries, unsigned int *nentries);
+
+uint16_t ptp_find_object_by_filename (PTPParams *params, uint32_t storage, uint32_t parent,
+				      char const *filename, PTPObject **retob);
+int ptp_filename_in_cache (PTPParams *params, uint32_t storage, uint32_t parent, char const *filename);
+uint32_t ptp_filename_hash (char const *filename);
+char *ptp_intern_string (PTPParams *params, char const *str);
+void ptp_objects_compact_strings (PTPParams *params);
 uint16_t ptp_find_or_insert_object_in_cache (PTPParams *params, uint32_t handle, PTPObject **retob);
 uint16_t ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle, PTPObjectHandles *children);
 
 PTPDevicePropDesc* ptp_find_dpd_in_cache(PTPParams *params, uint32_t dpc);
 
+/* UTF-16LE <-> UTF-8 without iconv */
+unsigned int ptp_utf16le_to_utf8 (const unsigned char *src, unsigned int units, char *dest);
+int ptp_utf8_to_utf16le (const char *src, size_t len, unsigned char *dest, unsigned int max, unsigned int *units);
+
 /* ptpip.c */
 void ptp_nikon_getptpipguid (unsigned char* guid);
 
@@ -0,0 +1,634 @@
+/**
+ * \file scheduler.c
+ *
+ * Transfer scheduler for stations with many devices attached at once.
+ *
+ * The scheduler opens all devices in parallel and runs one worker thread
+ * per device, which takes the jobs queued for its device in priority
+ * order and runs them through the ordinary blocking transfer functions.
+ * Devices on different buses then transfer at the same time, so the
+ * total time approaches that of the slowest device rather than the sum
+ * of all of them.
+ *
+ * Devices sharing a bus also share its bandwidth. The number of
+ * transfers running on one bus at a time can be limited, and waiting
+ * devices then take turns in the order they asked, so that one device
+ * with a long queue cannot starve the others on its bus.
+ *
+ * Without thread support the devices are opened one by one and the jobs
+ * are run in LIBMTP_Scheduler_Wait(), one device after the other.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "libmtp.h"
+#include "util.h"
+
+#define SCHED_JOB_SEND 0
+#define SCHED_JOB_GET 1
+
+typedef struct sched_job_struct sched_job_t;
+typedef struct sched_bus_struct sched_bus_t;
+typedef struct sched_device_struct sched_device_t;
+
+/**
+ * A queued transfer.
+ */
+struct sched_job_struct {
+  int id; /**< Job ID handed out to the caller */
+  int type; /**< SCHED_JOB_SEND or SCHED_JOB_GET */
+  int priority; /**< Higher priorities run first */
+  int fd; /**< Source of a send, destination of a get */
+  uint32_t item_id; /**< Object to get */
+  LIBMTP_file_t *filedata; /**< Metadata of the file to send */
+  uint64_t size; /**< Size of the transfer, 0 until known */
+  uint64_t sent; /**< Bytes transferred so far */
+  LIBMTP_job_done_fn done; /**< Called when the job has finished */
+  void *user_data; /**< Passed to the done function */
+  LIBMTP_scheduler_t *scheduler; /**< The scheduler running the job */
+  sched_job_t *next; /**< Next job in the queue */
+};
+
+/**
+ * A USB bus, shared by all devices attached to it.
+ */
+struct sched_bus_struct {
+  uint32_t bus_location; /**< Location of the bus */
+  unsigned int active; /**< Transfers running on this bus */
+  unsigned int next_ticket; /**< Turn handed to the next device asking */
+  unsigned int serving; /**< Turn of the device allowed to start next */
+};
+
+/**
+ * A device and its queue of jobs.
+ */
+struct sched_device_struct {
+  LIBMTP_scheduler_t *scheduler; /**< The scheduler owning the device */
+  LIBMTP_raw_device_t rawdevice; /**< The device to open */
+  LIBMTP_mtpdevice_t *device; /**< The opened device, NULL if it failed */
+  sched_bus_t *bus; /**< The bus the device is attached to */
+  sched_job_t *queue; /**< Jobs waiting, highest priority first */
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread; /**< The worker serving this device */
+  int has_thread; /**< Whether the worker was started */
+#endif
+};
+
+/**
+ * The scheduler itself.
+ */
+struct LIBMTP_scheduler_struct {
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock; /**< Protects the queues and counters */
+  pthread_cond_t changed; /**< Signalled when any of them change */
+  pthread_mutex_t progress_lock; /**< Serializes the progress callback */
+#endif
+  sched_device_t *devices; /**< The devices, in the order given */
+  int numdevices; /**< Number of devices */
+  sched_bus_t *buses; /**< The buses the devices are attached to */
+  int numbuses; /**< Number of buses */
+  unsigned int max_per_bus; /**< Transfers allowed per bus, 0 for any */
+  int cached; /**< Whether the devices are opened cached */
+  int opened; /**< Number of workers done opening their device */
+  int next_job_id; /**< ID of the next job */
+  unsigned int pending; /**< Jobs queued or running */
+  unsigned int failed; /**< Jobs failed since the last wait */
+  int stopping; /**< Set when the workers shall exit */
+  uint64_t total; /**< Size of all jobs seen so far */
+  uint64_t transferred; /**< Bytes transferred by all jobs */
+  LIBMTP_progressfunc_t progress; /**< Aggregate progress callback */
+  void const *progress_data; /**< Passed to the progress callback */
+};
+
+#ifdef HAVE_PTHREAD_H
+#define sched_lock(s) pthread_mutex_lock(&(s)->lock)
+#define sched_unlock(s) pthread_mutex_unlock(&(s)->lock)
+#define sched_signal(s) pthread_cond_broadcast(&(s)->changed)
+#define sched_wait(s) pthread_cond_wait(&(s)->changed, &(s)->lock)
+#else
+#define sched_lock(s)
+#define sched_unlock(s)
+#define sched_signal(s)
+#endif
+
+/**
+ * Tracks the progress of one job and reports the progress of all jobs
+ * to the progress function of the scheduler.
+ */
+static int job_progress(uint64_t const sent, uint64_t const total,
+			void const * const data)
+{
+  sched_job_t *job = (sched_job_t *) data;
+  LIBMTP_scheduler_t *scheduler = job->scheduler;
+  int ret = 0;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&scheduler->progress_lock);
+#endif
+  // The size of a get is only known once it has started
+  if (job->size != total) {
+    scheduler->total += total - job->size;
+    job->size = total;
+  }
+  scheduler->transferred += sent - job->sent;
+  job->sent = sent;
+  if (scheduler->progress != NULL) {
+    ret = scheduler->progress(scheduler->transferred, scheduler->total,
+			      scheduler->progress_data);
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&scheduler->progress_lock);
+#endif
+  return ret;
+}
+
+/**
+ * Runs a job on a device and frees it.
+ * @return 0 on success, any other value on failure.
+ */
+static int run_job(LIBMTP_mtpdevice_t *device, sched_job_t *job)
+{
+  int ret;
+
+  if (job->type == SCHED_JOB_SEND) {
+    ret = LIBMTP_Send_File_From_File_Descriptor(device, job->fd, job->filedata,
+						job_progress, job);
+  } else {
+    ret = LIBMTP_Get_File_To_File_Descriptor(device, job->item_id, job->fd,
+					     job_progress, job);
+  }
+  if (job->done != NULL) {
+    job->done(job->id, ret, job->user_data);
+  }
+  free(job);
+  return ret;
+}
+
+/**
+ * Frees the jobs left in a queue, telling their owners they failed.
+ */
+static void drop_jobs(sched_job_t *job)
+{
+  while (job != NULL) {
+    sched_job_t *next = job->next;
+
+    if (job->done != NULL) {
+      job->done(job->id, -1, job->user_data);
+    }
+    free(job);
+    job = next;
+  }
+}
+
+/**
+ * Opens the device of a queue.
+ */
+static void open_device(sched_device_t *dev)
+{
+  if (dev->scheduler->cached) {
+    dev->device = LIBMTP_Open_Raw_Device(&dev->rawdevice);
+  } else {
+    dev->device = LIBMTP_Open_Raw_Device_Uncached(&dev->rawdevice);
+  }
+  if (dev->device == NULL) {
+    LIBMTP_ERROR("LIBMTP_Create_Scheduler(): could not open device %d "
+		 "on bus %d\n", dev->rawdevice.devnum,
+		 dev->rawdevice.bus_location);
+  }
+}
+
+#ifdef HAVE_PTHREAD_H
+/**
+ * Waits for a turn to transfer on the bus of a device. Devices get
+ * their turns in the order they asked for them.
+ */
+static void acquire_bus(LIBMTP_scheduler_t *scheduler, sched_bus_t *bus)
+{
+  unsigned int ticket;
+
+  if (scheduler->max_per_bus == 0) {
+    return;
+  }
+  ticket = bus->next_ticket++;
+  while (ticket != bus->serving || bus->active >= scheduler->max_per_bus) {
+    sched_wait(scheduler);
+  }
+  bus->serving++;
+  bus->active++;
+  // The next device in line may fit as well
+  sched_signal(scheduler);
+}
+
+static void release_bus(LIBMTP_scheduler_t *scheduler, sched_bus_t *bus)
+{
+  if (scheduler->max_per_bus == 0) {
+    return;
+  }
+  bus->active--;
+  sched_signal(scheduler);
+}
+
+/**
+ * The worker of one device: opens the device, then runs its jobs
+ * until the scheduler is destroyed.
+ */
+static void *device_worker(void *data)
+{
+  sched_device_t *dev = (sched_device_t *) data;
+  LIBMTP_scheduler_t *scheduler = dev->scheduler;
+
+  open_device(dev);
+
+  sched_lock(scheduler);
+  scheduler->opened++;
+  sched_signal(scheduler);
+  while (dev->device != NULL) {
+    sched_job_t *job;
+    int ret;
+
+    while (dev->queue == NULL && !scheduler->stopping) {
+      sched_wait(scheduler);
+    }
+    if (scheduler->stopping) {
+      break;
+    }
+    acquire_bus(scheduler, dev->bus);
+    if (scheduler->stopping) {
+      release_bus(scheduler, dev->bus);
+      break;
+    }
+    job = dev->queue;
+    dev->queue = job->next;
+    sched_unlock(scheduler);
+
+    ret = run_job(dev->device, job);
+
+    sched_lock(scheduler);
+    release_bus(scheduler, dev->bus);
+    if (ret != 0) {
+      scheduler->failed++;
+    }
+    scheduler->pending--;
+    sched_signal(scheduler);
+  }
+  sched_unlock(scheduler);
+  return NULL;
+}
+#endif
+
+/**
+ * This creates a scheduler for transfers on several devices at once.
+ * The devices are opened in parallel and every device gets a worker
+ * thread of its own, which runs the jobs queued for it one at a time.
+ * Use <code>LIBMTP_Scheduler_Get_Device()</code> to reach the opened
+ * devices, for example to list their files. Devices that could not be
+ * opened are left out, but keep their index.
+ * @param rawdevices the raw devices to open, as returned by
+ *        <code>LIBMTP_Detect_Raw_Devices()</code>.
+ * @param numdevs the number of raw devices.
+ * @param cached open the devices cached, as
+ *        <code>LIBMTP_Open_Raw_Device()</code> does, instead of uncached.
+ * @param max_per_bus the number of transfers allowed to run at the same
+ *        time on devices attached to one bus, 0 for no limit.
+ * @return a new scheduler or NULL on failure.
+ * @see LIBMTP_Destroy_Scheduler()
+ */
+LIBMTP_scheduler_t *LIBMTP_Create_Scheduler(LIBMTP_raw_device_t *rawdevices,
+					    int numdevs, int cached,
+					    unsigned int max_per_bus)
+{
+  LIBMTP_scheduler_t *scheduler;
+  int i;
+
+  scheduler = (LIBMTP_scheduler_t *) calloc(1, sizeof(LIBMTP_scheduler_t));
+  if (scheduler == NULL) {
+    return NULL;
+  }
+  scheduler->devices = (sched_device_t *) calloc(numdevs ? numdevs : 1,
+						 sizeof(sched_device_t));
+  scheduler->buses = (sched_bus_t *) calloc(numdevs ? numdevs : 1,
+					    sizeof(sched_bus_t));
+  if (scheduler->devices == NULL || scheduler->buses == NULL) {
+    free(scheduler->devices);
+    free(scheduler->buses);
+    free(scheduler);
+    return NULL;
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&scheduler->lock, NULL);
+  pthread_cond_init(&scheduler->changed, NULL);
+  pthread_mutex_init(&scheduler->progress_lock, NULL);
+#endif
+  scheduler->numdevices = numdevs;
+  scheduler->max_per_bus = max_per_bus;
+  scheduler->cached = cached;
+
+  for (i = 0; i < numdevs; i++) {
+    sched_device_t *dev = &scheduler->devices[i];
+    int j;
+
+    dev->scheduler = scheduler;
+    dev->rawdevice = rawdevices[i];
+    for (j = 0; j < scheduler->numbuses; j++) {
+      if (scheduler->buses[j].bus_location == rawdevices[i].bus_location) {
+	break;
+      }
+    }
+    if (j == scheduler->numbuses) {
+      scheduler->buses[j].bus_location = rawdevices[i].bus_location;
+      scheduler->numbuses++;
+    }
+    dev->bus = &scheduler->buses[j];
+  }
+
+#ifdef HAVE_PTHREAD_H
+  sched_lock(scheduler);
+  for (i = 0; i < numdevs; i++) {
+    sched_device_t *dev = &scheduler->devices[i];
+
+    if (pthread_create(&dev->thread, NULL, device_worker, dev) == 0) {
+      dev->has_thread = 1;
+    } else {
+      LIBMTP_ERROR("LIBMTP_Create_Scheduler(): could not start a worker "
+		   "for device %d\n", i);
+      scheduler->opened++;
+    }
+  }
+  // Wait until every worker has opened its device
+  while (scheduler->opened < numdevs) {
+    sched_wait(scheduler);
+  }
+  sched_unlock(scheduler);
+#else
+  for (i = 0; i < numdevs; i++) {
+    open_device(&scheduler->devices[i]);
+  }
+#endif
+  return scheduler;
+}
+
+/**
+ * This returns the number of devices a scheduler was created for.
+ * @param scheduler the scheduler.
+ * @return the number of devices, including those that failed to open.
+ */
+int LIBMTP_Scheduler_Number_Devices(LIBMTP_scheduler_t *scheduler)
+{
+  return scheduler->numdevices;
+}
+
+/**
+ * This returns a device opened by a scheduler. The device stays owned
+ * by the scheduler, do not release it. It may be used from any thread
+ * while jobs are running on it.
+ * @param scheduler the scheduler.
+ * @param index the index of the device among the raw devices the
+ *        scheduler was created for.
+ * @return the device, or NULL if it could not be opened.
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Scheduler_Get_Device(LIBMTP_scheduler_t *scheduler,
+						int index)
+{
+  if (index < 0 || index >= scheduler->numdevices) {
+    return NULL;
+  }
+  return scheduler->devices[index].device;
+}
+
+/**
+ * This sets the function reporting the progress of all jobs of a
+ * scheduler together. It is called from the worker threads, but never
+ * from two of them at once. The total grows as jobs are queued and as
+ * the sizes of files being fetched become known.
+ * @param scheduler the scheduler.
+ * @param callback the progress function, or NULL for none. Returning
+ *        anything else than 0 cancels the transfer that made the call.
+ * @param data a user-defined pointer passed to the progress function.
+ */
+void LIBMTP_Set_Scheduler_Progress(LIBMTP_scheduler_t *scheduler,
+				   LIBMTP_progressfunc_t const callback,
+				   void const * const data)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&scheduler->progress_lock);
+#endif
+  scheduler->progress = callback;
+  scheduler->progress_data = data;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&scheduler->progress_lock);
+#endif
+}
+
+/**
+ * Queues a job behind the jobs of the same or a higher priority.
+ */
+static int queue_job(LIBMTP_scheduler_t *scheduler, int index, sched_job_t *job)
+{
+  sched_device_t *dev;
+  sched_job_t **pos;
+  int id;
+
+  if (index < 0 || index >= scheduler->numdevices ||
+      scheduler->devices[index].device == NULL) {
+    LIBMTP_ERROR("LIBMTP_Schedule: no device with index %d\n", index);
+    free(job);
+    return -1;
+  }
+  dev = &scheduler->devices[index];
+  job->scheduler = scheduler;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&scheduler->progress_lock);
+#endif
+  scheduler->total += job->size;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&scheduler->progress_lock);
+#endif
+
+  sched_lock(scheduler);
+  id = job->id = scheduler->next_job_id++;
+  for (pos = &dev->queue; *pos != NULL; pos = &(*pos)->next) {
+    if ((*pos)->priority < job->priority) {
+      break;
+    }
+  }
+  job->next = *pos;
+  *pos = job;
+  scheduler->pending++;
+  sched_signal(scheduler);
+  sched_unlock(scheduler);
+  return id;
+}
+
+/**
+ * This queues sending a file to a device, as
+ * <code>LIBMTP_Send_File_From_File_Descriptor()</code> would.
+ * The file descriptor and the file metadata must stay valid until the
+ * job has finished, after which <code>filedata->item_id</code> holds
+ * the ID of the new object.
+ * @param scheduler the scheduler.
+ * @param index the index of the device to send to.
+ * @param fd the file descriptor to read the file from.
+ * @param filedata the metadata of the file to send.
+ * @param priority jobs with higher priorities run first, jobs of equal
+ *        priority in the order they were queued.
+ * @param done a function called from the worker thread when the job
+ *        has finished, or NULL.
+ * @param user_data a user-defined pointer passed to the done function.
+ * @return the ID of the job, or -1 on failure.
+ */
+int LIBMTP_Schedule_Send_File(LIBMTP_scheduler_t *scheduler, int index,
+			      int const fd, LIBMTP_file_t * const filedata,
+			      int priority, LIBMTP_job_done_fn done,
+			      void *user_data)
+{
+  sched_job_t *job = (sched_job_t *) calloc(1, sizeof(sched_job_t));
+
+  if (job == NULL) {
+    return -1;
+  }
+  job->type = SCHED_JOB_SEND;
+  job->priority = priority;
+  job->fd = fd;
+  job->filedata = filedata;
+  job->size = filedata->filesize;
+  job->done = done;
+  job->user_data = user_data;
+  return queue_job(scheduler, index, job);
+}
+
+/**
+ * This queues getting a file from a device, as
+ * <code>LIBMTP_Get_File_To_File_Descriptor()</code> would.
+ * The file descriptor must stay valid until the job has finished.
+ * @param scheduler the scheduler.
+ * @param index the index of the device to get the file from.
+ * @param id the object ID of the file to get.
+ * @param fd the file descriptor to write the file to.
+ * @param priority jobs with higher priorities run first, jobs of equal
+ *        priority in the order they were queued.
+ * @param done a function called from the worker thread when the job
+ *        has finished, or NULL.
+ * @param user_data a user-defined pointer passed to the done function.
+ * @return the ID of the job, or -1 on failure.
+ */
+int LIBMTP_Schedule_Get_File(LIBMTP_scheduler_t *scheduler, int index,
+			     uint32_t const id, int const fd,
+			     int priority, LIBMTP_job_done_fn done,
+			     void *user_data)
+{
+  sched_job_t *job = (sched_job_t *) calloc(1, sizeof(sched_job_t));
+
+  if (job == NULL) {
+    return -1;
+  }
+  job->type = SCHED_JOB_GET;
+  job->priority = priority;
+  job->item_id = id;
+  job->fd = fd;
+  job->done = done;
+  job->user_data = user_data;
+  return queue_job(scheduler, index, job);
+}
+
+/**
+ * This waits until all jobs queued on a scheduler have finished.
+ * Without thread support, this is where the jobs are run.
+ * @param scheduler the scheduler.
+ * @return the number of jobs that failed since the last call.
+ */
+int LIBMTP_Scheduler_Wait(LIBMTP_scheduler_t *scheduler)
+{
+  int failed;
+
+  sched_lock(scheduler);
+#ifdef HAVE_PTHREAD_H
+  while (scheduler->pending > 0) {
+    sched_wait(scheduler);
+  }
+#else
+  {
+    int i;
+
+    for (i = 0; i < scheduler->numdevices; i++) {
+      sched_device_t *dev = &scheduler->devices[i];
+
+      while (dev->queue != NULL) {
+	sched_job_t *job = dev->queue;
+
+	dev->queue = job->next;
+	if (run_job(dev->device, job) != 0) {
+	  scheduler->failed++;
+	}
+	scheduler->pending--;
+      }
+    }
+  }
+#endif
+  failed = scheduler->failed;
+  scheduler->failed = 0;
+  sched_unlock(scheduler);
+  return failed;
+}
+
+/**
+ * This destroys a scheduler. Running jobs are completed, jobs still
+ * queued are dropped and reported as failed. Finally all devices opened
+ * by the scheduler are released.
+ * @param scheduler the scheduler to destroy.
+ */
+void LIBMTP_Destroy_Scheduler(LIBMTP_scheduler_t *scheduler)
+{
+  int i;
+
+  if (scheduler == NULL) {
+    return;
+  }
+  sched_lock(scheduler);
+  scheduler->stopping = 1;
+  sched_signal(scheduler);
+  sched_unlock(scheduler);
+  for (i = 0; i < scheduler->numdevices; i++) {
+    sched_device_t *dev = &scheduler->devices[i];
+
+#ifdef HAVE_PTHREAD_H
+    if (dev->has_thread) {
+      pthread_join(dev->thread, NULL);
+    }
+#endif
+    drop_jobs(dev->queue);
+    if (dev->device != NULL) {
+      LIBMTP_Release_Device(dev->device);
+    }
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_destroy(&scheduler->progress_lock);
+  pthread_cond_destroy(&scheduler->changed);
+  pthread_mutex_destroy(&scheduler->lock);
+#endif
+  free(scheduler->buses);
+  free(scheduler->devices);
+  free(scheduler);
+}
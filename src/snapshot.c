@@ -0,0 +1,953 @@
+/**
+ * \file snapshot.c
+ *
+ * On-disk snapshot of the object metadata cache, so that reopening a
+ * device which has not changed since the last session does not need
+ * to read the metadata of every object again.
+ *
+ * The snapshot is a single file per device, named after the serial
+ * number. It consists of fixed size records followed by a string table
+ * and is laid out so that it could be mapped into memory as it is:
+ *
+ *   header | storages | objects | properties | strings
+ *
+ * All integers are stored in host byte order, the header carries a
+ * marker so that files from a machine with a different byte order are
+ * rejected. Before the snapshot is used, the storage information
+ * recorded in it is compared to a fresh GetStorageInfo of each storage.
+ * If anything was added, removed or resized since, the free space or
+ * the free object count will differ and the caller falls back to a
+ * full scan.
+ *
+ * Next to the snapshot a device gets a profile of what it can do,
+ * keyed on vendor and product ID, device version and serial number, so
+ * that opening it again can skip asking for the object size width and
+ * battery range, for the properties each object format supports and
+ * for their descriptions. It also keeps the bugs found in the device
+ * while it was in use.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libmtp.h"
+#include "libusb-glue.h"
+#include "ptp.h"
+#include "util.h"
+
+#include "snapshot.h"
+
+/**
+ * Debug macro
+ */
+#define LIBMTP_SNAPSHOT_DEBUG(format, args...) \
+  do { \
+    if (LIBMTP_debug != 0) \
+      fprintf(stdout, "LIBMTP %s[%d]: " format, __FUNCTION__, __LINE__, ##args); \
+  } while (0)
+
+#define SNAPSHOT_MAGIC "LIBMTPSN"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTEORDER 0x01020304U
+
+/* Object flags worth keeping, the rest describes the session state */
+#define SNAPSHOT_OBJECT_FLAGS (PTPOBJECT_OBJECTINFO_LOADED | \
+			       PTPOBJECT_MTPPROPLIST_LOADED | \
+			       PTPOBJECT_PARENTOBJECT_LOADED | \
+			       PTPOBJECT_STORAGEID_LOADED)
+
+/*
+ * All strings are stored as offsets into the string table, offset 0
+ * is the empty string at the start of the table and stands for NULL.
+ * Every record size is a multiple of 8 so all sections stay aligned.
+ */
+typedef struct snapshot_header_struct {
+  char magic[8];
+  uint32_t byteorder;
+  uint32_t version;
+  uint32_t nrofstorages;
+  uint32_t nrofobjects;
+  uint32_t nrofprops;
+  uint32_t stringsize;
+  uint32_t serialnumber;
+  uint32_t reserved;
+} snapshot_header_t;
+
+typedef struct snapshot_storage_struct {
+  uint64_t maxcapacity;
+  uint64_t freespaceinbytes;
+  uint64_t freespaceinobjects;
+  uint32_t id;
+  uint32_t volumeidentifier;
+} snapshot_storage_t;
+
+typedef struct snapshot_object_struct {
+  uint64_t objectsize;
+  int64_t capturedate;
+  int64_t modificationdate;
+  uint32_t oid;
+  uint32_t flags;
+  uint32_t storageid;
+  uint32_t parentobject;
+  uint32_t thumbsize;
+  uint32_t thumbpixwidth;
+  uint32_t thumbpixheight;
+  uint32_t imagepixwidth;
+  uint32_t imagepixheight;
+  uint32_t imagebitdepth;
+  uint32_t associationdesc;
+  uint32_t sequencenumber;
+  uint32_t filename;
+  uint32_t keywords;
+  uint32_t firstprop;
+  uint32_t nrofprops;
+  uint16_t objectformat;
+  uint16_t protectionstatus;
+  uint16_t thumbformat;
+  uint16_t associationtype;
+} snapshot_object_t;
+
+typedef struct snapshot_prop_struct {
+  uint64_t value; /* integer value or string offset for PTP_DTC_STR */
+  uint16_t propcode;
+  uint16_t datatype;
+  uint32_t reserved;
+} snapshot_prop_t;
+
+#define PROFILE_MAGIC "LIBMTPPF"
+#define PROFILE_VERSION 3
+
+/*
+ * Device flags libmtp sets by itself once a device refused a request
+ * in a way that is known to happen. These are kept in the profile
+ * instead of being part of its key. Flags set for other reasons, such
+ * as a request that timed out, are never kept.
+ */
+#define PROFILE_LEARNED_FLAGS DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL
+
+/*
+ * The profile is laid out like the snapshot:
+ *
+ *   header | formats | descriptions | property codes |
+ *   description datasets | strings
+ *
+ * The device flags are part of the key, so that a profile made before
+ * the device table changed is not used. The property descriptions are
+ * kept as the datasets the device sent, in its byte order.
+ */
+typedef struct profile_header_struct {
+  char magic[8];
+  uint32_t byteorder;
+  uint32_t version;
+  uint32_t deviceflags;
+  uint32_t learnedflags;
+  uint32_t nrofformats;
+  uint32_t nrofprops;
+  uint32_t nrofdescs;
+  uint32_t descsize;
+  uint32_t stringsize;
+  uint32_t serialnumber;
+  uint32_t deviceversion;
+  uint16_t vendor_id;
+  uint16_t product_id;
+  uint8_t objectbitsize;
+  uint8_t maximumbatterylevel;
+  uint16_t reserved;
+} profile_header_t;
+
+typedef struct profile_format_struct {
+  uint32_t firstprop;
+  uint32_t nrofprops;
+  uint16_t ofc;
+  uint16_t reserved[3];
+} profile_format_t;
+
+typedef struct profile_desc_struct {
+  uint32_t offset;
+  uint32_t size;
+  uint16_t ofc;
+  uint16_t opc;
+  uint32_t reserved;
+} profile_desc_t;
+
+/*
+ * Growable buffer used to assemble the snapshot before it is written.
+ */
+typedef struct snapshot_buffer_struct {
+  unsigned char *data;
+  size_t len;
+  size_t size;
+} snapshot_buffer_t;
+
+static int buffer_append(snapshot_buffer_t *buf, void const * const data,
+			 size_t len)
+{
+  if (buf->len + len > buf->size) {
+    size_t newsize = buf->size ? buf->size : 4096;
+    unsigned char *tmp;
+
+    while (newsize < buf->len + len)
+      newsize *= 2;
+    tmp = realloc(buf->data, newsize);
+    if (tmp == NULL)
+      return -1;
+    buf->data = tmp;
+    buf->size = newsize;
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  return 0;
+}
+
+/**
+ * Add a string to the string table.
+ * @return the offset of the string, 0 for NULL or (uint32_t) -1 on
+ *         failure.
+ */
+static uint32_t add_string(snapshot_buffer_t *strings, char const * const str)
+{
+  uint32_t offset = strings->len;
+
+  if (str == NULL)
+    return 0;
+  if (buffer_append(strings, str, strlen(str) + 1) != 0)
+    return (uint32_t) -1;
+  return offset;
+}
+
+/**
+ * Build the name of the snapshot or profile file for a device.
+ * @param suffix ".snapshot" or ".profile".
+ * @return a newly allocated path or NULL if the device has no serial
+ *         number to key the file on.
+ */
+static char *snapshot_filename(PTPParams *params, char const * const dirname,
+			       char const * const suffix)
+{
+  char const * const serial = params->deviceinfo.SerialNumber;
+  char *path;
+  char *p;
+  size_t len;
+
+  if (serial == NULL || serial[0] == '\0')
+    return NULL;
+  len = strlen(dirname) + 1 + strlen(serial) + strlen(suffix) + 1;
+  path = malloc(len);
+  if (path == NULL)
+    return NULL;
+  snprintf(path, len, "%s/%s%s", dirname, serial, suffix);
+  // Only keep characters that are safe in file names
+  for (p = path + strlen(dirname) + 1; *p != '\0'; p++) {
+    if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+	  (*p >= '0' && *p <= '9') || *p == '.' || *p == '-' || *p == '_'))
+      *p = '_';
+  }
+  return path;
+}
+
+/**
+ * Write a file from a number of buffers. The file is written under a
+ * temporary name first so a crash never leaves half a file behind.
+ * @return 0 on success, any other value means failure.
+ */
+static int write_file(char const * const path,
+		      snapshot_buffer_t const * const parts, int nrofparts)
+{
+  char *tmppath;
+  FILE *f;
+  int i;
+  int ret = -1;
+
+  tmppath = malloc(strlen(path) + sizeof(".tmp"));
+  if (tmppath == NULL)
+    return -1;
+  sprintf(tmppath, "%s.tmp", path);
+  f = fopen(tmppath, "wb");
+  if (f == NULL) {
+    LIBMTP_SNAPSHOT_DEBUG("could not create %s\n", tmppath);
+    goto out;
+  }
+  for (i = 0; i < nrofparts; i++) {
+    if (parts[i].len && fwrite(parts[i].data, parts[i].len, 1, f) != 1) {
+      fclose(f);
+      unlink(tmppath);
+      goto out;
+    }
+  }
+  if (fclose(f) != 0) {
+    unlink(tmppath);
+    goto out;
+  }
+  if (rename(tmppath, path) != 0) {
+    // Some platforms will not rename onto an existing file
+    unlink(path);
+    if (rename(tmppath, path) != 0) {
+      unlink(tmppath);
+      goto out;
+    }
+  }
+  ret = 0;
+
+ out:
+  free(tmppath);
+  return ret;
+}
+
+/**
+ * Read a whole file into memory.
+ * @return the contents, to be freed by the caller, or NULL.
+ */
+static unsigned char *read_file(char const * const path, long *size)
+{
+  unsigned char *data = NULL;
+  FILE *f;
+
+  f = fopen(path, "rb");
+  if (f == NULL)
+    return NULL;
+  if (fseek(f, 0, SEEK_END) == 0 && (*size = ftell(f)) > 0 &&
+      fseek(f, 0, SEEK_SET) == 0) {
+    data = malloc(*size);
+    if (data != NULL && fread(data, *size, 1, f) != 1) {
+      free(data);
+      data = NULL;
+    }
+  }
+  fclose(f);
+  return data;
+}
+
+static int same_string(char const * const a, char const * const b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+  return !strcmp(a, b);
+}
+
+/**
+ * Store one property in its snapshot form.
+ * @return 0 if stored, 1 if the property type is not kept in snapshots,
+ *         -1 on failure.
+ */
+static int pack_prop(MTPObjectProp const * const prop,
+		     snapshot_prop_t *sprop, snapshot_buffer_t *strings)
+{
+  memset(sprop, 0, sizeof(*sprop));
+  sprop->propcode = prop->PropCode;
+  sprop->datatype = prop->DataType;
+  switch (prop->DataType) {
+  case PTP_DTC_INT8:   sprop->value = (uint64_t) prop->Value.i8; break;
+  case PTP_DTC_UINT8:  sprop->value = prop->Value.u8; break;
+  case PTP_DTC_INT16:  sprop->value = (uint64_t) prop->Value.i16; break;
+  case PTP_DTC_UINT16: sprop->value = prop->Value.u16; break;
+  case PTP_DTC_INT32:  sprop->value = (uint64_t) prop->Value.i32; break;
+  case PTP_DTC_UINT32: sprop->value = prop->Value.u32; break;
+  case PTP_DTC_INT64:  sprop->value = (uint64_t) prop->Value.i64; break;
+  case PTP_DTC_UINT64: sprop->value = prop->Value.u64; break;
+  case PTP_DTC_STR:
+    sprop->value = add_string(strings, prop->Value.str);
+    if (sprop->value == (uint32_t) -1)
+      return -1;
+    break;
+  default:
+    // Arrays (e.g. sample data) are left out, they are queried from
+    // the device when needed.
+    return 1;
+  }
+  return 0;
+}
+
+static int unpack_prop(PTPParams *params, snapshot_prop_t const * const sprop,
+		       char const * const strings, MTPObjectProp *prop)
+{
+  memset(prop, 0, sizeof(*prop));
+  prop->PropCode = sprop->propcode;
+  prop->DataType = sprop->datatype;
+  switch (sprop->datatype) {
+  case PTP_DTC_INT8:   prop->Value.i8 = (int8_t) sprop->value; break;
+  case PTP_DTC_UINT8:  prop->Value.u8 = (uint8_t) sprop->value; break;
+  case PTP_DTC_INT16:  prop->Value.i16 = (int16_t) sprop->value; break;
+  case PTP_DTC_UINT16: prop->Value.u16 = (uint16_t) sprop->value; break;
+  case PTP_DTC_INT32:  prop->Value.i32 = (int32_t) sprop->value; break;
+  case PTP_DTC_UINT32: prop->Value.u32 = (uint32_t) sprop->value; break;
+  case PTP_DTC_INT64:  prop->Value.i64 = (int64_t) sprop->value; break;
+  case PTP_DTC_UINT64: prop->Value.u64 = sprop->value; break;
+  case PTP_DTC_STR:
+    if (sprop->value != 0) {
+      prop->Value.str = ptp_intern_string(params, strings + sprop->value);
+      if (prop->Value.str == NULL)
+	return -1;
+    }
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Write the object cache of a device to its snapshot file. The current
+ * storage information is read from the device and recorded alongside
+ * so that a later load_metadata_snapshot() can tell whether the
+ * snapshot is still valid.
+ * @param device the device to save the snapshot for.
+ * @param dirname the directory holding the snapshot files.
+ * @return 0 on success, any other value means failure.
+ */
+int save_metadata_snapshot(LIBMTP_mtpdevice_t *device,
+			   char const * const dirname)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  snapshot_header_t header;
+  snapshot_buffer_t storages = { NULL, 0, 0 };
+  snapshot_buffer_t objects = { NULL, 0, 0 };
+  snapshot_buffer_t props = { NULL, 0, 0 };
+  snapshot_buffer_t strings = { NULL, 0, 0 };
+  snapshot_buffer_t headerbuf = { NULL, 0, 0 };
+  LIBMTP_devicestorage_t *storage;
+  char *path;
+  uint32_t i;
+  int ret = -1;
+
+  if (device->storage == NULL ||
+      !ptp_operation_issupported(params, PTP_OC_GetStorageInfo))
+    return -1;
+  path = snapshot_filename(params, dirname, ".snapshot");
+  if (path == NULL)
+    return -1;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.byteorder = SNAPSHOT_BYTEORDER;
+  header.version = SNAPSHOT_VERSION;
+
+  // Offset 0 is the empty string standing in for NULL
+  if (buffer_append(&strings, "", 1) != 0)
+    goto out;
+  header.serialnumber = add_string(&strings, params->deviceinfo.SerialNumber);
+  if (header.serialnumber == (uint32_t) -1)
+    goto out;
+
+  for (storage = device->storage; storage != NULL; storage = storage->next) {
+    PTPStorageInfo si;
+    snapshot_storage_t sst;
+
+    // Record the storage as it is right now, the cached values may be old
+    if (ptp_getstorageinfo(params, storage->id, &si) != PTP_RC_OK)
+      goto out;
+    memset(&sst, 0, sizeof(sst));
+    sst.id = storage->id;
+    sst.maxcapacity = si.MaxCapability;
+    sst.freespaceinbytes = si.FreeSpaceInBytes;
+    sst.freespaceinobjects = si.FreeSpaceInImages;
+    sst.volumeidentifier = add_string(&strings, si.VolumeLabel);
+    free(si.StorageDescription);
+    free(si.VolumeLabel);
+    if (sst.volumeidentifier == (uint32_t) -1 ||
+	buffer_append(&storages, &sst, sizeof(sst)) != 0)
+      goto out;
+    header.nrofstorages++;
+  }
+
+  for (i = 0; i < params->objects.len; i++) {
+    PTPObject *ob = params->objects.val[i];
+    snapshot_object_t sob;
+
+    memset(&sob, 0, sizeof(sob));
+    sob.oid = ob->oid;
+    sob.flags = ob->flags & SNAPSHOT_OBJECT_FLAGS;
+    sob.storageid = ob->oi.StorageID;
+    sob.objectformat = ob->oi.ObjectFormat;
+    sob.protectionstatus = ob->oi.ProtectionStatus;
+    sob.objectsize = ob->oi.ObjectSize;
+    sob.thumbformat = ob->oi.ThumbFormat;
+    sob.thumbsize = ob->oi.ThumbSize;
+    sob.thumbpixwidth = ob->oi.ThumbPixWidth;
+    sob.thumbpixheight = ob->oi.ThumbPixHeight;
+    sob.imagepixwidth = ob->oi.ImagePixWidth;
+    sob.imagepixheight = ob->oi.ImagePixHeight;
+    sob.imagebitdepth = ob->oi.ImageBitDepth;
+    sob.parentobject = ob->oi.ParentObject;
+    sob.associationtype = ob->oi.AssociationType;
+    sob.associationdesc = ob->oi.AssociationDesc;
+    sob.sequencenumber = ob->oi.SequenceNumber;
+    sob.capturedate = (int64_t) ob->oi.CaptureDate;
+    sob.modificationdate = (int64_t) ob->oi.ModificationDate;
+    sob.filename = add_string(&strings, ob->oi.Filename);
+    sob.keywords = add_string(&strings, ob->oi.Keywords);
+    if (sob.filename == (uint32_t) -1 || sob.keywords == (uint32_t) -1)
+      goto out;
+    sob.firstprop = header.nrofprops;
+    for_each (MTPObjectProp*, prop, ob->mtp_props) {
+      snapshot_prop_t sprop;
+      int packed = pack_prop(prop, &sprop, &strings);
+
+      if (packed < 0)
+	goto out;
+      if (packed > 0)
+	continue;
+      if (buffer_append(&props, &sprop, sizeof(sprop)) != 0)
+	goto out;
+      header.nrofprops++;
+      sob.nrofprops++;
+    }
+    if (buffer_append(&objects, &sob, sizeof(sob)) != 0)
+      goto out;
+    header.nrofobjects++;
+  }
+  header.stringsize = strings.len;
+
+  headerbuf.data = (unsigned char *) &header;
+  headerbuf.len = sizeof(header);
+  {
+    snapshot_buffer_t const parts[] = { headerbuf, storages, objects,
+					props, strings };
+
+    if (write_file(path, parts, sizeof(parts) / sizeof(parts[0])) != 0)
+      goto out;
+  }
+  LIBMTP_SNAPSHOT_DEBUG("saved %u objects to %s\n", header.nrofobjects, path);
+  ret = 0;
+
+ out:
+  free(storages.data);
+  free(objects.data);
+  free(props.data);
+  free(strings.data);
+  free(path);
+  return ret;
+}
+
+/**
+ * Check the recorded storages against the device. This costs one
+ * GetStorageInfo per storage.
+ */
+static int storages_unchanged(LIBMTP_mtpdevice_t *device,
+			      snapshot_storage_t const * const sst,
+			      uint32_t nrofstorages,
+			      char const * const strings)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_devicestorage_t *storage;
+  uint32_t count = 0;
+  uint32_t i;
+
+  for (storage = device->storage; storage != NULL; storage = storage->next)
+    count++;
+  if (count != nrofstorages)
+    return 0;
+
+  for (i = 0; i < nrofstorages; i++) {
+    PTPStorageInfo si;
+    int same;
+
+    for (storage = device->storage; storage != NULL; storage = storage->next) {
+      if (storage->id == sst[i].id)
+	break;
+    }
+    if (storage == NULL)
+      return 0;
+    if (ptp_getstorageinfo(params, sst[i].id, &si) != PTP_RC_OK)
+      return 0;
+    same = si.MaxCapability == sst[i].maxcapacity &&
+      si.FreeSpaceInBytes == sst[i].freespaceinbytes &&
+      si.FreeSpaceInImages == sst[i].freespaceinobjects &&
+      same_string(si.VolumeLabel, sst[i].volumeidentifier ?
+		  strings + sst[i].volumeidentifier : NULL);
+    free(si.StorageDescription);
+    free(si.VolumeLabel);
+    if (!same) {
+      LIBMTP_SNAPSHOT_DEBUG("storage %08x changed since the snapshot\n",
+			    sst[i].id);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Fill the (empty) object cache of a device from its snapshot file,
+ * provided the storages of the device are unchanged since the snapshot
+ * was taken.
+ * @param device the device to load the snapshot for.
+ * @param dirname the directory holding the snapshot files.
+ * @return 0 if the cache was loaded, any other value means the caller
+ *         has to scan the device.
+ */
+int load_metadata_snapshot(LIBMTP_mtpdevice_t *device,
+			   char const * const dirname)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  snapshot_header_t const *header;
+  snapshot_storage_t const *sst;
+  snapshot_object_t const *sob;
+  snapshot_prop_t const *sprop;
+  char const *strings;
+  unsigned char *data = NULL;
+  char *path;
+  long size = 0;
+  uint64_t expected;
+  uint32_t i, j;
+  int ret = -1;
+
+  if (!ptp_operation_issupported(params, PTP_OC_GetStorageInfo))
+    return -1;
+  path = snapshot_filename(params, dirname, ".snapshot");
+  if (path == NULL)
+    return -1;
+  data = read_file(path, &size);
+  if (data == NULL || size < (long) sizeof(*header))
+    goto out;
+
+  // Sanity check everything before any offset is used
+  header = (snapshot_header_t const *) data;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+      header->byteorder != SNAPSHOT_BYTEORDER ||
+      header->version != SNAPSHOT_VERSION)
+    goto out;
+  expected = sizeof(*header) +
+    (uint64_t) header->nrofstorages * sizeof(*sst) +
+    (uint64_t) header->nrofobjects * sizeof(*sob) +
+    (uint64_t) header->nrofprops * sizeof(*sprop) +
+    header->stringsize;
+  if (expected != (uint64_t) size || header->stringsize == 0)
+    goto out;
+  sst = (snapshot_storage_t const *) (header + 1);
+  sob = (snapshot_object_t const *) (sst + header->nrofstorages);
+  sprop = (snapshot_prop_t const *) (sob + header->nrofobjects);
+  strings = (char const *) (sprop + header->nrofprops);
+  // A terminated table makes every offset into it a valid string
+  if (strings[header->stringsize - 1] != '\0' ||
+      header->serialnumber >= header->stringsize)
+    goto out;
+  for (i = 0; i < header->nrofstorages; i++) {
+    if (sst[i].volumeidentifier >= header->stringsize)
+      goto out;
+  }
+  for (i = 0; i < header->nrofobjects; i++) {
+    if (sob[i].filename >= header->stringsize ||
+	sob[i].keywords >= header->stringsize ||
+	sob[i].firstprop > header->nrofprops ||
+	sob[i].nrofprops > header->nrofprops - sob[i].firstprop)
+      goto out;
+  }
+  for (i = 0; i < header->nrofprops; i++) {
+    if (sprop[i].datatype == PTP_DTC_STR &&
+	sprop[i].value >= header->stringsize)
+      goto out;
+  }
+  if (!same_string(params->deviceinfo.SerialNumber,
+		   strings + header->serialnumber))
+    goto out;
+
+  if (!storages_unchanged(device, sst, header->nrofstorages, strings))
+    goto out;
+
+  for (i = 0; i < header->nrofobjects; i++) {
+    PTPObject *ob;
+
+    if (ptp_find_or_insert_object_in_cache(params, sob[i].oid, &ob) != PTP_RC_OK)
+      goto out_clear;
+    ob->flags = sob[i].flags & SNAPSHOT_OBJECT_FLAGS;
+    ob->oi.StorageID = sob[i].storageid;
+    ob->oi.ObjectFormat = sob[i].objectformat;
+    ob->oi.ProtectionStatus = sob[i].protectionstatus;
+    ob->oi.ObjectSize = sob[i].objectsize;
+    ob->oi.ThumbFormat = sob[i].thumbformat;
+    ob->oi.ThumbSize = sob[i].thumbsize;
+    ob->oi.ThumbPixWidth = sob[i].thumbpixwidth;
+    ob->oi.ThumbPixHeight = sob[i].thumbpixheight;
+    ob->oi.ImagePixWidth = sob[i].imagepixwidth;
+    ob->oi.ImagePixHeight = sob[i].imagepixheight;
+    ob->oi.ImageBitDepth = sob[i].imagebitdepth;
+    ob->oi.ParentObject = sob[i].parentobject;
+    ob->oi.AssociationType = sob[i].associationtype;
+    ob->oi.AssociationDesc = sob[i].associationdesc;
+    ob->oi.SequenceNumber = sob[i].sequencenumber;
+    ob->oi.CaptureDate = (time_t) sob[i].capturedate;
+    ob->oi.ModificationDate = (time_t) sob[i].modificationdate;
+    if (sob[i].filename)
+      ob->oi.Filename = ptp_intern_string(params, strings + sob[i].filename);
+    if (sob[i].keywords)
+      ob->oi.Keywords = ptp_intern_string(params, strings + sob[i].keywords);
+    for (j = sob[i].firstprop; j < sob[i].firstprop + sob[i].nrofprops; j++) {
+      MTPObjectProp *prop = ptp_get_new_object_prop_entry(&ob->mtp_props);
+
+      if (prop == NULL)
+	goto out_clear;
+      if (unpack_prop(params, &sprop[j], strings, prop) != 0) {
+	ob->mtp_props.len--;
+	goto out_clear;
+      }
+      prop->ObjectHandle = ob->oid;
+    }
+  }
+  LIBMTP_SNAPSHOT_DEBUG("loaded %u objects from %s\n", header->nrofobjects, path);
+  ret = 0;
+  goto out;
+
+ out_clear:
+  ptp_objects_clear(params);
+ out:
+  free(data);
+  free(path);
+  return ret;
+}
+
+/**
+ * Write what is known about a device to its profile file: the width of
+ * object sizes, the maximum battery level, the bugs found in it, and the
+ * properties supported by each object format and the descriptions of
+ * the properties asked about so far.
+ * @param device the device to save the profile for.
+ * @param dirname the directory holding the snapshot files.
+ * @return 0 on success, any other value means failure.
+ */
+int save_device_profile(LIBMTP_mtpdevice_t *device,
+			char const * const dirname)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB *) device->usbinfo;
+  profile_header_t header;
+  snapshot_buffer_t headerbuf = { NULL, 0, 0 };
+  snapshot_buffer_t formats = { NULL, 0, 0 };
+  snapshot_buffer_t descs = { NULL, 0, 0 };
+  snapshot_buffer_t props = { NULL, 0, 0 };
+  snapshot_buffer_t descdata = { NULL, 0, 0 };
+  snapshot_buffer_t strings = { NULL, 0, 0 };
+  uint32_t flags = ptp_usb->rawdevice.device_entry.device_flags;
+  char *path;
+  int ret = -1;
+
+  path = snapshot_filename(params, dirname, ".profile");
+  if (path == NULL)
+    return -1;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PROFILE_MAGIC, sizeof(header.magic));
+  header.byteorder = SNAPSHOT_BYTEORDER;
+  header.version = PROFILE_VERSION;
+  header.vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
+  header.product_id = ptp_usb->rawdevice.device_entry.product_id;
+  header.deviceflags = flags & ~ptp_usb->learned_flags;
+  header.learnedflags = ptp_usb->learned_flags & PROFILE_LEARNED_FLAGS;
+  header.objectbitsize = device->object_bitsize;
+  header.maximumbatterylevel = device->maximum_battery_level;
+
+  if (buffer_append(&strings, "", 1) != 0)
+    goto out;
+  header.serialnumber = add_string(&strings, params->deviceinfo.SerialNumber);
+  header.deviceversion = add_string(&strings, params->deviceinfo.DeviceVersion);
+  if (header.serialnumber == (uint32_t) -1 ||
+      header.deviceversion == (uint32_t) -1)
+    goto out;
+
+  for_each (PTPFormatProps*, fp, params->props_supported) {
+    profile_format_t pf;
+
+    memset(&pf, 0, sizeof(pf));
+    pf.ofc = fp->ofc;
+    pf.firstprop = header.nrofprops;
+    pf.nrofprops = fp->propnum;
+    if (buffer_append(&formats, &pf, sizeof(pf)) != 0 ||
+	(fp->propnum &&
+	 buffer_append(&props, fp->props, fp->propnum * sizeof(uint16_t)) != 0))
+      goto out;
+    header.nrofformats++;
+    header.nrofprops += fp->propnum;
+  }
+  for_each (PTPPropDescData*, dd, params->opd_cache) {
+    profile_desc_t pd;
+
+    memset(&pd, 0, sizeof(pd));
+    pd.ofc = dd->ofc;
+    pd.opc = dd->opc;
+    pd.offset = descdata.len;
+    pd.size = dd->size;
+    if (buffer_append(&descs, &pd, sizeof(pd)) != 0 ||
+	buffer_append(&descdata, dd->data, dd->size) != 0)
+      goto out;
+    header.nrofdescs++;
+  }
+  header.descsize = descdata.len;
+  header.stringsize = strings.len;
+
+  headerbuf.data = (unsigned char *) &header;
+  headerbuf.len = sizeof(header);
+  {
+    snapshot_buffer_t const parts[] = {
+      headerbuf, formats, descs, props, descdata, strings
+    };
+
+    if (write_file(path, parts, sizeof(parts) / sizeof(parts[0])) != 0)
+      goto out;
+  }
+  LIBMTP_SNAPSHOT_DEBUG("saved profile with %u formats and %u property "
+			"descriptions to %s\n", header.nrofformats,
+			header.nrofdescs, path);
+  ret = 0;
+
+ out:
+  free(formats.data);
+  free(descs.data);
+  free(props.data);
+  free(descdata.data);
+  free(strings.data);
+  free(path);
+  return ret;
+}
+
+/**
+ * Set up a device from its profile file, if there is one for this very
+ * device and firmware version. This fills in the width of object sizes,
+ * the maximum battery level and the bugs found in the device before,
+ * and tells the PTP layer which properties the object formats support
+ * and how they are described.
+ * @param device the device to load the profile for, with its device
+ *        information read.
+ * @param dirname the directory holding the snapshot files.
+ * @return 0 if the profile was loaded, any other value means the caller
+ *         has to ask the device.
+ */
+int load_device_profile(LIBMTP_mtpdevice_t *device,
+			char const * const dirname)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB *) device->usbinfo;
+  profile_header_t const *header;
+  profile_format_t const *pf;
+  profile_desc_t const *pd;
+  uint16_t const *props;
+  unsigned char const *descdata;
+  char const *strings;
+  unsigned char *data = NULL;
+  char *path;
+  long size = 0;
+  uint64_t expected;
+  uint32_t flags = ptp_usb->rawdevice.device_entry.device_flags;
+  uint32_t i;
+  int ret = -1;
+
+  path = snapshot_filename(params, dirname, ".profile");
+  if (path == NULL)
+    return -1;
+  data = read_file(path, &size);
+  if (data == NULL || size < (long) sizeof(*header))
+    goto out;
+
+  // Sanity check everything before any offset is used
+  header = (profile_header_t const *) data;
+  if (memcmp(header->magic, PROFILE_MAGIC, sizeof(header->magic)) ||
+      header->byteorder != SNAPSHOT_BYTEORDER ||
+      header->version != PROFILE_VERSION)
+    goto out;
+  expected = sizeof(*header) +
+    (uint64_t) header->nrofformats * sizeof(*pf) +
+    (uint64_t) header->nrofdescs * sizeof(*pd) +
+    (uint64_t) header->nrofprops * sizeof(*props) +
+    header->descsize + header->stringsize;
+  if (expected != (uint64_t) size || header->stringsize == 0)
+    goto out;
+  pf = (profile_format_t const *) (header + 1);
+  pd = (profile_desc_t const *) (pf + header->nrofformats);
+  props = (uint16_t const *) (pd + header->nrofdescs);
+  descdata = (unsigned char const *) (props + header->nrofprops);
+  strings = (char const *) (descdata + header->descsize);
+  if (strings[header->stringsize - 1] != '\0' ||
+      header->serialnumber >= header->stringsize ||
+      header->deviceversion >= header->stringsize ||
+      (header->objectbitsize != 32 && header->objectbitsize != 64))
+    goto out;
+  for (i = 0; i < header->nrofformats; i++) {
+    if (pf[i].firstprop > header->nrofprops ||
+	pf[i].nrofprops > header->nrofprops - pf[i].firstprop)
+      goto out;
+  }
+  for (i = 0; i < header->nrofdescs; i++) {
+    if (pd[i].offset > header->descsize ||
+	pd[i].size > header->descsize - pd[i].offset)
+      goto out;
+  }
+
+  // Only for the same device running the same firmware
+  if (header->vendor_id != ptp_usb->rawdevice.device_entry.vendor_id ||
+      header->product_id != ptp_usb->rawdevice.device_entry.product_id ||
+      header->deviceflags != (flags & ~ptp_usb->learned_flags) ||
+      !same_string(params->deviceinfo.SerialNumber,
+		   header->serialnumber ? strings + header->serialnumber : NULL) ||
+      !same_string(params->deviceinfo.DeviceVersion,
+		   header->deviceversion ? strings + header->deviceversion : NULL)) {
+    LIBMTP_SNAPSHOT_DEBUG("profile %s is for another device or firmware\n",
+			  path);
+    goto out;
+  }
+
+  device->object_bitsize = header->objectbitsize;
+  device->maximum_battery_level = header->maximumbatterylevel;
+  // Spare the device the failures that taught us about these
+  flags = header->learnedflags & PROFILE_LEARNED_FLAGS;
+  ptp_usb->rawdevice.device_entry.device_flags |= flags;
+  ptp_usb->learned_flags |= flags;
+  params->device_flags |= flags;
+  for (i = 0; i < header->nrofformats; i++) {
+    // Whatever is missing will be asked for when needed
+    ptp_mtp_add_objectpropssupported(params, pf[i].ofc, pf[i].nrofprops,
+				     props + pf[i].firstprop);
+  }
+  for (i = 0; i < header->nrofdescs; i++) {
+    ptp_mtp_add_objectpropdesc(params, pd[i].opc, pd[i].ofc,
+			       descdata + pd[i].offset, pd[i].size);
+  }
+  LIBMTP_SNAPSHOT_DEBUG("loaded profile with %u formats and %u property "
+			"descriptions from %s\n", header->nrofformats,
+			header->nrofdescs, path);
+  ret = 0;
+
+ out:
+  free(data);
+  free(path);
+  return ret;
+}
+
+/**
+ * Delete the profile file of a device, so that the next time the
+ * device is opened everything is asked from it again.
+ * @param device the device to delete the profile of.
+ * @param dirname the directory holding the snapshot files.
+ * @return 0 if there is no profile left, any other value means failure.
+ */
+int remove_device_profile(LIBMTP_mtpdevice_t *device,
+			  char const * const dirname)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  char *path;
+  int ret = 0;
+
+  path = snapshot_filename(params, dirname, ".profile");
+  if (path == NULL)
+    return 0;
+  if (unlink(path) != 0 && errno != ENOENT)
+    ret = -1;
+  free(path);
+  return ret;
+}
@@ -0,0 +1,35 @@
+/*
+ * \file snapshot.h
+ * On-disk snapshot of the object metadata cache.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __MTP__SNAPSHOT__H
+#define __MTP__SNAPSHOT__H
+
+int load_metadata_snapshot(LIBMTP_mtpdevice_t *device,
+			   char const * const dirname);
+int save_metadata_snapshot(LIBMTP_mtpdevice_t *device,
+			   char const * const dirname);
+int load_device_profile(LIBMTP_mtpdevice_t *device,
+			char const * const dirname);
+int save_device_profile(LIBMTP_mtpdevice_t *device,
+			char const * const dirname);
+int remove_device_profile(LIBMTP_mtpdevice_t *device,
+			  char const * const dirname);
+
+#endif //__MTP__SNAPSHOT__H
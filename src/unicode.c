@@ -33,19 +33,11 @@
 
 #include <stdlib.h>
 #include <string.h>
-#ifdef HAVE_ICONV
-#include "iconv.h"
-#endif
 #include "libmtp.h"
 #include "unicode.h"
 #include "util.h"
 #include "ptp.h"
 
-/**
- * The size of the buffer (in characters) used for creating string copies.
- */
-#define STRING_BUFFER_LENGTH 1024
-
 /**
  * Gets the length (in characters, not bytes) of a unicode
  * UCS-2 string, eg a string which physically is 0x00 0x41 0x00 0x00
@@ -76,29 +68,21 @@ int ucs2_strlen(uint16_t const * const unicstr)
  */
 char *utf16_to_utf8(LIBMTP_mtpdevice_t *device, const uint16_t *unicstr)
 {
-  char loclstr[STRING_BUFFER_LENGTH*3+1]; // UTF-8 encoding is max 3 bytes per UCS2 char.
+  unsigned int units = ucs2_strlen(unicstr);
+  unsigned int len;
+  // UTF-8 encoding is max 3 bytes per UCS2 char.
+  char *loclstr = malloc(units*3+1);
 
-  loclstr[0]='\0';
-  #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
-  PTPParams *params = (PTPParams *) device->params;
-  char *stringp = (char *) unicstr;
-  char *locp = loclstr;
-  size_t nconv;
-  size_t convlen = (ucs2_strlen(unicstr)+1) * sizeof(uint16_t); // UCS-2 is 16 bit wide, include terminator
-  size_t convmax = STRING_BUFFER_LENGTH*3;
-  /* Do the conversion.  */
-  nconv = iconv(params->cd_ucs2_to_locale, &stringp, &convlen, &locp, &convmax);
-  if (nconv == (size_t) -1) {
-    // Return partial string anyway.
-    *locp = '\0';
+  if (loclstr == NULL) {
+    return NULL;
   }
-  #endif
-  loclstr[STRING_BUFFER_LENGTH*3] = '\0';
+  len = ptp_utf16le_to_utf8((const unsigned char *) unicstr, units, loclstr);
+  loclstr[len] = '\0';
   // Strip off any BOM, it's totally useless...
-  if ((uint8_t) loclstr[0] == 0xEFU && (uint8_t) loclstr[1] == 0xBBU && (uint8_t) loclstr[2] == 0xBFU) {
-    return strdup(loclstr+3);
+  if (len >= 3 && (uint8_t) loclstr[0] == 0xEFU && (uint8_t) loclstr[1] == 0xBBU && (uint8_t) loclstr[2] == 0xBFU) {
+    memmove(loclstr, loclstr+3, len-2);
   }
-  return strdup(loclstr);
+  return loclstr;
 }
 
 /**
@@ -111,36 +95,17 @@ char *utf16_to_utf8(LIBMTP_mtpdevice_t *device, const uint16_t *unicstr)
  */
 uint16_t *utf8_to_utf16(LIBMTP_mtpdevice_t *device, const char *localstr)
 {
-  char unicstr[(STRING_BUFFER_LENGTH+1)*2]; // UCS2 encoding is 2 bytes per UTF-8 char.
-  char *unip = unicstr;
-  size_t nconv = 0;
+  size_t convlen = strlen(localstr);
+  unsigned int units;
+  // UCS2 encoding is at most one char per UTF-8 byte, plus terminator.
+  uint16_t *ret = malloc((convlen+1)*sizeof(uint16_t));
 
-  unicstr[0]='\0';
-  unicstr[1]='\0';
-
-  #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
-  PTPParams *params = (PTPParams *) device->params;
-  char *stringp = (char *) localstr; // cast away "const"
-  size_t convlen = strlen(localstr)+1; // utf8 bytes, include terminator
-  size_t convmax = STRING_BUFFER_LENGTH*2;
-  /* Do the conversion.  */
-  nconv = iconv(params->cd_locale_to_ucs2, &stringp, &convlen, &unip, &convmax);
-  #endif
-  
-  if (nconv == (size_t) -1) {
-    // Return partial string anyway.
-    unip[0] = '\0';
-    unip[1] = '\0';
+  if (ret == NULL) {
+    return NULL;
   }
-  // make sure the string is null terminated
-  unicstr[STRING_BUFFER_LENGTH*2] = '\0';
-  unicstr[STRING_BUFFER_LENGTH*2+1] = '\0';
-
-  // allocate the string to be returned
-  // Note: can't use strdup since every other byte is a null byte
-  int ret_len = ucs2_strlen((uint16_t*)unicstr)*sizeof(uint16_t)+2;
-  uint16_t* ret = malloc(ret_len);
-  memcpy(ret,unicstr,(size_t)ret_len);
+  // Return partial string on errors anyway.
+  ptp_utf8_to_utf16le(localstr, convlen, (unsigned char *) ret, convlen, &units);
+  ret[units] = 0;
   return ret;
 }
 
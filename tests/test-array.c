@@ -0,0 +1,227 @@
+/**
+ * \file test-array.c
+ * Checks the capacity handling of the array macros in array.h.
+ *
+ * Pushing elements one by one has to grow the capacity geometrically,
+ * so that the number of reallocations stays logarithmic, new elements
+ * have to start out zeroed, and reserving or shrinking must never lose
+ * what is already in the array. Arrays allocated outside the macros,
+ * with a capacity below their length, have to be handled as well.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+#include "config.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* As in libmtp.c, the macros only need these two from libgphoto2 */
+#define GP_ERROR_NO_MEMORY -1
+#define GP_LOG_E(x,y)
+
+#include "array.h"
+
+#define TEST_ELEMENTS 100000
+
+typedef ARRAY_OF(uint32_t) test_array_t;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+/*
+ * The macros return from the calling function when out of memory,
+ * so each one gets a function of its own.
+ */
+static int reserve(test_array_t *array, uint32_t cap)
+{
+  array_reserve(array, cap);
+  return 0;
+}
+
+static int extend(test_array_t *array, uint32_t len)
+{
+  array_extend_capacity(array, len);
+  return 0;
+}
+
+static int push_back(test_array_t *array, uint32_t value)
+{
+  array_push_back(array, value);
+  return 0;
+}
+
+/**
+ * Tells whether the array holds 0, 1, 2 ... up to its length.
+ */
+static int holds_sequence(test_array_t const *array)
+{
+  uint32_t i;
+
+  for (i = 0; i < array->len; i++) {
+    if (array->val[i] != i)
+      return 0;
+  }
+  return 1;
+}
+
+static void test_reserve(void)
+{
+  test_array_t array;
+  uint32_t i;
+
+  array_init(&array);
+  CHECK(reserve(&array, 0) == 0);
+  CHECK(array.val == NULL && array.cap == 0);
+
+  CHECK(reserve(&array, 10) == 0);
+  CHECK(array.val != NULL && array.cap == 10 && array.len == 0);
+  for (i = 0; i < 10; i++) {
+    CHECK(push_back(&array, i) == 0);
+  }
+  // Filling the reserved room does not reallocate
+  CHECK(array.cap == 10);
+
+  // Reserving less never shrinks, more keeps the contents
+  CHECK(reserve(&array, 5) == 0);
+  CHECK(array.cap == 10);
+  CHECK(reserve(&array, 1000) == 0);
+  CHECK(array.cap == 1000 && array.len == 10);
+  CHECK(holds_sequence(&array));
+  free_array(&array);
+  CHECK(array.val == NULL && array.len == 0 && array.cap == 0);
+}
+
+static void test_extend(void)
+{
+  test_array_t array;
+  uint32_t reallocs = 0;
+  uint32_t lastcap;
+  uint32_t i;
+
+  array_init(&array);
+  CHECK(extend(&array, 1) == 0);
+  CHECK(array.cap == ARRAY_MIN_CAPACITY);
+  CHECK(array.val[0] == 0);
+
+  // One push at a time, as the object cache is filled
+  lastcap = array.cap;
+  for (i = 0; i < TEST_ELEMENTS; i++) {
+    CHECK(push_back(&array, i) == 0);
+    if (array.cap != lastcap) {
+      CHECK(array.cap >= 2 * lastcap);
+      lastcap = array.cap;
+      reallocs++;
+    }
+  }
+  CHECK(array.len == TEST_ELEMENTS && array.cap >= array.len);
+  CHECK(holds_sequence(&array));
+  // 4 doubled 15 times is the first capacity above TEST_ELEMENTS
+  CHECK(reallocs <= 15);
+
+  // A large extension takes what it needs at once, zeroed
+  CHECK(extend(&array, 3 * array.cap) == 0);
+  CHECK(array.cap >= array.len + 3 * lastcap);
+  for (i = 0; i < 3 * lastcap; i++) {
+    if (array.val[array.len + i] != 0) {
+      CHECK(array.val[array.len + i] == 0);
+      break;
+    }
+  }
+  // and extending into the existing room does not reallocate
+  lastcap = array.cap;
+  CHECK(extend(&array, lastcap - array.len) == 0);
+  CHECK(array.cap == lastcap);
+  CHECK(holds_sequence(&array));
+  free_array(&array);
+
+  printf("%u elements pushed with %u reallocations\n",
+	 TEST_ELEMENTS, reallocs);
+}
+
+/**
+ * Arrays that were allocated to their length outside the macros, as
+ * the object handle lists of ptp.c are, have no capacity recorded.
+ */
+static void test_foreign(void)
+{
+  test_array_t array;
+  uint32_t i;
+
+  array.len = 10;
+  array.cap = 0;
+  array.val = malloc(array.len * sizeof(array.val[0]));
+  if (array.val == NULL) {
+    CHECK(!"out of memory");
+    return;
+  }
+  for (i = 0; i < array.len; i++) {
+    array.val[i] = i;
+  }
+  CHECK(push_back(&array, 10) == 0);
+  CHECK(array.len == 11 && array.cap >= 2 * 10);
+  CHECK(holds_sequence(&array));
+  free_array(&array);
+}
+
+static void test_shrink(void)
+{
+  test_array_t array;
+  uint32_t i;
+
+  array_init(&array);
+  // Empty arrays, with and without an allocation, end up freed
+  array_shrink_to_fit(&array);
+  CHECK(array.val == NULL && array.cap == 0);
+  CHECK(reserve(&array, 100) == 0);
+  array_shrink_to_fit(&array);
+  CHECK(array.val == NULL && array.len == 0 && array.cap == 0);
+
+  for (i = 0; i < 1000; i++) {
+    CHECK(push_back(&array, i) == 0);
+  }
+  CHECK(array.cap > array.len);
+  array_shrink_to_fit(&array);
+  CHECK(array.len == 1000 && array.cap == 1000);
+  CHECK(holds_sequence(&array));
+
+  // Shrinking a full array changes nothing, growing again still works
+  array_shrink_to_fit(&array);
+  CHECK(array.cap == 1000);
+  CHECK(push_back(&array, 1000) == 0);
+  CHECK(array.len == 1001 && array.cap >= 2000);
+  CHECK(holds_sequence(&array));
+  free_array(&array);
+}
+
+int main(int argc, char **argv)
+{
+  test_reserve();
+  test_extend();
+  test_foreign();
+  test_shrink();
+  if (failures != 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * \file test-device-index.c
+ * Checks the hash index of the device table in libusb1-glue.c.
+ *
+ * Every entry of the device table has to resolve to the first entry
+ * with the same vendor and product ID, as a walk of the table does,
+ * and IDs missing from the table must not be found. The glue is
+ * included here since the index and the table are static to it.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+#include "libusb1-glue.c"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+/**
+ * Walks the table for the first entry of a device, as the lookup
+ * did before there was an index.
+ */
+static int first_device_entry(uint16_t vendor_id, uint16_t product_id)
+{
+  int i;
+
+  for (i = 0; i < mtp_device_table_size; i++) {
+    if (mtp_device_table[i].vendor_id == vendor_id &&
+	mtp_device_table[i].product_id == product_id)
+      return i;
+  }
+  return -1;
+}
+
+int main(int argc, char **argv)
+{
+  int duplicates = 0;
+  int missing = 0;
+  int i;
+
+  build_device_index();
+  CHECK(device_index_built);
+
+  for (i = 0; i < mtp_device_table_size; i++) {
+    uint16_t vendor_id = mtp_device_table[i].vendor_id;
+    uint16_t product_id = mtp_device_table[i].product_id;
+    int first = first_device_entry(vendor_id, product_id);
+
+    if (find_device_entry(vendor_id, product_id) != first) {
+      fprintf(stderr, "entry %d (%04x:%04x, %s %s) resolves to %d, not %d\n",
+	      i, vendor_id, product_id, mtp_device_table[i].vendor,
+	      mtp_device_table[i].product,
+	      find_device_entry(vendor_id, product_id), first);
+      failures++;
+    }
+    if (first != i)
+      duplicates++;
+
+    // Neighbouring IDs probe the same and the next slots
+    if (first_device_entry(vendor_id, product_id + 1) < 0) {
+      CHECK(find_device_entry(vendor_id, product_id + 1) == -1);
+      missing++;
+    }
+    if (first_device_entry(vendor_id ^ 0x8000, product_id) < 0) {
+      CHECK(find_device_entry(vendor_id ^ 0x8000, product_id) == -1);
+      missing++;
+    }
+  }
+  CHECK(find_device_entry(0x0000, 0x0000) ==
+	first_device_entry(0x0000, 0x0000));
+  CHECK(find_device_entry(0xffff, 0xffff) ==
+	first_device_entry(0xffff, 0xffff));
+
+  printf("%d devices, %d duplicate entries, %d missing IDs looked up\n",
+	 mtp_device_table_size, duplicates, missing);
+  if (failures != 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,397 @@
+/**
+ * \file test-loopback.c
+ * Runs listing, upload and download against the loopback device.
+ *
+ * The first device answers GetObjPropList properly, the second one
+ * fails it on all objects at once like many real devices do, so that
+ * the per-folder fallback is taken. The second one is then reopened
+ * to check that what was learned about it is kept in its profile
+ * until the profile is reset. A third device is opened lazily and
+ * given a .spl playlist, whose tracks are in folders not yet listed.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+#include "libmtp.h"
+#include "device-flags.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TEST_FOLDERS 4
+#define TEST_FILES 40
+#define TEST_FILESIZE 20000
+#define TEST_UPLOAD_SIZE 300000
+
+#define PTP_OC_MTP_GetObjPropList 0x9805
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+static int count_folders(LIBMTP_folder_t *folder)
+{
+  int n = 0;
+
+  while (folder != NULL) {
+    n += 1 + count_folders(folder->child);
+    folder = folder->sibling;
+  }
+  return n;
+}
+
+/**
+ * Checks that every generated file is listed with its size.
+ * @return the ID of a folder to send to.
+ */
+static uint32_t check_listing(LIBMTP_mtpdevice_t *device)
+{
+  LIBMTP_file_t *files;
+  LIBMTP_folder_t *folders;
+  uint32_t folder_id = 0;
+  int n = 0;
+
+  files = LIBMTP_Get_Filelisting_With_Callback(device, NULL, NULL);
+  while (files != NULL) {
+    LIBMTP_file_t *next = files->next;
+
+    CHECK(files->filename != NULL);
+    CHECK(files->filesize == TEST_FILESIZE);
+    CHECK(files->parent_id != 0);
+    LIBMTP_destroy_file_t(files);
+    files = next;
+    n++;
+  }
+  CHECK(n == TEST_FILES);
+
+  folders = LIBMTP_Get_Folder_List(device);
+  CHECK(count_folders(folders) == TEST_FOLDERS);
+  if (folders != NULL) {
+    folder_id = folders->folder_id;
+  }
+  LIBMTP_destroy_folder_t(folders);
+  return folder_id;
+}
+
+/**
+ * Sends a file into a folder, fetches it back and compares the two.
+ */
+static void check_transfer(LIBMTP_mtpdevice_t *device, uint32_t parent_id)
+{
+  LIBMTP_file_t *file;
+  LIBMTP_file_t *meta;
+  FILE *src;
+  FILE *dst;
+  unsigned char *in;
+  unsigned char *out;
+  uint32_t id;
+  int i;
+
+  in = malloc(TEST_UPLOAD_SIZE);
+  out = malloc(TEST_UPLOAD_SIZE);
+  src = tmpfile();
+  dst = tmpfile();
+  if (in == NULL || out == NULL || src == NULL || dst == NULL) {
+    CHECK(!"out of resources");
+    goto out;
+  }
+  for (i = 0; i < TEST_UPLOAD_SIZE; i++) {
+    in[i] = (unsigned char) (i * 7 + (i >> 8));
+  }
+  CHECK(fwrite(in, 1, TEST_UPLOAD_SIZE, src) == TEST_UPLOAD_SIZE);
+  fflush(src);
+  rewind(src);
+
+  file = LIBMTP_new_file_t();
+  file->filename = strdup("upload.bin");
+  file->filesize = TEST_UPLOAD_SIZE;
+  file->filetype = LIBMTP_FILETYPE_UNKNOWN;
+  file->parent_id = parent_id;
+  CHECK(LIBMTP_Send_File_From_File_Descriptor(device, fileno(src), file,
+					      NULL, NULL) == 0);
+  id = file->item_id;
+  LIBMTP_destroy_file_t(file);
+  CHECK(id != 0);
+
+  meta = LIBMTP_Get_Filemetadata(device, id);
+  CHECK(meta != NULL);
+  if (meta != NULL) {
+    CHECK(meta->filesize == TEST_UPLOAD_SIZE);
+    CHECK(strcmp(meta->filename, "upload.bin") == 0);
+    CHECK(meta->parent_id == parent_id);
+    LIBMTP_destroy_file_t(meta);
+  }
+
+  CHECK(LIBMTP_Get_File_To_File_Descriptor(device, id, fileno(dst),
+					   NULL, NULL) == 0);
+  rewind(dst);
+  CHECK(fread(out, 1, TEST_UPLOAD_SIZE, dst) == TEST_UPLOAD_SIZE);
+  CHECK(memcmp(in, out, TEST_UPLOAD_SIZE) == 0);
+
+ out:
+  if (src != NULL) {
+    fclose(src);
+  }
+  if (dst != NULL) {
+    fclose(dst);
+  }
+  free(in);
+  free(out);
+}
+
+/**
+ * Counts the failed GetObjPropList transactions on a device.
+ */
+static uint32_t objproplist_errors(LIBMTP_mtpdevice_t *device)
+{
+  LIBMTP_statistics_t *stats;
+  uint32_t errors = 0;
+  int n = 0;
+  int i;
+
+  if (LIBMTP_Get_Statistics(device, &stats, &n) != 0) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    if (stats[i].opcode == PTP_OC_MTP_GetObjPropList) {
+      errors = stats[i].errors;
+    }
+  }
+  free(stats);
+  return errors;
+}
+
+/**
+ * Opens a device that fails GetObjPropList on all objects three times
+ * with a snapshot directory set. The failure seen the first time is
+ * kept in the profile and spares the second open, until the profile
+ * is reset. The metadata snapshots are removed in between so that
+ * each open reads the objects from the device.
+ */
+static void check_profile(LIBMTP_raw_device_t *rawdevice)
+{
+  char dirname[] = "/tmp/test-loopback-XXXXXX";
+  char profile[sizeof(dirname) + 64] = "";
+  char snapshot[sizeof(dirname) + 64] = "";
+  LIBMTP_mtpdevice_t *device;
+  struct stat st;
+  char *serial;
+  int i;
+
+  if (mkdtemp(dirname) == NULL) {
+    CHECK(!"out of resources");
+    return;
+  }
+  CHECK(LIBMTP_Set_Snapshot_Directory(dirname) == 0);
+  for (i = 0; i < 3; i++) {
+    device = LIBMTP_Open_Raw_Device(rawdevice);
+    CHECK(device != NULL);
+    if (device == NULL) {
+      break;
+    }
+    if (i == 1) {
+      CHECK(objproplist_errors(device) == 0);
+      CHECK(LIBMTP_Reset_Device_Profile(device) == 0);
+      CHECK(stat(profile, &st) != 0);
+      // and a second time, with nothing left to delete
+      CHECK(LIBMTP_Reset_Device_Profile(device) == 0);
+    } else {
+      CHECK(objproplist_errors(device) > 0);
+    }
+    serial = LIBMTP_Get_Serialnumber(device);
+    CHECK(serial != NULL);
+    snprintf(profile, sizeof(profile), "%s/%s.profile", dirname,
+	     serial != NULL ? serial : "");
+    snprintf(snapshot, sizeof(snapshot), "%s/%s.snapshot", dirname,
+	     serial != NULL ? serial : "");
+    free(serial);
+    LIBMTP_Release_Device(device);
+    CHECK(stat(profile, &st) == 0);
+    unlink(snapshot);
+  }
+  LIBMTP_Set_Snapshot_Directory(NULL);
+  unlink(profile);
+  rmdir(dirname);
+}
+
+/**
+ * Writes the lines of a .spl playlist as UTF-16LE, as Samsung players
+ * keep them.
+ */
+static void write_spl(FILE *f, char const * const *lines)
+{
+  char const *c;
+
+  fwrite("\xff\xfe", 1, 2, f);
+  for (; *lines != NULL; lines++) {
+    for (c = *lines; *c != '\0'; c++) {
+      fputc(*c, f);
+      fputc(0, f);
+    }
+    fwrite("\r\0\n\0", 1, 4, f);
+  }
+}
+
+/**
+ * Checks that a track of a playlist is the file expected.
+ */
+static void check_track(LIBMTP_mtpdevice_t *device, uint32_t id,
+			char const *filename)
+{
+  LIBMTP_file_t *meta;
+
+  meta = LIBMTP_Get_Filemetadata(device, id);
+  CHECK(meta != NULL);
+  if (meta != NULL) {
+    CHECK(strcmp(meta->filename, filename) == 0);
+    LIBMTP_destroy_file_t(meta);
+  }
+}
+
+/**
+ * Reads and saves a .spl playlist on a lazily cached device. The
+ * tracks are looked up by their paths in folders that nothing has
+ * listed yet, and saving the same tracks must keep the playlist.
+ */
+static void run_lazy_spl(void)
+{
+  static char const * const lines[] = {
+    "SPL PLAYLIST", "VERSION 1.00", "",
+    "\\Folder0002\\file000002.mp3", "\\Folder0003\\file000007.mp3",
+    "", "END PLAYLIST", NULL
+  };
+  LIBMTP_loopback_config_t config;
+  LIBMTP_raw_device_t rawdevice;
+  LIBMTP_mtpdevice_t *device;
+  LIBMTP_playlist_t *pl;
+  LIBMTP_file_t *file;
+  uint32_t folder_id;
+  uint32_t plid;
+  FILE *src;
+
+  memset(&config, 0, sizeof(config));
+  config.folders = TEST_FOLDERS;
+  config.files = TEST_FILES;
+  config.filesize = TEST_FILESIZE;
+  CHECK(LIBMTP_Add_Loopback_Device(&config, &rawdevice) == 0);
+  rawdevice.device_entry.device_flags |= DEVICE_FLAG_PLAYLIST_SPL_V1;
+
+  device = LIBMTP_Open_Raw_Device_Lazy(&rawdevice);
+  CHECK(device != NULL);
+  if (device == NULL) {
+    return;
+  }
+  src = tmpfile();
+  if (src == NULL) {
+    CHECK(!"out of resources");
+    LIBMTP_Release_Device(device);
+    return;
+  }
+  write_spl(src, lines);
+  fflush(src);
+
+  folder_id = LIBMTP_Get_Folder_Id_For_Path(device, device->storage->id,
+					    "Folder0001");
+  CHECK(folder_id != 0xFFFFFFFFU);
+  file = LIBMTP_new_file_t();
+  file->filename = strdup("lazy.spl");
+  file->filesize = ftell(src);
+  file->filetype = LIBMTP_FILETYPE_UNKNOWN;
+  file->parent_id = folder_id;
+  file->storage_id = device->storage->id;
+  rewind(src);
+  CHECK(LIBMTP_Send_File_From_File_Descriptor(device, fileno(src), file,
+					      NULL, NULL) == 0);
+  plid = file->item_id;
+  LIBMTP_destroy_file_t(file);
+  fclose(src);
+
+  pl = LIBMTP_Get_Playlist(device, plid);
+  CHECK(pl != NULL);
+  if (pl != NULL) {
+    CHECK(strcmp(pl->name, "lazy") == 0);
+    CHECK(pl->no_tracks == 2);
+    if (pl->no_tracks == 2) {
+      check_track(device, pl->tracks[0], "file000002.mp3");
+      check_track(device, pl->tracks[1], "file000007.mp3");
+    }
+    // Nothing changed, so the playlist is not replaced
+    CHECK(LIBMTP_Update_Playlist(device, pl) == 0);
+    CHECK(pl->playlist_id == plid);
+    LIBMTP_destroy_playlist_t(pl);
+  }
+  LIBMTP_Dump_Errorstack(device);
+  LIBMTP_Clear_Errorstack(device);
+  LIBMTP_Release_Device(device);
+}
+
+static void run_device(uint32_t flags)
+{
+  LIBMTP_loopback_config_t config;
+  LIBMTP_raw_device_t rawdevice;
+  LIBMTP_mtpdevice_t *device;
+  uint32_t folder_id;
+
+  memset(&config, 0, sizeof(config));
+  config.folders = TEST_FOLDERS;
+  config.files = TEST_FILES;
+  config.filesize = TEST_FILESIZE;
+  config.flags = flags;
+  CHECK(LIBMTP_Add_Loopback_Device(&config, &rawdevice) == 0);
+
+  device = LIBMTP_Open_Raw_Device(&rawdevice);
+  CHECK(device != NULL);
+  if (device == NULL) {
+    return;
+  }
+  folder_id = check_listing(device);
+  if (flags & LIBMTP_LOOPBACK_BROKEN_OBJPROPLIST_ALL) {
+    // The failing request has to be seen, or the fallback was not tested
+    CHECK(objproplist_errors(device) > 0);
+  } else {
+    CHECK(objproplist_errors(device) == 0);
+  }
+  check_transfer(device, folder_id);
+  LIBMTP_Dump_Errorstack(device);
+  LIBMTP_Clear_Errorstack(device);
+  CHECK(LIBMTP_Set_Transfer_Queue(device, 1, 8, 0x10000) == 0);
+  CHECK(LIBMTP_Set_Transfer_Queue(device, 1, 0, 0x10000) != 0);
+  CHECK(LIBMTP_Get_Errorstack(device) != NULL);
+  LIBMTP_Clear_Errorstack(device);
+  LIBMTP_Release_Device(device);
+  if (flags & LIBMTP_LOOPBACK_BROKEN_OBJPROPLIST_ALL) {
+    check_profile(&rawdevice);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  LIBMTP_Init();
+  run_device(0);
+  run_device(LIBMTP_LOOPBACK_BROKEN_OBJPROPLIST_ALL);
+  run_lazy_spl();
+  if (failures != 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,245 @@
+/**
+ * \file test-unicode.c
+ * Checks the UTF-16LE and UTF-8 conversions of ptp.c.
+ *
+ * Besides the encodings themselves this covers the word at a time ASCII
+ * paths at every length and alignment around a machine word, and the
+ * limit of PTP_MAXSTRLEN-1 units that ptp_pack_string() converts with.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+#include "config.h"
+#include "ptp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Room for the longest string plus the alignment offsets */
+#define TEST_MAXUNITS (PTP_MAXSTRLEN + 16)
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+/**
+ * Converts UTF-16LE units given as numbers, and compares the result.
+ */
+static void check_to_utf8(uint16_t const *units, unsigned int n,
+			  char const *expected)
+{
+  unsigned char src[2 * TEST_MAXUNITS];
+  char dest[3 * TEST_MAXUNITS];
+  unsigned int i, len;
+
+  for (i = 0; i < n; i++) {
+    src[2*i] = units[i] & 0xff;
+    src[2*i+1] = units[i] >> 8;
+  }
+  len = ptp_utf16le_to_utf8(src, n, dest);
+  CHECK(len == strlen(expected));
+  CHECK(memcmp(dest, expected, len) == 0);
+}
+
+/**
+ * Converts a UTF-8 string, and compares the result and return value.
+ */
+static void check_to_utf16(char const *src, unsigned int max, int ret,
+			   uint16_t const *expected, unsigned int n)
+{
+  unsigned char dest[2 * TEST_MAXUNITS];
+  unsigned int i, units = 0;
+
+  CHECK(ptp_utf8_to_utf16le(src, strlen(src), dest, max, &units) == ret);
+  CHECK(units == n);
+  for (i = 0; i < n && i < units; i++) {
+    CHECK((dest[2*i] | (dest[2*i+1] << 8)) == expected[i]);
+  }
+}
+
+/**
+ * ASCII of every length up to a few words, at every alignment, in
+ * both directions, once on its own and once followed by a character
+ * that leaves the fast path.
+ */
+static void test_ascii(void)
+{
+  unsigned char utf16[2 * TEST_MAXUNITS + 8];
+  char utf8[3 * TEST_MAXUNITS + 8];
+  char text[TEST_MAXUNITS];
+  char back[3 * TEST_MAXUNITS];
+  unsigned int len, align, i, units, n;
+
+  for (len = 0; len <= 40; len++) {
+    for (i = 0; i < len; i++) {
+      text[i] = 'A' + (i * 5) % 26;
+    }
+    text[len] = '\0';
+    for (align = 0; align < 8; align++) {
+      // UTF-8 to UTF-16LE from an odd place into an odd place
+      memcpy(utf8 + align, text, len);
+      units = 0;
+      CHECK(ptp_utf8_to_utf16le(utf8 + align, len, utf16 + align,
+				PTP_MAXSTRLEN, &units) == 0);
+      CHECK(units == len);
+      for (i = 0; i < len && i < units; i++) {
+	CHECK(utf16[align + 2*i] == (unsigned char) text[i]);
+	CHECK(utf16[align + 2*i + 1] == 0);
+      }
+      // and back from there
+      n = ptp_utf16le_to_utf8(utf16 + align, len, back);
+      CHECK(n == len);
+      CHECK(memcmp(back, text, len) == 0);
+
+      // U+00E9 right after the ASCII, wherever the words end
+      memcpy(utf8 + align, text, len);
+      memcpy(utf8 + align + len, "\xc3\xa9z", 3);
+      units = 0;
+      CHECK(ptp_utf8_to_utf16le(utf8 + align, len + 3, utf16 + align,
+				PTP_MAXSTRLEN, &units) == 0);
+      CHECK(units == len + 2);
+      CHECK(utf16[align + 2*len] == 0xe9 && utf16[align + 2*len + 1] == 0);
+      n = ptp_utf16le_to_utf8(utf16 + align, len + 2, back);
+      CHECK(n == len + 3);
+      CHECK(memcmp(back, utf8 + align, len + 3) == 0);
+
+      // A unit with only the high byte set must not pass as ASCII
+      memset(utf16 + align, 0, 2 * (len + 1));
+      for (i = 0; i < len; i++) {
+	utf16[align + 2*i] = text[i];
+      }
+      utf16[align + 2*len + 1] = 0x01; /* U+0100 */
+      n = ptp_utf16le_to_utf8(utf16 + align, len + 1, back);
+      CHECK(n == len + 2);
+      CHECK(memcmp(back + len, "\xc4\x80", 2) == 0);
+    }
+  }
+}
+
+static void test_to_utf8(void)
+{
+  static const uint16_t bmp[] = { 0x0041, 0x00e9, 0x20ac, 0xffff };
+  static const uint16_t pair[] = { 0xd83d, 0xde00 };
+  static const uint16_t pairs[] = { 0x0061, 0xd800, 0xdc00, 0xdbff, 0xdfff };
+  static const uint16_t high_end[] = { 0x0061, 0xd83d };
+  static const uint16_t high_other[] = { 0xd83d, 0x0041 };
+  static const uint16_t high_high[] = { 0xd83d, 0xd83d, 0xde00 };
+  static const uint16_t low_alone[] = { 0xde00, 0x0041 };
+
+  check_to_utf8(bmp, 4, "A\xc3\xa9\xe2\x82\xac\xef\xbf\xbf");
+  check_to_utf8(pair, 2, "\xf0\x9f\x98\x80");
+  check_to_utf8(pairs, 5, "a\xf0\x90\x80\x80\xf4\x8f\xbf\xbf");
+  // Unpaired surrogates become U+FFFD
+  check_to_utf8(high_end, 2, "a\xef\xbf\xbd");
+  check_to_utf8(high_other, 2, "\xef\xbf\xbd" "A");
+  check_to_utf8(high_high, 3, "\xef\xbf\xbd\xf0\x9f\x98\x80");
+  check_to_utf8(low_alone, 2, "\xef\xbf\xbd" "A");
+  // The pair is not looked for beyond the units given
+  check_to_utf8(pair, 1, "\xef\xbf\xbd");
+}
+
+static void test_to_utf16(void)
+{
+  static const uint16_t bmp[] = { 0x0041, 0x00e9, 0x20ac, 0xffff };
+  static const uint16_t pair[] = { 0x0061, 0xd83d, 0xde00, 0x0062 };
+  static const uint16_t last[] = { 0xdbff, 0xdfff };
+  static const uint16_t ab[] = { 0x0061, 0x0062 };
+
+  check_to_utf16("A\xc3\xa9\xe2\x82\xac\xef\xbf\xbf", PTP_MAXSTRLEN, 0, bmp, 4);
+  check_to_utf16("a\xf0\x9f\x98\x80" "b", PTP_MAXSTRLEN, 0, pair, 4);
+  check_to_utf16("\xf4\x8f\xbf\xbf", PTP_MAXSTRLEN, 0, last, 2);
+
+  // Overlong forms
+  check_to_utf16("ab\xc0\xaf", PTP_MAXSTRLEN, -1, ab, 2);
+  check_to_utf16("ab\xc1\xbf", PTP_MAXSTRLEN, -1, ab, 2);
+  check_to_utf16("ab\xe0\x80\xaf", PTP_MAXSTRLEN, -1, ab, 2);
+  check_to_utf16("ab\xf0\x80\x80\xaf", PTP_MAXSTRLEN, -1, ab, 2);
+  // Truncated sequences, at the end and before another character
+  check_to_utf16("ab\xe2\x82", PTP_MAXSTRLEN, -1, ab, 2);
+  check_to_utf16("ab\xf0\x9f\x98", PTP_MAXSTRLEN, -1, ab, 2);
+  check_to_utf16("ab\xc3" "c", PTP_MAXSTRLEN, -1, ab, 2);
+  // Encoded surrogates, beyond U+10FFFF, stray and invalid bytes
+  check_to_utf16("ab\xed\xa0\x80", PTP_MAXSTRLEN, -1, ab, 2);
+  check_to_utf16("ab\xed\xbf\xbf", PTP_MAXSTRLEN, -1, ab, 2);
+  check_to_utf16("ab\xf4\x90\x80\x80", PTP_MAXSTRLEN, -1, ab, 2);
+  check_to_utf16("ab\x80", PTP_MAXSTRLEN, -1, ab, 2);
+  check_to_utf16("ab\xf8\x88\x80\x80\x80", PTP_MAXSTRLEN, -1, ab, 2);
+  check_to_utf16("ab\xff", PTP_MAXSTRLEN, -1, ab, 2);
+  // A bad byte right after a whole word of ASCII
+  {
+    static const uint16_t word[] = { 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h' };
+
+    check_to_utf16("abcdefgh\xc0\xaf", PTP_MAXSTRLEN, -1, word, 8);
+  }
+}
+
+/**
+ * ptp_pack_string() converts into PTP_MAXSTRLEN-1 units, the last one
+ * of the 255 is the terminator.
+ */
+static void test_limit(void)
+{
+  unsigned char dest[2 * TEST_MAXUNITS];
+  char text[TEST_MAXUNITS + 4];
+  unsigned int len, units;
+  int ret;
+
+  for (len = PTP_MAXSTRLEN - 10; len <= PTP_MAXSTRLEN; len++) {
+    memset(text, 'x', len);
+    units = 0;
+    ret = ptp_utf8_to_utf16le(text, len, dest, PTP_MAXSTRLEN - 1, &units);
+    if (len <= PTP_MAXSTRLEN - 1) {
+      CHECK(ret == 0);
+      CHECK(units == len);
+    } else {
+      CHECK(ret == -2);
+      CHECK(units == PTP_MAXSTRLEN - 1);
+    }
+  }
+
+  // A pair that would end exactly at the limit fits, one more does not
+  memset(text, 'x', PTP_MAXSTRLEN - 3);
+  memcpy(text + PTP_MAXSTRLEN - 3, "\xf0\x9f\x98\x80", 4);
+  units = 0;
+  CHECK(ptp_utf8_to_utf16le(text, PTP_MAXSTRLEN + 1, dest,
+			    PTP_MAXSTRLEN - 1, &units) == 0);
+  CHECK(units == PTP_MAXSTRLEN - 1);
+
+  // and a pair is never split to make it fit
+  memset(text, 'x', PTP_MAXSTRLEN - 2);
+  memcpy(text + PTP_MAXSTRLEN - 2, "\xf0\x9f\x98\x80", 4);
+  units = 0;
+  CHECK(ptp_utf8_to_utf16le(text, PTP_MAXSTRLEN + 2, dest,
+			    PTP_MAXSTRLEN - 1, &units) == -2);
+  CHECK(units == PTP_MAXSTRLEN - 2);
+}
+
+int main(int argc, char **argv)
+{
+  test_ascii();
+  test_to_utf8();
+  test_to_utf16();
+  test_limit();
+  if (failures != 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}